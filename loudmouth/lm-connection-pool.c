@@ -0,0 +1,627 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-connection-pool
+ * @Title: LmConnectionPool
+ * @Short_description: Running many connections in one process
+ *
+ * An #LmConnectionPool spreads its connections over a number of worker
+ * threads, each running its own #GMainContext. The connections of one
+ * worker share a single timer wheel for reply timeouts and keep alives,
+ * so a worker polls one timer source no matter how many connections it
+ * serves. All connections of the pool share a cache of DNS lookups, see
+ * lm_connection_pool_set_resolver_ttl(). Use lm_connection_pool_new_per_cpu() to run one worker per
+ * processor.
+ *
+ * A connection is not thread safe by itself, it belongs to the worker
+ * thread it was created on. What may be called from any thread is:
+ * <itemizedlist>
+ * <listitem><para>the #LmConnectionPool functions, except for
+ * lm_connection_pool_set_ssl_context() which has to be called before
+ * connections are created;</para></listitem>
+ * <listitem><para>lm_connection_ref() and lm_connection_unref(), as long
+ * as the last reference is dropped on the worker thread;</para></listitem>
+ * <listitem><para>lm_connection_send_with_reply_and_block() and
+ * lm_connection_send_with_reply_and_block_timeout(), which send from the
+ * worker thread and sleep until the reply has been dispatched there;
+ * </para></listitem>
+ * <listitem><para>anything on an #LmSSLContext shared by connections of
+ * different workers, its session cache has its own lock.
+ * </para></listitem>
+ * </itemizedlist>
+ * Everything else, such as opening, sending, closing, registering
+ * handlers and changing settings, has to run on the worker thread of
+ * the connection, using lm_connection_pool_invoke(). The same goes for
+ * the #LmMessage, #LmMessageHandler and #LmSSL objects while a
+ * connection uses them.
+ * <informalexample><programlisting><![CDATA[
+ * static gboolean
+ * open_cb (gpointer user_data)
+ * {
+ *     lm_connection_open (user_data, NULL, NULL, NULL, NULL);
+ *     return FALSE;
+ * }
+ *
+ * pool = lm_connection_pool_new (4);
+ * for (i = 0; i < 10000; i++) {
+ *     connection = lm_connection_pool_new_connection (pool, "myserver");
+ *     ...
+ *     lm_connection_pool_invoke (pool, connection, open_cb, connection, NULL);
+ * }
+ * ...]]></programlisting></informalexample>
+ */
+
+#include <config.h>
+
+#include <unistd.h>
+
+#include "lm-internals.h"
+#include "lm-resolver-cache.h"
+#include "lm-timer-wheel.h"
+#include "lm-connection-pool.h"
+
+#define N_STATES (LM_CONNECTION_STATE_AUTHENTICATED + 1)
+
+typedef struct {
+    GMainContext *context;
+    GMainLoop    *loop;
+    GThread      *thread;
+
+    /* Shared by all connections of the worker */
+    LmTimerWheel *timer_wheel;
+
+    gint          n_connections;
+} PoolWorker;
+
+struct _LmConnectionPool {
+    PoolWorker   *workers;
+    guint         n_workers;
+
+    /* Connections per LmConnectionState, updated from the workers */
+    gint          n_state[N_STATES];
+
+    /* Given to the LmSSL of the connections, see 
+     * lm_connection_pool_set_ssl_context() */
+    LmSSLContext *ssl_context;
+
+    /* Shared by the lookups of all workers, see 
+     * lm_connection_pool_set_resolver_ttl() */
+    LmResolverCache *resolver_cache;
+
+    gint          ref_count;
+};
+
+static gpointer
+connection_pool_worker_run (PoolWorker *worker)
+{
+    GMainLoop    *loop = g_main_loop_ref (worker->loop);
+    GMainContext *context = g_main_context_ref (worker->context);
+
+    /* The worker struct may be gone once the loop quits */
+    g_main_context_push_thread_default (context);
+    g_main_loop_run (loop);
+    g_main_context_pop_thread_default (context);
+
+    g_main_context_unref (context);
+    g_main_loop_unref (loop);
+
+    return NULL;
+}
+
+static gboolean
+connection_pool_quit_cb (GMainLoop *loop)
+{
+    g_main_loop_quit (loop);
+
+    return FALSE;
+}
+
+static void
+connection_pool_free (LmConnectionPool *pool)
+{
+    guint i;
+
+    /* g_main_loop_quit() is lost on a worker that has not entered
+     * g_main_loop_run() yet, a source is picked up whenever it does */
+    for (i = 0; i < MAX (pool->n_workers, 1); i++) {
+        PoolWorker *worker = &pool->workers[i];
+        GSource    *source;
+
+        if (!worker->loop) {
+            continue;
+        }
+
+        source = g_idle_source_new ();
+        g_source_set_priority (source, G_PRIORITY_HIGH);
+        g_source_set_callback (source,
+                               (GSourceFunc) connection_pool_quit_cb,
+                               g_main_loop_ref (worker->loop),
+                               (GDestroyNotify) g_main_loop_unref);
+        g_source_attach (source, worker->context);
+        g_source_unref (source);
+    }
+
+    for (i = 0; i < MAX (pool->n_workers, 1); i++) {
+        PoolWorker *worker = &pool->workers[i];
+
+        if (worker->thread == g_thread_self ()) {
+            /* The last connection went away inside this worker, it
+             * returns from the loop after the current dispatch */
+            g_thread_unref (worker->thread);
+        }
+        else if (worker->thread) {
+            g_thread_join (worker->thread);
+        }
+
+        lm_timer_wheel_unref (worker->timer_wheel);
+
+        if (worker->loop) {
+            g_main_loop_unref (worker->loop);
+        }
+
+        if (worker->context) {
+            g_main_context_unref (worker->context);
+        }
+    }
+
+    if (pool->ssl_context) {
+        lm_ssl_context_unref (pool->ssl_context);
+    }
+
+    lm_resolver_cache_unref (pool->resolver_cache);
+
+    g_free (pool->workers);
+    g_slice_free (LmConnectionPool, pool);
+}
+
+/* Connections run in the worker of their context */
+static PoolWorker *
+connection_pool_get_worker (LmConnectionPool *pool, LmConnection *connection)
+{
+    GMainContext *context;
+    guint         i;
+
+    context = _lm_connection_get_context (connection);
+
+    for (i = 0; i < MAX (pool->n_workers, 1); i++) {
+        if (pool->workers[i].context == context) {
+            return &pool->workers[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * lm_connection_pool_new:
+ * @n_workers: number of worker threads to start
+ *
+ * Creates a new connection pool and starts @n_workers threads, each
+ * running a main loop of its own. With @n_workers set to 0 no threads are
+ * started and the connections run in the default #GMainContext like
+ * those created with lm_connection_new(), still sharing one timer wheel.
+ *
+ * Return value: A newly created #LmConnectionPool, free it with
+ * lm_connection_pool_unref().
+ **/
+LmConnectionPool *
+lm_connection_pool_new (guint n_workers)
+{
+    LmConnectionPool *pool;
+    guint             i;
+
+    pool = g_slice_new0 (LmConnectionPool);
+    pool->n_workers = n_workers;
+    pool->workers   = g_new0 (PoolWorker, MAX (n_workers, 1));
+    pool->ref_count = 1;
+
+    pool->resolver_cache = 
+        lm_resolver_cache_new (LM_CONNECTION_POOL_DEFAULT_RESOLVER_TTL);
+
+    for (i = 0; i < MAX (n_workers, 1); i++) {
+        PoolWorker *worker = &pool->workers[i];
+
+        if (n_workers > 0) {
+            worker->context = g_main_context_new ();
+            worker->loop    = g_main_loop_new (worker->context, FALSE);
+        }
+
+        worker->timer_wheel = lm_timer_wheel_new ();
+        lm_timer_wheel_attach (worker->timer_wheel, worker->context);
+
+        if (n_workers > 0) {
+            gchar *name;
+
+            name = g_strdup_printf ("lm-pool-%u", i);
+            worker->thread = g_thread_new (name,
+                                           (GThreadFunc) connection_pool_worker_run,
+                                           worker);
+            g_free (name);
+        }
+    }
+
+    return pool;
+}
+
+static guint
+connection_pool_get_n_cpus (void)
+{
+#if GLIB_CHECK_VERSION (2, 36, 0)
+    return g_get_num_processors ();
+#elif defined (_SC_NPROCESSORS_ONLN)
+    long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+    return n_cpus > 0 ? (guint) n_cpus : 1;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * lm_connection_pool_new_per_cpu:
+ *
+ * Creates a new connection pool with one worker thread per processor,
+ * see lm_connection_pool_new().
+ *
+ * Return value: A newly created #LmConnectionPool, free it with
+ * lm_connection_pool_unref().
+ **/
+LmConnectionPool *
+lm_connection_pool_new_per_cpu (void)
+{
+    return lm_connection_pool_new (connection_pool_get_n_cpus ());
+}
+
+static LmConnection *
+connection_pool_add_connection (LmConnectionPool *pool,
+                                PoolWorker       *worker,
+                                const gchar      *server)
+{
+    LmConnection *connection;
+
+    connection = lm_connection_new_with_context (server, worker->context);
+
+    g_atomic_int_inc (&worker->n_connections);
+    g_atomic_int_inc (&pool->n_state[LM_CONNECTION_STATE_CLOSED]);
+
+    _lm_connection_set_pool (connection,
+                             lm_connection_pool_ref (pool),
+                             worker->timer_wheel);
+
+    return connection;
+}
+
+/**
+ * lm_connection_pool_new_connection:
+ * @pool: an #LmConnectionPool
+ * @server: The hostname to the server for the connection.
+ *
+ * Creates a new closed connection on the worker that currently has the
+ * fewest connections. See lm_connection_new() for @server. The pool is
+ * kept alive until the connection has been freed.
+ *
+ * Return value: A newly created LmConnection, should be unreffed with
+ * lm_connection_unref() from its worker thread.
+ **/
+LmConnection *
+lm_connection_pool_new_connection (LmConnectionPool *pool,
+                                   const gchar      *server)
+{
+    PoolWorker *worker;
+    guint       i;
+
+    g_return_val_if_fail (pool != NULL, NULL);
+
+    worker = &pool->workers[0];
+    for (i = 1; i < pool->n_workers; i++) {
+        if (g_atomic_int_get (&pool->workers[i].n_connections) <
+            g_atomic_int_get (&worker->n_connections)) {
+            worker = &pool->workers[i];
+        }
+    }
+
+    return connection_pool_add_connection (pool, worker, server);
+}
+
+/**
+ * lm_connection_pool_new_connection_with_hash:
+ * @pool: an #LmConnectionPool
+ * @server: The hostname to the server for the connection.
+ * @hash: a value picking the worker, for example a hash of the account
+ *
+ * Like lm_connection_pool_new_connection() but creates the connection
+ * on the worker picked by @hash, so that connections created with the
+ * same @hash share a thread.
+ *
+ * Return value: A newly created LmConnection, should be unreffed with
+ * lm_connection_unref() from its worker thread.
+ **/
+LmConnection *
+lm_connection_pool_new_connection_with_hash (LmConnectionPool *pool,
+                                             const gchar      *server,
+                                             guint             hash)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+
+    return connection_pool_add_connection (pool,
+                                           &pool->workers[hash % MAX (pool->n_workers, 1)],
+                                           server);
+}
+
+/**
+ * lm_connection_pool_get_n_workers:
+ * @pool: an #LmConnectionPool
+ *
+ * Returns the number of worker threads that was given to
+ * lm_connection_pool_new().
+ *
+ * Return value: the number of workers.
+ **/
+guint
+lm_connection_pool_get_n_workers (LmConnectionPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    return pool->n_workers;
+}
+
+/**
+ * lm_connection_pool_set_ssl_context:
+ * @pool: an #LmConnectionPool
+ * @context: an #LmSSLContext, or %NULL for the default context
+ *
+ * Makes the connections of @pool use @context for an #LmSSL set with
+ * lm_connection_set_ssl() that wasn't given a context of its own. Call
+ * this before creating connections from @pool.
+ **/
+void
+lm_connection_pool_set_ssl_context (LmConnectionPool *pool,
+                                    LmSSLContext     *context)
+{
+    g_return_if_fail (pool != NULL);
+
+    if (context) {
+        lm_ssl_context_ref (context);
+    }
+
+    if (pool->ssl_context) {
+        lm_ssl_context_unref (pool->ssl_context);
+    }
+
+    pool->ssl_context = context;
+}
+
+/**
+ * lm_connection_pool_set_resolver_ttl:
+ * @pool: an #LmConnectionPool
+ * @ttl: how long to keep lookups, in seconds
+ *
+ * The connections of @pool share one cache of host and SRV lookups, so
+ * opening many connections to the same server asks DNS once. Lookups are
+ * kept for @ttl seconds, #LM_CONNECTION_POOL_DEFAULT_RESOLVER_TTL unless
+ * changed. A @ttl of 0 turns the cache off and empties it. This can be
+ * called from any thread.
+ **/
+void
+lm_connection_pool_set_resolver_ttl (LmConnectionPool *pool,
+                                     guint             ttl)
+{
+    g_return_if_fail (pool != NULL);
+
+    lm_resolver_cache_set_ttl (pool->resolver_cache, ttl);
+}
+
+/**
+ * lm_connection_pool_invoke:
+ * @pool: an #LmConnectionPool
+ * @connection: a connection created from @pool
+ * @function: function to call in the worker of @connection
+ * @user_data: data to pass to @function
+ * @notify: function to free @user_data with, or %NULL
+ *
+ * Calls @function in the worker thread that runs @connection, right away
+ * if that is the calling thread. @function is called again for as long as
+ * it returns %TRUE, like a #GSourceFunc.
+ **/
+void
+lm_connection_pool_invoke (LmConnectionPool *pool,
+                           LmConnection     *connection,
+                           GSourceFunc       function,
+                           gpointer          user_data,
+                           GDestroyNotify    notify)
+{
+    PoolWorker *worker;
+
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (function != NULL);
+
+    worker = connection_pool_get_worker (pool, connection);
+    g_return_if_fail (worker != NULL);
+
+    g_main_context_invoke_full (worker->context, G_PRIORITY_DEFAULT,
+                                function, user_data, notify);
+}
+
+/**
+ * lm_connection_pool_get_stats:
+ * @pool: an #LmConnectionPool
+ * @stats: return location for the numbers
+ *
+ * Fills in @stats for all connections of @pool. This can be called from
+ * any thread; with workers running the numbers are a snapshot that may
+ * be a state change behind.
+ **/
+void
+lm_connection_pool_get_stats (LmConnectionPool      *pool,
+                              LmConnectionPoolStats *stats)
+{
+    guint i;
+
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (stats != NULL);
+
+    stats->n_workers     = pool->n_workers;
+    stats->n_connections = 0;
+    for (i = 0; i < MAX (pool->n_workers, 1); i++) {
+        stats->n_connections +=
+            g_atomic_int_get (&pool->workers[i].n_connections);
+    }
+
+    stats->n_opening =
+        g_atomic_int_get (&pool->n_state[LM_CONNECTION_STATE_OPENING]);
+    stats->n_open =
+        g_atomic_int_get (&pool->n_state[LM_CONNECTION_STATE_OPEN]);
+    stats->n_authenticating =
+        g_atomic_int_get (&pool->n_state[LM_CONNECTION_STATE_AUTHENTICATING]);
+    stats->n_authenticated =
+        g_atomic_int_get (&pool->n_state[LM_CONNECTION_STATE_AUTHENTICATED]);
+
+    lm_resolver_cache_get_stats (pool->resolver_cache,
+                                 &stats->n_resolver_hits,
+                                 &stats->n_resolver_misses);
+}
+
+/**
+ * lm_connection_pool_ref:
+ * @pool: an #LmConnectionPool
+ *
+ * Adds a reference to @pool.
+ *
+ * Return value: the same pool.
+ **/
+LmConnectionPool *
+lm_connection_pool_ref (LmConnectionPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+
+    g_atomic_int_inc (&pool->ref_count);
+
+    return pool;
+}
+
+/**
+ * lm_connection_pool_unref:
+ * @pool: an #LmConnectionPool
+ *
+ * Removes a reference from @pool. Each connection holds a reference, the
+ * workers are stopped once the last one is gone.
+ **/
+void
+lm_connection_pool_unref (LmConnectionPool *pool)
+{
+    g_return_if_fail (pool != NULL);
+
+    if (g_atomic_int_dec_and_test (&pool->ref_count)) {
+        connection_pool_free (pool);
+    }
+}
+
+/* Called from the worker thread of the connection */
+void
+_lm_connection_pool_state_changed (LmConnectionPool  *pool,
+                                   LmConnectionState  old_state,
+                                   LmConnectionState  new_state)
+{
+    if (old_state == new_state) {
+        return;
+    }
+
+    g_atomic_int_add (&pool->n_state[old_state], -1);
+    g_atomic_int_inc (&pool->n_state[new_state]);
+}
+
+/* Returns whether @context is run by one of the workers of @pool */
+gboolean
+_lm_connection_pool_runs_context (LmConnectionPool *pool, 
+                                  GMainContext     *context)
+{
+    guint i;
+
+    for (i = 0; i < MAX (pool->n_workers, 1); i++) {
+        if (pool->workers[i].context == context) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Counts @connection on the worker running @context from now on. Returns
+ * the timer wheel of that worker, or NULL if @context isn't run by one
+ * of the workers of @pool. */
+LmTimerWheel *
+_lm_connection_pool_move (LmConnectionPool *pool,
+                          LmConnection     *connection,
+                          GMainContext     *context)
+{
+    PoolWorker *from;
+    guint       i;
+
+    from = connection_pool_get_worker (pool, connection);
+
+    for (i = 0; i < MAX (pool->n_workers, 1); i++) {
+        PoolWorker *to = &pool->workers[i];
+
+        if (to->context != context) {
+            continue;
+        }
+
+        if (from) {
+            g_atomic_int_add (&from->n_connections, -1);
+        }
+        g_atomic_int_inc (&to->n_connections);
+
+        return to->timer_wheel;
+    }
+
+    return NULL;
+}
+
+LmSSLContext *
+_lm_connection_pool_get_ssl_context (LmConnectionPool *pool)
+{
+    return pool->ssl_context;
+}
+
+LmResolverCache *
+_lm_connection_pool_get_resolver_cache (LmConnectionPool *pool)
+{
+    return pool->resolver_cache;
+}
+
+/* Drops a connection that is being freed, and its reference on @pool */
+void
+_lm_connection_pool_remove (LmConnectionPool  *pool,
+                            LmConnection      *connection,
+                            LmConnectionState  state)
+{
+    PoolWorker *worker;
+
+    worker = connection_pool_get_worker (pool, connection);
+    if (worker) {
+        g_atomic_int_add (&worker->n_connections, -1);
+    }
+
+    g_atomic_int_add (&pool->n_state[state], -1);
+
+    lm_connection_pool_unref (pool);
+}
@@ -0,0 +1,97 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_CONNECTION_POOL_H__
+#define __LM_CONNECTION_POOL_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <loudmouth/lm-connection.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LM_CONNECTION_POOL_DEFAULT_RESOLVER_TTL:
+ *
+ * How many seconds a pool keeps DNS lookups unless told otherwise, see
+ * lm_connection_pool_set_resolver_ttl().
+ */
+#define LM_CONNECTION_POOL_DEFAULT_RESOLVER_TTL 300
+
+/**
+ * LmConnectionPool:
+ *
+ * This should not be accessed directly. Use the accessor functions as described below.
+ */
+typedef struct _LmConnectionPool LmConnectionPool;
+
+/**
+ * LmConnectionPoolStats:
+ * @n_workers: Number of worker threads, 0 if the pool runs in the default context.
+ * @n_connections: Number of connections created from the pool that are still alive.
+ * @n_opening: Number of connections that are being opened.
+ * @n_open: Number of connections that are open but not authenticated.
+ * @n_authenticating: Number of connections that are authenticating.
+ * @n_authenticated: Number of authenticated connections.
+ * @n_resolver_hits: Number of DNS lookups answered from the cache of the pool.
+ * @n_resolver_misses: Number of DNS lookups that were not in the cache.
+ *
+ * Aggregate numbers for all connections of an #LmConnectionPool, see
+ * lm_connection_pool_get_stats().
+ */
+typedef struct {
+    guint n_workers;
+    guint n_connections;
+    guint n_opening;
+    guint n_open;
+    guint n_authenticating;
+    guint n_authenticated;
+    guint n_resolver_hits;
+    guint n_resolver_misses;
+} LmConnectionPoolStats;
+
+LmConnectionPool * lm_connection_pool_new            (guint              n_workers);
+LmConnectionPool * lm_connection_pool_new_per_cpu    (void);
+LmConnection *     lm_connection_pool_new_connection (LmConnectionPool  *pool,
+                                                      const gchar       *server);
+LmConnection *     lm_connection_pool_new_connection_with_hash
+                                                     (LmConnectionPool  *pool,
+                                                      const gchar       *server,
+                                                      guint              hash);
+guint              lm_connection_pool_get_n_workers  (LmConnectionPool  *pool);
+void               lm_connection_pool_set_ssl_context (LmConnectionPool *pool,
+                                                      LmSSLContext      *context);
+void               lm_connection_pool_set_resolver_ttl (LmConnectionPool *pool,
+                                                      guint              ttl);
+void               lm_connection_pool_invoke         (LmConnectionPool  *pool,
+                                                      LmConnection      *connection,
+                                                      GSourceFunc        function,
+                                                      gpointer           user_data,
+                                                      GDestroyNotify     notify);
+void               lm_connection_pool_get_stats      (LmConnectionPool  *pool,
+                                                      LmConnectionPoolStats *stats);
+LmConnectionPool * lm_connection_pool_ref            (LmConnectionPool  *pool);
+void               lm_connection_pool_unref          (LmConnectionPool  *pool);
+
+G_END_DECLS
+
+#endif /* __LM_CONNECTION_POOL_H__ */
@@ -96,13 +96,88 @@
 #include "lm-connection.h"
 #include "lm-utils.h"
 #include "lm-old-socket.h"
+#include "lm-xmpp-writer.h"
 #include "lm-sasl.h"
+#include "lm-timer-wheel.h"
+#include "lm-id-table.h"
+#include "lm-token-bucket.h"
+#include "lm-external-loop.h"
 
 typedef struct {
     LmHandlerPriority  priority;
     LmMessageHandler  *handler;
+
+    /* Optional filters, see lm_connection_register_message_handler_full() */
+    LmMessageSubType   sub_type;
+    gchar             *child_name;
+    gchar             *xmlns;
 } HandlerData;
 
+/* Key into the handler index. Handlers registered without a sub type
+ * or namespace filter are kept in the plain per type lists instead. */
+typedef struct {
+    LmMessageType      type;
+    LmMessageSubType   sub_type;
+    gchar             *xmlns;
+} HandlerKey;
+
+/* At most the plain list plus the (sub type), (xmlns) and
+ * (sub type, xmlns) buckets can match a message */
+#define MAX_HANDLER_BUCKETS 4
+
+/* An outstanding lm_connection_send_with_reply(). Requests carrying an id
+ * from _lm_utils_format_id() are kept in id_replies on the counter value
+ * (@key), others in id_handlers on the id string (@id). */
+typedef struct {
+    guint64            key;
+    gchar             *id;
+    LmConnection      *connection;
+    LmMessageHandler  *handler;
+    LmTimer           *timer;
+    LmCallback        *timeout_cb;
+} ReplyData;
+
+/* A batch sent with lm_connection_send_batch(). The items and their ids
+ * are allocated in the same block as the batch itself. */
+typedef struct _BatchData BatchData;
+
+typedef struct {
+    BatchData         *batch;
+    guint64            key;
+    const gchar       *id;
+    LmMessage         *reply;
+} BatchItem;
+
+struct _BatchData {
+    LmConnection      *connection;
+    LmTimer           *timer;
+    LmCallback        *cb;
+    guint              n_items;
+    guint              n_pending;
+    BatchItem          items[1];
+};
+
+/* A caller blocked in lm_connection_send_with_reply_and_block_timeout().
+ * Lives on the stack of the caller and is filled in by the dispatcher. */
+typedef struct {
+    gchar     *id;
+    LmMessage *reply;
+    gboolean   failed;
+    GError    *error;
+} ReplyWaiter;
+
+/* How often a waiter that doesn't own the context rechecks whether it
+ * can take over iterating it */
+#define WAITER_POLL_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+
+/* Sub types indexed from LM_MESSAGE_SUB_TYPE_NOT_SET, which stands for 
+ * all sub types of a message type in output_priorities */
+#define SUB_TYPE_INDEX(t) ((t) - LM_MESSAGE_SUB_TYPE_NOT_SET)
+#define N_SUB_TYPES       SUB_TYPE_INDEX (LM_MESSAGE_SUB_TYPE_ERROR + 1)
+
+/* Idle per JID rate limit buckets are dropped once there are this many */
+#define MAX_JID_BUCKETS 1024
+
 struct _LmConnection {
     /* Parameters */
     GMainContext      *context;
@@ -114,6 +189,7 @@ struct _LmConnection {
     guint              port;
 
     LmOldSocket       *socket;
+    LmXmppWriter      *writer;
     LmSSL             *ssl;
     LmProxy           *proxy;
     LmParser          *parser;
@@ -121,7 +197,28 @@ struct _LmConnection {
     gchar             *stream_id;
 
     GHashTable        *id_handlers;
+    LmIdTable         *id_replies;
+    LmTimerWheel      *timer_wheel;
+    guint              reply_timeout;
+
+    /* Set for connections created by lm_connection_pool_new_connection() */
+    LmConnectionPool  *pool;
+
+    /* Set for connections created by lm_connection_new_external(), runs 
+     * context from the loop of the application */
+    LmExternalLoop    *external;
+
+    /* Outstanding batches and the id -> BatchItem maps for their replies */
+    GSList            *batches;
+    GHashTable        *batch_items;
+    LmIdTable         *batch_ids;
     GSList            *handlers[LM_MESSAGE_TYPE_UNKNOWN];
+    GHashTable        *indexed_handlers;
+
+    /* Callers blocking on a reply, protected by waiters_lock */
+    GHashTable        *reply_waiters;
+    GMutex             waiters_lock;
+    GCond              waiters_cond;
 
     /* XMPP1.0 stuff (SASL, resource binding, StartTLS) */
     gboolean           use_sasl;
@@ -144,6 +241,48 @@ struct _LmConnection {
 
     LmConnectionState  state;
 
+    /* Whether the socket coalesces writes, see lm_connection_set_corked() */
+    gboolean           corked;
+
+    /* Limit for the socket read buffer, see lm_connection_set_max_read_size() */
+    gsize              max_read_size;
+
+    /* Per wakeup read limits, see lm_connection_set_read_budget() */
+    gsize              read_budget_bytes;
+    guint              read_budget_msecs;
+
+    /* Send side flow control, see lm_connection_set_output_watermarks() */
+    gsize              output_low_watermark;
+    gsize              output_high_watermark;
+    gboolean           fail_when_full;
+    gboolean           output_full;
+    LmCallback        *writable_cb;
+
+    /* SendMarkers for lm_connection_send_full() per output priority, 
+     * oldest first */
+    GQueue            *send_markers[LM_OUTPUT_N_PRIORITIES];
+
+    /* LmOutputPriority per message type and sub type, see 
+     * lm_connection_set_output_priority() */
+    gint8              output_priorities[LM_MESSAGE_TYPE_UNKNOWN][N_SUB_TYPES];
+
+    /* Rate shaping, see lm_connection_set_rate_limit(). Messages over 
+     * the limits wait in held_messages until shaper_source fires. */
+    LmTokenBucket      rate_bytes;
+    LmTokenBucket      rate_stanzas;
+    guint              jid_bytes_rate;
+    guint              jid_bytes_burst;
+    guint              jid_stanzas_rate;
+    guint              jid_stanzas_burst;
+    GHashTable        *jid_buckets;
+    GQueue            *held_messages;
+    GSource           *shaper_source;
+    guint              shaper_pass;
+    /* Socket output that has been charged to rate_bytes */
+    guint64            shaper_charged;
+    guint64            n_delayed;
+    GTimeSpan          delayed_time;
+
     /* TODO: Move the rate to use the one in LmFeaturePing instead of keeping the two in sync */
     guint              keep_alive_rate;
     LmFeaturePing     *feature_ping;
@@ -151,6 +290,33 @@ struct _LmConnection {
     gint               ref_count;
 };
 
+/* Completion of a lm_connection_send_full(), due once the socket has 
+ * written @offset bytes of the message's output priority */
+typedef struct {
+    guint64     offset;
+    LmCallback *cb;
+} SendMarker;
+
+/* Rate limit buckets of a destination JID, see 
+ * lm_connection_set_jid_rate_limit() */
+typedef struct {
+    LmTokenBucket bytes;
+    LmTokenBucket stanzas;
+
+    /* Held messages to this JID, and the release pass that found it 
+     * over its limits */
+    guint         n_held;
+    guint         blocked_pass;
+} JidBuckets;
+
+/* A message held back by the rate limits */
+typedef struct {
+    LmMessage  *message;
+    JidBuckets *jid;
+    LmCallback *written_cb;
+    gint64      held_since;
+} HeldMessage;
+
 typedef enum {
     AUTH_TYPE_PLAIN  = 1,
     AUTH_TYPE_DIGEST = 2,
@@ -162,6 +328,7 @@ typedef enum {
 #define XMPP_NS_STARTTLS "urn:ietf:params:xml:ns:xmpp-tls"
 
 static void     connection_free              (LmConnection        *connection);
+static void     connection_batch_complete    (BatchData           *batch);
 static void     connection_handle_message    (LmConnection        *connection,
                                               LmMessage           *message);
 static void     connection_new_message_cb    (LmParser            *parser,
@@ -208,10 +375,15 @@ connection_signal_disconnect                 (LmConnection        *connection,
                                               LmDisconnectReason   reason);
 static void     connection_incoming_data     (LmOldSocket         *socket, 
                                               const gchar         *buf,
+                                              gsize                len,
                                               LmConnection        *connection);
 static void     connection_socket_closed_cb  (LmOldSocket            *socket,
                                               LmDisconnectReason   reason,
                                               LmConnection        *connection);
+static void     connection_socket_written_cb (LmOldSocket         *socket,
+                                              LmConnection        *connection);
+static void     connection_complete_sends    (LmConnection        *connection,
+                                              gboolean             success);
 static void      
 connection_socket_connect_cb                 (LmOldSocket         *socket,
                                               gboolean             result,
@@ -230,6 +402,56 @@ static gboolean connection_old_auth          (LmConnection        *connection,
                                               LmAuthParameters    *auth_params,
                                               GError             **errror);
 
+static void
+connection_handler_data_free (HandlerData *hd)
+{
+    lm_message_handler_unref (hd->handler);
+    g_free (hd->child_name);
+    g_free (hd->xmlns);
+    g_free (hd);
+}
+
+static void
+connection_handler_list_free (GSList *list)
+{
+    g_slist_foreach (list, (GFunc) connection_handler_data_free, NULL);
+    g_slist_free (list);
+}
+
+static guint
+connection_handler_key_hash (gconstpointer key)
+{
+    const HandlerKey *hk = key;
+    guint             hash;
+
+    hash = (hk->type << 8) ^ (hk->sub_type + 1);
+    if (hk->xmlns) {
+        hash ^= g_str_hash (hk->xmlns);
+    }
+
+    return hash;
+}
+
+static gboolean
+connection_handler_key_equal (gconstpointer a, gconstpointer b)
+{
+    const HandlerKey *ka = a;
+    const HandlerKey *kb = b;
+
+    if (ka->type != kb->type || ka->sub_type != kb->sub_type) {
+        return FALSE;
+    }
+
+    return g_strcmp0 (ka->xmlns, kb->xmlns) == 0;
+}
+
+static void
+connection_handler_key_free (HandlerKey *key)
+{
+    g_free (key->xmlns);
+    g_slice_free (HandlerKey, key);
+}
+
 static void
 connection_free_handlers (LmConnection *connection)
 {
@@ -237,22 +459,18 @@ connection_free_handlers (LmConnection *connection)
 
     /* Unref handlers */
     for (i = 0; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
-        GSList *l;
-
-        for (l = connection->handlers[i]; l; l = l->next) {
-            HandlerData *hd = (HandlerData *) l->data;
-            
-            lm_message_handler_unref (hd->handler);
-            g_free (hd);
-        }
-
-        g_slist_free (connection->handlers[i]);
+        connection_handler_list_free (connection->handlers[i]);
+        connection->handlers[i] = NULL;
     }
+
+    g_hash_table_destroy (connection->indexed_handlers);
 }
 
 static void
 connection_free (LmConnection *connection)
 {
+    gint i;
+
     /* This needs to be run before starting to free internal states.
      * It used to be run after the handlers where freed which lead to a crash
      * when the connection was freed prior to running lm_connection_close.
@@ -278,6 +496,25 @@ connection_free (LmConnection *connection)
     connection_free_handlers (connection);
     
     g_hash_table_destroy (connection->id_handlers);
+    lm_id_table_free (connection->id_replies);
+
+    while (connection->batches) {
+        BatchData *batch = connection->batches->data;
+
+        /* Too late to call back */
+        batch->cb->func = NULL;
+        connection_batch_complete (batch);
+    }
+    g_hash_table_destroy (connection->batch_items);
+    lm_id_table_free (connection->batch_ids);
+
+    if (connection->timer_wheel) {
+        lm_timer_wheel_unref (connection->timer_wheel);
+    }
+
+    g_hash_table_destroy (connection->reply_waiters);
+    g_mutex_clear (&connection->waiters_lock);
+    g_cond_clear (&connection->waiters_cond);
     
     if (connection->open_cb) {
         _lm_utils_free_callback (connection->open_cb);
@@ -288,6 +525,20 @@ connection_free (LmConnection *connection)
     }
 
     lm_connection_set_disconnect_function (connection, NULL, NULL, NULL);
+    lm_connection_set_writable_function (connection, NULL, NULL, NULL);
+
+    for (i = 0; i < LM_OUTPUT_N_PRIORITIES; i++) {
+        while (!g_queue_is_empty (connection->send_markers[i])) {
+            SendMarker *marker = g_queue_pop_head (connection->send_markers[i]);
+
+            _lm_utils_free_callback (marker->cb);
+            g_free (marker);
+        }
+        g_queue_free (connection->send_markers[i]);
+    }
+
+    g_queue_free (connection->held_messages);
+    g_hash_table_destroy (connection->jid_buckets);
 
     if (connection->proxy) {
         lm_proxy_unref (connection->proxy);
@@ -295,45 +546,308 @@ connection_free (LmConnection *connection)
 
     lm_message_queue_unref (connection->queue);
 
+    if (connection->pool) {
+        _lm_connection_pool_remove (connection->pool, connection, 
+                                    connection->state);
+    }
+
     if (connection->context) {
         g_main_context_unref (connection->context);
     }
 
+    if (connection->writer) {
+        g_object_unref (connection->writer);
+    }
+
     if (connection->socket) {
         lm_old_socket_unref (connection->socket);
     }
 
+    if (connection->external) {
+        lm_external_loop_free (connection->external);
+    }
+
     g_slice_free (LmConnection, connection);
 }
 
+static LmTimerWheel *
+connection_get_timer_wheel (LmConnection *connection)
+{
+    if (!connection->timer_wheel) {
+        connection->timer_wheel = lm_timer_wheel_new ();
+        lm_timer_wheel_attach (connection->timer_wheel, connection->context);
+    }
+
+    return connection->timer_wheel;
+}
+
+static void
+connection_set_state (LmConnection *connection, LmConnectionState state)
+{
+    if (connection->pool) {
+        _lm_connection_pool_state_changed (connection->pool, 
+                                           connection->state, state);
+    }
+
+    connection->state = state;
+}
+
+static void
+connection_reply_data_free (ReplyData *data)
+{
+    if (data->timer) {
+        lm_timer_wheel_cancel (data->connection->timer_wheel, data->timer);
+    }
+
+    if (data->timeout_cb) {
+        _lm_utils_free_callback (data->timeout_cb);
+    }
+
+    lm_message_handler_unref (data->handler);
+    g_free (data->id);
+    g_slice_free (ReplyData, data);
+}
+
+static void
+connection_reply_timeout_cb (ReplyData *data)
+{
+    LmConnection *connection = data->connection;
+    LmCallback   *cb = data->timeout_cb;
+    gchar         id_buf[LM_ID_BUF_SIZE];
+    const gchar  *id;
+
+    /* The timer is freed by the wheel once we return */
+    data->timer = NULL;
+
+    lm_connection_ref (connection);
+
+    if (data->id) {
+        g_hash_table_steal (connection->id_handlers, data->id);
+        id = data->id;
+    } else {
+        lm_id_table_steal (connection->id_replies, data->key);
+        _lm_utils_print_id (data->key, id_buf);
+        id = id_buf;
+    }
+
+    lm_verbose ("No reply to \"%s\" in time, dropping its handler\n", id);
+
+    if (cb && cb->func) {
+        (* ((LmReplyTimeoutFunction) cb->func)) (connection, id,
+                                                 cb->user_data);
+    }
+
+    connection_reply_data_free (data);
+    lm_connection_unref (connection);
+}
+
+/* Calls the callback of @batch with whatever replies arrived so far and
+ * frees it */
+static void
+connection_batch_complete (BatchData *batch)
+{
+    LmConnection  *connection = batch->connection;
+    LmMessage    **replies;
+    guint          i;
+
+    if (batch->timer) {
+        lm_timer_wheel_cancel (connection->timer_wheel, batch->timer);
+        batch->timer = NULL;
+    }
+
+    connection->batches = g_slist_remove (connection->batches, batch);
+
+    replies = g_new (LmMessage *, batch->n_items);
+    for (i = 0; i < batch->n_items; ++i) {
+        BatchItem *item = &batch->items[i];
+
+        if (!item->reply) {
+            if (item->id) {
+                g_hash_table_remove (connection->batch_items, item->id);
+            } else {
+                lm_id_table_remove (connection->batch_ids, item->key);
+            }
+        }
+        replies[i] = item->reply;
+    }
+
+    if (batch->cb->func) {
+        (* ((LmBatchFunction) batch->cb->func)) (connection, replies,
+                                                 batch->n_items,
+                                                 batch->cb->user_data);
+    }
+
+    for (i = 0; i < batch->n_items; ++i) {
+        if (replies[i]) {
+            lm_message_unref (replies[i]);
+        }
+    }
+
+    g_free (replies);
+    _lm_utils_free_callback (batch->cb);
+    g_free (batch);
+}
+
+static void
+connection_batch_timeout_cb (BatchData *batch)
+{
+    /* The timer is freed by the wheel once we return */
+    batch->timer = NULL;
+
+    lm_verbose ("Batch timed out with %u of %u replies missing\n",
+                batch->n_pending, batch->n_items);
+
+    connection_batch_complete (batch);
+}
+
+static void
+connection_fail_batches (LmConnection *connection)
+{
+    while (connection->batches) {
+        connection_batch_complete ((BatchData *) connection->batches->data);
+    }
+}
+
+static gboolean
+connection_run_batch_item (LmConnection *connection, 
+                           const gchar  *id,
+                           guint64       key,
+                           LmMessage    *m)
+{
+    BatchItem *item;
+    BatchData *batch;
+
+    if (key) {
+        item = lm_id_table_steal (connection->batch_ids, key);
+    } else {
+        item = g_hash_table_lookup (connection->batch_items, id);
+        if (item) {
+            g_hash_table_remove (connection->batch_items, id);
+        }
+    }
+
+    if (!item) {
+        return FALSE;
+    }
+
+    item->reply = lm_message_ref (m);
+    batch = item->batch;
+
+    if (--batch->n_pending == 0) {
+        connection_batch_complete (batch);
+    }
+
+    return TRUE;
+}
+
 static LmHandlerResult
 connection_run_message_handler (LmConnection *connection, LmMessage *m)
 {
-    LmMessageHandler *handler;
-    const gchar      *id;
-    LmHandlerResult   result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    ReplyData       *data;
+    const gchar     *id;
+    guint64          key = 0;
+    LmHandlerResult  result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
     id = lm_message_node_get_attribute (m->node, "id");
     if (!id) {
         return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
     }
 
-    handler = g_hash_table_lookup (connection->id_handlers, id);
-    if (handler) {
-        result = _lm_message_handler_handle_message (handler,
+    /* Our own ids are looked up on their counter value */
+    _lm_utils_parse_id (id, &key);
+
+    if (connection->batches && 
+        connection_run_batch_item (connection, id, key, m)) {
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    if (key) {
+        data = lm_id_table_lookup (connection->id_replies, key);
+    } else {
+        data = g_hash_table_lookup (connection->id_handlers, id);
+    }
+
+    if (data) {
+        /* Don't let the timer fire while the handler runs */
+        if (data->timer) {
+            lm_timer_wheel_cancel (connection->timer_wheel, data->timer);
+            data->timer = NULL;
+        }
+
+        result = _lm_message_handler_handle_message (data->handler,
                                                      connection,
                                                      m);
-        g_hash_table_remove (connection->id_handlers,
-                             id);
+        if (key) {
+            lm_id_table_remove (connection->id_replies, key);
+        } else {
+            g_hash_table_remove (connection->id_handlers, id);
+        }
     }
 
     return result;
 }
 
+/* Collects the handler lists that can match @m, the plain list for the
+ * message type and the indexed buckets for its sub type and the xmlns of
+ * its first child. Returns the number of lists stored in @buckets. */
+static gint
+connection_lookup_handlers (LmConnection   *connection,
+                            LmMessage      *m,
+                            GSList        **buckets,
+                            LmMessageNode **child)
+{
+    HandlerKey key;
+    gint       n_buckets = 0;
+    gint       i;
+
+    key.type     = lm_message_get_type (m);
+    key.sub_type = lm_message_get_sub_type (m);
+    key.xmlns    = NULL;
+
+    *child = m->node->children;
+    if (*child) {
+        key.xmlns = (gchar *) lm_message_node_get_attribute (*child, "xmlns");
+    }
+
+    buckets[n_buckets++] = connection->handlers[key.type];
+
+    if (g_hash_table_size (connection->indexed_handlers) == 0) {
+        return n_buckets;
+    }
+
+    for (i = 1; i < MAX_HANDLER_BUCKETS; ++i) {
+        HandlerKey lookup = key;
+
+        if (!(i & 1)) {
+            lookup.sub_type = LM_MESSAGE_SUB_TYPE_NOT_SET;
+        }
+        if (!(i & 2)) {
+            lookup.xmlns = NULL;
+        }
+
+        if ((i & 1) && key.sub_type == LM_MESSAGE_SUB_TYPE_NOT_SET) {
+            continue;
+        }
+        if ((i & 2) && key.xmlns == NULL) {
+            continue;
+        }
+
+        buckets[n_buckets] = g_hash_table_lookup (connection->indexed_handlers,
+                                                  &lookup);
+        if (buckets[n_buckets]) {
+            n_buckets++;
+        }
+    }
+
+    return n_buckets;
+}
+
 static void
 connection_handle_message (LmConnection *connection, LmMessage *m)
 {
-    GSList          *l;
+    GSList          *buckets[MAX_HANDLER_BUCKETS];
+    LmMessageNode   *child;
+    gint             n_buckets;
     LmHandlerResult  result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
     lm_connection_ref (connection);
@@ -348,11 +862,38 @@ connection_handle_message (LmConnection *connection, LmMessage *m)
         goto out;
     }
 
-    for (l = connection->handlers[lm_message_get_type (m)]; 
-         l && result == LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS; 
-         l = l->next) {
-        HandlerData *hd = (HandlerData *) l->data;
-        
+    n_buckets = connection_lookup_handlers (connection, m, buckets, &child);
+
+    /* Merge the matching buckets, each one is sorted on priority */
+    while (result == LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS) {
+        HandlerData *hd = NULL;
+        gint         i, best = -1;
+
+        for (i = 0; i < n_buckets; ++i) {
+            HandlerData *candidate;
+
+            if (!buckets[i]) {
+                continue;
+            }
+
+            candidate = (HandlerData *) buckets[i]->data;
+            if (!hd || candidate->priority > hd->priority) {
+                hd = candidate;
+                best = i;
+            }
+        }
+
+        if (!hd) {
+            break;
+        }
+
+        buckets[best] = buckets[best]->next;
+
+        if (hd->child_name &&
+            (!child || strcmp (hd->child_name, child->name) != 0)) {
+            continue;
+        }
+
         result = _lm_message_handler_handle_message (hd->handler,
                                                      connection,
                                                      m);
@@ -369,12 +910,62 @@ connection_handle_message (LmConnection *connection, LmMessage *m)
     return;
 }
 
+/* Hands @m over to a caller blocking on it, returns TRUE if there was one */
+static gboolean
+connection_deliver_to_waiter (LmConnection *connection, LmMessage *m)
+{
+    ReplyWaiter *waiter;
+    const gchar *id;
+
+    id = lm_message_node_get_attribute (m->node, "id");
+    if (!id) {
+        return FALSE;
+    }
+
+    g_mutex_lock (&connection->waiters_lock);
+
+    waiter = g_hash_table_lookup (connection->reply_waiters, id);
+    if (waiter) {
+        g_hash_table_remove (connection->reply_waiters, id);
+        waiter->reply = lm_message_ref (m);
+        g_cond_broadcast (&connection->waiters_cond);
+    }
+
+    g_mutex_unlock (&connection->waiters_lock);
+
+    return waiter != NULL;
+}
+
+/* Wakes up all blocked callers, they will return without a reply */
+static void
+connection_fail_waiters (LmConnection *connection)
+{
+    GHashTableIter  iter;
+    ReplyWaiter    *waiter;
+
+    g_mutex_lock (&connection->waiters_lock);
+
+    g_hash_table_iter_init (&iter, connection->reply_waiters);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &waiter)) {
+        waiter->failed = TRUE;
+    }
+
+    g_hash_table_remove_all (connection->reply_waiters);
+    g_cond_broadcast (&connection->waiters_cond);
+
+    g_mutex_unlock (&connection->waiters_lock);
+}
+
 static void
 connection_new_message_cb (LmParser     *parser,
                            LmMessage    *m,
                            LmConnection *connection)
 {
     const gchar *from;
+
+    if (connection_deliver_to_waiter (connection, m)) {
+        return;
+    }
     
     lm_message_ref (m);
 
@@ -431,27 +1022,9 @@ connection_stop_keep_alive (LmConnection *connection)
     connection->feature_ping = NULL;
 }
 
-static void
-connection_log_send (LmConnection *connection,
-                     const gchar  *str,
-                     gint          len)
-{
-    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\nSEND:\n");
-    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
-           "-----------------------------------\n");
-    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "%s\n", str);
-    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
-           "-----------------------------------\n");
-}
-
 static gboolean
-connection_send (LmConnection  *connection, 
-                 const gchar   *str, 
-                 gint           len, 
-                 GError       **error)
+connection_check_open (LmConnection *connection, GError **error)
 {
-    gint b_written;
-
     if (connection->state < LM_CONNECTION_STATE_OPENING) {
         g_log (LM_LOG_DOMAIN,LM_LOG_LEVEL_NET,
                "Connection is not open.\n");
@@ -463,28 +1036,497 @@ connection_send (LmConnection  *connection,
         return FALSE;
     }
 
-    if (len == -1) {
-        len = strlen (str);
-    }
-
-    connection_log_send (connection, str, len);
+    return TRUE;
+}
 
-    /* Check to see if there already is an output buffer, if so, add to the
-       buffer and return */
+/* Refuses new output once the high watermark is reached, if the 
+ * application asked for that with lm_connection_set_fail_when_full() */
+static gboolean
+connection_check_output (LmConnection *connection, GError **error)
+{
+    if (!connection->fail_when_full || 
+        connection->output_high_watermark == 0 ||
+        lm_connection_get_pending_output (connection) < connection->output_high_watermark) {
+        return TRUE;
+    }
 
-    b_written = lm_old_socket_write (connection->socket, str, len);
+    connection->output_full = TRUE;
 
-    if (b_written < 0) {
-        g_set_error (error,
-                     LM_ERROR,
-                     LM_ERROR_CONNECTION_FAILED,
-                     "Server closed the connection");
+    g_set_error (error,
+                 LM_ERROR,
+                 LM_ERROR_OUTPUT_FULL,
+                 "Too much output is pending, wait until the connection is writable");
+    return FALSE;
+}
+
+static gboolean
+connection_is_shaped (LmConnection *connection)
+{
+    return lm_token_bucket_is_limited (&connection->rate_bytes) ||
+        lm_token_bucket_is_limited (&connection->rate_stanzas) ||
+        connection->jid_bytes_rate > 0 || 
+        connection->jid_stanzas_rate > 0;
+}
+
+static void
+connection_init_jid_buckets (LmConnection *connection, 
+                             JidBuckets   *jid,
+                             gint64        now)
+{
+    lm_token_bucket_init (&jid->bytes, 
+                          connection->jid_bytes_rate,
+                          connection->jid_bytes_burst,
+                          now);
+    lm_token_bucket_init (&jid->stanzas, 
+                          connection->jid_stanzas_rate,
+                          connection->jid_stanzas_burst,
+                          now);
+}
+
+static gboolean
+connection_jid_buckets_are_idle (gpointer    key,
+                                 JidBuckets *jid,
+                                 gint64     *now)
+{
+    return jid->n_held == 0 && 
+        lm_token_bucket_is_full (&jid->bytes, *now) &&
+        lm_token_bucket_is_full (&jid->stanzas, *now);
+}
+
+/* Returns the buckets for the recipient of @message, NULL unless there are
+ * per JID rate limits */
+static JidBuckets *
+connection_get_jid_buckets (LmConnection *connection, 
+                            LmMessage    *message,
+                            gint64        now)
+{
+    JidBuckets  *jid;
+    const gchar *to;
+
+    if (connection->jid_bytes_rate == 0 && connection->jid_stanzas_rate == 0) {
+        return NULL;
+    }
+
+    to = lm_message_node_get_attribute (message->node, "to");
+    if (!to) {
+        to = "";
+    }
+
+    jid = g_hash_table_lookup (connection->jid_buckets, to);
+    if (jid) {
+        return jid;
+    }
+
+    if (g_hash_table_size (connection->jid_buckets) >= MAX_JID_BUCKETS) {
+        g_hash_table_foreach_remove (connection->jid_buckets,
+                                     (GHRFunc) connection_jid_buckets_are_idle,
+                                     &now);
+    }
+
+    jid = g_new0 (JidBuckets, 1);
+    connection_init_jid_buckets (connection, jid, now);
+    g_hash_table_insert (connection->jid_buckets, g_strdup (to), jid);
+
+    return jid;
+}
+
+/* Charges the output queued since the last call to the rate limits, and 
+ * one stanza if it was for @message */
+static void
+connection_shaper_charge (LmConnection *connection, LmMessage *message)
+{
+    JidBuckets *jid;
+    guint64     queued = 0;
+    gsize       charged;
+    gint64      now;
+    gint        i;
+
+    for (i = 0; i < LM_OUTPUT_N_PRIORITIES; i++) {
+        queued += lm_old_socket_get_bytes_queued (connection->socket, i);
+    }
+
+    charged = queued - connection->shaper_charged;
+    connection->shaper_charged = queued;
+
+    if (!connection_is_shaped (connection)) {
+        return;
+    }
+
+    now = g_get_monotonic_time ();
+
+    lm_token_bucket_take (&connection->rate_bytes, charged, now);
+
+    if (!message) {
+        return;
+    }
+
+    lm_token_bucket_take (&connection->rate_stanzas, 1, now);
+
+    jid = connection_get_jid_buckets (connection, message, now);
+    if (jid) {
+        lm_token_bucket_take (&jid->bytes, charged, now);
+        lm_token_bucket_take (&jid->stanzas, 1, now);
+    }
+}
+
+/* Called after output was queued, for @message or for raw data if NULL */
+static void
+connection_output_queued (LmConnection *connection, LmMessage *message)
+{
+    if (connection->output_high_watermark > 0 &&
+        lm_connection_get_pending_output (connection) >= connection->output_high_watermark) {
+        connection->output_full = TRUE;
+    }
+
+    connection_shaper_charge (connection, message);
+}
+
+static gboolean
+connection_send (LmConnection  *connection, 
+                 const gchar   *str, 
+                 gint           len, 
+                 GError       **error)
+{
+    if (!connection_check_open (connection, error)) {
+        return FALSE;
+    }
+
+    if (len == -1) {
+        len = strlen (str);
+    }
+
+    if (!lm_xmpp_writer_send_text (connection->writer, str, len, 
+                                   LM_OUTPUT_PRIORITY_BULK, error)) {
+        return FALSE;
+    }
+
+    connection_output_queued (connection, NULL);
+
+    return TRUE;
+}
+
+/* Calls the lm_connection_send_full() callbacks for everything the socket
+ * has written, or for all of them if the connection was closed */
+static void
+connection_complete_sends (LmConnection *connection, gboolean success)
+{
+    LmOutputPriority priority;
+
+    for (priority = 0; priority < LM_OUTPUT_N_PRIORITIES; priority++) {
+        GQueue  *markers = connection->send_markers[priority];
+        guint64  bytes_written = 0;
+
+        if (success) {
+            bytes_written = lm_old_socket_get_bytes_written (connection->socket,
+                                                             priority);
+        }
+
+        while (!g_queue_is_empty (markers)) {
+            SendMarker *marker = g_queue_peek_head (markers);
+            LmCallback *cb;
+
+            if (success && marker->offset > bytes_written) {
+                break;
+            }
+
+            g_queue_pop_head (markers);
+            cb = marker->cb;
+            g_free (marker);
+
+            (* ((LmResultFunction) cb->func)) (connection, success, 
+                                               cb->user_data);
+            _lm_utils_free_callback (cb);
+        }
+    }
+}
+
+/* Returns the priority @message is written with */
+static LmOutputPriority
+connection_get_message_priority (LmConnection *connection, LmMessage *message)
+{
+    LmOutputPriority priority;
+    LmMessageType    type;
+
+    priority = lm_message_get_output_priority (message);
+    if (priority != LM_OUTPUT_PRIORITY_DEFAULT) {
+        return priority;
+    }
+
+    type = lm_message_get_type (message);
+    if (type < 0 || type >= LM_MESSAGE_TYPE_UNKNOWN) {
+        return LM_OUTPUT_PRIORITY_BULK;
+    }
+
+    priority = lm_connection_get_output_priority (connection, type, 
+                                                  lm_message_get_sub_type (message));
+    if (priority == LM_OUTPUT_PRIORITY_DEFAULT) {
+        priority = lm_connection_get_output_priority (connection, type,
+                                                      LM_MESSAGE_SUB_TYPE_NOT_SET);
+    }
+
+    if (priority == LM_OUTPUT_PRIORITY_DEFAULT) {
+        return LM_OUTPUT_PRIORITY_BULK;
+    }
+
+    return priority;
+}
+
+/* Writes @message to the socket. If @written_cb is set it is called once
+ * all of @message has been written, but only if this succeeds. */
+static gboolean
+connection_write_message (LmConnection  *connection,
+                          LmMessage     *message,
+                          LmCallback    *written_cb,
+                          GError       **error)
+{
+    LmOutputPriority  priority;
+    SendMarker       *marker;
+
+    priority = connection_get_message_priority (connection, message);
+
+    if (!lm_xmpp_writer_send_message (connection->writer, message, priority,
+                                      error)) {
+        return FALSE;
+    }
+
+    connection_output_queued (connection, message);
+
+    if (!written_cb) {
+        return TRUE;
+    }
+
+    marker = g_new (SendMarker, 1);
+    marker->offset = lm_old_socket_get_bytes_queued (connection->socket,
+                                                     priority);
+    marker->cb = written_cb;
+
+    g_queue_push_tail (connection->send_markers[priority], marker);
+
+    if (marker->offset <= lm_old_socket_get_bytes_written (connection->socket,
+                                                           priority)) {
+        connection_complete_sends (connection, TRUE);
+    }
+
+    return TRUE;
+}
+
+static gint64
+connection_shaper_get_delay (LmConnection *connection, gint64 now)
+{
+    return MAX (lm_token_bucket_get_delay (&connection->rate_bytes, 0, now),
+                lm_token_bucket_get_delay (&connection->rate_stanzas, 1, now));
+}
+
+static gint64
+connection_shaper_get_jid_delay (JidBuckets *jid, gint64 now)
+{
+    if (!jid) {
+        return 0;
+    }
+
+    return MAX (lm_token_bucket_get_delay (&jid->bytes, 0, now),
+                lm_token_bucket_get_delay (&jid->stanzas, 1, now));
+}
+
+static gboolean connection_shaper_timeout_cb (LmConnection *connection);
+
+/* Sends the held messages that are within the rate limits. Messages to 
+ * the same JID stay in order. */
+static void
+connection_shaper_release (LmConnection *connection)
+{
+    GList  *l, *next;
+    gint64  now;
+    gint64  wait = G_MAXINT64;
+    guint   pass;
+
+    now  = g_get_monotonic_time ();
+    pass = ++connection->shaper_pass;
+
+    for (l = connection->held_messages->head; l; l = next) {
+        HeldMessage *held = l->data;
+        gint64       delay;
+
+        next = l->next;
+
+        delay = connection_shaper_get_delay (connection, now);
+        if (delay > 0) {
+            wait = delay;
+            break;
+        }
+
+        if (held->jid) {
+            if (held->jid->blocked_pass == pass) {
+                continue;
+            }
+
+            delay = connection_shaper_get_jid_delay (held->jid, now);
+            if (delay > 0) {
+                held->jid->blocked_pass = pass;
+                wait = MIN (wait, delay);
+                continue;
+            }
+
+            held->jid->n_held--;
+        }
+
+        g_queue_delete_link (connection->held_messages, l);
+        connection->delayed_time += now - held->held_since;
+
+        if (!connection_write_message (connection, held->message, 
+                                       held->written_cb, NULL) &&
+            held->written_cb) {
+            LmCallback *cb = held->written_cb;
+
+            (* ((LmResultFunction) cb->func)) (connection, FALSE, 
+                                               cb->user_data);
+            _lm_utils_free_callback (cb);
+        }
+
+        lm_message_unref (held->message);
+        g_free (held);
+    }
+
+    if (g_queue_is_empty (connection->held_messages) || 
+        connection->shaper_source) {
+        return;
+    }
+
+    connection->shaper_source = 
+        lm_misc_add_timeout (connection->context,
+                             MAX (1, (wait + 999) / 1000),
+                             (GSourceFunc) connection_shaper_timeout_cb,
+                             connection);
+}
+
+static gboolean
+connection_shaper_timeout_cb (LmConnection *connection)
+{
+    connection->shaper_source = NULL;
+
+    lm_connection_ref (connection);
+    connection_shaper_release (connection);
+    lm_connection_unref (connection);
+
+    return FALSE;
+}
+
+/* Holds @message back if sending it now would exceed the rate limits.
+ * Control messages are never held, but they are charged. */
+static gboolean
+connection_shaper_hold (LmConnection *connection,
+                        LmMessage    *message,
+                        LmCallback   *written_cb)
+{
+    HeldMessage *held;
+    JidBuckets  *jid;
+    gint64       now;
+
+    if (!connection_is_shaped (connection) ||
+        connection_get_message_priority (connection, message) == LM_OUTPUT_PRIORITY_CONTROL) {
+        return FALSE;
+    }
+
+    now = g_get_monotonic_time ();
+    jid = connection_get_jid_buckets (connection, message, now);
+
+    if (jid) {
+        if (jid->n_held == 0 && 
+            connection_shaper_get_delay (connection, now) == 0 &&
+            connection_shaper_get_jid_delay (jid, now) == 0) {
+            return FALSE;
+        }
+
+        jid->n_held++;
+    } 
+    else if (g_queue_is_empty (connection->held_messages) &&
+             connection_shaper_get_delay (connection, now) == 0) {
         return FALSE;
     }
 
+    held = g_new (HeldMessage, 1);
+    held->message    = lm_message_ref (message);
+    held->jid        = jid;
+    held->written_cb = written_cb;
+    held->held_since = now;
+
+    g_queue_push_tail (connection->held_messages, held);
+    connection->n_delayed++;
+
+    if (!connection->shaper_source) {
+        connection_shaper_release (connection);
+    }
+
     return TRUE;
 }
 
+/* Drops the held messages when the connection closes */
+static void
+connection_shaper_reset (LmConnection *connection)
+{
+    if (connection->shaper_source) {
+        g_source_destroy (connection->shaper_source);
+        connection->shaper_source = NULL;
+    }
+
+    while (!g_queue_is_empty (connection->held_messages)) {
+        HeldMessage *held = g_queue_pop_head (connection->held_messages);
+
+        if (held->written_cb) {
+            LmCallback *cb = held->written_cb;
+
+            (* ((LmResultFunction) cb->func)) (connection, FALSE, 
+                                               cb->user_data);
+            _lm_utils_free_callback (cb);
+        }
+
+        lm_message_unref (held->message);
+        g_free (held);
+    }
+
+    g_hash_table_remove_all (connection->jid_buckets);
+}
+
+static gboolean
+connection_send_message (LmConnection  *connection,
+                         LmMessage     *message,
+                         LmCallback    *written_cb,
+                         GError       **error)
+{
+    if (!connection_check_open (connection, error) ||
+        !connection_check_output (connection, error)) {
+        return FALSE;
+    }
+
+    if (connection_shaper_hold (connection, message, written_cb)) {
+        return TRUE;
+    }
+
+    return connection_write_message (connection, message, written_cb, error);
+}
+
+static void
+connection_socket_written_cb (LmOldSocket *socket, LmConnection *connection)
+{
+    LmCallback *cb;
+
+    lm_connection_ref (connection);
+
+    connection_complete_sends (connection, TRUE);
+
+    if (connection->output_full &&
+        lm_old_socket_get_pending_output (socket) <= connection->output_low_watermark) {
+        connection->output_full = FALSE;
+
+        cb = connection->writable_cb;
+        if (cb && cb->func) {
+            (* ((LmWritableFunction) cb->func)) (connection, cb->user_data);
+        }
+    }
+
+    lm_connection_unref (connection);
+}
+
 static void
 connection_message_queue_cb (LmMessageQueue *queue, LmConnection *connection)
 {
@@ -536,9 +1578,26 @@ connection_do_open (LmConnection *connection, GError **error)
         return FALSE;
     }
 
+    if (connection->writer) {
+        g_object_unref (connection->writer);
+    }
+    connection->writer = lm_xmpp_writer_new (connection->socket);
+    lm_old_socket_set_written_func (connection->socket,
+                                    (OutputWrittenFunc) connection_socket_written_cb);
+    connection->shaper_charged = 0;
+
+    if (connection->corked) {
+        lm_old_socket_set_corked (connection->socket, TRUE);
+    }
+    lm_old_socket_set_max_read_size (connection->socket, 
+                                     connection->max_read_size);
+    lm_old_socket_set_read_budget (connection->socket,
+                                   connection->read_budget_bytes,
+                                   connection->read_budget_msecs);
+
     lm_message_queue_attach (connection->queue, connection->context);
     
-    connection->state = LM_CONNECTION_STATE_OPENING;
+    connection_set_state (connection, LM_CONNECTION_STATE_OPENING);
 
     return TRUE;
 }
@@ -553,14 +1612,20 @@ connection_do_close (LmConnection *connection)
     }
 
     lm_message_queue_detach (connection->queue);
+
+    connection_fail_waiters (connection);
+    connection_fail_batches (connection);
+    connection_complete_sends (connection, FALSE);
+    connection_shaper_reset (connection);
+    connection->output_full = FALSE;
     
     if (!lm_connection_is_open (connection)) {
         /* lm_connection_is_open is FALSE for state OPENING as well */
-        connection->state = LM_CONNECTION_STATE_CLOSED;
+        connection_set_state (connection, LM_CONNECTION_STATE_CLOSED);
         return;
     }
     
-    connection->state = LM_CONNECTION_STATE_CLOSED;
+    connection_set_state (connection, LM_CONNECTION_STATE_CLOSED);
 
     if (connection->sasl) {
         lm_sasl_free (connection->sasl);
@@ -702,11 +1767,11 @@ connection_auth_reply (LmMessageHandler *handler,
     type = lm_message_node_get_attribute (m->node, "type");
     if (strcmp (type, "result") == 0) {
         result = TRUE;
-        connection->state = LM_CONNECTION_STATE_AUTHENTICATED;
+        connection_set_state (connection, LM_CONNECTION_STATE_AUTHENTICATED);
     } 
     else if (strcmp (type, "error") == 0) {
         result = FALSE;
-        connection->state = LM_CONNECTION_STATE_OPEN;
+        connection_set_state (connection, LM_CONNECTION_STATE_OPEN);
     }
     
     lm_verbose ("AUTH reply: %d\n", result);
@@ -729,16 +1794,30 @@ connection_auth_reply (LmMessageHandler *handler,
 }
 
 
+static void
+connection_starttls_done_cb (LmOldSocket  *socket,
+                             gboolean      result,
+                             LmConnection *connection)
+{
+    if (result) {
+        connection->tls_started = TRUE;
+        connection_send_stream_header (connection);
+    } else {
+        connection_do_close (connection);
+        connection_signal_disconnect (connection, 
+                                      LM_DISCONNECT_REASON_ERROR);
+    }
+}
+
 static LmHandlerResult
 _lm_connection_starttls_cb (LmMessageHandler *handler,
                             LmConnection     *connection,
                             LmMessage        *message,
                             gpointer          user_data)
 {
-    if (lm_old_socket_starttls (connection->socket)) {
-        connection->tls_started = TRUE;
-        connection_send_stream_header (connection);
-    } else {
+    /* The stream restarts once the handshake is done */
+    if (!lm_old_socket_starttls (connection->socket,
+                                 (ConnectResultFunc) connection_starttls_done_cb)) {
         connection_do_close (connection);
         connection_signal_disconnect (connection, 
                                       LM_DISCONNECT_REASON_ERROR);
@@ -797,7 +1876,7 @@ connection_stream_received (LmConnection *connection, LmMessage *m)
     }
     
     if (connection->state < LM_CONNECTION_STATE_OPEN) {
-        connection->state = LM_CONNECTION_STATE_OPEN;
+        connection_set_state (connection, LM_CONNECTION_STATE_OPEN);
     }
     
     /* Check to see if the stream is correctly set up */
@@ -878,9 +1957,10 @@ connection_signal_disconnect (LmConnection       *connection,
 static void
 connection_incoming_data (LmOldSocket  *socket, 
                           const gchar  *buf, 
+                          gsize         len,
                           LmConnection *connection)
 {
-    lm_parser_parse (connection->parser, buf);
+    lm_parser_parse_len (connection->parser, buf, len);
 }
 
 static void
@@ -983,6 +2063,41 @@ _lm_connection_get_context (LmConnection *conn)
     return conn->context;
 }
 
+LmTimerWheel *
+_lm_connection_get_timer_wheel (LmConnection *conn)
+{
+    g_return_val_if_fail (conn != NULL, NULL);
+
+    return connection_get_timer_wheel (conn);
+}
+
+/* Returns the resolver cache of the pool of @conn, NULL if it has none */
+LmResolverCache *
+_lm_connection_get_resolver_cache (LmConnection *conn)
+{
+    g_return_val_if_fail (conn != NULL, NULL);
+
+    if (!conn->pool) {
+        return NULL;
+    }
+
+    return _lm_connection_pool_get_resolver_cache (conn->pool);
+}
+
+/* Makes @conn share the timer wheel of its pool worker. Takes over the
+ * reference on @pool. */
+void
+_lm_connection_set_pool (LmConnection     *conn, 
+                         LmConnectionPool *pool, 
+                         LmTimerWheel     *wheel)
+{
+    g_return_if_fail (conn != NULL);
+    g_return_if_fail (conn->pool == NULL && conn->timer_wheel == NULL);
+
+    conn->pool        = pool;
+    conn->timer_wheel = lm_timer_wheel_ref (wheel);
+}
+
 gchar *
 _lm_connection_get_server (LmConnection *conn)
 {
@@ -1001,9 +2116,9 @@ static void
 connection_call_auth_cb (LmConnection *connection, gboolean success)
 {
     if (success) {
-        connection->state = LM_CONNECTION_STATE_AUTHENTICATED;
+        connection_set_state (connection, LM_CONNECTION_STATE_AUTHENTICATED);
     } else {
-        connection->state = LM_CONNECTION_STATE_OPEN;
+        connection_set_state (connection, LM_CONNECTION_STATE_OPEN);
     }
 
     if (connection->auth_cb) {
@@ -1209,20 +2324,59 @@ lm_connection_new (const gchar *server)
     }
 
     connection->port        = LM_CONNECTION_DEFAULT_PORT;
+    connection->max_read_size = LM_CONNECTION_DEFAULT_MAX_READ_SIZE;
+    connection->read_budget_bytes = LM_CONNECTION_DEFAULT_READ_BUDGET_BYTES;
+    connection->read_budget_msecs = LM_CONNECTION_DEFAULT_READ_BUDGET_MSECS;
     connection->queue       = lm_message_queue_new ((LmMessageQueueCallback) connection_message_queue_cb, 
                                                           connection);
     connection->state       = LM_CONNECTION_STATE_CLOSED;
     
     connection->id_handlers = g_hash_table_new_full (g_str_hash, 
                                                      g_str_equal,
-                                                     g_free, 
-                                                     (GDestroyNotify) lm_message_handler_unref);
-    connection->ref_count   = 1;
+                                                     NULL, 
+                                                     (GDestroyNotify) connection_reply_data_free);
+    connection->id_replies  = lm_id_table_new ((GDestroyNotify) connection_reply_data_free);
+    connection->batch_items = g_hash_table_new (g_str_hash, g_str_equal);
+    connection->batch_ids   = lm_id_table_new (NULL);
+    connection->reply_waiters = g_hash_table_new (g_str_hash, g_str_equal);
+    for (i = 0; i < LM_OUTPUT_N_PRIORITIES; i++) {
+        connection->send_markers[i] = g_queue_new ();
+    }
+
+    connection->held_messages = g_queue_new ();
+    connection->jid_buckets = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, g_free);
+
+    memset (connection->output_priorities, LM_OUTPUT_PRIORITY_DEFAULT,
+            sizeof (connection->output_priorities));
+
+    /* Replies and authentication are waited for by the server */
+    lm_connection_set_output_priority (connection, LM_MESSAGE_TYPE_IQ,
+                                       LM_MESSAGE_SUB_TYPE_RESULT,
+                                       LM_OUTPUT_PRIORITY_CONTROL);
+    lm_connection_set_output_priority (connection, LM_MESSAGE_TYPE_IQ,
+                                       LM_MESSAGE_SUB_TYPE_ERROR,
+                                       LM_OUTPUT_PRIORITY_CONTROL);
+    lm_connection_set_output_priority (connection, LM_MESSAGE_TYPE_AUTH,
+                                       LM_MESSAGE_SUB_TYPE_NOT_SET,
+                                       LM_OUTPUT_PRIORITY_CONTROL);
+    lm_connection_set_output_priority (connection, LM_MESSAGE_TYPE_RESPONSE,
+                                       LM_MESSAGE_SUB_TYPE_NOT_SET,
+                                       LM_OUTPUT_PRIORITY_CONTROL);
+    g_mutex_init (&connection->waiters_lock);
+    g_cond_init (&connection->waiters_cond);
+    connection->ref_count   = 1;
     
     for (i = 0; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
         connection->handlers[i] = NULL;
     }
 
+    connection->indexed_handlers = 
+        g_hash_table_new_full (connection_handler_key_hash,
+                               connection_handler_key_equal,
+                               (GDestroyNotify) connection_handler_key_free,
+                               (GDestroyNotify) connection_handler_list_free);
+
     connection->parser = lm_parser_new 
         ((LmParserMessageFunction) connection_new_message_cb, 
          connection, NULL);
@@ -1256,6 +2410,87 @@ lm_connection_new_with_context (const gchar *server, GMainContext *context)
     return connection;
 }
 
+/**
+ * lm_connection_new_external:
+ * @server: The hostname to the server for the connection.
+ * 
+ * Creates a new closed connection that is run from an event loop of the 
+ * application instead of a #GMainLoop. Before each time it waits for 
+ * events the application calls lm_connection_prepare() to learn the fd 
+ * to watch, the events to watch it for and the longest time to wait. It 
+ * then passes what happened on the fd to lm_connection_process(), which 
+ * reads, parses, dispatches to the handlers and writes out in the calling 
+ * thread. The connection may only be used from that thread.
+ * 
+ * The wakeup fd of the #GMainContext the connection runs in is not one 
+ * of the fds lm_connection_prepare() returns. Calling 
+ * g_main_context_invoke() or g_main_context_wakeup() on it, or attaching
+ * a source to it, from another thread does not wake up the application's
+ * loop; the work only gets done on the next lm_connection_process(), at 
+ * the latest once the timeout from lm_connection_prepare() expires. For
+ * the same reason lm_connection_send_with_reply_and_block() can only be
+ * used from the thread running the connection.
+ * 
+ * Return value: A newly created LmConnection, should be unreffed with lm_connection_unref().
+ **/
+LmConnection *
+lm_connection_new_external (const gchar *server)
+{
+    LmExternalLoop *external;
+    LmConnection   *connection;
+
+    external = lm_external_loop_new ();
+
+    connection = lm_connection_new_with_context (server, 
+                                                 lm_external_loop_get_context (external));
+    connection->external = external;
+
+    return connection;
+}
+
+/**
+ * lm_connection_prepare:
+ * @connection: A connection created with lm_connection_new_external()
+ * @events: location to store the #GIOCondition to watch the fd for, or %NULL
+ * @timeout: location to store the longest time in milliseconds to wait 
+ * before calling lm_connection_process(), -1 for no limit, or %NULL
+ * 
+ * Returns what @connection waits for. The fd can change as the connection 
+ * is opened and closed so this should be called again before each wait, 
+ * and after @connection has been used outside of lm_connection_process().
+ * 
+ * Return value: The fd to watch, or -1 if there is none.
+ **/
+gint
+lm_connection_prepare (LmConnection *connection, 
+                       GIOCondition *events,
+                       gint         *timeout)
+{
+    g_return_val_if_fail (connection != NULL, -1);
+    g_return_val_if_fail (connection->external != NULL, -1);
+
+    return lm_external_loop_prepare (connection->external, events, timeout);
+}
+
+/**
+ * lm_connection_process:
+ * @connection: A connection created with lm_connection_new_external()
+ * @revents: The events that occurred on the fd from lm_connection_prepare()
+ * 
+ * Does the work @connection has pending for @revents and for the timeouts 
+ * that are due. Message handlers and callbacks are called from here.
+ **/
+void
+lm_connection_process (LmConnection *connection, GIOCondition revents)
+{
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (connection->external != NULL);
+
+    lm_connection_ref (connection);
+    lm_external_loop_process (connection->external, revents);
+    lm_connection_unref (connection);
+}
+
 /**
  * lm_connection_open:
  * @connection: #LmConnection to open
@@ -1387,7 +2622,7 @@ lm_connection_close (LmConnection *connection, GError **error)
             no_errors = FALSE;
         }
 
-        lm_old_socket_flush (connection->socket);
+        lm_xmpp_writer_flush (connection->writer);
     }
     
     connection_do_close (connection);
@@ -1454,7 +2689,7 @@ lm_connection_authenticate (LmConnection      *connection,
         return FALSE;
     }
 
-    connection->state = LM_CONNECTION_STATE_AUTHENTICATING;
+    connection_set_state (connection, LM_CONNECTION_STATE_AUTHENTICATING);
     
     connection->auth_cb = _lm_utils_new_callback (function, 
                                                   user_data, 
@@ -1804,6 +3039,12 @@ lm_connection_set_ssl (LmConnection *connection, LmSSL *ssl)
 
     if (ssl) {
         connection->ssl = lm_ssl_ref (ssl);
+
+        if (connection->pool && !lm_ssl_get_context (ssl) &&
+            _lm_connection_pool_get_ssl_context (connection->pool)) {
+            lm_ssl_set_context (ssl, 
+                                _lm_connection_pool_get_ssl_context (connection->pool));
+        }
     } else {
         connection->ssl = NULL;
     }
@@ -1854,299 +3095,1639 @@ lm_connection_set_proxy (LmConnection *connection, LmProxy *proxy)
 }
 
 /**
- * lm_connection_send: 
- * @connection: #LmConnection to send message over.
- * @message: #LmMessage to send.
- * @error: location to store error, or %NULL
+ * lm_connection_get_corked:
+ * @connection: an #LmConnection
  * 
- * Asynchronous call to send a message.
+ * Returns whether output on @connection is corked, see
+ * lm_connection_set_corked().
  * 
- * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ * Return value: %TRUE if sends are coalesced.
  **/
 gboolean
-lm_connection_send (LmConnection  *connection, 
-                    LmMessage     *message, 
-                    GError       **error)
+lm_connection_get_corked (LmConnection *connection)
 {
-    gchar    *xml_str;
-    gchar    *ch;
-    gboolean  result;
-    
     g_return_val_if_fail (connection != NULL, FALSE);
-    g_return_val_if_fail (message != NULL, FALSE);
 
-    xml_str = lm_message_node_to_string (message->node);
-    if ((ch = strstr (xml_str, "</stream:stream>"))) {
-        *ch = '\0';
-    }
-    
-    result = connection_send (connection, xml_str, -1, error);
-    g_free (xml_str);
-
-    return result;
+    return connection->corked;
 }
 
 /**
- * lm_connection_send_with_reply:
- * @connection: #LmConnection used to send message.
- * @message: #LmMessage to send.
- * @handler: #LmMessageHandler that will be used when a reply to @message arrives
- * @error: location to store error, or %NULL
+ * lm_connection_set_corked:
+ * @connection: an #LmConnection
+ * @corked: whether to coalesce sends
  * 
- * Send a #LmMessage which will result in a reply. 
+ * When @corked is %TRUE messages sent during one iteration of the main 
+ * loop are collected and written to the socket together from an idle
+ * source, which runs in a later iteration, or as soon as 16 kB are
+ * pending. This saves system calls and TLS record overhead for code that
+ * sends many messages at once, at the cost of delaying each send until
+ * the main loop has come around again.
  * 
- * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ * On systems that support it TCP_CORK is used as well so the collected 
+ * data leaves in full segments. Turning corking off writes out anything 
+ * that is pending.
  **/
-gboolean 
-lm_connection_send_with_reply (LmConnection      *connection,
-                               LmMessage         *message,
-                               LmMessageHandler  *handler,
-                               GError           **error)
+void
+lm_connection_set_corked (LmConnection *connection, gboolean corked)
 {
-    gchar *id;
-    
-    g_return_val_if_fail (connection != NULL, FALSE);
-    g_return_val_if_fail (message != NULL, FALSE);
-    g_return_val_if_fail (handler != NULL, FALSE);
+    g_return_if_fail (connection != NULL);
 
-    if (lm_message_node_get_attribute (message->node, "id")) {
-        id = g_strdup (lm_message_node_get_attribute (message->node, 
-                                                      "id"));
-    } else {
-        id = _lm_utils_generate_id ();
-        lm_message_node_set_attributes (message->node, "id", id, NULL);
+    connection->corked = corked;
+
+    if (connection->socket && connection->state >= LM_CONNECTION_STATE_OPENING) {
+        lm_old_socket_set_corked (connection->socket, corked);
     }
-    
-    g_hash_table_insert (connection->id_handlers, 
-                         id, lm_message_handler_ref (handler));
-    
-    return lm_connection_send (connection, message, error);
 }
 
 /**
- * lm_connection_send_with_reply_and_block:
+ * lm_connection_get_max_read_size:
  * @connection: an #LmConnection
- * @message: an #LmMessage
- * @error: Set if error was detected during sending.
  * 
- * Send @message and wait for return.
+ * Returns how large the read buffer of @connection may grow, see
+ * lm_connection_set_max_read_size().
  * 
- * Return value: The reply
+ * Return value: the limit in bytes.
  **/
-LmMessage *
-lm_connection_send_with_reply_and_block (LmConnection  *connection,
-                                         LmMessage     *message,
-                                         GError       **error)
+gsize
+lm_connection_get_max_read_size (LmConnection *connection)
 {
-    gchar     *id;
-    LmMessage *reply = NULL;
+    g_return_val_if_fail (connection != NULL, 0);
 
-    g_return_val_if_fail (connection != NULL, NULL);
-    g_return_val_if_fail (message != NULL, NULL);
+    return connection->max_read_size;
+}
 
-    if (connection->state < LM_CONNECTION_STATE_OPENING) {
-        g_set_error (error,
-                     LM_ERROR,
-                     LM_ERROR_CONNECTION_NOT_OPEN,
-                     "Connection is not open, call lm_connection_open() first");
-        return FALSE;
-    }
+/**
+ * lm_connection_set_max_read_size:
+ * @connection: an #LmConnection
+ * @size: the largest read buffer to use, in bytes
+ * 
+ * Incoming data is read into a buffer that starts at 1 kB and doubles 
+ * each time a read fills it, so a busy stream is taken in with few 
+ * system calls and parsed in large chunks. Once reads stay small again 
+ * the buffer is shrunk back, and once nothing has been read for a second
+ * it drops back to 1 kB. @size limits how far the buffer may grow; it 
+ * defaults to #LM_CONNECTION_DEFAULT_MAX_READ_SIZE and values below 1 kB 
+ * are raised to it.
+ **/
+void
+lm_connection_set_max_read_size (LmConnection *connection, gsize size)
+{
+    g_return_if_fail (connection != NULL);
 
+    connection->max_read_size = size;
 
-    if (lm_message_node_get_attribute (message->node, "id")) {
-        id = g_strdup (lm_message_node_get_attribute (message->node, 
-                                                      "id"));
-    } else {
-        id = _lm_utils_generate_id ();
-        lm_message_node_set_attributes (message->node, "id", id, NULL);
+    if (connection->socket && connection->state >= LM_CONNECTION_STATE_OPENING) {
+        lm_old_socket_set_max_read_size (connection->socket, size);
     }
+}
 
-    lm_message_queue_detach (connection->queue);
-
-    lm_connection_send (connection, message, error);
-
-    while (!reply) {
-        const gchar *m_id;
-        guint        n;
+/**
+ * lm_connection_get_read_size:
+ * @connection: an #LmConnection
+ * 
+ * Returns the current size of the read buffer of @connection, see
+ * lm_connection_set_max_read_size().
+ * 
+ * Return value: the size in bytes, or 0 if @connection isn't open.
+ **/
+gsize
+lm_connection_get_read_size (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
 
-        g_main_context_iteration (connection->context, TRUE);
-    
-        if (lm_message_queue_is_empty (connection->queue)) {
-            continue;
-        }
+    if (!connection->socket || connection->state < LM_CONNECTION_STATE_OPENING) {
+        return 0;
+    }
 
-        for (n = 0; n < lm_message_queue_get_length (connection->queue); n++) {
-            LmMessage *m;
+    return lm_old_socket_get_read_size (connection->socket);
+}
 
-            m = (LmMessage *) lm_message_queue_peek_nth (connection->queue, n);
+/**
+ * lm_connection_get_read_budget:
+ * @connection: an #LmConnection
+ * @bytes: return location for the byte limit, or %NULL
+ * @msecs: return location for the time limit, or %NULL
+ * 
+ * Gets the limits set with lm_connection_set_read_budget().
+ **/
+void
+lm_connection_get_read_budget (LmConnection *connection,
+                               gsize        *bytes,
+                               guint        *msecs)
+{
+    g_return_if_fail (connection != NULL);
 
-            m_id = lm_message_node_get_attribute (m->node, "id");
-            
-            if (m_id && strcmp (m_id, id) == 0) {
-                reply = m;
-                lm_message_queue_pop_nth (connection->queue, n);
-                break;
-            }
-        }
+    if (bytes) {
+        *bytes = connection->read_budget_bytes;
     }
 
-    g_free (id);
-    lm_message_queue_attach (connection->queue, connection->context);
-
-    return reply;
+    if (msecs) {
+        *msecs = connection->read_budget_msecs;
+    }
 }
 
 /**
- * lm_connection_register_message_handler:
- * @connection: Connection to register a handler for.
- * @handler: Message handler to register.
- * @type: Message type that @handler will handle.
- * @priority: The priority in which to call @handler.
+ * lm_connection_set_read_budget:
+ * @connection: an #LmConnection
+ * @bytes: how many bytes to read per wakeup, 0 for no limit
+ * @msecs: how long to read per wakeup in milliseconds, 0 for no limit
  * 
- * Registers a #LmMessageHandler to handle incoming messages of a certain type.
- * To unregister the handler call lm_connection_unregister_message_handler().
+ * Limits how much @connection reads each time its socket becomes readable.
+ * Once either limit is reached the connection stops reading and returns to
+ * the main loop, and continues on the next iteration. This keeps one busy 
+ * peer from holding up timers, keep alives and other connections that 
+ * share the #GMainContext. The limits are checked after each read, so at 
+ * least one read is always done. 
+ * 
+ * The defaults are #LM_CONNECTION_DEFAULT_READ_BUDGET_BYTES and 
+ * #LM_CONNECTION_DEFAULT_READ_BUDGET_MSECS. Setting both to 0 reads until
+ * the socket runs dry.
  **/
 void
-lm_connection_register_message_handler  (LmConnection      *connection,
-                                         LmMessageHandler  *handler,
-                                         LmMessageType      type,
-                                         LmHandlerPriority  priority)
+lm_connection_set_read_budget (LmConnection *connection,
+                               gsize         bytes,
+                               guint         msecs)
 {
-    HandlerData *hd;
-    
     g_return_if_fail (connection != NULL);
-    g_return_if_fail (handler != NULL);
-    g_return_if_fail (type != LM_MESSAGE_TYPE_UNKNOWN);
 
-    hd = g_new0 (HandlerData, 1);
-    hd->priority = priority;
-    hd->handler  = lm_message_handler_ref (handler);
+    connection->read_budget_bytes = bytes;
+    connection->read_budget_msecs = msecs;
 
-    connection->handlers[type] = g_slist_insert_sorted (connection->handlers[type],
-                                                        hd, 
-                                                        (GCompareFunc) connection_handler_compare_func);
+    if (connection->socket && connection->state >= LM_CONNECTION_STATE_OPENING) {
+        lm_old_socket_set_read_budget (connection->socket, bytes, msecs);
+    }
 }
 
 /**
- * lm_connection_unregister_message_handler:
- * @connection: Connection to unregister a handler for.
- * @handler: The handler to unregister.
- * @type: What type of messages to unregister this handler for.
+ * lm_connection_get_pending_output:
+ * @connection: an #LmConnection
  * 
- * Unregisters a handler for @connection. @handler will no longer be called 
- * when incoming messages of @type arrive.
+ * Returns how much of what has been sent on @connection is still waiting 
+ * to be written to the network.
+ * 
+ * Return value: The number of pending bytes.
  **/
-void
-lm_connection_unregister_message_handler (LmConnection     *connection,
-                                          LmMessageHandler *handler,
-                                          LmMessageType     type)
+gsize
+lm_connection_get_pending_output (LmConnection *connection)
 {
-    GSList *l;
-    
-    g_return_if_fail (connection != NULL);
-    g_return_if_fail (handler != NULL);
-    g_return_if_fail (type != LM_MESSAGE_TYPE_UNKNOWN);
+    g_return_val_if_fail (connection != NULL, 0);
 
-    for (l = connection->handlers[type]; l; l = l->next) {
-        HandlerData *hd = (HandlerData *) l->data;
-        
-        if (handler == hd->handler) {
-            connection->handlers[type] = g_slist_remove_link (connection->handlers[type], l);
-            g_slist_free (l);
-            lm_message_handler_unref (hd->handler);
-            g_free (hd);
-            break;
-        }
+    if (!connection->socket || connection->state < LM_CONNECTION_STATE_OPENING) {
+        return 0;
     }
+
+    return lm_old_socket_get_pending_output (connection->socket);
 }
 
 /**
- * lm_connection_set_disconnect_function:
- * @connection: Connection to register disconnect callback for.
- * @function: Function to be called when @connection is closed.
- * @user_data: User data passed to @function.
- * @notify: Function that will be called with @user_data when @user_data needs to be freed. Pass #NULL if it shouldn't be freed.
+ * lm_connection_get_output_watermarks:
+ * @connection: an #LmConnection
+ * @low: location to store the low watermark, or %NULL
+ * @high: location to store the high watermark, or %NULL
  * 
- * Set the callback that will be called when a connection is closed. 
+ * Gets the watermarks set with lm_connection_set_output_watermarks().
  **/
 void
-lm_connection_set_disconnect_function (LmConnection         *connection,
-                                       LmDisconnectFunction  function,
-                                       gpointer              user_data,
-                                       GDestroyNotify        notify)
+lm_connection_get_output_watermarks (LmConnection *connection,
+                                     gsize        *low,
+                                     gsize        *high)
 {
     g_return_if_fail (connection != NULL);
 
-    if (connection->disconnect_cb) {
-        _lm_utils_free_callback (connection->disconnect_cb);
+    if (low) {
+        *low = connection->output_low_watermark;
     }
-        
-    if (function) {
-        connection->disconnect_cb = _lm_utils_new_callback (function, 
-                                                            user_data,
-                                                            notify);
-    } else {
-        connection->disconnect_cb = NULL;
+
+    if (high) {
+        *high = connection->output_high_watermark;
     }
 }
 
 /**
- * lm_connection_send_raw:
- * @connection: Connection used to send
- * @str: The string to send, the entire string will be sent.
- * @error: Set if error was detected during sending.
+ * lm_connection_set_output_watermarks:
+ * @connection: an #LmConnection
+ * @low: pending output, in bytes, at which the connection is writable again
+ * @high: pending output, in bytes, at which the connection is full, 0 for no limit
  * 
- * Asynchronous call to send a raw string. Useful for debugging and testing.
+ * Sets limits for the output that may be pending on @connection. Once 
+ * lm_connection_get_pending_output() reaches @high the connection is 
+ * considered full. When it has dropped to @low again the function set
+ * with lm_connection_set_writable_function() is called. With a @low of 0
+ * that happens once everything has been written.
  * 
- * Return value: Returns #TRUE if no errors was detected during sending, 
- * #FALSE otherwise.
+ * Producers that can generate output faster than the network takes it 
+ * can use this to stop sending while the connection is full, see also
+ * lm_connection_set_fail_when_full().
  **/
-gboolean 
-lm_connection_send_raw (LmConnection  *connection, 
-                        const gchar   *str, 
-                        GError       **error)
+void
+lm_connection_set_output_watermarks (LmConnection *connection,
+                                     gsize         low,
+                                     gsize         high)
 {
-    g_return_val_if_fail (connection != NULL, FALSE);
-    g_return_val_if_fail (str != NULL, FALSE);
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (high == 0 || low <= high);
 
-    return connection_send (connection, str, -1, error);
+    connection->output_low_watermark  = low;
+    connection->output_high_watermark = high;
 }
+
 /**
- * lm_connection_get_state:
- * @connection: Connection to get state on
- *
- * Returns the state of the connection.
- *
- * Return value: The state of the connection.
+ * lm_connection_get_fail_when_full:
+ * @connection: an #LmConnection
+ * 
+ * Returns whether sends fail while the connection is full, see 
+ * lm_connection_set_fail_when_full().
+ * 
+ * Return value: %TRUE if sends fail while the connection is full.
  **/
-LmConnectionState 
-lm_connection_get_state (LmConnection *connection)
+gboolean
+lm_connection_get_fail_when_full (LmConnection *connection)
 {
-    g_return_val_if_fail (connection != NULL, 
-                          LM_CONNECTION_STATE_CLOSED);
+    g_return_val_if_fail (connection != NULL, FALSE);
 
-    return connection->state;
+    return connection->fail_when_full;
 }
 
 /**
- * lm_connection_get_client_host:
- * @connection: An #LmConnection
- *
- * Returns the local host name of the connection.
- *
- * Return value: A newly allocated string representing the local host name.
+ * lm_connection_set_fail_when_full:
+ * @connection: an #LmConnection
+ * @fail: whether to fail sends while the connection is full
+ * 
+ * If @fail is %TRUE, lm_connection_send(), lm_connection_send_raw(),
+ * lm_connection_send_bytes() and lm_connection_send_batch() fail with %LM_ERROR_OUTPUT_FULL instead of 
+ * queueing more output while the high watermark set with 
+ * lm_connection_set_output_watermarks() is reached.
  **/
-gchar *
-lm_connection_get_local_host (LmConnection *connection)
+void
+lm_connection_set_fail_when_full (LmConnection *connection, gboolean fail)
 {
-    return lm_old_socket_get_local_host (connection->socket);
+    g_return_if_fail (connection != NULL);
+
+    connection->fail_when_full = fail;
 }
 
 /**
- * lm_connection_ref:
- * @connection: Connection to add a reference to.
+ * lm_connection_set_writable_function:
+ * @connection: an #LmConnection
+ * @function: Function called when @connection is writable again.
+ * @user_data: User data passed to @function.
+ * @notify: Function for freeing @user_data, can be %NULL.
  * 
- * Add a reference on @connection. To remove a reference call 
+ * Sets the function called when the pending output on @connection has 
+ * dropped to the low watermark after having reached the high watermark.
+ **/
+void
+lm_connection_set_writable_function (LmConnection       *connection,
+                                     LmWritableFunction  function,
+                                     gpointer            user_data,
+                                     GDestroyNotify      notify)
+{
+    g_return_if_fail (connection != NULL);
+
+    if (connection->writable_cb) {
+        _lm_utils_free_callback (connection->writable_cb);
+    }
+
+    if (function) {
+        connection->writable_cb = _lm_utils_new_callback (function, 
+                                                          user_data,
+                                                          notify);
+    } else {
+        connection->writable_cb = NULL;
+    }
+}
+
+/**
+ * lm_connection_get_output_priority:
+ * @connection: an #LmConnection
+ * @type: a message type
+ * @sub_type: a message sub type, or %LM_MESSAGE_SUB_TYPE_NOT_SET
+ * 
+ * Returns the priority set with lm_connection_set_output_priority() for
+ * messages of @type and @sub_type.
+ * 
+ * Return value: The output priority, %LM_OUTPUT_PRIORITY_DEFAULT if none is set.
+ **/
+LmOutputPriority
+lm_connection_get_output_priority (LmConnection     *connection,
+                                   LmMessageType     type,
+                                   LmMessageSubType  sub_type)
+{
+    g_return_val_if_fail (connection != NULL, LM_OUTPUT_PRIORITY_DEFAULT);
+    g_return_val_if_fail (type >= 0 && type < LM_MESSAGE_TYPE_UNKNOWN, 
+                          LM_OUTPUT_PRIORITY_DEFAULT);
+    g_return_val_if_fail (sub_type >= LM_MESSAGE_SUB_TYPE_NOT_SET &&
+                          sub_type <= LM_MESSAGE_SUB_TYPE_ERROR,
+                          LM_OUTPUT_PRIORITY_DEFAULT);
+
+    return connection->output_priorities[type][SUB_TYPE_INDEX (sub_type)];
+}
+
+/**
+ * lm_connection_set_output_priority:
+ * @connection: an #LmConnection
+ * @type: a message type
+ * @sub_type: a message sub type, or %LM_MESSAGE_SUB_TYPE_NOT_SET for all sub types of @type
+ * @priority: the output priority
+ * 
+ * Sets the priority messages of @type and @sub_type are written with 
+ * unless one has been set on the message with 
+ * lm_message_set_output_priority(). A priority set for a sub type takes
+ * precedence over the one set for all sub types of @type, messages 
+ * without any priority set are %LM_OUTPUT_PRIORITY_BULK. 
+ * 
+ * IQ results and errors, such as the replies to pings from the server, 
+ * and the SASL auth and response elements are %LM_OUTPUT_PRIORITY_CONTROL
+ * by default.
+ **/
+void
+lm_connection_set_output_priority (LmConnection     *connection,
+                                   LmMessageType     type,
+                                   LmMessageSubType  sub_type,
+                                   LmOutputPriority  priority)
+{
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (type >= 0 && type < LM_MESSAGE_TYPE_UNKNOWN);
+    g_return_if_fail (sub_type >= LM_MESSAGE_SUB_TYPE_NOT_SET &&
+                      sub_type <= LM_MESSAGE_SUB_TYPE_ERROR);
+    g_return_if_fail (priority >= LM_OUTPUT_PRIORITY_DEFAULT &&
+                      priority < LM_OUTPUT_N_PRIORITIES);
+
+    connection->output_priorities[type][SUB_TYPE_INDEX (sub_type)] = priority;
+}
+
+/**
+ * lm_connection_set_rate_limit:
+ * @connection: an #LmConnection
+ * @bytes_per_second: bytes that may be sent per second, 0 for no limit
+ * @bytes_burst: bytes that may be sent at once, 0 for one second's worth
+ * @stanzas_per_second: messages that may be sent per second, 0 for no limit
+ * @stanzas_burst: messages that may be sent at once, 0 for one second's worth
+ * 
+ * Shapes the output of @connection to stay within the rate limits of the
+ * server. Messages sent with lm_connection_send() and the functions built
+ * on it are held back in order once a limit is reached, and are written 
+ * when the main context of @connection gets to them. Messages with 
+ * %LM_OUTPUT_PRIORITY_CONTROL are never held back, and neither are raw 
+ * data and batches, but all of it counts against the limits.
+ * 
+ * See also lm_connection_set_jid_rate_limit() and 
+ * lm_connection_get_rate_limit_stats().
+ **/
+void
+lm_connection_set_rate_limit (LmConnection *connection,
+                              guint         bytes_per_second,
+                              guint         bytes_burst,
+                              guint         stanzas_per_second,
+                              guint         stanzas_burst)
+{
+    gint64 now;
+
+    g_return_if_fail (connection != NULL);
+
+    now = g_get_monotonic_time ();
+
+    lm_token_bucket_init (&connection->rate_bytes, bytes_per_second,
+                          bytes_burst ? bytes_burst : bytes_per_second,
+                          now);
+    lm_token_bucket_init (&connection->rate_stanzas, stanzas_per_second,
+                          stanzas_burst ? stanzas_burst : stanzas_per_second,
+                          now);
+
+    if (!g_queue_is_empty (connection->held_messages)) {
+        connection_shaper_release (connection);
+    }
+}
+
+static void
+connection_reset_jid_buckets (gpointer      key, 
+                              JidBuckets   *jid,
+                              LmConnection *connection)
+{
+    connection_init_jid_buckets (connection, jid, g_get_monotonic_time ());
+}
+
+/**
+ * lm_connection_set_jid_rate_limit:
+ * @connection: an #LmConnection
+ * @bytes_per_second: bytes that may be sent to a JID per second, 0 for no limit
+ * @bytes_burst: bytes that may be sent to a JID at once, 0 for one second's worth
+ * @stanzas_per_second: messages that may be sent to a JID per second, 0 for no limit
+ * @stanzas_burst: messages that may be sent to a JID at once, 0 for one second's worth
+ * 
+ * Like lm_connection_set_rate_limit() but limits what is sent to each 
+ * recipient separately. Messages held back for one recipient don't delay
+ * messages to others. 
+ **/
+void
+lm_connection_set_jid_rate_limit (LmConnection *connection,
+                                  guint         bytes_per_second,
+                                  guint         bytes_burst,
+                                  guint         stanzas_per_second,
+                                  guint         stanzas_burst)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->jid_bytes_rate    = bytes_per_second;
+    connection->jid_bytes_burst   = bytes_burst ? bytes_burst : bytes_per_second;
+    connection->jid_stanzas_rate  = stanzas_per_second;
+    connection->jid_stanzas_burst = stanzas_burst ? stanzas_burst : stanzas_per_second;
+
+    g_hash_table_foreach (connection->jid_buckets,
+                          (GHFunc) connection_reset_jid_buckets,
+                          connection);
+
+    if (!g_queue_is_empty (connection->held_messages)) {
+        connection_shaper_release (connection);
+    }
+}
+
+/**
+ * lm_connection_get_rate_limit_stats:
+ * @connection: an #LmConnection
+ * @n_delayed: location to store the number of messages held back, or %NULL
+ * @delayed_time: location to store the total time messages were held back, or %NULL
+ * 
+ * Gets how often and for how long the rate limits set with 
+ * lm_connection_set_rate_limit() and lm_connection_set_jid_rate_limit() 
+ * have delayed messages. @delayed_time only includes messages that have 
+ * been sent.
+ **/
+void
+lm_connection_get_rate_limit_stats (LmConnection *connection,
+                                    guint64      *n_delayed,
+                                    GTimeSpan    *delayed_time)
+{
+    g_return_if_fail (connection != NULL);
+
+    if (n_delayed) {
+        *n_delayed = connection->n_delayed;
+    }
+
+    if (delayed_time) {
+        *delayed_time = connection->delayed_time;
+    }
+}
+
+/**
+ * lm_connection_send: 
+ * @connection: #LmConnection to send message over.
+ * @message: #LmMessage to send.
+ * @error: location to store error, or %NULL
+ * 
+ * Asynchronous call to send a message.
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send (LmConnection  *connection, 
+                    LmMessage     *message, 
+                    GError       **error)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (message != NULL, FALSE);
+
+    return connection_send_message (connection, message, NULL, error);
+}
+
+/**
+ * lm_connection_send_full: 
+ * @connection: #LmConnection to send message over.
+ * @message: #LmMessage to send.
+ * @function: Function called once @message has been written, can be %NULL.
+ * @user_data: User data passed to @function.
+ * @notify: Function for freeing @user_data, can be %NULL.
+ * @error: location to store error, or %NULL
+ * 
+ * Like lm_connection_send() but calls @function with %TRUE once all of 
+ * @message has been handed to the operating system, or with %FALSE if the
+ * connection was closed before that. If @message could be written right 
+ * away @function is called before lm_connection_send_full() returns.
+ * @function is not called if sending fails.
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send_full (LmConnection      *connection, 
+                         LmMessage         *message, 
+                         LmResultFunction   function,
+                         gpointer           user_data,
+                         GDestroyNotify     notify,
+                         GError           **error)
+{
+    LmCallback *cb;
+
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (message != NULL, FALSE);
+
+    if (!function) {
+        if (notify) {
+            (* notify) (user_data);
+        }
+        return lm_connection_send (connection, message, error);
+    }
+
+    cb = _lm_utils_new_callback (function, user_data, notify);
+
+    if (!connection_send_message (connection, message, cb, error)) {
+        _lm_utils_free_callback (cb);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * lm_connection_send_with_reply:
+ * @connection: #LmConnection used to send message.
+ * @message: #LmMessage to send.
+ * @handler: #LmMessageHandler that will be used when a reply to @message arrives
+ * @error: location to store error, or %NULL
+ * 
+ * Send a #LmMessage which will result in a reply. If a reply timeout has
+ * been set with lm_connection_set_reply_timeout() @handler is dropped 
+ * when no reply arrived within that time.
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean 
+lm_connection_send_with_reply (LmConnection      *connection,
+                               LmMessage         *message,
+                               LmMessageHandler  *handler,
+                               GError           **error)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    return lm_connection_send_with_reply_full (connection, message, handler,
+                                               connection->reply_timeout,
+                                               NULL, NULL, NULL, error);
+}
+
+/**
+ * lm_connection_send_with_reply_full:
+ * @connection: #LmConnection used to send message.
+ * @message: #LmMessage to send.
+ * @handler: #LmMessageHandler that will be used when a reply to @message arrives
+ * @timeout: Time in milliseconds to wait for the reply, 0 to wait forever.
+ * @function: Function called if no reply arrived within @timeout, can be %NULL.
+ * @user_data: User data passed to @function.
+ * @notify: Function for freeing @user_data, can be %NULL.
+ * @error: location to store error, or %NULL
+ * 
+ * Send a #LmMessage which will result in a reply. If no reply has arrived
+ * after @timeout milliseconds @handler is dropped and @function is called.
+ * The timeouts of all outstanding requests on @connection share a single
+ * timer source in the context of @connection.
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean 
+lm_connection_send_with_reply_full (LmConnection            *connection,
+                                    LmMessage               *message,
+                                    LmMessageHandler        *handler,
+                                    guint                    timeout,
+                                    LmReplyTimeoutFunction   function,
+                                    gpointer                 user_data,
+                                    GDestroyNotify           notify,
+                                    GError                 **error)
+{
+    ReplyData   *data;
+    const gchar *id;
+    gchar        id_buf[LM_ID_BUF_SIZE];
+    
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (message != NULL, FALSE);
+    g_return_val_if_fail (handler != NULL, FALSE);
+
+    data = g_slice_new0 (ReplyData);
+    data->connection = connection;
+    data->handler    = lm_message_handler_ref (handler);
+
+    id = lm_message_node_get_attribute (message->node, "id");
+    if (!id) {
+        data->key = _lm_utils_format_id (id_buf);
+        lm_message_node_set_attribute (message->node, "id", id_buf);
+    } else if (!_lm_utils_parse_id (id, &data->key)) {
+        data->id = g_strdup (id);
+    }
+
+    if (timeout > 0) {
+        data->timer = lm_timer_wheel_add (connection_get_timer_wheel (connection),
+                                          timeout, 
+                                          (LmTimerFunc) connection_reply_timeout_cb,
+                                          data);
+        if (function) {
+            data->timeout_cb = _lm_utils_new_callback (function, user_data,
+                                                       notify);
+        }
+    }
+    
+    if (data->id) {
+        g_hash_table_replace (connection->id_handlers, data->id, data);
+    } else {
+        lm_id_table_insert (connection->id_replies, data->key, data);
+    }
+    
+    return lm_connection_send (connection, message, error);
+}
+
+/* Replies are matched to batch items by id, so every message of @messages
+ * needs an id that no other outstanding batch item uses */
+static gboolean
+connection_check_batch_ids (LmConnection  *connection,
+                            LmMessage    **messages,
+                            guint          n_messages,
+                            GError       **error)
+{
+    GHashTable *seen;
+    guint       i;
+    gboolean    result = TRUE;
+
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < n_messages && result; ++i) {
+        const gchar *id;
+        guint64      key;
+        gboolean     pending;
+
+        id = lm_message_node_get_attribute (messages[i]->node, "id");
+        if (!id) {
+            continue;
+        }
+
+        if (_lm_utils_parse_id (id, &key)) {
+            pending = lm_id_table_lookup (connection->batch_ids, key) != NULL;
+        } else {
+            pending = g_hash_table_lookup (connection->batch_items, id) != NULL;
+        }
+
+        if (pending || g_hash_table_lookup (seen, id)) {
+            g_set_error (error,
+                         LM_ERROR,
+                         LM_ERROR_DUPLICATE_ID,
+                         "Id '%s' is used by more than one message", id);
+            result = FALSE;
+        } else {
+            g_hash_table_insert (seen, (gpointer) id, (gpointer) id);
+        }
+    }
+
+    g_hash_table_destroy (seen);
+
+    return result;
+}
+
+/**
+ * lm_connection_send_batch:
+ * @connection: #LmConnection used to send the messages.
+ * @messages: Array of #LmMessage to send.
+ * @n_messages: Number of messages in @messages.
+ * @timeout: Time in milliseconds to wait for the replies, 0 to wait forever.
+ * @function: Function called when all replies arrived or @timeout passed.
+ * @user_data: User data passed to @function.
+ * @notify: Function for freeing @user_data, can be %NULL.
+ * @error: location to store error, or %NULL
+ * 
+ * Sends all of @messages in a single write and waits for their replies.
+ * Once every message got a reply, @timeout passed or the connection was
+ * closed @function is called with an array holding the reply to each of
+ * @messages in the same order, or %NULL for messages that got no reply.
+ * The replies are unreffed after @function returns. Messages without an
+ * id get one assigned. If two of @messages, or one of them and a message
+ * of an outstanding batch, have the same id nothing is sent and @error
+ * is set to %LM_ERROR_DUPLICATE_ID.
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send_batch (LmConnection      *connection,
+                          LmMessage        **messages,
+                          guint              n_messages,
+                          guint              timeout,
+                          LmBatchFunction    function,
+                          gpointer           user_data,
+                          GDestroyNotify     notify,
+                          GError           **error)
+{
+    BatchData *batch;
+    GString   *str;
+    gchar     *ids;
+    gsize      ids_len = 0;
+    guint      i;
+    gboolean   result;
+
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (messages != NULL, FALSE);
+    g_return_val_if_fail (n_messages > 0, FALSE);
+    g_return_val_if_fail (function != NULL, FALSE);
+
+    if (!connection_check_output (connection, error)) {
+        return FALSE;
+    }
+
+    if (!connection_check_batch_ids (connection, messages, n_messages, 
+                                     error)) {
+        return FALSE;
+    }
+
+    /* Only ids that weren't created by us need to be copied */
+    for (i = 0; i < n_messages; ++i) {
+        const gchar *id;
+        guint64      key;
+
+        id = lm_message_node_get_attribute (messages[i]->node, "id");
+        if (!id) {
+            gchar id_buf[LM_ID_BUF_SIZE];
+
+            _lm_utils_format_id (id_buf);
+            lm_message_node_set_attribute (messages[i]->node, "id", id_buf);
+        } else if (!_lm_utils_parse_id (id, &key)) {
+            ids_len += strlen (id) + 1;
+        }
+    }
+
+    batch = g_malloc0 (sizeof (BatchData) + 
+                       (n_messages - 1) * sizeof (BatchItem) +
+                       ids_len);
+    batch->connection = connection;
+    batch->cb         = _lm_utils_new_callback (function, user_data, notify);
+    batch->n_items    = n_messages;
+    batch->n_pending  = n_messages;
+
+    str = g_string_sized_new (256 * n_messages);
+    ids = (gchar *) &batch->items[n_messages];
+
+    for (i = 0; i < n_messages; ++i) {
+        BatchItem   *item = &batch->items[i];
+        const gchar *id;
+
+        item->batch = batch;
+
+        id = lm_message_node_get_attribute (messages[i]->node, "id");
+        if (_lm_utils_parse_id (id, &item->key)) {
+            lm_id_table_insert (connection->batch_ids, item->key, item);
+        } else {
+            gsize len = strlen (id) + 1;
+
+            memcpy (ids, id, len);
+            item->id = ids;
+            g_hash_table_insert (connection->batch_items, ids, item);
+            ids += len;
+        }
+
+        _lm_message_node_write (messages[i]->node, str, FALSE);
+    }
+
+    connection->batches = g_slist_prepend (connection->batches, batch);
+
+    if (timeout > 0) {
+        batch->timer = lm_timer_wheel_add (connection_get_timer_wheel (connection),
+                                           timeout,
+                                           (LmTimerFunc) connection_batch_timeout_cb,
+                                           batch);
+    }
+
+    result = connection_send (connection, str->str, str->len, error);
+    g_string_free (str, TRUE);
+
+    if (!result) {
+        /* Nothing was sent so don't call back for it either */
+        batch->cb->func = NULL;
+        connection_batch_complete (batch);
+    }
+
+    return result;
+}
+
+/**
+ * lm_connection_get_reply_timeout:
+ * @connection: an #LmConnection
+ * 
+ * Returns the time lm_connection_send_with_reply() waits for a reply
+ * before dropping its handler.
+ * 
+ * Return value: The timeout in milliseconds, 0 if handlers are kept until a reply arrives.
+ **/
+guint
+lm_connection_get_reply_timeout (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
+
+    return connection->reply_timeout;
+}
+
+/**
+ * lm_connection_set_reply_timeout:
+ * @connection: an #LmConnection
+ * @timeout: Timeout in milliseconds, 0 to wait forever.
+ * 
+ * Sets the time lm_connection_send_with_reply() waits for a reply before
+ * dropping its handler. Only affects messages sent after the call.
+ **/
+void
+lm_connection_set_reply_timeout (LmConnection *connection, guint timeout)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->reply_timeout = timeout;
+}
+
+typedef struct {
+    LmConnection *connection;
+    LmMessage    *message;
+} WaiterSendData;
+
+static gboolean
+connection_waiter_send_cb (WaiterSendData *data)
+{
+    LmConnection *connection = data->connection;
+    const gchar  *id;
+    ReplyWaiter  *waiter;
+    GError       *error = NULL;
+
+    if (lm_connection_send (connection, data->message, &error)) {
+        return FALSE;
+    }
+
+    id = lm_message_node_get_attribute (data->message->node, "id");
+
+    g_mutex_lock (&connection->waiters_lock);
+    waiter = g_hash_table_lookup (connection->reply_waiters, id);
+    if (waiter) {
+        g_hash_table_remove (connection->reply_waiters, id);
+        waiter->failed = TRUE;
+        waiter->error  = error;
+        error = NULL;
+        g_cond_broadcast (&connection->waiters_cond);
+    }
+    g_mutex_unlock (&connection->waiters_lock);
+
+    g_clear_error (&error);
+
+    return FALSE;
+}
+
+static void
+connection_waiter_send_data_free (WaiterSendData *data)
+{
+    lm_connection_unref (data->connection);
+    lm_message_unref (data->message);
+    g_slice_free (WaiterSendData, data);
+}
+
+static gboolean
+connection_waiter_wakeup_cb (gpointer user_data)
+{
+    return FALSE;
+}
+
+/* Runs the context until @waiter has been filled in, the connection
+ * failed or @deadline (monotonic time, -1 for none) passes. Only one
+ * thread can iterate the context, the others sleep on waiters_cond and
+ * are woken up when their reply is dispatched or the context is 
+ * released. Called with waiters_lock held. */
+static void
+connection_wait_for_reply (LmConnection *connection,
+                           ReplyWaiter  *waiter,
+                           gint64        deadline)
+{
+    GMainContext *context;
+
+    context = connection->context;
+    if (!context) {
+        context = g_main_context_default ();
+    }
+
+    while (!waiter->reply && !waiter->failed) {
+        gint64 now = g_get_monotonic_time ();
+
+        if (deadline >= 0 && now >= deadline) {
+            g_hash_table_remove (connection->reply_waiters, waiter->id);
+            break;
+        }
+
+        if (g_main_context_acquire (context)) {
+            GSource *timeout_src = NULL;
+
+            g_mutex_unlock (&connection->waiters_lock);
+
+            if (deadline >= 0) {
+                /* The source is destroyed as soon as it fires */
+                timeout_src = lm_misc_add_timeout (context,
+                                                   (deadline - now + 999) / G_TIME_SPAN_MILLISECOND,
+                                                   connection_waiter_wakeup_cb,
+                                                   NULL);
+                g_source_ref (timeout_src);
+            }
+
+            g_main_context_iteration (context, TRUE);
+
+            if (timeout_src) {
+                g_source_destroy (timeout_src);
+                g_source_unref (timeout_src);
+            }
+
+            g_mutex_lock (&connection->waiters_lock);
+            g_main_context_release (context);
+
+            /* Let another waiter take over the context */
+            g_cond_broadcast (&connection->waiters_cond);
+        } else {
+            gint64 until = now + WAITER_POLL_INTERVAL;
+
+            if (deadline >= 0) {
+                until = MIN (until, deadline);
+            }
+
+            g_cond_wait_until (&connection->waiters_cond, 
+                               &connection->waiters_lock,
+                               until);
+        }
+    }
+}
+
+/**
+ * lm_connection_send_with_reply_and_block:
+ * @connection: an #LmConnection
+ * @message: an #LmMessage
+ * @error: Set if error was detected during sending.
+ * 
+ * Send @message and wait for return. This is the same as calling 
+ * lm_connection_send_with_reply_and_block_timeout() without a timeout.
+ * 
+ * Return value: The reply
+ **/
+LmMessage *
+lm_connection_send_with_reply_and_block (LmConnection  *connection,
+                                         LmMessage     *message,
+                                         GError       **error)
+{
+    return lm_connection_send_with_reply_and_block_timeout (connection,
+                                                            message, 0,
+                                                            error);
+}
+
+/**
+ * lm_connection_send_with_reply_and_block_timeout:
+ * @connection: an #LmConnection
+ * @message: an #LmMessage
+ * @timeout: Time in milliseconds to wait for the reply, 0 to wait forever.
+ * @error: Set if error was detected during sending or no reply arrived in time.
+ * 
+ * Send @message and wait at most @timeout milliseconds for the reply. 
+ * Several threads can block on replies from the same connection at the 
+ * same time. If the context of @connection is already being run by 
+ * another thread the message is sent from that thread and the caller 
+ * sleeps until the reply has been dispatched.
+ *
+ * While the caller blocks, the context of @connection is iterated from
+ * inside this call, so other sources on it run and message handlers are
+ * called for anything else that arrives. Handlers must be prepared to be
+ * called re-entrantly from lm_connection_send_with_reply_and_block() and
+ * must not rely on the blocking caller having returned.
+ * 
+ * Return value: The reply or %NULL if sending failed, the connection was 
+ * closed or @timeout passed.
+ **/
+LmMessage *
+lm_connection_send_with_reply_and_block_timeout (LmConnection  *connection,
+                                                 LmMessage     *message,
+                                                 guint          timeout,
+                                                 GError       **error)
+{
+    ReplyWaiter   waiter;
+    GMainContext *context;
+    gint64        deadline = -1;
+
+    g_return_val_if_fail (connection != NULL, NULL);
+    g_return_val_if_fail (message != NULL, NULL);
+
+    if (connection->state < LM_CONNECTION_STATE_OPENING) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_NOT_OPEN,
+                     "Connection is not open, call lm_connection_open() first");
+        return NULL;
+    }
+
+    if (lm_message_node_get_attribute (message->node, "id")) {
+        waiter.id = g_strdup (lm_message_node_get_attribute (message->node, 
+                                                             "id"));
+    } else {
+        waiter.id = _lm_utils_generate_id ();
+        lm_message_node_set_attributes (message->node, "id", waiter.id, NULL);
+    }
+
+    waiter.reply  = NULL;
+    waiter.failed = FALSE;
+    waiter.error  = NULL;
+
+    if (timeout > 0) {
+        deadline = g_get_monotonic_time () + timeout * G_TIME_SPAN_MILLISECOND;
+    }
+
+    g_mutex_lock (&connection->waiters_lock);
+    g_hash_table_insert (connection->reply_waiters, waiter.id, &waiter);
+    g_mutex_unlock (&connection->waiters_lock);
+
+    context = connection->context;
+    if (!context) {
+        context = g_main_context_default ();
+    }
+
+    if (g_main_context_acquire (context)) {
+        gboolean result;
+
+        result = lm_connection_send (connection, message, error);
+        g_main_context_release (context);
+
+        if (!result) {
+            g_mutex_lock (&connection->waiters_lock);
+            g_hash_table_remove (connection->reply_waiters, waiter.id);
+            g_mutex_unlock (&connection->waiters_lock);
+            g_free (waiter.id);
+
+            return NULL;
+        }
+    } else {
+        WaiterSendData *data;
+
+        /* Another thread is running the context, send from there */
+        data = g_slice_new (WaiterSendData);
+        data->connection = lm_connection_ref (connection);
+        data->message    = lm_message_ref (message);
+
+        g_main_context_invoke_full (context, G_PRIORITY_DEFAULT,
+                                    (GSourceFunc) connection_waiter_send_cb,
+                                    data,
+                                    (GDestroyNotify) connection_waiter_send_data_free);
+    }
+
+    g_mutex_lock (&connection->waiters_lock);
+    connection_wait_for_reply (connection, &waiter, deadline);
+    g_mutex_unlock (&connection->waiters_lock);
+
+    g_free (waiter.id);
+
+    if (waiter.reply) {
+        return waiter.reply;
+    }
+
+    if (waiter.error) {
+        g_propagate_error (error, waiter.error);
+    } else if (waiter.failed) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_FAILED,
+                     "Connection closed while waiting for the reply");
+    } else {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_TIMED_OUT,
+                     "No reply received within %u ms", timeout);
+    }
+
+    return NULL;
+}
+
+/**
+ * lm_connection_register_message_handler:
+ * @connection: Connection to register a handler for.
+ * @handler: Message handler to register.
+ * @type: Message type that @handler will handle.
+ * @priority: The priority in which to call @handler.
+ * 
+ * Registers a #LmMessageHandler to handle incoming messages of a certain type.
+ * To unregister the handler call lm_connection_unregister_message_handler().
+ **/
+void
+lm_connection_register_message_handler  (LmConnection      *connection,
+                                         LmMessageHandler  *handler,
+                                         LmMessageType      type,
+                                         LmHandlerPriority  priority)
+{
+    lm_connection_register_message_handler_full (connection, handler, type,
+                                                 LM_MESSAGE_SUB_TYPE_NOT_SET,
+                                                 NULL, NULL, priority);
+}
+
+/**
+ * lm_connection_register_message_handler_full:
+ * @connection: Connection to register a handler for.
+ * @handler: Message handler to register.
+ * @type: Message type that @handler will handle.
+ * @sub_type: Sub type that @handler will handle or #LM_MESSAGE_SUB_TYPE_NOT_SET for any sub type.
+ * @child_name: Name of the first child element that @handler will handle, or %NULL for any.
+ * @xmlns: Namespace of the first child element that @handler will handle, or %NULL for any.
+ * @priority: The priority in which to call @handler.
+ * 
+ * Registers a #LmMessageHandler that is only called for incoming messages
+ * matching all of the given filters. Handlers are looked up on the type,
+ * sub type and the namespace of the first child of the message so a large
+ * number of filtered handlers doesn't slow down the dispatching of
+ * unrelated messages. To unregister the handler call 
+ * lm_connection_unregister_message_handler().
+ **/
+void
+lm_connection_register_message_handler_full (LmConnection      *connection,
+                                             LmMessageHandler  *handler,
+                                             LmMessageType      type,
+                                             LmMessageSubType   sub_type,
+                                             const gchar       *child_name,
+                                             const gchar       *xmlns,
+                                             LmHandlerPriority  priority)
+{
+    HandlerData *hd;
+    
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (handler != NULL);
+    g_return_if_fail (type != LM_MESSAGE_TYPE_UNKNOWN);
+
+    hd = g_new0 (HandlerData, 1);
+    hd->priority   = priority;
+    hd->handler    = lm_message_handler_ref (handler);
+    hd->sub_type   = sub_type;
+    hd->child_name = g_strdup (child_name);
+    hd->xmlns      = g_strdup (xmlns);
+
+    if (sub_type == LM_MESSAGE_SUB_TYPE_NOT_SET && xmlns == NULL) {
+        connection->handlers[type] = g_slist_insert_sorted (connection->handlers[type],
+                                                            hd, 
+                                                            (GCompareFunc) connection_handler_compare_func);
+    } else {
+        HandlerKey  lookup;
+        HandlerKey *key;
+        GSList     *list;
+
+        lookup.type     = type;
+        lookup.sub_type = sub_type;
+        lookup.xmlns    = (gchar *) xmlns;
+
+        if (g_hash_table_lookup_extended (connection->indexed_handlers,
+                                          &lookup, 
+                                          (gpointer *) &key, 
+                                          (gpointer *) &list)) {
+            g_hash_table_steal (connection->indexed_handlers, key);
+        } else {
+            key = g_slice_new (HandlerKey);
+            key->type     = type;
+            key->sub_type = sub_type;
+            key->xmlns    = g_strdup (xmlns);
+            list          = NULL;
+        }
+
+        list = g_slist_insert_sorted (list, hd,
+                                      (GCompareFunc) connection_handler_compare_func);
+        g_hash_table_insert (connection->indexed_handlers, key, list);
+    }
+}
+
+static GSList *
+connection_remove_handler_from_list (GSList           *list,
+                                     LmMessageHandler *handler,
+                                     gboolean         *found)
+{
+    GSList *l;
+
+    for (l = list; l; l = l->next) {
+        HandlerData *hd = (HandlerData *) l->data;
+        
+        if (handler == hd->handler) {
+            list = g_slist_delete_link (list, l);
+            connection_handler_data_free (hd);
+            *found = TRUE;
+            break;
+        }
+    }
+
+    return list;
+}
+
+/**
+ * lm_connection_unregister_message_handler:
+ * @connection: Connection to unregister a handler for.
+ * @handler: The handler to unregister.
+ * @type: What type of messages to unregister this handler for.
+ * 
+ * Unregisters a handler for @connection. @handler will no longer be called 
+ * when incoming messages of @type arrive.
+ **/
+void
+lm_connection_unregister_message_handler (LmConnection     *connection,
+                                          LmMessageHandler *handler,
+                                          LmMessageType     type)
+{
+    GHashTableIter  iter;
+    HandlerKey     *key;
+    GSList         *list;
+    gboolean        found = FALSE;
+    
+    g_return_if_fail (connection != NULL);
+    g_return_if_fail (handler != NULL);
+    g_return_if_fail (type != LM_MESSAGE_TYPE_UNKNOWN);
+
+    connection->handlers[type] = 
+        connection_remove_handler_from_list (connection->handlers[type],
+                                             handler, &found);
+    if (found) {
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, connection->indexed_handlers);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &key, (gpointer *) &list)) {
+        if (key->type != type) {
+            continue;
+        }
+
+        list = connection_remove_handler_from_list (list, handler, &found);
+        if (found) {
+            break;
+        }
+    }
+
+    if (!found) {
+        return;
+    }
+
+    g_hash_table_steal (connection->indexed_handlers, key);
+    if (list) {
+        g_hash_table_insert (connection->indexed_handlers, key, list);
+    } else {
+        connection_handler_key_free (key);
+    }
+}
+
+/**
+ * lm_connection_set_disconnect_function:
+ * @connection: Connection to register disconnect callback for.
+ * @function: Function to be called when @connection is closed.
+ * @user_data: User data passed to @function.
+ * @notify: Function that will be called with @user_data when @user_data needs to be freed. Pass #NULL if it shouldn't be freed.
+ * 
+ * Set the callback that will be called when a connection is closed. 
+ **/
+void
+lm_connection_set_disconnect_function (LmConnection         *connection,
+                                       LmDisconnectFunction  function,
+                                       gpointer              user_data,
+                                       GDestroyNotify        notify)
+{
+    g_return_if_fail (connection != NULL);
+
+    if (connection->disconnect_cb) {
+        _lm_utils_free_callback (connection->disconnect_cb);
+    }
+        
+    if (function) {
+        connection->disconnect_cb = _lm_utils_new_callback (function, 
+                                                            user_data,
+                                                            notify);
+    } else {
+        connection->disconnect_cb = NULL;
+    }
+}
+
+/**
+ * lm_connection_send_raw:
+ * @connection: Connection used to send
+ * @str: The string to send, the entire string will be sent.
+ * @error: Set if error was detected during sending.
+ * 
+ * Asynchronous call to send a raw string. Useful for debugging and testing.
+ * 
+ * Return value: Returns #TRUE if no errors was detected during sending, 
+ * #FALSE otherwise.
+ **/
+gboolean 
+lm_connection_send_raw (LmConnection  *connection, 
+                        const gchar   *str, 
+                        GError       **error)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (str != NULL, FALSE);
+
+    if (!connection_check_output (connection, error)) {
+        return FALSE;
+    }
+
+    return connection_send (connection, str, -1, error);
+}
+
+/**
+ * lm_connection_send_bytes:
+ * @connection: Connection used to send
+ * @bytes: Serialized data to send.
+ * @error: Set if error was detected during sending.
+ * 
+ * Like lm_connection_send_raw() but without copying the data. Whatever 
+ * of @bytes can't be written right away is queued by taking a reference,
+ * so the same @bytes can be sent on any number of connections. @bytes 
+ * must hold complete stanzas.
+ * 
+ * Return value: Returns #TRUE if no errors was detected during sending, 
+ * #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send_bytes (LmConnection  *connection,
+                          GBytes        *bytes,
+                          GError       **error)
+{
+    g_return_val_if_fail (bytes != NULL, FALSE);
+
+    return lm_connection_send_bytesv (connection, &bytes, 1, error);
+}
+
+/**
+ * lm_connection_send_bytesv:
+ * @connection: Connection used to send
+ * @bytes: Array of serialized data to send.
+ * @n_bytes: Number of elements in @bytes.
+ * @error: Set if error was detected during sending.
+ * 
+ * Sends the concatenation of @bytes like lm_connection_send_bytes(), 
+ * letting a payload shared between recipients be surrounded by data 
+ * that is specific to @connection.
+ * 
+ * Return value: Returns #TRUE if no errors was detected during sending, 
+ * #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send_bytesv (LmConnection  *connection,
+                           GBytes       **bytes,
+                           guint          n_bytes,
+                           GError       **error)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (bytes != NULL || n_bytes == 0, FALSE);
+
+    if (!connection_check_open (connection, error) ||
+        !connection_check_output (connection, error)) {
+        return FALSE;
+    }
+
+    if (!lm_xmpp_writer_send_bytes (connection->writer, bytes, n_bytes, 
+                                    error)) {
+        return FALSE;
+    }
+
+    connection_output_queued (connection, NULL);
+
+    return TRUE;
+}
+
+/* A reply or batch timer taken off the wheel of the old pool worker */
+typedef struct {
+    LmTimer *timer;
+    guint    timeout;
+} MovedTimer;
+
+typedef struct {
+    LmConnection *connection;
+    GSList       *timers;
+} ConnectionMove;
+
+static void
+connection_move_timer (ConnectionMove *move, LmTimer *timer)
+{
+    MovedTimer *moved;
+
+    if (!timer) {
+        return;
+    }
+
+    moved = g_slice_new (MovedTimer);
+    moved->timer   = timer;
+    moved->timeout = lm_timer_wheel_steal (move->connection->timer_wheel, 
+                                           timer);
+
+    move->timers = g_slist_prepend (move->timers, moved);
+}
+
+static void
+connection_move_reply_timer (gpointer key, ReplyData *data, ConnectionMove *move)
+{
+    connection_move_timer (move, data->timer);
+}
+
+static void
+connection_move_id_reply_timer (guint64 id, ReplyData *data, ConnectionMove *move)
+{
+    connection_move_timer (move, data->timer);
+}
+
+/* Runs in the new context and hooks the connection up to it */
+static gboolean
+connection_move_attach_cb (ConnectionMove *move)
+{
+    LmConnection *connection = move->connection;
+    GSList       *l;
+
+    for (l = move->timers; l; l = l->next) {
+        MovedTimer *moved = l->data;
+
+        lm_timer_wheel_readd (connection->timer_wheel, 
+                              moved->timer, moved->timeout);
+        g_slice_free (MovedTimer, moved);
+    }
+    g_slist_free (move->timers);
+    move->timers = NULL;
+
+    if (connection->timer_wheel && !connection->pool) {
+        lm_timer_wheel_attach (connection->timer_wheel, connection->context);
+    }
+
+    if (connection->socket) {
+        if (!lm_old_socket_attach (connection->socket, connection->context)) {
+            connection_do_close (connection);
+            connection_signal_disconnect (connection, 
+                                          LM_DISCONNECT_REASON_ERROR);
+            return FALSE;
+        }
+
+        lm_message_queue_attach (connection->queue, connection->context);
+    }
+
+    if (connection->feature_ping) {
+        lm_feature_ping_start (connection->feature_ping);
+    }
+
+    if (!g_queue_is_empty (connection->held_messages)) {
+        connection_shaper_release (connection);
+    }
+
+    return FALSE;
+}
+
+static void
+connection_move_free (ConnectionMove *move)
+{
+    lm_connection_unref (move->connection);
+    g_slice_free (ConnectionMove, move);
+}
+
+/**
+ * lm_connection_move_to_context:
+ * @connection: An #LmConnection
+ * @context: The #GMainContext to move to, %NULL for the default context
+ * @error: location to store error, or %NULL
+ *
+ * Moves @connection, with its socket, message queue, keep alive pings and 
+ * reply timeouts, to be run by @context. Buffered input and output are 
+ * kept. The connection is hooked up to @context from an idle in @context 
+ * so this has to be called from the thread running the current context 
+ * of @connection and from then on @connection may only be used from the 
+ * thread running @context.
+ *
+ * A connection that is being opened or authenticated, or that has 
+ * callers blocked in lm_connection_send_with_reply_and_block(), can't be 
+ * moved and %LM_ERROR_CONNECTION_BUSY is returned. The keep alive 
+ * interval starts over in @context. A connection created by an 
+ * #LmConnectionPool can only be moved to the context of one of the 
+ * workers of that pool, for any other @context %LM_ERROR_WRONG_CONTEXT
+ * is returned. @connection is left untouched when an error is returned.
+ *
+ * Return value: Returns #TRUE if @connection is being moved, otherwise #FALSE.
+ **/
+gboolean
+lm_connection_move_to_context (LmConnection  *connection,
+                               GMainContext  *context,
+                               GError       **error)
+{
+    ConnectionMove *move;
+    LmTimerWheel   *wheel = NULL;
+    GSList         *l;
+    gboolean        waiting;
+
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (connection->external == NULL, FALSE);
+
+    if (connection->state == LM_CONNECTION_STATE_OPENING ||
+        connection->state == LM_CONNECTION_STATE_AUTHENTICATING) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_BUSY,
+                     "Connection is being opened");
+        return FALSE;
+    }
+
+    g_mutex_lock (&connection->waiters_lock);
+    waiting = g_hash_table_size (connection->reply_waiters) > 0;
+    g_mutex_unlock (&connection->waiters_lock);
+
+    if (waiting) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_BUSY,
+                     "Connection has callers waiting for a reply");
+        return FALSE;
+    }
+
+    if (connection->pool && 
+        !_lm_connection_pool_runs_context (connection->pool, context)) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_WRONG_CONTEXT,
+                     "Context is not run by a worker of the connection's pool");
+        return FALSE;
+    }
+
+    if (connection->socket && !lm_old_socket_detach (connection->socket)) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_BUSY,
+                     "Connection is still connecting");
+        return FALSE;
+    }
+
+    if (connection->pool) {
+        wheel = _lm_connection_pool_move (connection->pool, connection, 
+                                          context);
+    }
+
+    move = g_slice_new0 (ConnectionMove);
+    move->connection = lm_connection_ref (connection);
+
+    /* Stopped before the timer wheel changes since it holds a timer */
+    if (connection->feature_ping) {
+        lm_feature_ping_stop (connection->feature_ping);
+    }
+
+    if (connection->socket) {
+        lm_message_queue_detach (connection->queue);
+    }
+
+    if (connection->shaper_source) {
+        g_source_destroy (connection->shaper_source);
+        connection->shaper_source = NULL;
+    }
+
+    if (wheel) {
+        /* Pool workers share one wheel between their connections */
+        g_hash_table_foreach (connection->id_handlers, 
+                              (GHFunc) connection_move_reply_timer, move);
+        lm_id_table_foreach (connection->id_replies, 
+                             (LmIdTableFunc) connection_move_id_reply_timer, 
+                             move);
+        for (l = connection->batches; l; l = l->next) {
+            connection_move_timer (move, ((BatchData *) l->data)->timer);
+        }
+
+        lm_timer_wheel_unref (connection->timer_wheel);
+        connection->timer_wheel = lm_timer_wheel_ref (wheel);
+    }
+    else if (connection->timer_wheel) {
+        lm_timer_wheel_detach (connection->timer_wheel);
+    }
+
+    if (connection->context) {
+        g_main_context_unref (connection->context);
+    }
+    connection->context = context ? g_main_context_ref (context) : NULL;
+
+    g_main_context_invoke_full (context, G_PRIORITY_DEFAULT,
+                                (GSourceFunc) connection_move_attach_cb, 
+                                move,
+                                (GDestroyNotify) connection_move_free);
+
+    return TRUE;
+}
+
+/**
+ * lm_connection_get_state:
+ * @connection: Connection to get state on
+ *
+ * Returns the state of the connection.
+ *
+ * Return value: The state of the connection.
+ **/
+LmConnectionState 
+lm_connection_get_state (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 
+                          LM_CONNECTION_STATE_CLOSED);
+
+    return connection->state;
+}
+
+/**
+ * lm_connection_get_client_host:
+ * @connection: An #LmConnection
+ *
+ * Returns the local host name of the connection.
+ *
+ * Return value: A newly allocated string representing the local host name.
+ **/
+gchar *
+lm_connection_get_local_host (LmConnection *connection)
+{
+    return lm_old_socket_get_local_host (connection->socket);
+}
+
+/**
+ * lm_connection_ref:
+ * @connection: Connection to add a reference to.
+ * 
+ * Add a reference on @connection. To remove a reference call 
  * lm_connection_unref().
  * 
  * Return value: Returns the same connection.
@@ -2156,7 +4737,7 @@ lm_connection_ref (LmConnection *connection)
 {
     g_return_val_if_fail (connection != NULL, NULL);
     
-    connection->ref_count++;
+    g_atomic_int_inc (&connection->ref_count);
     
     return connection;
 }
@@ -2173,9 +4754,7 @@ lm_connection_unref (LmConnection *connection)
 {
     g_return_if_fail (connection != NULL);
     
-    connection->ref_count--;
-    
-    if (connection->ref_count == 0) {
+    if (g_atomic_int_dec_and_test (&connection->ref_count)) {
         connection_free (connection);
     }
 }
@@ -53,6 +53,28 @@ G_BEGIN_DECLS
  */
 #define LM_CONNECTION_DEFAULT_PORT_SSL 5223
 
+/**
+ * LM_CONNECTION_DEFAULT_MAX_READ_SIZE:
+ * 
+ * Default limit for how large the read buffer of a connection may grow.
+ */
+#define LM_CONNECTION_DEFAULT_MAX_READ_SIZE (256 * 1024)
+
+/**
+ * LM_CONNECTION_DEFAULT_READ_BUDGET_BYTES:
+ * 
+ * Default for how many bytes a connection reads per main loop wakeup.
+ */
+#define LM_CONNECTION_DEFAULT_READ_BUDGET_BYTES (512 * 1024)
+
+/**
+ * LM_CONNECTION_DEFAULT_READ_BUDGET_MSECS:
+ * 
+ * Default for how many milliseconds a connection spends reading per main 
+ * loop wakeup.
+ */
+#define LM_CONNECTION_DEFAULT_READ_BUDGET_MSECS 10
+
 typedef struct _LmConnection LmConnection;
 
 typedef struct LmMessageHandler LmMessageHandler;
@@ -144,9 +166,55 @@ typedef void         (* LmDisconnectFunction) (LmConnection       *connection,
                                                LmDisconnectReason  reason,
                                                gpointer            user_data);
 
+/**
+ * LmReplyTimeoutFunction:
+ * @connection: an #LmConnection
+ * @id: the id of the message that didn't get a reply
+ * @user_data: User data passed when function being called.
+ * 
+ * Callback called when no reply arrived in time for a message sent with
+ * lm_connection_send_with_reply_full().
+ */
+typedef void         (* LmReplyTimeoutFunction) (LmConnection     *connection,
+                                                 const gchar      *id,
+                                                 gpointer          user_data);
+
+/**
+ * LmBatchFunction:
+ * @connection: an #LmConnection
+ * @replies: the reply to each message in the batch, %NULL where none arrived
+ * @n_replies: the number of messages in the batch
+ * @user_data: User data passed when function being called.
+ * 
+ * Callback called when a batch sent with lm_connection_send_batch() has
+ * finished.
+ */
+typedef void         (* LmBatchFunction)      (LmConnection       *connection,
+                                               LmMessage         **replies,
+                                               guint               n_replies,
+                                               gpointer            user_data);
+
+/**
+ * LmWritableFunction:
+ * @connection: an #LmConnection
+ * @user_data: User data passed when function being called.
+ * 
+ * Callback called when pending output has dropped to the low watermark
+ * after it had reached the high watermark, see 
+ * lm_connection_set_output_watermarks().
+ */
+typedef void         (* LmWritableFunction)   (LmConnection       *connection,
+                                               gpointer            user_data);
+
 LmConnection *lm_connection_new               (const gchar        *server);
 LmConnection *lm_connection_new_with_context  (const gchar        *server,
                                                GMainContext       *context);
+LmConnection *lm_connection_new_external      (const gchar        *server);
+gint          lm_connection_prepare           (LmConnection       *connection,
+                                               GIOCondition       *events,
+                                               gint               *timeout);
+void          lm_connection_process           (LmConnection       *connection,
+                                               GIOCondition        revents);
 gboolean      lm_connection_open              (LmConnection       *connection,
                                                LmResultFunction    function,
                                                gpointer            user_data,
@@ -198,23 +266,114 @@ void          lm_connection_set_ssl           (LmConnection       *connection,
 LmProxy *     lm_connection_get_proxy         (LmConnection       *connection);
 void          lm_connection_set_proxy         (LmConnection       *connection,
                                                LmProxy            *proxy);
+gboolean      lm_connection_get_corked        (LmConnection       *connection);
+void          lm_connection_set_corked        (LmConnection       *connection,
+                                               gboolean            corked);
+gsize         lm_connection_get_max_read_size (LmConnection       *connection);
+void          lm_connection_set_max_read_size (LmConnection       *connection,
+                                               gsize               size);
+gsize         lm_connection_get_read_size     (LmConnection       *connection);
+void          lm_connection_get_read_budget   (LmConnection       *connection,
+                                               gsize              *bytes,
+                                               guint              *msecs);
+void          lm_connection_set_read_budget   (LmConnection       *connection,
+                                               gsize               bytes,
+                                               guint               msecs);
+gsize         lm_connection_get_pending_output (LmConnection      *connection);
+void          lm_connection_get_output_watermarks (LmConnection   *connection,
+                                               gsize              *low,
+                                               gsize              *high);
+void          lm_connection_set_output_watermarks (LmConnection   *connection,
+                                               gsize               low,
+                                               gsize               high);
+gboolean      lm_connection_get_fail_when_full (LmConnection      *connection);
+void          lm_connection_set_fail_when_full (LmConnection      *connection,
+                                               gboolean            fail);
+void          
+lm_connection_set_writable_function           (LmConnection       *connection,
+                                               LmWritableFunction  function,
+                                               gpointer            user_data,
+                                               GDestroyNotify      notify);
+LmOutputPriority
+lm_connection_get_output_priority             (LmConnection       *connection,
+                                               LmMessageType       type,
+                                               LmMessageSubType    sub_type);
+void          
+lm_connection_set_output_priority             (LmConnection       *connection,
+                                               LmMessageType       type,
+                                               LmMessageSubType    sub_type,
+                                               LmOutputPriority    priority);
+void          lm_connection_set_rate_limit    (LmConnection       *connection,
+                                               guint               bytes_per_second,
+                                               guint               bytes_burst,
+                                               guint               stanzas_per_second,
+                                               guint               stanzas_burst);
+void          
+lm_connection_set_jid_rate_limit              (LmConnection       *connection,
+                                               guint               bytes_per_second,
+                                               guint               bytes_burst,
+                                               guint               stanzas_per_second,
+                                               guint               stanzas_burst);
+void          
+lm_connection_get_rate_limit_stats            (LmConnection       *connection,
+                                               guint64            *n_delayed,
+                                               GTimeSpan          *delayed_time);
 gboolean      lm_connection_send              (LmConnection       *connection,
                                                LmMessage          *message,
                                                GError            **error);
+gboolean      lm_connection_send_full         (LmConnection       *connection,
+                                               LmMessage          *message,
+                                               LmResultFunction    function,
+                                               gpointer            user_data,
+                                               GDestroyNotify      notify,
+                                               GError            **error);
 gboolean      lm_connection_send_with_reply   (LmConnection       *connection,
                                                LmMessage          *message,
                                                LmMessageHandler   *handler,
                                                GError            **error);
+gboolean      
+lm_connection_send_with_reply_full            (LmConnection       *connection,
+                                               LmMessage          *message,
+                                               LmMessageHandler   *handler,
+                                               guint               timeout,
+                                               LmReplyTimeoutFunction function,
+                                               gpointer            user_data,
+                                               GDestroyNotify      notify,
+                                               GError            **error);
+gboolean      lm_connection_send_batch        (LmConnection       *connection,
+                                               LmMessage         **messages,
+                                               guint               n_messages,
+                                               guint               timeout,
+                                               LmBatchFunction     function,
+                                               gpointer            user_data,
+                                               GDestroyNotify      notify,
+                                               GError            **error);
+guint         lm_connection_get_reply_timeout (LmConnection       *connection);
+void          lm_connection_set_reply_timeout (LmConnection       *connection,
+                                               guint               timeout);
 LmMessage *   
 lm_connection_send_with_reply_and_block       (LmConnection       *connection,
                                                LmMessage          *message,
                                                GError            **error);
+LmMessage *   
+lm_connection_send_with_reply_and_block_timeout (LmConnection     *connection,
+                                               LmMessage          *message,
+                                               guint               timeout,
+                                               GError            **error);
 void
 lm_connection_register_message_handler        (LmConnection       *connection,
                                                LmMessageHandler   *handler,
                                                LmMessageType       type,
                                                LmHandlerPriority   priority);
 void
+lm_connection_register_message_handler_full   (LmConnection       *connection,
+                                               LmMessageHandler   *handler,
+                                               LmMessageType       type,
+                                               LmMessageSubType    sub_type,
+                                               const gchar        *child_name,
+                                               const gchar        *xmlns,
+                                               LmHandlerPriority   priority);
+void
 lm_connection_unregister_message_handler      (LmConnection       *connection,
                                                LmMessageHandler   *handler,
                                                LmMessageType       type);
@@ -227,7 +386,17 @@ lm_connection_set_disconnect_function         (LmConnection       *connection,
 gboolean      lm_connection_send_raw          (LmConnection       *connection,
                                                const gchar        *str,
                                                GError            **error);
+gboolean      lm_connection_send_bytes        (LmConnection       *connection,
+                                               GBytes             *bytes,
+                                               GError            **error);
+gboolean      lm_connection_send_bytesv       (LmConnection       *connection,
+                                               GBytes            **bytes,
+                                               guint               n_bytes,
+                                               GError            **error);
 LmConnectionState lm_connection_get_state     (LmConnection       *connection);
+gboolean      lm_connection_move_to_context   (LmConnection       *connection,
+                                               GMainContext       *context,
+                                               GError            **error);
 gchar *       lm_connection_get_local_host    (LmConnection       *connection);
 LmConnection* lm_connection_ref               (LmConnection       *connection);
 void          lm_connection_unref             (LmConnection       *connection);
@@ -23,7 +23,7 @@
 #ifndef LM_NO_DEBUG
 
 static LmLogLevelFlags debug_flags = 0;
-static gboolean initialized = FALSE;
+static gsize           initialized = 0;
 
 static const GDebugKey debug_keys[] = {
     {"VERBOSE",      LM_LOG_LEVEL_VERBOSE},
@@ -70,7 +70,7 @@ lm_debug_init (void)
 {
     const gchar *env_lm_debug;
 
-    if (initialized) {
+    if (!g_once_init_enter (&initialized)) {
         return;
     }
     
@@ -83,7 +83,7 @@ lm_debug_init (void)
     g_log_set_handler (LM_LOG_DOMAIN, LM_LOG_LEVEL_ALL, 
                        debug_log_handler, NULL);
 
-    initialized = TRUE;
+    g_once_init_leave (&initialized, 1);
 }
 
 #else  /* LM_NO_DEBUG */
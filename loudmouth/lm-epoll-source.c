@@ -0,0 +1,380 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * All fds watched on one GMainContext are registered, edge triggered,
+ * with a single epoll fd. The context only polls that fd through one
+ * GSource, which dispatches the watches the kernel reported ready. A
+ * watch that stopped before draining its fd is put back on the ready
+ * list with lm_epoll_watch_set_ready() since no new edge will come for
+ * it. Idle fds cost nothing per main loop iteration.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "lm-epoll-source.h"
+
+/* Events fetched per epoll_wait() call */
+#define MAX_EVENTS 64
+
+typedef struct {
+    GSource       source;
+
+    GMainContext *context;
+    gint          epfd;
+    GPollFD       poll_fd;
+
+    /* Watches to dispatch, linked through their ready_link */
+    GQueue        ready;
+    guint         n_watches;
+} EpollSource;
+
+struct _LmEpollWatch {
+    EpollSource  *source;
+    gint          fd;
+    GIOCondition  condition;
+
+    /* Reported but not yet dispatched */
+    GIOCondition  ready;
+    GList         ready_link;
+
+    LmEpollFunc   func;
+    gpointer      user_data;
+};
+
+static gboolean    epoll_source_prepare_func    (GSource         *source,
+                                                 gint            *timeout);
+static gboolean    epoll_source_check_func      (GSource         *source);
+static gboolean    epoll_source_dispatch_func   (GSource         *source,
+                                                 GSourceFunc      callback,
+                                                 gpointer         user_data);
+static void        epoll_source_finalize_func   (GSource         *source);
+
+static GSourceFuncs source_funcs = {
+    epoll_source_prepare_func,
+    epoll_source_check_func,
+    epoll_source_dispatch_func,
+    epoll_source_finalize_func
+};
+
+/* GMainContext -> EpollSource, contexts can run in different threads */
+static GHashTable *sources;
+static GMutex      sources_lock;
+
+static guint32
+epoll_events_from_condition (GIOCondition condition)
+{
+    guint32 events = EPOLLET;
+
+    if (condition & G_IO_IN) {
+        events |= EPOLLIN;
+    }
+    if (condition & G_IO_PRI) {
+        events |= EPOLLPRI;
+    }
+    if (condition & G_IO_OUT) {
+        events |= EPOLLOUT;
+    }
+
+    /* EPOLLERR and EPOLLHUP are always reported */
+    return events;
+}
+
+static GIOCondition
+epoll_events_to_condition (guint32 events)
+{
+    GIOCondition condition = 0;
+
+    if (events & EPOLLIN) {
+        condition |= G_IO_IN;
+    }
+    if (events & EPOLLPRI) {
+        condition |= G_IO_PRI;
+    }
+    if (events & EPOLLOUT) {
+        condition |= G_IO_OUT;
+    }
+    if (events & EPOLLERR) {
+        condition |= G_IO_ERR;
+    }
+    if (events & EPOLLHUP) {
+        condition |= G_IO_HUP;
+    }
+
+    return condition;
+}
+
+static void
+epoll_source_queue (EpollSource *source, LmEpollWatch *watch)
+{
+    if (!watch->ready_link.data) {
+        watch->ready_link.data = watch;
+        g_queue_push_tail_link (&source->ready, &watch->ready_link);
+    }
+}
+
+/* Moves what the kernel has reported onto the ready list */
+static void
+epoll_source_collect (EpollSource *source)
+{
+    struct epoll_event events[MAX_EVENTS];
+    gint               n, i;
+
+    do {
+        n = epoll_wait (source->epfd, events, MAX_EVENTS, 0);
+
+        for (i = 0; i < n; i++) {
+            LmEpollWatch *watch = events[i].data.ptr;
+
+            watch->ready |= epoll_events_to_condition (events[i].events);
+            epoll_source_queue (source, watch);
+        }
+    } while (n == MAX_EVENTS || (n < 0 && errno == EINTR));
+}
+
+static gboolean
+epoll_source_prepare_func (GSource *source, gint *timeout)
+{
+    *timeout = -1;
+
+    return !g_queue_is_empty (&((EpollSource *) source)->ready);
+}
+
+static gboolean
+epoll_source_check_func (GSource *source)
+{
+    EpollSource *esource = (EpollSource *) source;
+
+    return (esource->poll_fd.revents & G_IO_IN) ||
+        !g_queue_is_empty (&esource->ready);
+}
+
+static gboolean
+epoll_source_dispatch_func (GSource     *source,
+                            GSourceFunc  callback,
+                            gpointer     user_data)
+{
+    EpollSource *esource = (EpollSource *) source;
+    guint        n;
+
+    epoll_source_collect (esource);
+
+    /* Watches that get put back while dispatching wait for the next
+     * iteration, so other sources get to run in between */
+    n = g_queue_get_length (&esource->ready);
+    while (n-- > 0 && !g_queue_is_empty (&esource->ready)) {
+        LmEpollWatch *watch;
+        GIOCondition  condition;
+        GList        *link;
+
+        link = g_queue_pop_head_link (&esource->ready);
+        watch = link->data;
+        link->data = NULL;
+
+        condition = watch->ready;
+        watch->ready = 0;
+
+        /* The watch may be freed by its callback */
+        watch->func (watch, condition, watch->user_data);
+    }
+
+    return TRUE;
+}
+
+static void
+epoll_source_finalize_func (GSource *source)
+{
+    EpollSource *esource = (EpollSource *) source;
+
+    close (esource->epfd);
+
+    if (esource->context) {
+        g_main_context_unref (esource->context);
+    }
+}
+
+/* Returns the source of @context, creating it on first use */
+static EpollSource *
+epoll_source_get (GMainContext *context)
+{
+    EpollSource *esource;
+    gint         epfd;
+
+    if (!context) {
+        context = g_main_context_default ();
+    }
+
+    g_mutex_lock (&sources_lock);
+
+    if (!sources) {
+        sources = g_hash_table_new (g_direct_hash, g_direct_equal);
+    }
+
+    esource = g_hash_table_lookup (sources, context);
+    if (esource) {
+        g_mutex_unlock (&sources_lock);
+        return esource;
+    }
+
+    epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        g_mutex_unlock (&sources_lock);
+        return NULL;
+    }
+
+    esource = (EpollSource *) g_source_new (&source_funcs, sizeof (EpollSource));
+    esource->context = g_main_context_ref (context);
+    esource->epfd    = epfd;
+    g_queue_init (&esource->ready);
+
+    esource->poll_fd.fd     = epfd;
+    esource->poll_fd.events = G_IO_IN;
+    g_source_add_poll ((GSource *) esource, &esource->poll_fd);
+
+    g_source_attach ((GSource *) esource, context);
+
+    g_hash_table_insert (sources, context, esource);
+
+    g_mutex_unlock (&sources_lock);
+
+    return esource;
+}
+
+static void
+epoll_source_release (EpollSource *esource)
+{
+    if (--esource->n_watches > 0) {
+        return;
+    }
+
+    g_mutex_lock (&sources_lock);
+    g_hash_table_remove (sources, esource->context);
+    g_mutex_unlock (&sources_lock);
+
+    g_source_destroy ((GSource *) esource);
+    g_source_unref ((GSource *) esource);
+}
+
+/* Calls @func from the main loop of @context when @fd meets @condition.
+ * Errors and hangups are always reported. Returns NULL if @fd can't be
+ * watched. */
+LmEpollWatch *
+lm_epoll_watch_new (GMainContext *context,
+                    gint          fd,
+                    GIOCondition  condition,
+                    LmEpollFunc   func,
+                    gpointer      user_data)
+{
+    EpollSource        *esource;
+    LmEpollWatch       *watch;
+    struct epoll_event  event;
+
+    g_return_val_if_fail (fd >= 0, NULL);
+    g_return_val_if_fail (func != NULL, NULL);
+
+    esource = epoll_source_get (context);
+    if (!esource) {
+        return NULL;
+    }
+
+    watch = g_slice_new0 (LmEpollWatch);
+    watch->source    = esource;
+    watch->fd        = fd;
+    watch->condition = condition;
+    watch->func      = func;
+    watch->user_data = user_data;
+
+    event.events   = epoll_events_from_condition (condition);
+    event.data.ptr = watch;
+
+    esource->n_watches++;
+
+    if (epoll_ctl (esource->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        g_slice_free (LmEpollWatch, watch);
+        epoll_source_release (esource);
+        return NULL;
+    }
+
+    return watch;
+}
+
+/* Changing the condition reports the new condition right away if the fd
+ * already meets it */
+void
+lm_epoll_watch_set_condition (LmEpollWatch *watch, GIOCondition condition)
+{
+    struct epoll_event event;
+
+    g_return_if_fail (watch != NULL);
+
+    if (watch->condition == condition) {
+        return;
+    }
+
+    watch->condition = condition;
+
+    event.events   = epoll_events_from_condition (condition);
+    event.data.ptr = watch;
+
+    epoll_ctl (watch->source->epfd, EPOLL_CTL_MOD, watch->fd, &event);
+}
+
+GIOCondition
+lm_epoll_watch_get_condition (LmEpollWatch *watch)
+{
+    g_return_val_if_fail (watch != NULL, 0);
+
+    return watch->condition;
+}
+
+/* Dispatches @watch with @condition on the next iteration, for an fd
+ * that was not drained and so will not be reported again */
+void
+lm_epoll_watch_set_ready (LmEpollWatch *watch, GIOCondition condition)
+{
+    g_return_if_fail (watch != NULL);
+
+    watch->ready |= condition;
+    epoll_source_queue (watch->source, watch);
+}
+
+void
+lm_epoll_watch_free (LmEpollWatch *watch)
+{
+    EpollSource *esource;
+
+    g_return_if_fail (watch != NULL);
+
+    esource = watch->source;
+
+    epoll_ctl (esource->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+    if (watch->ready_link.data) {
+        g_queue_unlink (&esource->ready, &watch->ready_link);
+    }
+
+    g_slice_free (LmEpollWatch, watch);
+
+    epoll_source_release (esource);
+}
@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_EPOLL_SOURCE_H__
+#define __LM_EPOLL_SOURCE_H__
+
+#include <glib.h>
+
+typedef struct _LmEpollWatch LmEpollWatch;
+
+typedef void (* LmEpollFunc) (LmEpollWatch *watch,
+                              GIOCondition  condition,
+                              gpointer      user_data);
+
+LmEpollWatch * lm_epoll_watch_new           (GMainContext *context,
+                                             gint          fd,
+                                             GIOCondition  condition,
+                                             LmEpollFunc   func,
+                                             gpointer      user_data);
+void           lm_epoll_watch_set_condition (LmEpollWatch *watch,
+                                             GIOCondition  condition);
+GIOCondition   lm_epoll_watch_get_condition (LmEpollWatch *watch);
+void           lm_epoll_watch_set_ready     (LmEpollWatch *watch,
+                                             GIOCondition  condition);
+void           lm_epoll_watch_free          (LmEpollWatch *watch);
+
+#endif /* __LM_EPOLL_SOURCE_H__ */
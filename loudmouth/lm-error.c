@@ -31,11 +31,11 @@
 GQuark
 lm_error_quark (void)
 {
-    static GQuark q = 0;
+    static gsize q = 0;
 
-    if (q == 0) {
-        q = g_quark_from_static_string ("lm-error-quark");
+    if (g_once_init_enter (&q)) {
+        g_once_init_leave (&q, g_quark_from_static_string ("lm-error-quark"));
     }
     
-    return q;
+    return (GQuark) q;
 }
@@ -41,14 +41,28 @@ G_BEGIN_DECLS
  * @LM_ERROR_CONNECTION_NOT_OPEN: Connection not open when trying to send a message
  * @LM_ERROR_CONNECTION_OPEN: Connection is already open when trying to open it again.
  * @LM_ERROR_AUTH_FAILED: Authentication failed while opening connection
- * @LM_ERROR_CONNECTION_FAILED:  * 
+ * @LM_ERROR_CONNECTION_FAILED: The connection failed or was closed by the server.
+ * @LM_ERROR_TIMED_OUT: The operation didn't finish within the given time.
+ * @LM_ERROR_OUTPUT_FULL: More output than the high watermark is pending.
+ * @LM_ERROR_CONNECTION_BUSY: The connection is in the middle of something 
+ * that has to finish first.
+ * @LM_ERROR_DUPLICATE_ID: The same id was used for more than one message
+ * waiting for a reply.
+ * @LM_ERROR_WRONG_CONTEXT: The connection can't be run by the given
+ * #GMainContext.
+ * 
  * Describes the problem of the error.
  */
 typedef enum {
     LM_ERROR_CONNECTION_NOT_OPEN,
     LM_ERROR_CONNECTION_OPEN,
     LM_ERROR_AUTH_FAILED,
-    LM_ERROR_CONNECTION_FAILED
+    LM_ERROR_CONNECTION_FAILED,
+    LM_ERROR_TIMED_OUT,
+    LM_ERROR_OUTPUT_FULL,
+    LM_ERROR_CONNECTION_BUSY,
+    LM_ERROR_DUPLICATE_ID,
+    LM_ERROR_WRONG_CONTEXT
 } LmError;
 
 GQuark lm_error_quark (void) G_GNUC_CONST;
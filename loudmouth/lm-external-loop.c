@@ -0,0 +1,223 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/*
+ * Runs a private GMainContext from a loop that isn't a GMainLoop. The
+ * host polls the one fd the context is waiting on and hands what it got
+ * to lm_external_loop_process(), which checks and dispatches the context
+ * in the calling thread. The wakeup fd GLib adds to every context is left
+ * out since the context is only used from the host thread, so wakeups
+ * from other threads are not seen until the host calls in. Any further
+ * fd, like the resolver's while a connection is being opened, is polled
+ * without blocking on each process and keeps the timeout short.
+ */
+
+#include <config.h>
+
+#include "lm-external-loop.h"
+
+/* Timeout while the context waits on more than the one fd the host polls */
+#define OTHER_FDS_TIMEOUT 10
+
+/* Room for the GPollFDs of a connected socket */
+#define N_FDS 4
+
+struct _LmExternalLoop {
+    GMainContext *context;
+
+    /* What the last prepare queried from the context */
+    GPollFD      *fds;
+    gint          n_fds;
+    gint          n_allocated;
+    gint          max_priority;
+    gint          fd;
+    gint          n_other_fds;
+    gboolean      prepared;
+
+    gint          wakeup_fd;
+};
+
+static gint
+external_loop_query (LmExternalLoop *loop)
+{
+    gint timeout;
+
+    for (;;) {
+        loop->n_fds = g_main_context_query (loop->context,
+                                            loop->max_priority,
+                                            &timeout,
+                                            loop->fds,
+                                            loop->n_allocated);
+        if (loop->n_fds <= loop->n_allocated) {
+            return timeout;
+        }
+
+        loop->n_allocated = loop->n_fds;
+        loop->fds = g_renew (GPollFD, loop->fds, loop->n_allocated);
+    }
+}
+
+LmExternalLoop *
+lm_external_loop_new (void)
+{
+    LmExternalLoop *loop;
+
+    loop = g_slice_new0 (LmExternalLoop);
+    loop->context     = g_main_context_new ();
+    loop->n_allocated = N_FDS;
+    loop->fds         = g_new (GPollFD, N_FDS);
+    loop->fd          = -1;
+    loop->wakeup_fd   = -1;
+
+    /* A context without sources only polls its wakeup fd */
+    g_main_context_acquire (loop->context);
+    g_main_context_prepare (loop->context, &loop->max_priority);
+    external_loop_query (loop);
+    if (loop->n_fds == 1) {
+        loop->wakeup_fd = loop->fds[0].fd;
+    }
+    g_main_context_release (loop->context);
+
+    return loop;
+}
+
+GMainContext *
+lm_external_loop_get_context (LmExternalLoop *loop)
+{
+    g_return_val_if_fail (loop != NULL, NULL);
+
+    return loop->context;
+}
+
+/* Returns the fd to poll for @events, or -1 if there is none. @timeout
+ * is set to the milliseconds until lm_external_loop_process() has to be
+ * called without anything happening on the fd, -1 for no limit. */
+gint
+lm_external_loop_prepare (LmExternalLoop *loop,
+                          GIOCondition   *events,
+                          gint           *timeout)
+{
+    GIOCondition condition = 0;
+    gboolean     ready;
+    gint         wait;
+    gint         i;
+
+    g_return_val_if_fail (loop != NULL, -1);
+
+    g_main_context_acquire (loop->context);
+
+    ready = g_main_context_prepare (loop->context, &loop->max_priority);
+    wait  = external_loop_query (loop);
+
+    loop->fd          = -1;
+    loop->n_other_fds = 0;
+
+    for (i = 0; i < loop->n_fds; i++) {
+        GPollFD *poll_fd = &loop->fds[i];
+
+        if (poll_fd->fd == loop->wakeup_fd) {
+            continue;
+        }
+
+        if (loop->fd == -1) {
+            loop->fd = poll_fd->fd;
+        }
+
+        if (poll_fd->fd == loop->fd) {
+            condition |= poll_fd->events;
+        } else {
+            loop->n_other_fds++;
+        }
+    }
+
+    if (ready) {
+        wait = 0;
+    }
+    else if (loop->n_other_fds > 0 && 
+             (wait < 0 || wait > OTHER_FDS_TIMEOUT)) {
+        wait = OTHER_FDS_TIMEOUT;
+    }
+
+    loop->prepared = TRUE;
+
+    g_main_context_release (loop->context);
+
+    if (events) {
+        *events = condition;
+    }
+    if (timeout) {
+        *timeout = wait;
+    }
+
+    return loop->fd;
+}
+
+/* Dispatches what is due, @revents being what the host polled on the fd
+ * from the last lm_external_loop_prepare() */
+void
+lm_external_loop_process (LmExternalLoop *loop, GIOCondition revents)
+{
+    gint i;
+
+    g_return_if_fail (loop != NULL);
+
+    if (!loop->prepared) {
+        lm_external_loop_prepare (loop, NULL, NULL);
+        revents = 0;
+    }
+
+    g_main_context_acquire (loop->context);
+
+    if (loop->n_other_fds > 0) {
+        g_poll (loop->fds, loop->n_fds, 0);
+    } else {
+        for (i = 0; i < loop->n_fds; i++) {
+            loop->fds[i].revents = 0;
+        }
+    }
+
+    for (i = 0; i < loop->n_fds; i++) {
+        GPollFD *poll_fd = &loop->fds[i];
+
+        if (poll_fd->fd == loop->fd) {
+            poll_fd->revents |= revents & 
+                (poll_fd->events | G_IO_ERR | G_IO_HUP | G_IO_NVAL);
+        }
+    }
+
+    loop->prepared = FALSE;
+
+    g_main_context_check (loop->context, loop->max_priority,
+                          loop->fds, loop->n_fds);
+    g_main_context_dispatch (loop->context);
+
+    g_main_context_release (loop->context);
+}
+
+void
+lm_external_loop_free (LmExternalLoop *loop)
+{
+    g_return_if_fail (loop != NULL);
+
+    g_main_context_unref (loop->context);
+    g_free (loop->fds);
+    g_slice_free (LmExternalLoop, loop);
+}
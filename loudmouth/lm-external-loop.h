@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __LM_EXTERNAL_LOOP_H__
+#define __LM_EXTERNAL_LOOP_H__
+
+#include <glib.h>
+
+typedef struct _LmExternalLoop LmExternalLoop;
+
+LmExternalLoop * lm_external_loop_new         (void);
+GMainContext *   lm_external_loop_get_context (LmExternalLoop *loop);
+gint             lm_external_loop_prepare     (LmExternalLoop *loop,
+                                               GIOCondition   *events,
+                                               gint           *timeout);
+void             lm_external_loop_process     (LmExternalLoop *loop,
+                                               GIOCondition    revents);
+void             lm_external_loop_free        (LmExternalLoop *loop);
+
+#endif /* __LM_EXTERNAL_LOOP_H__ */
@@ -24,7 +24,7 @@
 #include "lm-debug.h"
 #include "lm-internals.h"
 #include "lm-marshal.h"
-#include "lm-misc.h"
+#include "lm-timer-wheel.h"
 
 #include "lm-feature-ping.h"
 
@@ -36,7 +36,10 @@ typedef struct LmFeaturePingPriv LmFeaturePingPriv;
 struct LmFeaturePingPriv {
     LmConnection *connection;
     guint         keep_alive_rate;
-    GSource      *keep_alive_source;
+    /* The pings run on the timer wheel of the connection, which pooled
+     * connections share */
+    LmTimerWheel *timer_wheel;
+    LmTimer      *keep_alive_timer;
     guint         keep_alive_counter;
 };
 
@@ -55,7 +58,8 @@ feature_ping_keep_alive_reply                    (LmMessageHandler *handler,
                                                   LmConnection     *connection,
                                                   LmMessage        *m,
                                                   gpointer          user_data);
-static gboolean feature_ping_send_keep_alive     (LmFeaturePing    *fp);
+static void     feature_ping_send_keep_alive     (LmFeaturePing    *fp);
+static void     feature_ping_keep_alive_cb       (LmFeaturePing    *fp);
 
 G_DEFINE_TYPE (LmFeaturePing, lm_feature_ping, G_TYPE_OBJECT)
 
@@ -187,7 +191,7 @@ feature_ping_keep_alive_reply (LmMessageHandler *handler,
     return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
-static gboolean
+static void
 feature_ping_send_keep_alive (LmFeaturePing *fp)
 {
     LmFeaturePingPriv *priv;
@@ -208,6 +212,10 @@ feature_ping_send_keep_alive (LmFeaturePing *fp)
                                       LM_DISCONNECT_REASON_PING_TIME_OUT);
 #endif
 
+        /* The handler closed the connection */
+        if (!priv->timer_wheel) {
+            return;
+        }
     }
 
     server = _lm_connection_get_server (priv->connection);
@@ -220,6 +228,10 @@ feature_ping_send_keep_alive (LmFeaturePing *fp)
 
     lm_message_node_set_attribute (ping_node, "xmlns", XMPP_NS_PING);
 
+    /* Don't let the ping wait behind bulk output, the server would think
+     * we are gone */
+    lm_message_set_output_priority (ping, LM_OUTPUT_PRIORITY_CONTROL);
+
     keep_alive_handler =
         lm_message_handler_new (feature_ping_keep_alive_reply,
                                 fp,
@@ -235,8 +247,31 @@ feature_ping_send_keep_alive (LmFeaturePing *fp)
     lm_message_handler_unref (keep_alive_handler);
     lm_message_unref (ping);
     g_free (server);
+}
+
+static void
+feature_ping_keep_alive_cb (LmFeaturePing *fp)
+{
+    LmFeaturePingPriv *priv;
+
+    priv = GET_PRIV (fp);
+
+    /* The timer is freed by the wheel once we return */
+    priv->keep_alive_timer = NULL;
+
+    g_object_ref (fp);
+
+    feature_ping_send_keep_alive (fp);
 
-    return TRUE;
+    if (priv->timer_wheel && !priv->keep_alive_timer) {
+        priv->keep_alive_timer =
+            lm_timer_wheel_add (priv->timer_wheel,
+                                priv->keep_alive_rate * 1000,
+                                (LmTimerFunc) feature_ping_keep_alive_cb,
+                                fp);
+    }
+
+    g_object_unref (fp);
 }
 
 
@@ -249,17 +284,19 @@ lm_feature_ping_start (LmFeaturePing *fp)
 
     priv = GET_PRIV (fp);
 
-    if (priv->keep_alive_source) {
+    if (priv->timer_wheel) {
         lm_feature_ping_stop (fp);
     }
 
     if (priv->keep_alive_rate > 0) {
         priv->keep_alive_counter = 0;
-        priv->keep_alive_source =
-            lm_misc_add_timeout (_lm_connection_get_context (priv->connection),
-                                 priv->keep_alive_rate * 1000,
-                                 (GSourceFunc) feature_ping_send_keep_alive,
-                                 fp);
+        priv->timer_wheel = 
+            lm_timer_wheel_ref (_lm_connection_get_timer_wheel (priv->connection));
+        priv->keep_alive_timer =
+            lm_timer_wheel_add (priv->timer_wheel,
+                                priv->keep_alive_rate * 1000,
+                                (LmTimerFunc) feature_ping_keep_alive_cb,
+                                fp);
     }
 }
 
@@ -272,11 +309,16 @@ lm_feature_ping_stop (LmFeaturePing *fp)
 
     priv = GET_PRIV (fp);
 
-    if (priv->keep_alive_source) {
-        g_source_destroy (priv->keep_alive_source);
+    if (priv->keep_alive_timer) {
+        lm_timer_wheel_cancel (priv->timer_wheel, priv->keep_alive_timer);
+    }
+
+    if (priv->timer_wheel) {
+        lm_timer_wheel_unref (priv->timer_wheel);
     }
 
-    priv->keep_alive_source = NULL;
+    priv->keep_alive_timer = NULL;
+    priv->timer_wheel      = NULL;
 }
 
 
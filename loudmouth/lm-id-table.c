@@ -0,0 +1,280 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Linear probing with backward shift deletion, so there are no
+ * tombstones and lookups never have to scan past the run a key hashes
+ * to. Id 0 marks an empty slot.
+ */
+
+#include <config.h>
+
+#include "lm-id-table.h"
+
+#define MIN_SIZE 16
+
+typedef struct {
+    guint64  id;
+    gpointer value;
+} IdTableEntry;
+
+struct _LmIdTable {
+    IdTableEntry   *entries;
+    guint           size;
+    guint           n_entries;
+
+    GDestroyNotify  value_destroy;
+};
+
+static guint
+id_table_hash (guint64 id)
+{
+    /* Finalizer of MurmurHash3, the ids are sequential */
+    id ^= id >> 33;
+    id *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+    id ^= id >> 33;
+    id *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+    id ^= id >> 33;
+
+    return (guint) id;
+}
+
+static guint
+id_table_find (LmIdTable *table, guint64 id)
+{
+    guint mask = table->size - 1;
+    guint i;
+
+    for (i = id_table_hash (id) & mask; ; i = (i + 1) & mask) {
+        if (table->entries[i].id == id || table->entries[i].id == 0) {
+            return i;
+        }
+    }
+}
+
+static void
+id_table_resize (LmIdTable *table, guint size)
+{
+    IdTableEntry *old_entries = table->entries;
+    guint         old_size = table->size;
+    guint         i;
+
+    table->entries = g_new0 (IdTableEntry, size);
+    table->size    = size;
+
+    for (i = 0; i < old_size; ++i) {
+        if (old_entries[i].id != 0) {
+            table->entries[id_table_find (table, old_entries[i].id)] = old_entries[i];
+        }
+    }
+
+    g_free (old_entries);
+}
+
+/* Removes the entry at @i and moves later entries of the same run back
+ * so that they can still be found */
+static void
+id_table_remove_at (LmIdTable *table, guint i)
+{
+    guint mask = table->size - 1;
+    guint j = i;
+
+    table->entries[i].id    = 0;
+    table->entries[i].value = NULL;
+    table->n_entries--;
+
+    for (;;) {
+        guint home;
+
+        j = (j + 1) & mask;
+        if (table->entries[j].id == 0) {
+            break;
+        }
+
+        home = id_table_hash (table->entries[j].id) & mask;
+
+        /* Leave the entry if its home lies cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+
+        table->entries[i] = table->entries[j];
+        table->entries[j].id    = 0;
+        table->entries[j].value = NULL;
+        i = j;
+    }
+
+    if (table->size > MIN_SIZE && table->n_entries < table->size / 8) {
+        id_table_resize (table, table->size / 2);
+    }
+}
+
+LmIdTable *
+lm_id_table_new (GDestroyNotify value_destroy)
+{
+    LmIdTable *table;
+
+    table = g_new0 (LmIdTable, 1);
+    table->entries       = g_new0 (IdTableEntry, MIN_SIZE);
+    table->size          = MIN_SIZE;
+    table->value_destroy = value_destroy;
+
+    return table;
+}
+
+void
+lm_id_table_free (LmIdTable *table)
+{
+    guint i;
+
+    g_return_if_fail (table != NULL);
+
+    if (table->value_destroy) {
+        for (i = 0; i < table->size; ++i) {
+            if (table->entries[i].id != 0) {
+                table->value_destroy (table->entries[i].value);
+            }
+        }
+    }
+
+    g_free (table->entries);
+    g_free (table);
+}
+
+void
+lm_id_table_insert (LmIdTable *table, guint64 id, gpointer value)
+{
+    guint i;
+
+    g_return_if_fail (table != NULL);
+    g_return_if_fail (id != 0);
+
+    i = id_table_find (table, id);
+    if (table->entries[i].id == id) {
+        gpointer old_value = table->entries[i].value;
+
+        table->entries[i].value = value;
+        if (table->value_destroy) {
+            table->value_destroy (old_value);
+        }
+        return;
+    }
+
+    table->entries[i].id    = id;
+    table->entries[i].value = value;
+    table->n_entries++;
+
+    /* Keep the load factor below 3/4 */
+    if (table->n_entries * 4 >= table->size * 3) {
+        id_table_resize (table, table->size * 2);
+    }
+}
+
+gpointer
+lm_id_table_lookup (LmIdTable *table, guint64 id)
+{
+    guint i;
+
+    g_return_val_if_fail (table != NULL, NULL);
+
+    if (id == 0) {
+        return NULL;
+    }
+
+    i = id_table_find (table, id);
+
+    return table->entries[i].value;
+}
+
+gpointer
+lm_id_table_steal (LmIdTable *table, guint64 id)
+{
+    gpointer value;
+    guint    i;
+
+    g_return_val_if_fail (table != NULL, NULL);
+
+    if (id == 0) {
+        return NULL;
+    }
+
+    i = id_table_find (table, id);
+    if (table->entries[i].id != id) {
+        return NULL;
+    }
+
+    value = table->entries[i].value;
+    id_table_remove_at (table, i);
+
+    return value;
+}
+
+gboolean
+lm_id_table_remove (LmIdTable *table, guint64 id)
+{
+    gpointer value;
+    guint    i;
+
+    g_return_val_if_fail (table != NULL, FALSE);
+
+    if (id == 0) {
+        return FALSE;
+    }
+
+    i = id_table_find (table, id);
+    if (table->entries[i].id != id) {
+        return FALSE;
+    }
+
+    value = table->entries[i].value;
+    id_table_remove_at (table, i);
+
+    if (table->value_destroy) {
+        table->value_destroy (value);
+    }
+
+    return TRUE;
+}
+
+/* @func must not modify @table */
+void
+lm_id_table_foreach (LmIdTable     *table,
+                     LmIdTableFunc  func,
+                     gpointer       user_data)
+{
+    guint i;
+
+    g_return_if_fail (table != NULL);
+    g_return_if_fail (func != NULL);
+
+    for (i = 0; i < table->size; ++i) {
+        if (table->entries[i].id != 0) {
+            func (table->entries[i].id, table->entries[i].value, user_data);
+        }
+    }
+}
+
+guint
+lm_id_table_size (LmIdTable *table)
+{
+    g_return_val_if_fail (table != NULL, 0);
+
+    return table->n_entries;
+}
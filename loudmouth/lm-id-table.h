@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_ID_TABLE_H__
+#define __LM_ID_TABLE_H__
+
+#include <glib.h>
+
+/* Open addressing hash table mapping non zero 64 bit ids to pointers */
+typedef struct _LmIdTable LmIdTable;
+
+typedef void (* LmIdTableFunc) (guint64  id,
+                                gpointer value,
+                                gpointer user_data);
+
+LmIdTable * lm_id_table_new         (GDestroyNotify  value_destroy);
+void        lm_id_table_free        (LmIdTable      *table);
+void        lm_id_table_insert      (LmIdTable      *table,
+                                     guint64         id,
+                                     gpointer        value);
+gpointer    lm_id_table_lookup      (LmIdTable      *table,
+                                     guint64         id);
+gpointer    lm_id_table_steal       (LmIdTable      *table,
+                                     guint64         id);
+gboolean    lm_id_table_remove      (LmIdTable      *table,
+                                     guint64         id);
+void        lm_id_table_foreach     (LmIdTable      *table,
+                                     LmIdTableFunc   func,
+                                     gpointer        user_data);
+guint       lm_id_table_size        (LmIdTable      *table);
+
+#endif /* __LM_ID_TABLE_H__ */
@@ -28,15 +28,25 @@
 #include <sys/types.h>
 
 #include "lm-connection.h"
+#include "lm-connection-pool.h"
 #include "lm-message.h"
 #include "lm-message-handler.h"
 #include "lm-message-node.h"
 #include "lm-sock.h"
 #include "lm-old-socket.h"
+#include "lm-output-buffer.h"
+#include "lm-resolver-cache.h"
+#include "lm-timer-wheel.h"
 
 #define LM_MIN_PORT 1
 #define LM_MAX_PORT 65536
 
+/* Size of a buffer that fits any id written by _lm_utils_format_id() */
+#define LM_ID_BUF_SIZE 32
+
+/* Number of LmOutputPriority classes, leaving out the default */
+#define LM_OUTPUT_N_PRIORITIES 2
+
 #ifndef G_OS_WIN32
 typedef int LmOldSocketT;
 #else  /* G_OS_WIN32 */
@@ -62,6 +72,24 @@ typedef struct {
 GMainContext *   _lm_connection_get_context       (LmConnection       *conn);
 /* Need to free the return value */
 gchar *          _lm_connection_get_server        (LmConnection       *conn);
+LmTimerWheel *   _lm_connection_get_timer_wheel   (LmConnection       *conn);
+LmResolverCache * _lm_connection_get_resolver_cache (LmConnection     *conn);
+void             _lm_connection_set_pool          (LmConnection       *conn,
+                                                   LmConnectionPool   *pool,
+                                                   LmTimerWheel       *wheel);
+void             _lm_connection_pool_state_changed (LmConnectionPool  *pool,
+                                                    LmConnectionState  old_state,
+                                                    LmConnectionState  new_state);
+LmSSLContext *   _lm_connection_pool_get_ssl_context (LmConnectionPool *pool);
+LmResolverCache * _lm_connection_pool_get_resolver_cache (LmConnectionPool *pool);
+void             _lm_connection_pool_remove       (LmConnectionPool   *pool,
+                                                   LmConnection       *connection,
+                                                   LmConnectionState   state);
+gboolean         _lm_connection_pool_runs_context (LmConnectionPool   *pool,
+                                                   GMainContext       *context);
+LmTimerWheel *   _lm_connection_pool_move         (LmConnectionPool   *pool,
+                                                   LmConnection       *connection,
+                                                   GMainContext       *context);
 gboolean         _lm_old_socket_failed_with_error (LmConnectData         *data,
                                                    int                    error);
 gboolean         _lm_old_socket_failed            (LmConnectData         *data);
@@ -73,6 +101,11 @@ LmCallback *     _lm_utils_new_callback       (gpointer               func,
 void             _lm_utils_free_callback      (LmCallback            *cb);
 
 gchar *          _lm_utils_generate_id        (void);
+guint64          _lm_utils_format_id          (gchar                 *buf);
+void             _lm_utils_print_id           (guint64                value,
+                                               gchar                 *buf);
+gboolean         _lm_utils_parse_id           (const gchar           *id,
+                                               guint64               *value);
 gchar *          
 _lm_utils_hostname_to_punycode                (const gchar           *hostname);
 const gchar *    _lm_message_type_to_string   (LmMessageType          type);
@@ -83,6 +116,9 @@ void
 _lm_message_node_add_child_node               (LmMessageNode         *node,
                                                LmMessageNode         *child);
 LmMessageNode *  _lm_message_node_new         (const gchar           *name);
+void             _lm_message_node_write       (LmMessageNode         *node,
+                                               GString               *str,
+                                               gboolean               open_only);
 void             _lm_debug_init               (void);
 gboolean         _lm_proxy_connect_cb         (GIOChannel            *source,
                                                GIOCondition           condition,
@@ -116,4 +152,9 @@ gchar       *    _lm_sock_get_local_host      (LmOldSocketT              sock);
 
 gboolean         _lm_sock_set_keepalive       (LmOldSocketT              sock,
                                                int                    delay);
+gboolean         _lm_sock_set_cork            (LmOldSocketT              sock,
+                                               gboolean               cork);
+gssize           _lm_sock_writev              (LmOldSocketT              sock,
+                                               const LmOutputVector  *vectors,
+                                               gint                   n_vectors);
 #endif /* __LM_INTERNALS_H__ */
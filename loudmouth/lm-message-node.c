@@ -404,7 +404,7 @@ lm_message_node_ref (LmMessageNode *node)
 {
     g_return_val_if_fail (node != NULL, NULL);
     
-    node->ref_count++;
+    g_atomic_int_inc (&node->ref_count);
        
     return node;
 }
@@ -424,79 +424,145 @@ lm_message_node_unref (LmMessageNode *node)
 {
     g_return_if_fail (node != NULL);
     
-    node->ref_count--;
-    
-    if (node->ref_count == 0) {
+    if (g_atomic_int_dec_and_test (&node->ref_count)) {
         message_node_free (node);
     }
 }
 
-/**
- * lm_message_node_to_string:
- * @node: an #LmMessageNode
- * 
- * Returns an XML string representing the node. This is what is sent over the
- * wire. This is used internally Loudmouth and is external for debugging 
- * purposes.
- * 
- * Return value: an XML string representation of @node
- **/
-gchar *
-lm_message_node_to_string (LmMessageNode *node)
+/* Appends @text to @str escaped the same way g_markup_escape_text() does,
+ * copying runs of plain text in one go */
+static void
+message_node_append_escaped (GString *str, const gchar *text)
+{
+    const guchar *p = (const guchar *) text;
+    const guchar *run = p;
+
+    while (*p) {
+        const gchar *entity = NULL;
+        guint        c = 0;
+        gint         skip = 1;
+
+        switch (*p) {
+        case '&':
+            entity = "&amp;";
+            break;
+        case '<':
+            entity = "&lt;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '\'':
+            entity = "&#39;";
+            break;
+        case '"':
+            entity = "&quot;";
+            break;
+        default:
+            if ((*p >= 0x1 && *p <= 0x8) || *p == 0xb || *p == 0xc ||
+                (*p >= 0xe && *p <= 0x1f) || *p == 0x7f) {
+                c = *p;
+            } else if (*p == 0xc2 && p[1] >= 0x80 && p[1] <= 0x9f && 
+                       p[1] != 0x85) {
+                /* C1 control characters */
+                c = p[1];
+                skip = 2;
+            }
+            break;
+        }
+
+        if (!entity && !c) {
+            p++;
+            continue;
+        }
+
+        g_string_append_len (str, (const gchar *) run, p - run);
+        if (entity) {
+            g_string_append (str, entity);
+        } else {
+            g_string_append_printf (str, "&#x%x;", c);
+        }
+
+        p += skip;
+        run = p;
+    }
+
+    g_string_append_len (str, (const gchar *) run, p - run);
+}
+
+/* Serializes @node to the end of @str. If @open_only is TRUE only the
+ * start tag is written, which is what is sent for the stream element. */
+void
+_lm_message_node_write (LmMessageNode *node, GString *str, gboolean open_only)
 {
-    GString       *ret;
     GSList        *l;
     LmMessageNode *child;
 
-    g_return_val_if_fail (node != NULL, NULL);
-    
     if (node->name == NULL) {
-        return g_strdup ("");
+        return;
     }
-    
-    ret = g_string_new ("<");
-    g_string_append (ret, node->name);
-    
+
+    g_string_append_c (str, '<');
+    g_string_append (str, node->name);
+
     for (l = node->attributes; l; l = l->next) {
         KeyValuePair *kvp = (KeyValuePair *) l->data;
 
-        if (node->raw_mode == FALSE) {
-            gchar *escaped;
+        g_string_append_c (str, ' ');
+        g_string_append (str, kvp->key);
+        g_string_append (str, "=\"");
 
-            escaped = g_markup_escape_text (kvp->value, -1);
-            g_string_append_printf (ret, " %s=\"%s\"", 
-                                    kvp->key, escaped);
-            g_free (escaped);
+        if (node->raw_mode == FALSE) {
+            message_node_append_escaped (str, kvp->value);
         } else {
-            g_string_append_printf (ret, " %s=\"%s\"", 
-                                    kvp->key, kvp->value);
+            g_string_append (str, kvp->value);
         }
-        
+
+        g_string_append_c (str, '"');
     }
-    
-    g_string_append_c (ret, '>');
-    
-    if (node->value) {
-        gchar *tmp;
 
+    g_string_append_c (str, '>');
+
+    if (open_only) {
+        return;
+    }
+
+    if (node->value) {
         if (node->raw_mode == FALSE) {
-            tmp = g_markup_escape_text (node->value, -1);
-            g_string_append (ret,  tmp);
-            g_free (tmp);
+            message_node_append_escaped (str, node->value);
         } else {
-            g_string_append (ret, node->value);
+            g_string_append (str, node->value);
         }
-    } 
+    }
 
     for (child = node->children; child; child = child->next) {
-        gchar *child_str = lm_message_node_to_string (child);
-/*        g_string_append_c (ret, ' '); */
-        g_string_append (ret, child_str);
-        g_free (child_str);
+        _lm_message_node_write (child, str, FALSE);
     }
 
-    /* g_string_append_printf (ret, "</%s>\n", node->name); */
-    g_string_append_printf (ret, "</%s>", node->name);
+    g_string_append (str, "</");
+    g_string_append (str, node->name);
+    g_string_append_c (str, '>');
+}
+
+/**
+ * lm_message_node_to_string:
+ * @node: an #LmMessageNode
+ * 
+ * Returns an XML string representing the node. This is what is sent over the
+ * wire. This is used internally Loudmouth and is external for debugging 
+ * purposes.
+ * 
+ * Return value: an XML string representation of @node
+ **/
+gchar *
+lm_message_node_to_string (LmMessageNode *node)
+{
+    GString *ret;
+
+    g_return_val_if_fail (node != NULL, NULL);
     
+    ret = g_string_sized_new (256);
+    _lm_message_node_write (node, ret, FALSE);
+
     return g_string_free (ret, FALSE);
 }
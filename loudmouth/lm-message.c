@@ -79,6 +79,7 @@ static struct SubTypeNames
 struct LmMessagePriv {
     LmMessageType    type;
     LmMessageSubType sub_type;
+    LmOutputPriority output_priority;
     gint             ref_count;
 };
 
@@ -220,7 +221,7 @@ LmMessage *
 lm_message_new (const gchar *to, LmMessageType type)
 {
     LmMessage *m;
-    gchar     *id;
+    gchar      id[LM_ID_BUF_SIZE];
 
     m       = g_new0 (LmMessage, 1);
     m->priv = g_new0 (LmMessagePriv, 1);
@@ -228,13 +229,13 @@ lm_message_new (const gchar *to, LmMessageType type)
     PRIV(m)->ref_count = 1;
     PRIV(m)->type      = type;
     PRIV(m)->sub_type  = message_sub_type_when_unset (type);
+    PRIV(m)->output_priority = LM_OUTPUT_PRIORITY_DEFAULT;
     
     m->node = _lm_message_node_new (_lm_message_type_to_string (type));
 
     if (type != LM_MESSAGE_TYPE_STREAM) {
-        id = _lm_utils_generate_id ();
+        _lm_utils_format_id (id);
         lm_message_node_set_attribute (m->node, "id", id);
-        g_free (id);
     }
 
     if (to) {
@@ -328,6 +329,39 @@ lm_message_get_node (LmMessage *message)
     return message->node;
 }
 
+/**
+ * lm_message_get_output_priority:
+ * @message: an #LmMessage
+ * 
+ * Fetches the output priority of @message.
+ * 
+ * Return value: the output priority
+ **/
+LmOutputPriority
+lm_message_get_output_priority (LmMessage *message)
+{
+    g_return_val_if_fail (message != NULL, LM_OUTPUT_PRIORITY_DEFAULT);
+
+    return PRIV(message)->output_priority;
+}
+
+/**
+ * lm_message_set_output_priority:
+ * @message: an #LmMessage
+ * @priority: the output priority
+ * 
+ * Sets the priority @message is written with when it is sent. This 
+ * overrides the priority the connection has for the type of @message.
+ **/
+void
+lm_message_set_output_priority (LmMessage        *message,
+                                LmOutputPriority  priority)
+{
+    g_return_if_fail (message != NULL);
+
+    PRIV(message)->output_priority = priority;
+}
+
 /**
  * lm_message_ref:
  * @message: an #LmMessage
@@ -341,7 +375,7 @@ lm_message_ref (LmMessage *message)
 {
     g_return_val_if_fail (message != NULL, NULL);
     
-    PRIV(message)->ref_count++;
+    g_atomic_int_inc (&PRIV(message)->ref_count);
     
     return message;
 }
@@ -358,9 +392,7 @@ lm_message_unref (LmMessage *message)
 {
     g_return_if_fail (message != NULL);
 
-    PRIV(message)->ref_count--;
-    
-    if (PRIV(message)->ref_count == 0) {
+    if (g_atomic_int_dec_and_test (&PRIV(message)->ref_count)) {
         lm_message_node_unref (message->node);
         g_free (message->priv);
         g_free (message);
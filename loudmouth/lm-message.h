@@ -104,6 +104,20 @@ typedef enum {
     LM_MESSAGE_SUB_TYPE_ERROR
 } LmMessageSubType;
 
+/**
+ * LmOutputPriority:
+ * @LM_OUTPUT_PRIORITY_DEFAULT: use the priority the connection has for the message type, see lm_connection_set_output_priority()
+ * @LM_OUTPUT_PRIORITY_BULK: the message is written in the order it was sent
+ * @LM_OUTPUT_PRIORITY_CONTROL: the message is written ahead of bulk output that is still waiting, as soon as the bulk message being written is complete
+ * 
+ * Describes how urgently a message is written to the network. Keepalives and replies that the server waits for should not be stuck behind a large amount of bulk output.
+ */
+typedef enum {
+    LM_OUTPUT_PRIORITY_DEFAULT = -1,
+    LM_OUTPUT_PRIORITY_BULK,
+    LM_OUTPUT_PRIORITY_CONTROL
+} LmOutputPriority;
+
 LmMessage *      lm_message_new               (const gchar      *to,
                                                LmMessageType     type);
 LmMessage *      lm_message_new_with_sub_type (const gchar      *to,
@@ -112,6 +126,9 @@ LmMessage *      lm_message_new_with_sub_type (const gchar      *to,
 LmMessageType    lm_message_get_type          (LmMessage        *message);
 LmMessageSubType lm_message_get_sub_type      (LmMessage        *message);
 LmMessageNode *  lm_message_get_node          (LmMessage        *message);
+LmOutputPriority lm_message_get_output_priority (LmMessage        *message);
+void             lm_message_set_output_priority (LmMessage        *message,
+                                                 LmOutputPriority  priority);
 LmMessage *      lm_message_ref               (LmMessage        *message);
 void             lm_message_unref             (LmMessage        *message);
 
@@ -48,9 +48,45 @@
 #include "lm-ssl-internals.h"
 #include "lm-sock.h"
 #include "lm-old-socket.h"
+#include "lm-output-buffer.h"
+
+#ifdef HAVE_EPOLL
+#include "lm-epoll-source.h"
+#endif
 
 #define IN_BUFFER_SIZE 1024
+/* How large the read buffer may grow unless told otherwise */
+#define IN_BUFFER_MAX_SIZE (256 * 1024)
+/* The read buffer is halved after this many reads in a row that used at
+ * most a quarter of it */
+#define IN_BUFFER_SHRINK_READS 16
+/* A grown read buffer goes back to IN_BUFFER_SIZE once nothing has been
+ * read for this long */
+#define IN_BUFFER_IDLE_MSECS 1000
+/* How much one wakeup may read before yielding unless told otherwise */
+#define READ_BUDGET_BYTES (512 * 1024)
+#define READ_BUDGET_MSECS 10
+#define OUT_BUFFER_SIZE 1024
+/* Serialized output at least this large is queued without copying it */
+#define OUT_BUFFER_TAKE_SIZE 4096
+#define OUT_VECTORS 16
+/* The largest payload of a TLS record. Queued output is gathered into 
+ * records this size and corked output is written once this much is 
+ * pending. */
+#define TLS_RECORD_SIZE 16384
+/* How long the TLS handshake may take before the socket is given up */
+#define HANDSHAKE_TIMEOUT_MSECS (30 * 1000)
 #define SRV_LEN 8192
+/* Written bulk stanza ends are dropped once this many have piled up */
+#define BULK_ENDS_COMPACT 64
+
+typedef struct {
+    GString        *buf;
+    LmOutputBuffer *queue;
+
+    /* Bytes of this class handed to the kernel */
+    guint64         written;
+} OutputClass;
 
 struct _LmOldSocket {
     LmConnection      *connection;
@@ -62,12 +98,25 @@ struct _LmOldSocket {
 
     LmSSL             *ssl;
     gboolean           ssl_started;
+    /* While the TLS handshake runs from watch_handshake the socket has no
+     * other watches and output is only buffered. Its result goes to 
+     * starttls_func, or to connect_func for old style SSL. */
+    gboolean           handshaking;
+    GSource           *watch_handshake;
+    GSource           *watch_handshake_timeout;
+    ConnectResultFunc  starttls_func;
     LmProxy           *proxy;
 
     GIOChannel        *io_channel;
+#ifdef HAVE_EPOLL
+    /* Input, errors, hangups and queued output share one edge triggered
+     * watch on the epoll source of the context */
+    LmEpollWatch      *epoll_watch;
+#else
     GSource           *watch_in;
     GSource           *watch_err;
     GSource           *watch_hup;
+#endif
 
     LmOldSocketT       fd;
 
@@ -75,8 +124,59 @@ struct _LmOldSocket {
 
     gboolean           cancel_open;
     
-    GSource           *watch_out;
-    GString           *out_buf;
+    /* Output is serialized into the buffer of its priority class. What 
+     * the socket doesn't take right away moves to the queue of the class,
+     * the queues are drained once the socket meets watch_out_condition. */
+    gboolean           watch_out;
+    GIOCondition       watch_out_condition;
+#ifndef HAVE_EPOLL
+    GSource           *watch_out_source;
+#endif
+    OutputClass        output[LM_OUTPUT_N_PRIORITIES];
+
+    /* Where the queued bulk stanzas end, counted like the bulk written 
+     * bytes. Control output is only written at these boundaries. */
+    GArray            *bulk_ends;
+    guint              bulk_ends_head;
+
+    /* An SSL write that would block has to be retried with the same data
+     * before anything else is written. ssl_blocked_len is its length, 0 
+     * when no write is blocked, and ssl_blocked_priority its class. */
+    LmOutputPriority   ssl_blocked_priority;
+    gsize              ssl_blocked_len;
+
+    /* Bytes handed to the kernel so far, written_func is called whenever
+     * it has grown */
+    guint64            bytes_written;
+    OutputWrittenFunc  written_func;
+
+    /* While corked, writes are collected and sent from watch_flush, which
+     * runs in the main loop iteration after the sends */
+    gboolean           corked;
+    GSource           *watch_flush;
+
+    /* Between lm_old_socket_detach() and lm_old_socket_attach(), output
+     * is only buffered */
+    gboolean           detached;
+
+    /* Incoming data is read into in_buf. It doubles up to in_buf_max while
+     * reads fill it and shrinks again once the reads stay small. */
+    gchar             *in_buf;
+    gsize              in_buf_size;
+    gsize              in_buf_max;
+    guint              in_small_reads;
+    /* Runs while in_buf is grown, see socket_in_idle_cb() */
+    GSource           *watch_in_idle;
+    gint64             in_last_read;
+
+    /* One wakeup stops reading after read_budget_bytes or read_budget_time
+     * microseconds, whichever comes first; 0 means no limit. Data that is
+     * left inside the SSL layer is picked up from watch_read_more. */
+    gsize              read_budget_bytes;
+    gint64             read_budget_time;
+#ifndef HAVE_EPOLL
+    GSource           *watch_read_more;
+#endif
 
     LmConnectData     *connect_data;
 
@@ -108,16 +208,31 @@ static gboolean     socket_buffered_write_cb       (GIOChannel     *source,
                                                     GIOCondition    condition,
                                                     LmOldSocket    *socket);
 static void         socket_close_io_channel        (GIOChannel     *io_channel);
-static gboolean     old_socket_output_is_buffered  (LmOldSocket    *socket,
-                                                    const gchar    *buffer,
-                                                    gint            len);
-static void         old_socket_setup_output_buffer (LmOldSocket    *socket,
-                                                    const gchar    *buffer,
-                                                    gint            len);
+static void         old_socket_setup_output_buffer (LmOldSocket    *socket);
+static gboolean     old_socket_send_output_buffer  (LmOldSocket    *socket);
+static void         old_socket_remove_output_watch (LmOldSocket    *socket);
+static gboolean     socket_flush_cb                (LmOldSocket    *socket);
+static gboolean     socket_handshake_timeout_cb    (LmOldSocket    *socket);
+static gboolean     socket_in_idle_cb              (LmOldSocket    *socket);
+static gboolean     socket_handshake_cb            (GIOChannel     *source,
+                                                    GIOCondition    condition,
+                                                    LmOldSocket    *socket);
+static gboolean     old_socket_add_watches         (LmOldSocket    *socket);
+static void         old_socket_remove_watches      (LmOldSocket    *socket);
+static void         old_socket_resume              (LmOldSocket    *socket);
+#ifdef HAVE_EPOLL
+static void         socket_epoll_event             (LmEpollWatch   *watch,
+                                                    GIOCondition    condition,
+                                                    LmOldSocket    *socket);
+#else
+static gboolean     socket_read_more_cb            (LmOldSocket    *socket);
+#endif
 
 static void
 socket_free (LmOldSocket *socket)
 {
+    gint i;
+
     g_free (socket->server);
     g_free (socket->domain);
 
@@ -129,9 +244,12 @@ socket_free (LmOldSocket *socket)
         lm_proxy_unref (socket->proxy);
     }
     
-    if (socket->out_buf) {
-        g_string_free (socket->out_buf, TRUE);
+    for (i = 0; i < LM_OUTPUT_N_PRIORITIES; i++) {
+        g_string_free (socket->output[i].buf, TRUE);
+        lm_output_buffer_free (socket->output[i].queue);
     }
+    g_array_free (socket->bulk_ends, TRUE);
+    g_free (socket->in_buf);
 
     if (socket->resolver) {
         g_object_unref (socket->resolver);
@@ -140,53 +258,468 @@ socket_free (LmOldSocket *socket)
     g_free (socket);
 }
 
+/* Whether output goes to the socket as it is, which is also the case once
+ * the kernel took over the encryption */
+static gboolean
+old_socket_writes_plain (LmOldSocket *socket)
+{
+    return !socket->ssl_started || _lm_ssl_get_ktls_send (socket->ssl);
+}
+
+/* Writes @len bytes of @priority output through SSL, remembering a write
+ * that would block so that old_socket_write_queue() retries it first */
 static gint
-old_socket_do_write (LmOldSocket *socket, const gchar *buf, guint len)
+old_socket_ssl_send (LmOldSocket      *socket,
+                     LmOutputPriority  priority,
+                     const gchar      *buf,
+                     gsize             len)
 {
     gint b_written;
 
-    if (socket->ssl_started) {
-        b_written = _lm_ssl_send (socket->ssl, buf, len);
+    b_written = _lm_ssl_send (socket->ssl, buf, len);
+    if (b_written == 0) {
+        socket->ssl_blocked_priority = priority;
+        socket->ssl_blocked_len      = len;
     } else {
-        GIOStatus io_status = G_IO_STATUS_AGAIN;
-        gsize     bytes_written;
-
-        while (io_status == G_IO_STATUS_AGAIN) {
-            io_status = g_io_channel_write_chars (socket->io_channel, 
-                                                  buf, len, 
-                                                  &bytes_written,
-                                                  NULL);
+        socket->ssl_blocked_len = 0;
+    }
+
+    return b_written;
+}
+
+static gint
+old_socket_do_write (LmOldSocket      *socket, 
+                     LmOutputPriority  priority,
+                     const gchar      *buf, 
+                     guint             len)
+{
+    LmOutputVector vector;
+
+    if (!old_socket_writes_plain (socket)) {
+        /* Output that would block is queued and retried from there a
+         * record at a time */
+        return old_socket_ssl_send (socket, priority, buf, 
+                                    MIN (len, TLS_RECORD_SIZE));
+    } 
+
+    vector.iov_base = (gchar *) buf;
+    vector.iov_len  = len;
+
+    return _lm_sock_writev (socket->fd, &vector, 1);
+}
+
+static void
+old_socket_notify_written (LmOldSocket *socket, guint64 bytes_written)
+{
+    if (socket->written_func && socket->bytes_written != bytes_written) {
+        (socket->written_func) (socket, socket->user_data);
+    }
+}
+
+/* Writes up to @limit bytes from the queue of @priority. Plain and kernel 
+ * TLS sockets get it in one writev() per OUT_VECTORS chunks, for SSL it is
+ * gathered into full records. Returns the number of bytes written or -1 
+ * if the write failed. */
+static gssize
+old_socket_write_class (LmOldSocket      *socket, 
+                        LmOutputPriority  priority, 
+                        gsize             limit)
+{
+    OutputClass *output = &socket->output[priority];
+    gssize       total = 0;
+
+    while (limit > 0 && lm_output_buffer_get_size (output->queue) > 0) {
+        gssize b_written;
+        gsize  len;
+
+        if (!old_socket_writes_plain (socket)) {
+            gchar buf[TLS_RECORD_SIZE];
+
+            len = lm_output_buffer_gather (output->queue, buf, 
+                                           MIN (sizeof (buf), limit));
+            b_written = old_socket_ssl_send (socket, priority, buf, len);
+        } else {
+            LmOutputVector vectors[OUT_VECTORS];
+            gint           n_vectors, i;
+
+            n_vectors = lm_output_buffer_get_vectors (output->queue, vectors, 
+                                                      OUT_VECTORS);
+            for (len = 0, i = 0; i < n_vectors; ++i) {
+                if (vectors[i].iov_len >= limit - len) {
+                    vectors[i].iov_len = limit - len;
+                    n_vectors = i + 1;
+                }
+                len += vectors[i].iov_len;
+            }
+
+            b_written = _lm_sock_writev (socket->fd, vectors, n_vectors);
         }
 
-        b_written = bytes_written;
+        if (b_written < 0) {
+            return -1;
+        }
 
-        if (io_status != G_IO_STATUS_NORMAL) {
-            b_written = -1;
+        lm_output_buffer_consume (output->queue, b_written);
+        output->written += b_written;
+        socket->bytes_written += b_written;
+        limit -= b_written;
+        total += b_written;
+
+        if ((gsize) b_written < len) {
+            break;
         }
     }
 
-    return b_written;
+    return total;
+}
+
+/* Returns where the bulk stanza that is being written ends. This is the 
+ * number of bulk bytes written so far when at a stanza boundary. */
+static guint64
+old_socket_get_bulk_end (LmOldSocket *socket)
+{
+    GArray  *ends    = socket->bulk_ends;
+    guint64  written = socket->output[LM_OUTPUT_PRIORITY_BULK].written;
+
+    while (socket->bulk_ends_head < ends->len &&
+           g_array_index (ends, guint64, socket->bulk_ends_head) < written) {
+        socket->bulk_ends_head++;
+    }
+
+    if (socket->bulk_ends_head == ends->len) {
+        g_array_set_size (ends, 0);
+        socket->bulk_ends_head = 0;
+        return written;
+    }
+
+    if (socket->bulk_ends_head >= BULK_ENDS_COMPACT &&
+        socket->bulk_ends_head * 2 >= ends->len) {
+        g_array_remove_range (ends, 0, socket->bulk_ends_head);
+        socket->bulk_ends_head = 0;
+    }
+
+    return g_array_index (ends, guint64, socket->bulk_ends_head);
+}
+
+/* Writes as much of the queued output as the socket takes. Control output
+ * goes first but never cuts into a bulk stanza that has been partially 
+ * written. Returns FALSE if the write failed. */
+static gboolean
+old_socket_write_queue (LmOldSocket *socket)
+{
+    LmOutputBuffer *control = socket->output[LM_OUTPUT_PRIORITY_CONTROL].queue;
+    LmOutputBuffer *bulk    = socket->output[LM_OUTPUT_PRIORITY_BULK].queue;
+
+    while (TRUE) {
+        LmOutputPriority priority;
+        guint64          bulk_end;
+        guint64          bulk_written;
+        gsize            len;
+        gssize           b_written;
+
+        bulk_end     = old_socket_get_bulk_end (socket);
+        bulk_written = socket->output[LM_OUTPUT_PRIORITY_BULK].written;
+
+        if (socket->ssl_blocked_len > 0) {
+            /* Retry the blocked SSL write as it was, control output can
+             * only go ahead once it is through */
+            priority = socket->ssl_blocked_priority;
+            len      = socket->ssl_blocked_len;
+        }
+        else if (lm_output_buffer_get_size (control) > 0 && bulk_end == bulk_written) {
+            priority = LM_OUTPUT_PRIORITY_CONTROL;
+            len      = lm_output_buffer_get_size (control);
+        }
+        else if (lm_output_buffer_get_size (bulk) > 0) {
+            priority = LM_OUTPUT_PRIORITY_BULK;
+            len      = lm_output_buffer_get_size (bulk);
+
+            /* Stop at the end of the stanza if control output is waiting */
+            if (lm_output_buffer_get_size (control) > 0) {
+                len = MIN (len, bulk_end - bulk_written);
+            }
+        } else {
+            break;
+        }
+
+        b_written = old_socket_write_class (socket, priority, len);
+        if (b_written < 0) {
+            return FALSE;
+        }
+
+        if ((gsize) b_written < len) {
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Moves the buffer of @priority, except for the first @offset bytes which
+ * have been written already, to the end of its queue. @offset is only 
+ * used when the queue is empty. */
+static void
+old_socket_queue_output (LmOldSocket      *socket, 
+                         LmOutputPriority  priority,
+                         gsize             offset)
+{
+    OutputClass *output  = &socket->output[priority];
+    GString     *out_buf = output->buf;
+
+    if (out_buf->len == offset) {
+        g_string_truncate (out_buf, 0);
+        return;
+    }
+
+    if (out_buf->len >= OUT_BUFFER_TAKE_SIZE) {
+        GBytes *bytes;
+        gsize   len = out_buf->len;
+
+        bytes = g_bytes_new_take (g_string_free (out_buf, FALSE), len);
+        lm_output_buffer_append_bytes (output->queue, bytes);
+        lm_output_buffer_consume (output->queue, offset);
+        g_bytes_unref (bytes);
+
+        output->buf = g_string_sized_new (OUT_BUFFER_SIZE);
+    } else {
+        lm_output_buffer_append (output->queue, 
+                                 out_buf->str + offset, 
+                                 out_buf->len - offset);
+        g_string_truncate (out_buf, 0);
+    }
+}
+
+static gsize
+old_socket_get_class_pending (LmOldSocket *socket, LmOutputPriority priority)
+{
+    OutputClass *output = &socket->output[priority];
+
+    return output->buf->len + lm_output_buffer_get_size (output->queue);
+}
+
+static gsize
+old_socket_get_pending (LmOldSocket *socket)
+{
+    return old_socket_get_class_pending (socket, LM_OUTPUT_PRIORITY_CONTROL) +
+        old_socket_get_class_pending (socket, LM_OUTPUT_PRIORITY_BULK);
+}
+
+/* Records that a bulk stanza ends after the output pending so far */
+static void
+old_socket_add_bulk_end (LmOldSocket *socket)
+{
+    GArray  *ends = socket->bulk_ends;
+    guint64  end;
+
+    end = socket->output[LM_OUTPUT_PRIORITY_BULK].written +
+        old_socket_get_class_pending (socket, LM_OUTPUT_PRIORITY_BULK);
+
+    if (ends->len > socket->bulk_ends_head && 
+        g_array_index (ends, guint64, ends->len - 1) == end) {
+        return;
+    }
+
+    g_array_append_val (ends, end);
 }
 
 gint
 lm_old_socket_write (LmOldSocket *socket, const gchar *buf, gint len)
 {
-    gint b_written;
+    g_string_append_len (socket->output[LM_OUTPUT_PRIORITY_BULK].buf, buf, len);
+    old_socket_add_bulk_end (socket);
+
+    if (!old_socket_send_output_buffer (socket)) {
+        return -1;
+    }
+
+    return len;
+}
+
+/* Returns the buffer that lm_old_socket_write_output_buffer() sends from
+ * for @priority. Callers serialize straight into it instead of building 
+ * their own string. */
+GString *
+lm_old_socket_get_output_buffer (LmOldSocket      *socket, 
+                                 LmOutputPriority  priority)
+{
+    g_return_val_if_fail (socket != NULL, NULL);
+    g_return_val_if_fail (priority >= 0 && priority < LM_OUTPUT_N_PRIORITIES, NULL);
+
+    return socket->output[priority].buf;
+}
 
-    if (old_socket_output_is_buffered (socket, buf, len)) {
-        return len;
+/* Writes out what has been appended to the output buffer of @priority, 
+ * which has to be one or more complete stanzas. Whatever can't be written
+ * right away is queued until the socket is writable, control output is 
+ * written ahead of queued bulk output at the next stanza boundary.
+ * A corked socket defers the write to an idle source, which runs in a
+ * later main loop iteration, unless enough data is pending. Returns FALSE
+ * if the write failed. */
+gboolean
+lm_old_socket_write_output_buffer (LmOldSocket      *socket, 
+                                   LmOutputPriority  priority)
+{
+    g_return_val_if_fail (socket != NULL, FALSE);
+
+    if (priority == LM_OUTPUT_PRIORITY_BULK) {
+        old_socket_add_bulk_end (socket);
     }
 
-    b_written = old_socket_do_write (socket, buf, len);
+    if (socket->corked && old_socket_get_pending (socket) < TLS_RECORD_SIZE) {
+        if (!socket->watch_flush && !socket->watch_out && 
+            !socket->detached && !socket->handshaking) {
+            socket->watch_flush = lm_misc_add_idle (socket->context,
+                                                    (GSourceFunc) socket_flush_cb,
+                                                    socket);
+            /* Idle sources added while dispatching only run in the next 
+             * iteration, flush ahead of other idle work there */
+            g_source_set_priority (socket->watch_flush, G_PRIORITY_DEFAULT);
+        }
 
-    if (b_written < len && b_written != -1) {
-        old_socket_setup_output_buffer (socket,
-                                        buf + b_written,
-                                        len - b_written);
-        return len;
+        return TRUE;
+    }
+
+    return old_socket_send_output_buffer (socket);
+}
+
+/* Queues @bytes behind the pending bulk output without copying them and 
+ * writes like lm_old_socket_write_output_buffer() */
+gboolean
+lm_old_socket_write_bytes (LmOldSocket *socket, GBytes *bytes)
+{
+    g_return_val_if_fail (bytes != NULL, FALSE);
+
+    return lm_old_socket_write_bytesv (socket, &bytes, 1);
+}
+
+gboolean
+lm_old_socket_write_bytesv (LmOldSocket  *socket, 
+                            GBytes      **bytes, 
+                            guint         n_bytes)
+{
+    guint i;
+
+    g_return_val_if_fail (socket != NULL, FALSE);
+    g_return_val_if_fail (bytes != NULL || n_bytes == 0, FALSE);
+
+    old_socket_queue_output (socket, LM_OUTPUT_PRIORITY_BULK, 0);
+
+    for (i = 0; i < n_bytes; i++) {
+        lm_output_buffer_append_bytes (socket->output[LM_OUTPUT_PRIORITY_BULK].queue, 
+                                       bytes[i]);
+    }
+
+    return lm_old_socket_write_output_buffer (socket, LM_OUTPUT_PRIORITY_BULK);
+}
+
+/* Pushes out the last partial frame once a corked burst has been sent */
+static void
+old_socket_push_corked (LmOldSocket *socket)
+{
+    if (socket->corked) {
+        _lm_sock_set_cork (socket->fd, FALSE);
+        _lm_sock_set_cork (socket->fd, TRUE);
+    }
+}
+
+static gboolean
+old_socket_send_output_buffer (LmOldSocket *socket)
+{
+    OutputClass *control = &socket->output[LM_OUTPUT_PRIORITY_CONTROL];
+    OutputClass *bulk    = &socket->output[LM_OUTPUT_PRIORITY_BULK];
+    guint64      bytes_written = socket->bytes_written;
+
+    if (socket->watch_out || socket->handshaking) {
+        /* Sent from socket_buffered_write_cb() or once the handshake is
+         * done */
+        old_socket_queue_output (socket, LM_OUTPUT_PRIORITY_CONTROL, 0);
+        old_socket_queue_output (socket, LM_OUTPUT_PRIORITY_BULK, 0);
+        return TRUE;
+    }
+
+    if (lm_output_buffer_get_size (control->queue) == 0 &&
+        lm_output_buffer_get_size (bulk->queue) == 0 &&
+        (control->buf->len == 0 || bulk->buf->len == 0)) {
+        LmOutputPriority  priority;
+        OutputClass      *output;
+        gint              b_written;
+
+        priority = control->buf->len > 0 ? 
+            LM_OUTPUT_PRIORITY_CONTROL : LM_OUTPUT_PRIORITY_BULK;
+        output = &socket->output[priority];
+
+        if (output->buf->len == 0) {
+            return TRUE;
+        }
+
+        /* Nothing queued, write straight from the buffer */
+        b_written = old_socket_do_write (socket, priority, 
+                                         output->buf->str, 
+                                         output->buf->len);
+        if (b_written < 0) {
+            g_string_truncate (output->buf, 0);
+            return FALSE;
+        }
+
+        output->written += b_written;
+        socket->bytes_written += b_written;
+        old_socket_queue_output (socket, priority, b_written);
+    } else {
+        old_socket_queue_output (socket, LM_OUTPUT_PRIORITY_CONTROL, 0);
+        old_socket_queue_output (socket, LM_OUTPUT_PRIORITY_BULK, 0);
+
+        if (!old_socket_write_queue (socket)) {
+            return FALSE;
+        }
+    }
+
+    if (old_socket_get_pending (socket) > 0) {
+        old_socket_setup_output_buffer (socket);
+    } else {
+        old_socket_push_corked (socket);
+    }
+
+    old_socket_notify_written (socket, bytes_written);
+
+    return TRUE;
+}
+
+static gboolean
+socket_flush_cb (LmOldSocket *socket)
+{
+    socket->watch_flush = NULL;
+
+    if (!old_socket_send_output_buffer (socket)) {
+        (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR, 
+                               socket->user_data);
+        return FALSE;
+    }
+
+    return FALSE;
+}
+
+/* Sets whether writes are coalesced until the end of the current main
+ * loop iteration, see lm_old_socket_write_output_buffer() */
+void
+lm_old_socket_set_corked (LmOldSocket *socket, gboolean corked)
+{
+    g_return_if_fail (socket != NULL);
+
+    socket->corked = corked;
+
+    if (socket->fd != -1) {
+        _lm_sock_set_cork (socket->fd, corked);
+    }
+
+    if (!corked && socket->watch_flush) {
+        g_source_destroy (socket->watch_flush);
+        socket->watch_flush = NULL;
+
+        if (!old_socket_send_output_buffer (socket)) {
+            (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR, 
+                                   socket->user_data);
+        }
     }
-        
-    return b_written;
 }
 
 static gboolean
@@ -239,47 +772,213 @@ socket_read_incoming (LmOldSocket *socket,
     return TRUE;
 }
 
+/* Grows the read buffer when a read filled it and shrinks it after a run
+ * of small reads. The contents have been consumed already. */
+static void
+old_socket_adapt_in_buf (LmOldSocket *socket, gsize bytes_read)
+{
+    gsize size = socket->in_buf_size;
+
+    if (bytes_read == size - 1 && size < socket->in_buf_max) {
+        size = MIN (size * 2, socket->in_buf_max);
+    }
+    else if (bytes_read <= size / 4 && size > IN_BUFFER_SIZE) {
+        if (++socket->in_small_reads < IN_BUFFER_SHRINK_READS) {
+            return;
+        }
+
+        size = MAX (size / 2, IN_BUFFER_SIZE);
+    }
+
+    socket->in_small_reads = 0;
+
+    if (size != socket->in_buf_size) {
+        g_free (socket->in_buf);
+        socket->in_buf      = g_malloc (size);
+        socket->in_buf_size = size;
+    }
+}
+
+static void
+old_socket_add_in_idle_watch (LmOldSocket *socket, guint msecs)
+{
+    socket->watch_in_idle = lm_misc_add_timeout (socket->context, msecs,
+                                                 (GSourceFunc) socket_in_idle_cb,
+                                                 socket);
+}
+
+/* Drops a grown read buffer once the peer has gone quiet, so idle 
+ * connections don't hold on to what a burst made them allocate */
+static gboolean
+socket_in_idle_cb (LmOldSocket *socket)
+{
+    gint64 idle;
+
+    socket->watch_in_idle = NULL;
+
+    idle = (g_get_monotonic_time () - socket->in_last_read) / 
+        G_TIME_SPAN_MILLISECOND;
+    if (idle < IN_BUFFER_IDLE_MSECS) {
+        old_socket_add_in_idle_watch (socket, IN_BUFFER_IDLE_MSECS - idle);
+        return FALSE;
+    }
+
+    g_free (socket->in_buf);
+    socket->in_buf         = g_malloc (IN_BUFFER_SIZE);
+    socket->in_buf_size    = IN_BUFFER_SIZE;
+    socket->in_small_reads = 0;
+
+    return FALSE;
+}
+
 static gboolean
 socket_in_event (GIOChannel   *source,
                  GIOCondition  condition,
                  LmOldSocket     *socket)
 {
-    gchar    buf[IN_BUFFER_SIZE];
     gsize    bytes_read = 0;
+    gsize    total_read = 0;
+    gint64   deadline = 0;
     gboolean read_anything = FALSE;
+    gboolean yielded = FALSE;
     gboolean hangup = 0;
     gint     reason = 0;
+    gboolean result = TRUE;
 
     if (!socket->io_channel) {
         return FALSE;
     }
 
-    while (socket_read_incoming (socket, buf, IN_BUFFER_SIZE, 
+    lm_old_socket_ref (socket);
+
+    if (socket->read_budget_time > 0) {
+        deadline = g_get_monotonic_time () + socket->read_budget_time;
+    }
+
+    /* A handshake started by the data_func owns the socket */
+    while (socket->io_channel && !socket->handshaking &&
+           socket_read_incoming (socket, socket->in_buf, socket->in_buf_size,
                                  &bytes_read, &hangup, &reason)) {
         
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\nRECV [%d]:\n", 
                (int)bytes_read);
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
                "-----------------------------------\n");
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "'%s'\n", buf);
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "'%s'\n", socket->in_buf);
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
                "-----------------------------------\n");
         
         lm_verbose ("Read: %d chars\n", (int)bytes_read);
 
-        (socket->data_func) (socket, buf, socket->user_data);
+        (socket->data_func) (socket, socket->in_buf, bytes_read, 
+                             socket->user_data);
+
+        old_socket_adapt_in_buf (socket, bytes_read);
 
         read_anything = TRUE;
+        total_read += bytes_read;
+
+        /* Leave the rest for the next iteration so other sources on the
+         * context get to run */
+        if ((socket->read_budget_bytes > 0 && 
+             total_read >= socket->read_budget_bytes) ||
+            (deadline > 0 && g_get_monotonic_time () >= deadline)) {
+            yielded = TRUE;
+            break;
+        }
+    }
+
+    /* Rather than rearming a timer on every wakeup, the timer checks the
+     * time of the last read when it fires */
+    if (read_anything && socket->io_channel && 
+        socket->in_buf_size > IN_BUFFER_SIZE) {
+        socket->in_last_read = g_get_monotonic_time ();
+
+        if (!socket->watch_in_idle) {
+            old_socket_add_in_idle_watch (socket, IN_BUFFER_IDLE_MSECS);
+        }
+    }
+
+#ifdef HAVE_EPOLL
+    /* The edge triggered watch reports nothing new for data that is 
+     * already waiting, nor for the end of stream behind it */
+    if (socket->epoll_watch && (yielded || (hangup && read_anything))) {
+        lm_epoll_watch_set_ready (socket->epoll_watch, G_IO_IN);
+    }
+#else
+    /* The watch fires again for data still in the kernel, but not for
+     * records SSL has already taken off the socket */
+    if (yielded && socket->io_channel && socket->ssl_started &&
+        !socket->watch_read_more && _lm_ssl_get_pending (socket->ssl)) {
+        socket->watch_read_more = lm_misc_add_idle (socket->context,
+                                                    (GSourceFunc) socket_read_more_cb,
+                                                    socket);
+        g_source_set_priority (socket->watch_read_more, G_PRIORITY_DEFAULT);
+    }
+#endif
+
+    /* An SSL write that was waiting for the peer can continue now */
+    if (socket->watch_out && socket->watch_out_condition == G_IO_IN) {
+        socket_buffered_write_cb (NULL, G_IO_IN, socket);
     }
 
     /* If we have read something, delay the hangup so that the data can be
      * processed. */
     if (hangup && !read_anything) {
         (socket->closed_func) (socket, reason, socket->user_data);
-        return FALSE;
+        result = FALSE;
     }
 
-    return TRUE;
+    lm_old_socket_unref (socket);
+
+    return result;
+}
+
+#ifndef HAVE_EPOLL
+static gboolean
+socket_read_more_cb (LmOldSocket *socket)
+{
+    socket->watch_read_more = NULL;
+
+    socket_in_event (NULL, G_IO_IN, socket);
+
+    return FALSE;
+}
+#endif
+
+gsize
+lm_old_socket_get_read_size (LmOldSocket *socket)
+{
+    g_return_val_if_fail (socket != NULL, 0);
+
+    return socket->in_buf_size;
+}
+
+/* Limits how much one wakeup reads before giving other sources a turn */
+void
+lm_old_socket_set_read_budget (LmOldSocket *socket, 
+                               gsize        bytes,
+                               guint        msecs)
+{
+    g_return_if_fail (socket != NULL);
+
+    socket->read_budget_bytes = bytes;
+    socket->read_budget_time  = (gint64) msecs * G_TIME_SPAN_MILLISECOND;
+}
+
+/* Sets how large the read buffer may grow while the peer keeps sending */
+void
+lm_old_socket_set_max_read_size (LmOldSocket *socket, gsize size)
+{
+    g_return_if_fail (socket != NULL);
+
+    socket->in_buf_max = MAX (size, IN_BUFFER_SIZE);
+
+    if (socket->in_buf_size > socket->in_buf_max) {
+        g_free (socket->in_buf);
+        socket->in_buf      = g_malloc (socket->in_buf_max);
+        socket->in_buf_size = socket->in_buf_max;
+    }
 }
     
 static gboolean
@@ -294,30 +993,133 @@ socket_hup_event (GIOChannel   *source,
         return FALSE;
     }
 
-    (socket->closed_func) (socket, LM_DISCONNECT_REASON_HUP, 
-                           socket->user_data);
-    
-    return TRUE;
+    (socket->closed_func) (socket, LM_DISCONNECT_REASON_HUP, 
+                           socket->user_data);
+    
+    return TRUE;
+}
+
+static gboolean
+socket_error_event (GIOChannel   *source,
+                    GIOCondition  condition,
+                    LmOldSocket     *socket)
+{
+    lm_verbose ("ERROR event: %d->'%s'\n", 
+                condition, lm_misc_io_condition_to_str (condition));
+
+    if (!socket->io_channel) {
+        return FALSE;
+    }
+
+    (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR, 
+                           socket->user_data);
+    
+    return TRUE;
+}
+
+/* Ends the handshake and hands its result to starttls_func or
+ * connect_func */
+static void
+old_socket_handshake_done (LmOldSocket *socket, gboolean result)
+{
+    ConnectResultFunc func;
+
+    socket->handshaking = FALSE;
+
+    if (socket->watch_handshake_timeout) {
+        g_source_destroy (socket->watch_handshake_timeout);
+        socket->watch_handshake_timeout = NULL;
+    }
+
+    func = socket->starttls_func ? socket->starttls_func : socket->connect_func;
+    socket->starttls_func = NULL;
+
+    if (result) {
+        lm_verbose ("SSL handshake done\n");
+        socket->ssl_started = TRUE;
+
+        if (old_socket_add_watches (socket)) {
+            old_socket_resume (socket);
+        } else {
+            result = FALSE;
+        }
+    } else {
+        lm_verbose ("SSL handshake failed\n");
+
+        _lm_sock_shutdown (socket->fd);
+        _lm_sock_close (socket->fd);
+    }
+
+    if (func) {
+        (func) (socket, result, socket->user_data);
+    }
+}
+
+/* Takes the handshake one step further each time the socket meets what
+ * SSL is waiting for */
+static void
+old_socket_continue_handshake (LmOldSocket *socket)
+{
+    GError    *error = NULL;
+    GIOStatus  status;
+
+    status = _lm_ssl_handshake (socket->ssl, &error);
+    if (status == G_IO_STATUS_AGAIN) {
+        socket->watch_handshake =
+            lm_misc_add_io_watch (socket->context,
+                                  socket->io_channel,
+                                  _lm_ssl_get_send_condition (socket->ssl) | 
+                                  G_IO_ERR | G_IO_HUP,
+                                  (GIOFunc) socket_handshake_cb,
+                                  socket);
+        return;
+    }
+
+    if (error) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+               "%s\n", error->message);
+        g_error_free (error);
+    }
+
+    old_socket_handshake_done (socket, status == G_IO_STATUS_NORMAL);
+}
+
+/* Gives up on a server that doesn't finish the handshake */
+static gboolean
+socket_handshake_timeout_cb (LmOldSocket *socket)
+{
+    socket->watch_handshake_timeout = NULL;
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "SSL handshake timed out\n");
+
+    if (socket->watch_handshake) {
+        g_source_destroy (socket->watch_handshake);
+        socket->watch_handshake = NULL;
+    }
+
+    lm_old_socket_ref (socket);
+    old_socket_handshake_done (socket, FALSE);
+    lm_old_socket_unref (socket);
+
+    return FALSE;
 }
 
 static gboolean
-socket_error_event (GIOChannel   *source,
-                    GIOCondition  condition,
-                    LmOldSocket     *socket)
+socket_handshake_cb (GIOChannel   *source,
+                     GIOCondition  condition,
+                     LmOldSocket  *socket)
 {
-    lm_verbose ("ERROR event: %d->'%s'\n", 
-                condition, lm_misc_io_condition_to_str (condition));
+    socket->watch_handshake = NULL;
 
-    if (!socket->io_channel) {
-        return FALSE;
-    }
+    lm_old_socket_ref (socket);
+    old_socket_continue_handshake (socket);
+    lm_old_socket_unref (socket);
 
-    (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR, 
-                           socket->user_data);
-    
-    return TRUE;
+    return FALSE;
 }
 
+/* Sets up SSL and starts the handshake, which adds the watches of the
+ * socket once it is done. Returns FALSE if SSL could not be set up. */
 static gboolean
 _lm_old_socket_ssl_init (LmOldSocket *socket, gboolean delayed)
 {
@@ -328,11 +1130,6 @@ _lm_old_socket_ssl_init (LmOldSocket *socket, gboolean delayed)
 
     _lm_ssl_initialize (socket->ssl);
 
-#ifdef HAVE_GNUTLS
-    /* GNU TLS requires the socket to be blocking */
-    _lm_sock_set_blocking (socket->fd, TRUE);
-#endif
-
     /* If we're using StartTLS, the correct thing is to verify against
      * the domain. If we're using old SSL, we should verify against the
      * hostname. */
@@ -341,7 +1138,8 @@ _lm_old_socket_ssl_init (LmOldSocket *socket, gboolean delayed)
     else
         ssl_verify_domain = socket->server;
     
-    if (!_lm_ssl_begin (socket->ssl, socket->fd, ssl_verify_domain, &error)) {
+    if (!_lm_ssl_begin (socket->ssl, socket->fd, ssl_verify_domain, 
+                        socket->port, &error)) {
         lm_verbose ("Could not begin SSL\n");
 
         if (error) {
@@ -353,31 +1151,241 @@ _lm_old_socket_ssl_init (LmOldSocket *socket, gboolean delayed)
         _lm_sock_shutdown (socket->fd);
         _lm_sock_close (socket->fd);
 
-        if (!delayed && socket->connect_func) {
-            (socket->connect_func) (socket, FALSE, socket->user_data);
-        }
+        return FALSE;
+    }
+
+    socket->handshaking = TRUE;
+
+    /* The client speaks first */
+    socket->watch_handshake =
+        lm_misc_add_io_watch (socket->context,
+                              socket->io_channel,
+                              G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                              (GIOFunc) socket_handshake_cb,
+                              socket);
+
+    socket->watch_handshake_timeout =
+        lm_misc_add_timeout (socket->context,
+                             HANDSHAKE_TIMEOUT_MSECS,
+                             (GSourceFunc) socket_handshake_timeout_cb,
+                             socket);
+
+    return TRUE;
+}
+
+/* Starts TLS on the connected socket. @func is called from the main loop
+ * with the result of the handshake, output written in the meantime is 
+ * sent once it succeeded. Returns FALSE without calling @func if TLS
+ * could not be set up, or if plain output is still pending since the
+ * server expects nothing but the handshake after <proceed/>. */
+gboolean
+lm_old_socket_starttls (LmOldSocket *socket, ConnectResultFunc func)
+{
+    g_return_val_if_fail (lm_ssl_get_use_starttls (socket->ssl) == TRUE, FALSE);
+    g_return_val_if_fail (func != NULL, FALSE);
+
+    if (old_socket_get_pending (socket) > 0) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+               "Output pending when starting TLS\n");
+        return FALSE;
+    }
+
+    /* The handshake reads and writes the socket itself */
+    old_socket_remove_watches (socket);
+    old_socket_remove_output_watch (socket);
+
+    if (!_lm_old_socket_ssl_init (socket, TRUE)) {
+        return FALSE;
+    }
+
+    socket->starttls_func = func;
+
+    return TRUE;
+}
+
+/* Watches the connected socket for input, errors and hangups */
+static gboolean
+old_socket_add_watches (LmOldSocket *socket)
+{
+#ifdef HAVE_EPOLL
+    socket->epoll_watch = lm_epoll_watch_new (socket->context,
+                                              socket->fd,
+                                              G_IO_IN,
+                                              (LmEpollFunc) socket_epoll_event,
+                                              socket);
+    if (!socket->epoll_watch) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
+               "Could not add the socket to the epoll source\n");
+        return FALSE;
+    }
+#else
+    socket->watch_in = 
+        lm_misc_add_io_watch (socket->context,
+                              socket->io_channel,
+                              G_IO_IN,
+                              (GIOFunc) socket_in_event,
+                              socket);
+
+    /* FIXME: if we add these, we don't get ANY
+     * response from the server, this is to do with the way that
+     * windows handles watches, see bug #331214.
+     */
+#ifndef G_OS_WIN32
+    socket->watch_err = 
+        lm_misc_add_io_watch (socket->context,
+                              socket->io_channel,
+                              G_IO_ERR,
+                              (GIOFunc) socket_error_event,
+                              socket);
         
+    socket->watch_hup =
+        lm_misc_add_io_watch (socket->context,
+                              socket->io_channel,
+                              G_IO_HUP,
+                              (GIOFunc) socket_hup_event,
+                              socket);
+#endif
+#endif /* HAVE_EPOLL */
+
+    return TRUE;
+}
+
+/* Removes all sources of the connected socket but the output watch */
+static void
+old_socket_remove_watches (LmOldSocket *socket)
+{
+#ifdef HAVE_EPOLL
+    if (socket->epoll_watch) {
+        lm_epoll_watch_free (socket->epoll_watch);
+        socket->epoll_watch = NULL;
+    }
+#else
+    if (socket->watch_in) {
+        g_source_destroy (socket->watch_in);
+        socket->watch_in = NULL;
+    }
+
+    if (socket->watch_err) {
+        g_source_destroy (socket->watch_err);
+        socket->watch_err = NULL;
+    }
+
+    if (socket->watch_hup) {
+        g_source_destroy (socket->watch_hup);
+        socket->watch_hup = NULL;
+    }
+
+    if (socket->watch_read_more) {
+        g_source_destroy (socket->watch_read_more);
+        socket->watch_read_more = NULL;
+    }
+#endif
+
+    if (socket->watch_flush) {
+        g_source_destroy (socket->watch_flush);
+        socket->watch_flush = NULL;
+    }
+
+    if (socket->watch_in_idle) {
+        g_source_destroy (socket->watch_in_idle);
+        socket->watch_in_idle = NULL;
+    }
+}
+
+/* Takes the connected socket off its context, see lm_old_socket_attach().
+ * Returns FALSE while the socket is still connecting or in the TLS
+ * handshake. */
+gboolean
+lm_old_socket_detach (LmOldSocket *socket)
+{
+    g_return_val_if_fail (socket != NULL, FALSE);
+
+    if (socket->watch_connect || socket->connect_data || socket->resolver ||
+        socket->handshaking) {
         return FALSE;
     }
 
-#ifdef HAVE_GNUTLS
-    _lm_sock_set_blocking (socket->fd, FALSE); 
+    if (socket->io_channel) {
+        old_socket_remove_watches (socket);
+
+        /* Pending output keeps watch_out set and gets a new watch */
+#ifndef HAVE_EPOLL
+        if (socket->watch_out_source) {
+            g_source_destroy (socket->watch_out_source);
+            socket->watch_out_source = NULL;
+        }
 #endif
+    }
+
+    if (socket->context) {
+        g_main_context_unref (socket->context);
+        socket->context = NULL;
+    }
 
-    socket->ssl_started = TRUE;
+    socket->detached = TRUE;
 
     return TRUE;
 }
 
+/* Continues a socket taken off its context by lm_old_socket_detach() in
+ * @context. Buffered input and output is kept. */
 gboolean
-lm_old_socket_starttls (LmOldSocket *socket)
+lm_old_socket_attach (LmOldSocket *socket, GMainContext *context)
 {
-    g_return_val_if_fail (lm_ssl_get_use_starttls (socket->ssl) == TRUE, FALSE);
+    g_return_val_if_fail (socket != NULL, FALSE);
+    g_return_val_if_fail (socket->detached, FALSE);
+
+    socket->detached = FALSE;
+
+    if (context) {
+        socket->context = g_main_context_ref (context);
+    }
+
+    if (!socket->io_channel) {
+        return TRUE;
+    }
+
+    if (!old_socket_add_watches (socket)) {
+        return FALSE;
+    }
+
+    old_socket_resume (socket);
 
-    return _lm_old_socket_ssl_init (socket, TRUE);
+    return TRUE;
 }
 
+/* Picks up the output and input that waited while the socket had no
+ * watches */
+static void
+old_socket_resume (LmOldSocket *socket)
+{
+    if (socket->watch_out) {
+        old_socket_setup_output_buffer (socket);
+    }
+    else if (old_socket_get_pending (socket) > 0) {
+        socket->watch_flush = lm_misc_add_idle (socket->context,
+                                                (GSourceFunc) socket_flush_cb,
+                                                socket);
+        g_source_set_priority (socket->watch_flush, G_PRIORITY_DEFAULT);
+    }
+
+    if (socket->in_buf_size > IN_BUFFER_SIZE) {
+        old_socket_add_in_idle_watch (socket, IN_BUFFER_IDLE_MSECS);
+    }
 
+    /* The new watches see what is waiting in the kernel, but not what
+     * SSL has already taken off the socket */
+#ifdef HAVE_EPOLL
+    lm_epoll_watch_set_ready (socket->epoll_watch, G_IO_IN);
+#else
+    if (socket->ssl_started && _lm_ssl_get_pending (socket->ssl)) {
+        socket->watch_read_more = lm_misc_add_idle (socket->context,
+                                                    (GSourceFunc) socket_read_more_cb,
+                                                    socket);
+        g_source_set_priority (socket->watch_read_more, G_PRIORITY_DEFAULT);
+    }
+#endif
+}
 
 void
 _lm_old_socket_succeeded (LmConnectData *connect_data)
@@ -403,45 +1411,31 @@ _lm_old_socket_succeeded (LmConnectData *connect_data)
     socket->fd = connect_data->fd;
     socket->io_channel = connect_data->io_channel;
 
+    if (socket->corked) {
+        _lm_sock_set_cork (socket->fd, TRUE);
+    }
+
     g_object_unref (socket->resolver);
     socket->resolver = NULL;
 
     socket->connect_data = NULL;
     g_free (connect_data);
 
-    /* old-style ssl should be started immediately */
+    /* old-style ssl should be started immediately, connect_func is 
+     * called once the handshake is done */
     if (socket->ssl && (lm_ssl_get_use_starttls (socket->ssl) == FALSE)) {
-        if (!_lm_old_socket_ssl_init (socket, FALSE)) {
-            return;
+        if (!_lm_old_socket_ssl_init (socket, FALSE) && socket->connect_func) {
+            (socket->connect_func) (socket, FALSE, socket->user_data);
         }
+        return;
     }
 
-    socket->watch_in = 
-        lm_misc_add_io_watch (socket->context,
-                              socket->io_channel,
-                              G_IO_IN,
-                              (GIOFunc) socket_in_event,
-                              socket);
-
-    /* FIXME: if we add these, we don't get ANY
-     * response from the server, this is to do with the way that
-     * windows handles watches, see bug #331214.
-     */
-#ifndef G_OS_WIN32
-    socket->watch_err = 
-        lm_misc_add_io_watch (socket->context,
-                              socket->io_channel,
-                              G_IO_ERR,
-                              (GIOFunc) socket_error_event,
-                              socket);
-        
-    socket->watch_hup =
-        lm_misc_add_io_watch (socket->context,
-                              socket->io_channel,
-                              G_IO_HUP,
-                              (GIOFunc) socket_hup_event,
-                              socket);
-#endif
+    if (!old_socket_add_watches (socket)) {
+        if (socket->connect_func) {
+            (socket->connect_func) (socket, FALSE, socket->user_data);
+        }
+        return;
+    }
 
     if (socket->connect_func) {
         (socket->connect_func) (socket, TRUE, socket->user_data);
@@ -669,72 +1663,180 @@ socket_do_connect (LmConnectData *connect_data)
     return TRUE;
 }
 
-static gboolean
-old_socket_output_is_buffered (LmOldSocket     *socket,
-                               const gchar  *buffer,
-                               gint          len)
+/* Writes are normally retried once the socket is writable, but an SSL 
+ * write can also be waiting for data from the peer */
+static GIOCondition
+old_socket_get_write_condition (LmOldSocket *socket)
 {
-    if (socket->out_buf) {
-        lm_verbose ("Appending %d bytes to output buffer\n", len);
-        g_string_append_len (socket->out_buf, buffer, len);
-        return TRUE;
+    if (!old_socket_writes_plain (socket)) {
+        return _lm_ssl_get_send_condition (socket->ssl);
     }
 
-    return FALSE;
+    return G_IO_OUT;
 }
 
 static void
-old_socket_setup_output_buffer (LmOldSocket *socket, const gchar *buffer, gint len)
+old_socket_setup_output_buffer (LmOldSocket *socket)
 {
     lm_verbose ("OUTPUT BUFFER ENABLED\n");
 
-    socket->out_buf = g_string_new_len (buffer, len);
+    socket->watch_out = TRUE;
+    socket->watch_out_condition = old_socket_get_write_condition (socket);
 
-    socket->watch_out =
+    if (socket->detached) {
+        return;
+    }
+
+#ifdef HAVE_EPOLL
+    lm_epoll_watch_set_condition (socket->epoll_watch, 
+                                  G_IO_IN | socket->watch_out_condition);
+#else
+    socket->watch_out_source =
         lm_misc_add_io_watch (socket->context,
                               socket->io_channel,
-                              G_IO_OUT,
+                              socket->watch_out_condition,
                               (GIOFunc) socket_buffered_write_cb,
                               socket);
+#endif
+}
+
+static void
+old_socket_remove_output_watch (LmOldSocket *socket)
+{
+    socket->watch_out = FALSE;
+#ifdef HAVE_EPOLL
+    if (socket->epoll_watch) {
+        lm_epoll_watch_set_condition (socket->epoll_watch, G_IO_IN);
+    }
+#else
+    if (socket->watch_out_source) {
+        g_source_destroy (socket->watch_out_source);
+        socket->watch_out_source = NULL;
+    }
+#endif
+}
+
+#ifdef HAVE_EPOLL
+/* Dispatches in the order the separate GIOChannel watches would run */
+static void
+socket_epoll_event (LmEpollWatch *watch,
+                    GIOCondition  condition,
+                    LmOldSocket  *socket)
+{
+    lm_old_socket_ref (socket);
+
+    if (condition & G_IO_IN) {
+        socket_in_event (NULL, G_IO_IN, socket);
+    }
+
+    if (socket->io_channel && (condition & G_IO_ERR)) {
+        socket_error_event (NULL, condition, socket);
+    }
+    else if (socket->io_channel && (condition & G_IO_HUP)) {
+        socket_hup_event (NULL, condition, socket);
+    }
+
+    /* An SSL write waiting for input was retried by socket_in_event() */
+    if (socket->io_channel && socket->watch_out && 
+        socket->watch_out_condition == G_IO_OUT && (condition & G_IO_OUT)) {
+        socket_buffered_write_cb (NULL, G_IO_OUT, socket);
+    }
+
+    lm_old_socket_unref (socket);
 }
+#endif
 
 static gboolean
 socket_buffered_write_cb (GIOChannel   *source, 
                           GIOCondition  condition,
                           LmOldSocket     *socket)
 {
-    gint     b_written;
-    GString *out_buf;
-
-    out_buf = socket->out_buf;
-    if (!out_buf) {
-        /* Should not be possible */
+    guint64  bytes_written = socket->bytes_written;
+    gboolean keep = TRUE;
+
+    if (socket->handshaking) {
+        /* The handshake owns the socket, old_socket_resume() sets the
+         * watch up again once it is done */
+#ifndef HAVE_EPOLL
+        if (socket->watch_out_source) {
+            g_source_destroy (socket->watch_out_source);
+            socket->watch_out_source = NULL;
+        }
+#endif
         return FALSE;
     }
 
-    b_written = old_socket_do_write (socket, out_buf->str, out_buf->len);
+    old_socket_queue_output (socket, LM_OUTPUT_PRIORITY_CONTROL, 0);
+    old_socket_queue_output (socket, LM_OUTPUT_PRIORITY_BULK, 0);
 
-    if (b_written < 0) {
+    if (!old_socket_write_queue (socket)) {
         (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR, 
                                socket->user_data);
         return FALSE;
     }
 
-    g_string_erase (out_buf, 0, (gsize) b_written);
-    if (out_buf->len == 0) {
+    if (old_socket_get_pending (socket) == 0) {
         lm_verbose ("Output buffer is empty, going back to normal output\n");
 
-        if (socket->watch_out) {
-            g_source_destroy (socket->watch_out);
-            socket->watch_out = NULL;
-        }
+        old_socket_remove_output_watch (socket);
 
-        g_string_free (out_buf, TRUE);
-        socket->out_buf = NULL;
-        return FALSE;
+        old_socket_push_corked (socket);
+        keep = FALSE;
+    }
+    else if (old_socket_get_write_condition (socket) != socket->watch_out_condition) {
+        /* Wait for the other direction instead */
+        old_socket_remove_output_watch (socket);
+        old_socket_setup_output_buffer (socket);
+        keep = FALSE;
     }
 
-    return TRUE;
+    old_socket_notify_written (socket, bytes_written);
+
+    return keep;
+}
+
+/* Returns the number of bytes that have been sent but not yet been handed
+ * to the kernel */
+gsize
+lm_old_socket_get_pending_output (LmOldSocket *socket)
+{
+    g_return_val_if_fail (socket != NULL, 0);
+
+    return old_socket_get_pending (socket);
+}
+
+/* Returns the number of bytes of @priority handed to the kernel */
+guint64
+lm_old_socket_get_bytes_written (LmOldSocket      *socket,
+                                 LmOutputPriority  priority)
+{
+    g_return_val_if_fail (socket != NULL, 0);
+    g_return_val_if_fail (priority >= 0 && priority < LM_OUTPUT_N_PRIORITIES, 0);
+
+    return socket->output[priority].written;
+}
+
+/* Returns the number of bytes of @priority sent so far, everything up to
+ * here has been written once lm_old_socket_get_bytes_written() reaches it */
+guint64
+lm_old_socket_get_bytes_queued (LmOldSocket      *socket,
+                                LmOutputPriority  priority)
+{
+    g_return_val_if_fail (socket != NULL, 0);
+    g_return_val_if_fail (priority >= 0 && priority < LM_OUTPUT_N_PRIORITIES, 0);
+
+    return socket->output[priority].written + 
+        old_socket_get_class_pending (socket, priority);
+}
+
+/* Sets a function called with the socket's user data after pending 
+ * output has been written */
+void
+lm_old_socket_set_written_func (LmOldSocket *socket, OutputWrittenFunc func)
+{
+    g_return_if_fail (socket != NULL);
+
+    socket->written_func = func;
 }
 
 static void
@@ -752,6 +1854,16 @@ socket_close_io_channel (GIOChannel *io_channel)
     _lm_sock_close (fd);
 }
 
+/* Connections of a pool share their lookups */
+static void
+old_socket_set_resolver_cache (LmOldSocket *socket)
+{
+    if (socket->connection) {
+        lm_resolver_set_cache (socket->resolver,
+                               _lm_connection_get_resolver_cache (socket->connection));
+    }
+}
+
 static void
 old_socket_resolver_host_cb (LmResolver       *resolver,
                              LmResolverResult  result,
@@ -816,6 +1928,12 @@ old_socket_resolver_srv_cb (LmResolver       *resolver,
             lm_resolver_new_for_host (remote_addr,
                                       old_socket_resolver_host_cb,
                                       socket);
+
+    if (socket->context) {
+        g_object_set (socket->resolver, "context", socket->context, NULL);
+    }
+
+    old_socket_set_resolver_cache (socket);
        
     lm_resolver_lookup (socket->resolver);
 }
@@ -836,6 +1954,7 @@ lm_old_socket_create (GMainContext      *context,
 {
     LmOldSocket   *socket;
     LmConnectData *data;
+    gint           i;
 
     g_return_val_if_fail (domain != NULL, NULL);
     g_return_val_if_fail ((port >= LM_MIN_PORT && port <= LM_MAX_PORT), NULL);
@@ -846,6 +1965,17 @@ lm_old_socket_create (GMainContext      *context,
     socket = g_new0 (LmOldSocket, 1);
 
     socket->ref_count = 1;
+    socket->fd = -1;
+    for (i = 0; i < LM_OUTPUT_N_PRIORITIES; i++) {
+        socket->output[i].buf = g_string_sized_new (OUT_BUFFER_SIZE);
+        socket->output[i].queue = lm_output_buffer_new ();
+    }
+    socket->bulk_ends = g_array_new (FALSE, FALSE, sizeof (guint64));
+    socket->in_buf_size = IN_BUFFER_SIZE;
+    socket->in_buf_max = IN_BUFFER_MAX_SIZE;
+    socket->in_buf = g_malloc (socket->in_buf_size);
+    socket->read_budget_bytes = READ_BUDGET_BYTES;
+    socket->read_budget_time  = READ_BUDGET_MSECS * G_TIME_SPAN_MILLISECOND;
 
     socket->connection = connection;
     socket->domain = g_strdup (domain);
@@ -887,6 +2017,8 @@ lm_old_socket_create (GMainContext      *context,
         g_object_set (socket->resolver, "context", context, NULL);
     }
 
+    old_socket_set_resolver_cache (socket);
+
     socket->data_func = data_func;
     socket->closed_func = closed_func;
     socket->connect_func = connect_func;
@@ -918,6 +2050,13 @@ lm_old_socket_flush (LmOldSocket *socket)
     g_return_if_fail (socket != NULL);
     g_return_if_fail (socket->io_channel != NULL);
 
+    if (socket->watch_flush) {
+        g_source_destroy (socket->watch_flush);
+        socket->watch_flush = NULL;
+
+        old_socket_send_output_buffer (socket);
+    }
+
     g_io_channel_flush (socket->io_channel, NULL);
 }
 
@@ -925,6 +2064,7 @@ void
 lm_old_socket_close (LmOldSocket *socket)
 {
     LmConnectData *data;
+    gint           i;
 
     g_return_if_fail (socket != NULL);
 
@@ -944,26 +2084,28 @@ lm_old_socket_close (LmOldSocket *socket)
         socket->resolver = NULL;
     }
 
-    if (socket->io_channel) {
-        if (socket->watch_in) {
-            g_source_destroy (socket->watch_in);
-            socket->watch_in = NULL;
-        }
-
-        if (socket->watch_err) {
-            g_source_destroy (socket->watch_err);
-            socket->watch_err = NULL;
-        }
+    if (socket->watch_handshake) {
+        g_source_destroy (socket->watch_handshake);
+        socket->watch_handshake = NULL;
+    }
+    if (socket->watch_handshake_timeout) {
+        g_source_destroy (socket->watch_handshake_timeout);
+        socket->watch_handshake_timeout = NULL;
+    }
+    socket->handshaking   = FALSE;
+    socket->starttls_func = NULL;
 
-        if (socket->watch_hup) {
-            g_source_destroy (socket->watch_hup);
-            socket->watch_hup = NULL;
-        }
+    if (socket->io_channel) {
+        old_socket_remove_output_watch (socket);
+        old_socket_remove_watches (socket);
 
-        if (socket->watch_out) {
-            g_source_destroy (socket->watch_out);
-            socket->watch_out = NULL;
+        for (i = 0; i < LM_OUTPUT_N_PRIORITIES; i++) {
+            g_string_truncate (socket->output[i].buf, 0);
+            lm_output_buffer_clear (socket->output[i].queue);
         }
+        g_array_set_size (socket->bulk_ends, 0);
+        socket->bulk_ends_head = 0;
+        socket->ssl_blocked_len = 0;
 
         socket_close_io_channel (socket->io_channel);
 
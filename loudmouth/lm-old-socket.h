@@ -29,6 +29,7 @@ typedef struct _LmOldSocket LmOldSocket;
 
 typedef void    (* IncomingDataFunc)  (LmOldSocket         *socket,
                                        const gchar         *buf,
+                                       gsize                len,
                                        gpointer             user_data);
 
 typedef void    (* SocketClosedFunc)  (LmOldSocket         *socket,
@@ -39,6 +40,9 @@ typedef void    (* ConnectResultFunc) (LmOldSocket         *socket,
                                        gboolean             result,
                                        gpointer             user_data);
 
+typedef void    (* OutputWrittenFunc) (LmOldSocket         *socket,
+                                       gpointer             user_data);
+
 LmOldSocket * lm_old_socket_create          (GMainContext       *context, 
                                              IncomingDataFunc    data_func,
                                              SocketClosedFunc    closed_func,
@@ -54,11 +58,39 @@ LmOldSocket * lm_old_socket_create          (GMainContext       *context,
 gint           lm_old_socket_write          (LmOldSocket       *socket,
                                              const gchar       *buf,
                                              gint               len);
+GString *      lm_old_socket_get_output_buffer   (LmOldSocket      *socket,
+                                                  LmOutputPriority  priority);
+gboolean       lm_old_socket_write_output_buffer (LmOldSocket      *socket,
+                                                  LmOutputPriority  priority);
+gboolean       lm_old_socket_write_bytes    (LmOldSocket        *socket,
+                                             GBytes             *bytes);
+gboolean       lm_old_socket_write_bytesv   (LmOldSocket        *socket,
+                                             GBytes            **bytes,
+                                             guint               n_bytes);
+void           lm_old_socket_set_corked     (LmOldSocket        *socket,
+                                             gboolean            corked);
+gsize          lm_old_socket_get_pending_output (LmOldSocket    *socket);
+guint64        lm_old_socket_get_bytes_written  (LmOldSocket      *socket,
+                                                 LmOutputPriority  priority);
+guint64        lm_old_socket_get_bytes_queued   (LmOldSocket      *socket,
+                                                 LmOutputPriority  priority);
+void           lm_old_socket_set_written_func   (LmOldSocket    *socket,
+                                                 OutputWrittenFunc func);
+void           lm_old_socket_set_max_read_size (LmOldSocket     *socket,
+                                                gsize            size);
+gsize          lm_old_socket_get_read_size  (LmOldSocket        *socket);
+void           lm_old_socket_set_read_budget (LmOldSocket       *socket,
+                                              gsize              bytes,
+                                              guint              msecs);
+gboolean       lm_old_socket_detach         (LmOldSocket        *socket);
+gboolean       lm_old_socket_attach         (LmOldSocket        *socket,
+                                             GMainContext       *context);
 void           lm_old_socket_flush          (LmOldSocket        *socket);
 void           lm_old_socket_close          (LmOldSocket        *socket);
 LmOldSocket *  lm_old_socket_ref            (LmOldSocket        *socket);
 void           lm_old_socket_unref          (LmOldSocket        *socket);
-gboolean       lm_old_socket_starttls       (LmOldSocket        *socket);
+gboolean       lm_old_socket_starttls       (LmOldSocket        *socket,
+                                             ConnectResultFunc   func);
 gboolean       lm_old_socket_set_keepalive  (LmOldSocket        *socket, 
                                              int                 delay);
 gchar *        lm_old_socket_get_local_host (LmOldSocket        *socket);
@@ -0,0 +1,269 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <config.h>
+#include <string.h>
+
+#include "lm-output-buffer.h"
+
+#define CHUNK_SIZE 4096
+#define MAX_SPARE_CHUNKS 4
+
+typedef struct _OutputChunk OutputChunk;
+
+struct _OutputChunk {
+    OutputChunk *next;
+
+    /* Set for data linked in with lm_output_buffer_append_bytes(), 
+     * otherwise data points at the space following the chunk */
+    GBytes      *bytes;
+    const gchar *data;
+    gsize        len;
+};
+
+struct _LmOutputBuffer {
+    OutputChunk *head;
+    OutputChunk *tail;
+
+    /* Bytes of head that have already been consumed */
+    gsize        offset;
+    gsize        size;
+
+    /* Emptied chunks kept for reuse */
+    OutputChunk *spare;
+    guint        n_spare;
+};
+
+static OutputChunk *
+output_buffer_new_chunk (LmOutputBuffer *buffer)
+{
+    OutputChunk *chunk;
+
+    if (buffer->spare) {
+        chunk = buffer->spare;
+        buffer->spare = chunk->next;
+        buffer->n_spare--;
+    } else {
+        chunk = g_malloc (sizeof (OutputChunk) + CHUNK_SIZE);
+        chunk->bytes = NULL;
+        chunk->data  = (const gchar *) (chunk + 1);
+    }
+
+    chunk->next = NULL;
+    chunk->len  = 0;
+
+    return chunk;
+}
+
+static void
+output_buffer_free_chunk (LmOutputBuffer *buffer, OutputChunk *chunk)
+{
+    if (chunk->bytes) {
+        g_bytes_unref (chunk->bytes);
+        g_free (chunk);
+    }
+    else if (buffer->n_spare < MAX_SPARE_CHUNKS) {
+        chunk->next = buffer->spare;
+        buffer->spare = chunk;
+        buffer->n_spare++;
+    } else {
+        g_free (chunk);
+    }
+}
+
+static void
+output_buffer_link (LmOutputBuffer *buffer, OutputChunk *chunk)
+{
+    if (buffer->tail) {
+        buffer->tail->next = chunk;
+    } else {
+        buffer->head = chunk;
+    }
+    buffer->tail = chunk;
+}
+
+LmOutputBuffer *
+lm_output_buffer_new (void)
+{
+    return g_new0 (LmOutputBuffer, 1);
+}
+
+void
+lm_output_buffer_free (LmOutputBuffer *buffer)
+{
+    OutputChunk *chunk;
+
+    g_return_if_fail (buffer != NULL);
+
+    lm_output_buffer_clear (buffer);
+
+    while ((chunk = buffer->spare)) {
+        buffer->spare = chunk->next;
+        g_free (chunk);
+    }
+
+    g_free (buffer);
+}
+
+/* Copies @data into the chain, filling up the last chunk first */
+void
+lm_output_buffer_append (LmOutputBuffer *buffer,
+                         const gchar    *data,
+                         gsize           len)
+{
+    OutputChunk *chunk;
+
+    g_return_if_fail (buffer != NULL);
+
+    buffer->size += len;
+
+    chunk = buffer->tail;
+    while (len > 0) {
+        gsize n;
+
+        if (!chunk || chunk->bytes || chunk->len == CHUNK_SIZE) {
+            chunk = output_buffer_new_chunk (buffer);
+            output_buffer_link (buffer, chunk);
+        }
+
+        n = MIN (len, CHUNK_SIZE - chunk->len);
+        memcpy ((gchar *) chunk->data + chunk->len, data, n);
+
+        chunk->len += n;
+        data += n;
+        len  -= n;
+    }
+}
+
+/* Links @bytes into the chain without copying, a reference is taken */
+void
+lm_output_buffer_append_bytes (LmOutputBuffer *buffer, GBytes *bytes)
+{
+    OutputChunk *chunk;
+    gsize        len;
+
+    g_return_if_fail (buffer != NULL);
+    g_return_if_fail (bytes != NULL);
+
+    len = g_bytes_get_size (bytes);
+    if (len == 0) {
+        return;
+    }
+
+    chunk = g_new (OutputChunk, 1);
+    chunk->next  = NULL;
+    chunk->bytes = g_bytes_ref (bytes);
+    chunk->data  = g_bytes_get_data (bytes, NULL);
+    chunk->len   = len;
+
+    output_buffer_link (buffer, chunk);
+    buffer->size += len;
+}
+
+gsize
+lm_output_buffer_get_size (LmOutputBuffer *buffer)
+{
+    g_return_val_if_fail (buffer != NULL, 0);
+
+    return buffer->size;
+}
+
+/* Points up to @n_vectors vectors at the pending data, in order, for 
+ * writev(). Returns the number of vectors used. */
+gint
+lm_output_buffer_get_vectors (LmOutputBuffer *buffer,
+                              LmOutputVector *vectors,
+                              gint            n_vectors)
+{
+    OutputChunk *chunk;
+    gsize        offset;
+    gint         i = 0;
+
+    g_return_val_if_fail (buffer != NULL, 0);
+
+    offset = buffer->offset;
+    for (chunk = buffer->head; chunk && i < n_vectors; chunk = chunk->next) {
+        vectors[i].iov_base = (gchar *) chunk->data + offset;
+        vectors[i].iov_len  = chunk->len - offset;
+        offset = 0;
+        i++;
+    }
+
+    return i;
+}
+
+/* Copies up to @len bytes from the front of the chain into @dest without
+ * consuming them. Returns the number of bytes copied. */
+gsize
+lm_output_buffer_gather (LmOutputBuffer *buffer,
+                         gchar          *dest,
+                         gsize           len)
+{
+    OutputChunk *chunk;
+    gsize        offset;
+    gsize        copied = 0;
+
+    g_return_val_if_fail (buffer != NULL, 0);
+
+    offset = buffer->offset;
+    for (chunk = buffer->head; chunk && copied < len; chunk = chunk->next) {
+        gsize n = MIN (len - copied, chunk->len - offset);
+
+        memcpy (dest + copied, chunk->data + offset, n);
+        copied += n;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+/* Drops @len bytes from the front of the chain */
+void
+lm_output_buffer_consume (LmOutputBuffer *buffer, gsize len)
+{
+    g_return_if_fail (buffer != NULL);
+    g_return_if_fail (len <= buffer->size);
+
+    buffer->size -= len;
+    len += buffer->offset;
+
+    while (buffer->head && len >= buffer->head->len) {
+        OutputChunk *chunk = buffer->head;
+
+        len -= chunk->len;
+        buffer->head = chunk->next;
+        output_buffer_free_chunk (buffer, chunk);
+    }
+
+    if (!buffer->head) {
+        buffer->tail = NULL;
+    }
+
+    buffer->offset = len;
+}
+
+void
+lm_output_buffer_clear (LmOutputBuffer *buffer)
+{
+    g_return_if_fail (buffer != NULL);
+
+    lm_output_buffer_consume (buffer, buffer->size);
+}
@@ -0,0 +1,66 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __LM_OUTPUT_BUFFER_H__
+#define __LM_OUTPUT_BUFFER_H__
+
+#include <glib.h>
+
+#ifndef G_OS_WIN32
+#include <sys/uio.h>
+#endif
+
+/* A piece of pending output as handed to _lm_sock_writev(). This is the
+ * system's struct iovec where there is one so it can be passed to 
+ * writev() as it is. */
+#ifndef G_OS_WIN32
+typedef struct iovec LmOutputVector;
+#else
+typedef struct {
+    gpointer iov_base;
+    gsize    iov_len;
+} LmOutputVector;
+#endif
+
+/* Queue of pending output kept as a chain of chunks. Copied data is 
+ * packed into fixed size chunks, caller owned GBytes are linked in as 
+ * they are. Consuming from the front never moves the rest. */
+typedef struct _LmOutputBuffer LmOutputBuffer;
+
+LmOutputBuffer * lm_output_buffer_new          (void);
+void             lm_output_buffer_free         (LmOutputBuffer *buffer);
+void             lm_output_buffer_append       (LmOutputBuffer *buffer,
+                                                const gchar    *data,
+                                                gsize           len);
+void             lm_output_buffer_append_bytes (LmOutputBuffer *buffer,
+                                                GBytes         *bytes);
+gsize            lm_output_buffer_get_size     (LmOutputBuffer *buffer);
+gint             lm_output_buffer_get_vectors  (LmOutputBuffer *buffer,
+                                                LmOutputVector *vectors,
+                                                gint            n_vectors);
+gsize            lm_output_buffer_gather       (LmOutputBuffer *buffer,
+                                                gchar          *dest,
+                                                gsize           len);
+void             lm_output_buffer_consume      (LmOutputBuffer *buffer,
+                                                gsize           len);
+void             lm_output_buffer_clear        (LmOutputBuffer *buffer);
+
+#endif /* __LM_OUTPUT_BUFFER_H__ */
@@ -245,6 +245,17 @@ lm_parser_new (LmParserMessageFunction function,
 
 gboolean
 lm_parser_parse (LmParser *parser, const gchar *string)
+{
+    g_return_val_if_fail (parser != NULL, FALSE);
+    g_return_val_if_fail (string != NULL, FALSE);
+
+    return lm_parser_parse_len (parser, string, strlen (string));
+}
+
+/* Parses @len bytes of @string where they are, without copying them or 
+ * looking for a terminating NUL */
+gboolean
+lm_parser_parse_len (LmParser *parser, const gchar *string, gsize len)
 {
     g_return_val_if_fail (parser != NULL, FALSE);
     
@@ -254,7 +265,7 @@ lm_parser_parse (LmParser *parser, const gchar *string)
     }
         
     if (g_markup_parse_context_parse (parser->context, string, 
-                                      (gssize)strlen (string), NULL)) {
+                                      (gssize)len, NULL)) {
         return TRUE;
     } else {
         g_markup_parse_context_free (parser->context);
@@ -35,6 +35,9 @@ LmParser *   lm_parser_new       (LmParserMessageFunction  function,
                                   GDestroyNotify           notify);
 gboolean     lm_parser_parse     (LmParser                *parser,
                                   const gchar             *string);
+gboolean     lm_parser_parse_len (LmParser                *parser,
+                                  const gchar             *string,
+                                  gsize                    len);
 void         lm_parser_free      (LmParser                *parser);
 
 #endif /* __LM_PARSER_H__ */
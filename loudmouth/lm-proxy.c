@@ -478,7 +478,7 @@ lm_proxy_ref (LmProxy *proxy)
 {
     g_return_val_if_fail (proxy != NULL, NULL);
     
-    proxy->ref_count++;
+    g_atomic_int_inc (&proxy->ref_count);
     return proxy;
 }
 
@@ -494,9 +494,7 @@ lm_proxy_unref (LmProxy *proxy)
 {
     g_return_if_fail (proxy != NULL);
     
-    proxy->ref_count--;
-
-    if (proxy->ref_count == 0) {
+    if (g_atomic_int_dec_and_test (&proxy->ref_count)) {
         proxy_free (proxy);
     }
 }
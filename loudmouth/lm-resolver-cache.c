@@ -0,0 +1,344 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "lm-resolver-cache.h"
+
+/* Expired entries are only dropped when they are looked up, or when the
+ * cache has grown to this size */
+#define MAX_ENTRIES 1024
+
+typedef struct {
+    gint64           expires;
+
+    /* Host lookups */
+    struct addrinfo *results;
+
+    /* SRV lookups */
+    gchar           *host;
+    guint            port;
+} CacheEntry;
+
+struct _LmResolverCache {
+    GMutex      lock;
+
+    gint64      ttl;
+    GHashTable *hosts;
+    GHashTable *services;
+
+    guint       n_hits;
+    guint       n_misses;
+
+    gint        ref_count;
+};
+
+/* Copies @results into memory of our own, getaddrinfo() results can only
+ * be freed as a whole with freeaddrinfo() */
+static struct addrinfo *
+resolver_cache_copy_results (const struct addrinfo *results)
+{
+    struct addrinfo  *copy = NULL;
+    struct addrinfo **next = &copy;
+
+    for (; results; results = results->ai_next) {
+        struct addrinfo *ai;
+
+        ai = g_new0 (struct addrinfo, 1);
+        ai->ai_flags    = results->ai_flags;
+        ai->ai_family   = results->ai_family;
+        ai->ai_socktype = results->ai_socktype;
+        ai->ai_protocol = results->ai_protocol;
+        ai->ai_addrlen  = results->ai_addrlen;
+
+        if (results->ai_addr) {
+            ai->ai_addr = g_malloc (results->ai_addrlen);
+            memcpy (ai->ai_addr, results->ai_addr, results->ai_addrlen);
+        }
+
+        ai->ai_canonname = g_strdup (results->ai_canonname);
+
+        *next = ai;
+        next  = &ai->ai_next;
+    }
+
+    return copy;
+}
+
+/* Frees results returned by lm_resolver_cache_lookup_host() */
+void
+lm_resolver_cache_free_results (struct addrinfo *results)
+{
+    while (results) {
+        struct addrinfo *next = results->ai_next;
+
+        g_free (results->ai_addr);
+        g_free (results->ai_canonname);
+        g_free (results);
+
+        results = next;
+    }
+}
+
+static void
+resolver_cache_entry_free (CacheEntry *entry)
+{
+    lm_resolver_cache_free_results (entry->results);
+    g_free (entry->host);
+    g_slice_free (CacheEntry, entry);
+}
+
+/* Returns the entry for @key if it is still valid, must be called with
+ * the lock held */
+static CacheEntry *
+resolver_cache_lookup (LmResolverCache *cache, 
+                       GHashTable      *table,
+                       const gchar     *key,
+                       gint64           now)
+{
+    CacheEntry *entry;
+
+    entry = g_hash_table_lookup (table, key);
+    if (entry && entry->expires <= now) {
+        g_hash_table_remove (table, key);
+        entry = NULL;
+    }
+
+    if (entry) {
+        cache->n_hits++;
+    } else {
+        cache->n_misses++;
+    }
+
+    return entry;
+}
+
+static gboolean
+resolver_cache_entry_expired (gpointer key, CacheEntry *entry, gint64 *now)
+{
+    return entry->expires <= *now;
+}
+
+/* Must be called with the lock held */
+static void
+resolver_cache_insert (LmResolverCache *cache,
+                       GHashTable      *table,
+                       const gchar     *key,
+                       CacheEntry      *entry,
+                       gint64           now)
+{
+    if (g_hash_table_size (table) >= MAX_ENTRIES) {
+        g_hash_table_foreach_remove (table,
+                                     (GHRFunc) resolver_cache_entry_expired,
+                                     &now);
+    }
+
+    entry->expires = now + cache->ttl;
+    g_hash_table_replace (table, g_strdup (key), entry);
+}
+
+LmResolverCache *
+lm_resolver_cache_new (guint ttl)
+{
+    LmResolverCache *cache;
+
+    cache = g_slice_new0 (LmResolverCache);
+
+    g_mutex_init (&cache->lock);
+    cache->ttl      = (gint64) ttl * G_USEC_PER_SEC;
+    cache->hosts    = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify) resolver_cache_entry_free);
+    cache->services = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify) resolver_cache_entry_free);
+    cache->ref_count = 1;
+
+    return cache;
+}
+
+LmResolverCache *
+lm_resolver_cache_ref (LmResolverCache *cache)
+{
+    g_return_val_if_fail (cache != NULL, NULL);
+
+    g_atomic_int_inc (&cache->ref_count);
+
+    return cache;
+}
+
+void
+lm_resolver_cache_unref (LmResolverCache *cache)
+{
+    g_return_if_fail (cache != NULL);
+
+    if (!g_atomic_int_dec_and_test (&cache->ref_count)) {
+        return;
+    }
+
+    g_hash_table_destroy (cache->hosts);
+    g_hash_table_destroy (cache->services);
+    g_mutex_clear (&cache->lock);
+    g_slice_free (LmResolverCache, cache);
+}
+
+/* Entries cached before keep the time to live they were added with */
+void
+lm_resolver_cache_set_ttl (LmResolverCache *cache, guint ttl)
+{
+    g_return_if_fail (cache != NULL);
+
+    g_mutex_lock (&cache->lock);
+    cache->ttl = (gint64) ttl * G_USEC_PER_SEC;
+
+    if (cache->ttl == 0) {
+        g_hash_table_remove_all (cache->hosts);
+        g_hash_table_remove_all (cache->services);
+    }
+    g_mutex_unlock (&cache->lock);
+}
+
+/* Returns a copy of the addresses cached for @host, free it with
+ * lm_resolver_cache_free_results(). Returns NULL if there are none. */
+struct addrinfo *
+lm_resolver_cache_lookup_host (LmResolverCache *cache, 
+                               const gchar     *host,
+                               gint64           now)
+{
+    CacheEntry      *entry;
+    struct addrinfo *results = NULL;
+
+    g_return_val_if_fail (cache != NULL, NULL);
+    g_return_val_if_fail (host != NULL, NULL);
+
+    g_mutex_lock (&cache->lock);
+    if (cache->ttl > 0) {
+        entry = resolver_cache_lookup (cache, cache->hosts, host, now);
+        if (entry) {
+            results = resolver_cache_copy_results (entry->results);
+        }
+    }
+    g_mutex_unlock (&cache->lock);
+
+    return results;
+}
+
+void
+lm_resolver_cache_add_host (LmResolverCache       *cache,
+                            const gchar           *host,
+                            const struct addrinfo *results,
+                            gint64                 now)
+{
+    CacheEntry *entry;
+
+    g_return_if_fail (cache != NULL);
+    g_return_if_fail (host != NULL);
+
+    if (!results) {
+        return;
+    }
+
+    g_mutex_lock (&cache->lock);
+    if (cache->ttl > 0) {
+        entry = g_slice_new0 (CacheEntry);
+        entry->results = resolver_cache_copy_results (results);
+
+        resolver_cache_insert (cache, cache->hosts, host, entry, now);
+    }
+    g_mutex_unlock (&cache->lock);
+}
+
+/* Looks up the server of the SRV record @srv. @host is set to a newly
+ * allocated string. */
+gboolean
+lm_resolver_cache_lookup_service (LmResolverCache  *cache,
+                                  const gchar      *srv,
+                                  gchar           **host,
+                                  guint            *port,
+                                  gint64            now)
+{
+    CacheEntry *entry = NULL;
+
+    g_return_val_if_fail (cache != NULL, FALSE);
+    g_return_val_if_fail (srv != NULL, FALSE);
+    g_return_val_if_fail (host != NULL, FALSE);
+    g_return_val_if_fail (port != NULL, FALSE);
+
+    g_mutex_lock (&cache->lock);
+    if (cache->ttl > 0) {
+        entry = resolver_cache_lookup (cache, cache->services, srv, now);
+        if (entry) {
+            *host = g_strdup (entry->host);
+            *port = entry->port;
+        }
+    }
+    g_mutex_unlock (&cache->lock);
+
+    return entry != NULL;
+}
+
+void
+lm_resolver_cache_add_service (LmResolverCache *cache,
+                               const gchar     *srv,
+                               const gchar     *host,
+                               guint            port,
+                               gint64           now)
+{
+    CacheEntry *entry;
+
+    g_return_if_fail (cache != NULL);
+    g_return_if_fail (srv != NULL);
+
+    if (!host) {
+        return;
+    }
+
+    g_mutex_lock (&cache->lock);
+    if (cache->ttl > 0) {
+        entry = g_slice_new0 (CacheEntry);
+        entry->host = g_strdup (host);
+        entry->port = port;
+
+        resolver_cache_insert (cache, cache->services, srv, entry, now);
+    }
+    g_mutex_unlock (&cache->lock);
+}
+
+/* Counts the lookups that were answered from the cache and those that
+ * had to go to DNS */
+void
+lm_resolver_cache_get_stats (LmResolverCache *cache,
+                             guint           *n_hits,
+                             guint           *n_misses)
+{
+    g_return_if_fail (cache != NULL);
+
+    g_mutex_lock (&cache->lock);
+    if (n_hits) {
+        *n_hits = cache->n_hits;
+    }
+    if (n_misses) {
+        *n_misses = cache->n_misses;
+    }
+    g_mutex_unlock (&cache->lock);
+}
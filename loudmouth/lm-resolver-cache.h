@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_RESOLVER_CACHE_H__
+#define __LM_RESOLVER_CACHE_H__
+
+#include <glib.h>
+
+struct addrinfo;
+
+/* Remembers the results of host and SRV lookups for the time to live
+ * given, so that connections to the same server don't each ask DNS. A
+ * time to live of 0 turns the cache off. The cache may be shared between
+ * threads. Times are in microseconds as returned by 
+ * g_get_monotonic_time(). */
+typedef struct _LmResolverCache LmResolverCache;
+
+LmResolverCache * lm_resolver_cache_new            (guint             ttl);
+LmResolverCache * lm_resolver_cache_ref            (LmResolverCache  *cache);
+void              lm_resolver_cache_unref          (LmResolverCache  *cache);
+void              lm_resolver_cache_set_ttl        (LmResolverCache  *cache,
+                                                    guint             ttl);
+struct addrinfo * lm_resolver_cache_lookup_host    (LmResolverCache  *cache,
+                                                    const gchar      *host,
+                                                    gint64            now);
+void              lm_resolver_cache_add_host       (LmResolverCache  *cache,
+                                                    const gchar      *host,
+                                                    const struct addrinfo *results,
+                                                    gint64            now);
+gboolean          lm_resolver_cache_lookup_service (LmResolverCache  *cache,
+                                                    const gchar      *srv,
+                                                    gchar           **host,
+                                                    guint            *port,
+                                                    gint64            now);
+void              lm_resolver_cache_add_service    (LmResolverCache  *cache,
+                                                    const gchar      *srv,
+                                                    const gchar      *host,
+                                                    guint             port,
+                                                    gint64            now);
+void              lm_resolver_cache_get_stats      (LmResolverCache  *cache,
+                                                    guint            *n_hits,
+                                                    guint            *n_misses);
+void              lm_resolver_cache_free_results   (struct addrinfo  *results);
+
+#endif /* __LM_RESOLVER_CACHE_H__ */
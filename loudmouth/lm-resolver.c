@@ -35,7 +35,9 @@
 #include "lm-debug.h"
 #include "lm-internals.h"
 #include "lm-marshal.h"
+#include "lm-misc.h"
 #include "lm-resolver.h"
+#include "lm-resolver-cache.h"
 
 #define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_RESOLVER, LmResolverPriv))
 
@@ -60,6 +62,13 @@ struct LmResolverPriv {
     LmResolverResult    result;
     struct addrinfo    *results;
     struct addrinfo    *current_result;
+
+    /* Lookups are answered from the cache when it has them, the result
+     * is then delivered from cache_source. from_cache is set for results
+     * that came from the cache. */
+    LmResolverCache    *cache;
+    GSource            *cache_source;
+    gboolean            from_cache;
 };
 
 static void     resolver_finalize            (GObject           *object);
@@ -180,7 +189,18 @@ resolver_finalize (GObject *object)
         g_main_context_unref (priv->context);
     }
 
-    if (priv->results) {
+    if (priv->cache_source) {
+        g_source_destroy (priv->cache_source);
+    }
+
+    if (priv->cache) {
+        lm_resolver_cache_unref (priv->cache);
+    }
+
+    if (priv->results && priv->from_cache) {
+        lm_resolver_cache_free_results (priv->results);
+    }
+    else if (priv->results) {
         freeaddrinfo (priv->results);
     }
 
@@ -352,6 +372,119 @@ lm_resolver_new_for_service (const gchar        *domain,
     return resolver;
 }
 
+/* Makes lookups go to @cache first and adds their results to it */
+void
+lm_resolver_set_cache (LmResolver *resolver, LmResolverCache *cache)
+{
+    LmResolverPriv *priv;
+
+    g_return_if_fail (LM_IS_RESOLVER (resolver));
+
+    priv = GET_PRIV (resolver);
+
+    if (cache) {
+        lm_resolver_cache_ref (cache);
+    }
+
+    if (priv->cache) {
+        lm_resolver_cache_unref (priv->cache);
+    }
+
+    priv->cache = cache;
+}
+
+static gboolean
+resolver_cache_cb (LmResolver *resolver)
+{
+    LmResolverPriv *priv;
+
+    priv = GET_PRIV (resolver);
+
+    priv->cache_source = NULL;
+
+    g_object_ref (resolver);
+    _lm_resolver_set_result (resolver, LM_RESOLVER_RESULT_OK, priv->results);
+    g_object_unref (resolver);
+
+    return FALSE;
+}
+
+/* Like the blocking resolver, a cached result is delivered from an idle
+ * so the callback never runs inside lm_resolver_lookup() */
+static gboolean
+resolver_lookup_cache (LmResolver *resolver)
+{
+    LmResolverPriv  *priv;
+    gint64           now;
+
+    priv = GET_PRIV (resolver);
+
+    if (!priv->cache) {
+        return FALSE;
+    }
+
+    now = g_get_monotonic_time ();
+
+    if (priv->type == LM_RESOLVER_HOST) {
+        struct addrinfo *results;
+
+        results = lm_resolver_cache_lookup_host (priv->cache, priv->host, now);
+        if (!results) {
+            return FALSE;
+        }
+
+        priv->results = results;
+    } else {
+        gchar *srv;
+        gchar *host;
+        guint  port;
+
+        srv = _lm_resolver_create_srv_string (priv->domain, priv->service,
+                                              priv->protocol);
+        if (!lm_resolver_cache_lookup_service (priv->cache, srv, 
+                                               &host, &port, now)) {
+            g_free (srv);
+            return FALSE;
+        }
+        g_free (srv);
+
+        g_free (priv->host);
+        priv->host = host;
+        priv->port = port;
+    }
+
+    priv->from_cache   = TRUE;
+    priv->cache_source = lm_misc_add_idle (priv->context,
+                                           (GSourceFunc) resolver_cache_cb,
+                                           resolver);
+
+    return TRUE;
+}
+
+/* Adds the result of a lookup that went to DNS to the cache */
+static void
+resolver_add_to_cache (LmResolver *resolver)
+{
+    LmResolverPriv *priv;
+    gint64          now;
+    gchar          *srv;
+
+    priv = GET_PRIV (resolver);
+
+    now = g_get_monotonic_time ();
+
+    if (priv->type == LM_RESOLVER_HOST) {
+        lm_resolver_cache_add_host (priv->cache, priv->host, 
+                                    priv->results, now);
+    } else {
+        srv = _lm_resolver_create_srv_string (priv->domain, priv->service,
+                                              priv->protocol);
+        lm_resolver_cache_add_service (priv->cache, srv, 
+                                       priv->host, priv->port, now);
+        g_free (srv);
+    }
+}
+
 void
 lm_resolver_lookup (LmResolver *resolver)
 {
@@ -359,16 +492,29 @@ lm_resolver_lookup (LmResolver *resolver)
         g_assert_not_reached ();
     }
 
+    if (resolver_lookup_cache (resolver)) {
+        return;
+    }
+
     LM_RESOLVER_GET_CLASS(resolver)->lookup (resolver);
 }
 
 void
 lm_resolver_cancel (LmResolver *resolver)
 {
+    LmResolverPriv *priv;
+
     if (!LM_RESOLVER_GET_CLASS(resolver)->cancel) {
         g_assert_not_reached ();
     }
 
+    priv = GET_PRIV (resolver);
+
+    if (priv->cache_source) {
+        g_source_destroy (priv->cache_source);
+        priv->cache_source = NULL;
+    }
+
     LM_RESOLVER_GET_CLASS(resolver)->cancel (resolver);
 }
 
@@ -431,6 +577,10 @@ _lm_resolver_set_result (LmResolver       *resolver,
     priv->result = result;
     priv->results = priv->current_result = results;
 
+    if (result == LM_RESOLVER_RESULT_OK && priv->cache && !priv->from_cache) {
+        resolver_add_to_cache (resolver);
+    }
+
     lm_verbose ("Calling resolver callback: %s\n", priv->host);
 
     priv->callback (resolver, result, priv->user_data);
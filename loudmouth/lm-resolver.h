@@ -23,6 +23,8 @@
 
 #include <glib-object.h>
 
+#include "lm-resolver-cache.h"
+
 G_BEGIN_DECLS
 
 #define LM_TYPE_RESOLVER            (lm_resolver_get_type ())
@@ -73,6 +75,8 @@ LmResolver *      lm_resolver_new_for_service   (const gchar        *domain,
                                                  const gchar        *protocol,
                                                  LmResolverCallback  callback,
                                                  gpointer            user_data);
+void              lm_resolver_set_cache         (LmResolver         *resolver,
+                                                 LmResolverCache    *cache);
 void              lm_resolver_lookup            (LmResolver         *resolver);
 void              lm_resolver_cancel            (LmResolver         *resolver);
 /* To iterate through the results */ 
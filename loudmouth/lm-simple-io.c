@@ -20,6 +20,8 @@
 
 #include <config.h>
 
+#include "lm-debug.h"
+#include "lm-error.h"
 #include "lm-marshal.h"
 #include "lm-xmpp-writer.h"
 #include "lm-simple-io.h"
@@ -28,7 +30,7 @@
 
 typedef struct LmSimpleIOPriv LmSimpleIOPriv;
 struct LmSimpleIOPriv {
-    gint my_prop;
+    LmOldSocket *socket;
 };
 
 static void     simple_io_finalize            (GObject           *object);
@@ -41,11 +43,20 @@ static void     simple_io_set_property        (GObject           *object,
                                                guint              param_id,
                                                const GValue      *value,
                                                GParamSpec        *pspec);
-static void     simple_io_send_message        (LmXmppWriter      *writer,
-                                               LmMessage         *message);
-static void     simple_io_send_text           (LmXmppWriter      *writer,
+static gboolean simple_io_send_message        (LmXmppWriter      *writer,
+                                               LmMessage         *message,
+                                               LmOutputPriority   priority,
+                                               GError           **error);
+static gboolean simple_io_send_text           (LmXmppWriter      *writer,
                                                const gchar       *buf,
-                                               gsize              len);
+                                               gsize              len,
+                                               LmOutputPriority   priority,
+                                               GError           **error);
+static gboolean simple_io_send_bytes          (LmXmppWriter      *writer,
+                                               GBytes           **bytes,
+                                               guint              n_bytes,
+                                               GError           **error);
+static void     simple_io_flush               (LmXmppWriter      *writer);
 
 G_DEFINE_TYPE_WITH_CODE (LmSimpleIO, lm_simple_io, G_TYPE_OBJECT,
                          G_IMPLEMENT_INTERFACE (LM_TYPE_XMPP_WRITER,
@@ -53,7 +64,7 @@ G_DEFINE_TYPE_WITH_CODE (LmSimpleIO, lm_simple_io, G_TYPE_OBJECT,
 
 enum {
     PROP_0,
-    PROP_MY_PROP
+    PROP_SOCKET
 };
 
 static void
@@ -66,12 +77,12 @@ lm_simple_io_class_init (LmSimpleIOClass *class)
     object_class->set_property = simple_io_set_property;
 
     g_object_class_install_property (object_class,
-                                     PROP_MY_PROP,
-                                     g_param_spec_string ("my-prop",
-                                                          "My Prop",
-                                                          "My Property",
-                                                          NULL,
-                                                          G_PARAM_READWRITE));
+                                     PROP_SOCKET,
+                                     g_param_spec_pointer ("socket",
+                                                           "Socket",
+                                                           "The socket to write to",
+                                                           G_PARAM_READWRITE |
+                                                           G_PARAM_CONSTRUCT_ONLY));
     
     g_type_class_add_private (object_class, sizeof (LmSimpleIOPriv));
 }
@@ -79,9 +90,6 @@ lm_simple_io_class_init (LmSimpleIOClass *class)
 static void
 lm_simple_io_init (LmSimpleIO *simple_io)
 {
-    LmSimpleIOPriv *priv;
-
-    priv = GET_PRIV (simple_io);
 }
 
 static void
@@ -91,6 +99,10 @@ simple_io_finalize (GObject *object)
 
     priv = GET_PRIV (object);
 
+    if (priv->socket) {
+        lm_old_socket_unref (priv->socket);
+    }
+
     (G_OBJECT_CLASS (lm_simple_io_parent_class)->finalize) (object);
 }
 
@@ -99,6 +111,8 @@ simple_io_writer_iface_init (LmXmppWriterIface *iface)
 {
     iface->send_message = simple_io_send_message;
     iface->send_text    = simple_io_send_text;
+    iface->send_bytes   = simple_io_send_bytes;
+    iface->flush        = simple_io_flush;
 }
 
 static void
@@ -112,8 +126,8 @@ simple_io_get_property (GObject    *object,
     priv = GET_PRIV (object);
 
     switch (param_id) {
-    case PROP_MY_PROP:
-        g_value_set_int (value, priv->my_prop);
+    case PROP_SOCKET:
+        g_value_set_pointer (value, priv->socket);
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
@@ -132,8 +146,8 @@ simple_io_set_property (GObject      *object,
     priv = GET_PRIV (object);
 
     switch (param_id) {
-    case PROP_MY_PROP:
-        priv->my_prop = g_value_get_int (value);
+    case PROP_SOCKET:
+        priv->socket = lm_old_socket_ref (g_value_get_pointer (value));
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
@@ -141,15 +155,118 @@ simple_io_set_property (GObject      *object,
     };
 }
 
-static void
-simple_io_send_message (LmXmppWriter *writer, LmMessage *message)
+/* Logs what was appended to the output buffer since @start and sends it */
+static gboolean
+simple_io_write (LmSimpleIOPriv    *priv, 
+                 GString           *out_buf, 
+                 gsize              start,
+                 LmOutputPriority   priority,
+                 GError           **error)
 {
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\nSEND:\n");
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
+           "-----------------------------------\n");
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "%s\n", out_buf->str + start);
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
+           "-----------------------------------\n");
+
+    if (!lm_old_socket_write_output_buffer (priv->socket, priority)) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_FAILED,
+                     "Server closed the connection");
+        return FALSE;
+    }
+
+    return TRUE;
 }
 
-static void
-simple_io_send_text (LmXmppWriter *writer,
-                     const gchar  *buf,
-                     gsize         len)
+static gboolean
+simple_io_send_message (LmXmppWriter      *writer, 
+                        LmMessage         *message,
+                        LmOutputPriority   priority,
+                        GError           **error)
 {
+    LmSimpleIOPriv *priv;
+    GString        *out_buf;
+    gsize           start;
+    gboolean        open_only;
+
+    priv = GET_PRIV (writer);
+
+    out_buf = lm_old_socket_get_output_buffer (priv->socket, priority);
+    start   = out_buf->len;
+
+    /* The stream element stays open until the connection is closed */
+    open_only = lm_message_get_type (message) == LM_MESSAGE_TYPE_STREAM;
+    _lm_message_node_write (message->node, out_buf, open_only);
+
+    return simple_io_write (priv, out_buf, start, priority, error);
 }
 
+static gboolean
+simple_io_send_text (LmXmppWriter      *writer,
+                     const gchar       *buf,
+                     gsize              len,
+                     LmOutputPriority   priority,
+                     GError           **error)
+{
+    LmSimpleIOPriv *priv;
+    GString        *out_buf;
+    gsize           start;
+
+    priv = GET_PRIV (writer);
+
+    out_buf = lm_old_socket_get_output_buffer (priv->socket, priority);
+    start   = out_buf->len;
+
+    g_string_append_len (out_buf, buf, len);
+
+    return simple_io_write (priv, out_buf, start, priority, error);
+}
+
+/* The socket keeps references to @bytes instead of copying them */
+static gboolean
+simple_io_send_bytes (LmXmppWriter  *writer,
+                      GBytes       **bytes,
+                      guint          n_bytes,
+                      GError       **error)
+{
+    LmSimpleIOPriv *priv;
+    guint           i;
+
+    priv = GET_PRIV (writer);
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\nSEND:\n");
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "-----------------------------------\n");
+    for (i = 0; i < n_bytes; i++) {
+        gsize        len;
+        const gchar *data = g_bytes_get_data (bytes[i], &len);
+
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "%.*s", (gint) len, data);
+    }
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\n");
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "-----------------------------------\n");
+
+    if (!lm_old_socket_write_bytesv (priv->socket, bytes, n_bytes)) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_FAILED,
+                     "Server closed the connection");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+simple_io_flush (LmXmppWriter *writer)
+{
+    LmSimpleIOPriv *priv;
+
+    priv = GET_PRIV (writer);
+
+    lm_old_socket_flush (priv->socket);
+}
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 /* Needed for BSD, LM-130 */
@@ -57,20 +58,17 @@
 
 #define IPV6_MAX_ADDRESS_LEN 46 /* 45 + '\0' */
 
+G_LOCK_DEFINE_STATIC (initialised);
 static gboolean initialised = FALSE;
 
-gboolean
-_lm_sock_library_init (void)
+static gboolean
+sock_library_init (void)
 {
 #ifdef G_OS_WIN32
     WORD    version;
     WSADATA data;
     int     error;
 #endif /* G_OS_WIN32 */
-    
-    if (initialised) {
-        return TRUE;
-    }
 
     lm_verbose ("Socket library initialising...\n");
     
@@ -102,25 +100,40 @@ _lm_sock_library_init (void)
     }
 #endif /* G_OS_WIN32 */
 
-    initialised = TRUE;
-    
     return TRUE;
 }
 
-void
-_lm_sock_library_shutdown (void)
+gboolean
+_lm_sock_library_init (void)
 {
+    gboolean ret = TRUE;
+
+    /* Connections can be created from several threads */
+    G_LOCK (initialised);
     if (!initialised) {
-        return;
+        ret = initialised = sock_library_init ();
     }
+    G_UNLOCK (initialised);
 
-    lm_verbose ("Socket library shutting down...\n");
+    return ret;
+}
+
+void
+_lm_sock_library_shutdown (void)
+{
+    G_LOCK (initialised);
+
+    if (initialised) {
+        lm_verbose ("Socket library shutting down...\n");
 
 #ifdef G_OS_WIN32
-    WSACleanup ();
+        WSACleanup ();
 #endif /* G_OS_WIN32 */
 
-    initialised = FALSE;
+        initialised = FALSE;
+    }
+
+    G_UNLOCK (initialised);
 }
 
 void
@@ -339,6 +352,71 @@ _lm_sock_set_keepalive (LmOldSocketT sock, int delay)
     return TRUE;
 }
 
+/* Writes @vectors in order with a single system call. Returns the number
+ * of bytes written, 0 if the socket isn't writable right now and -1 on 
+ * error. */
+gssize
+_lm_sock_writev (LmOldSocketT           sock, 
+                 const LmOutputVector  *vectors, 
+                 gint                   n_vectors)
+{
+#ifndef G_OS_WIN32
+    gssize ret;
+
+    do {
+        ret = writev (sock, vectors, n_vectors);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+
+    return ret;
+#else  /* G_OS_WIN32 */
+    gssize total = 0;
+    gint   i;
+
+    /* No writev(), send the vectors one by one until one is cut short */
+    for (i = 0; i < n_vectors; ++i) {
+        int ret;
+
+        ret = send (sock, vectors[i].iov_base, vectors[i].iov_len, 0);
+        if (ret < 0) {
+            if (WSAGetLastError () == WSAEWOULDBLOCK) {
+                break;
+            }
+
+            return total > 0 ? total : -1;
+        }
+
+        total += ret;
+        if ((gsize) ret < vectors[i].iov_len) {
+            break;
+        }
+    }
+
+    return total;
+#endif /* G_OS_WIN32 */
+}
+
+/* Holds back partial frames while @cork is TRUE, clearing it pushes out 
+ * whatever is queued. Returns FALSE if the platform has no TCP_CORK. */
+gboolean
+_lm_sock_set_cork (LmOldSocketT sock, gboolean cork)
+{
+#ifdef TCP_CORK
+    int opt = cork ? 1 : 0;
+
+    if (setsockopt (sock, IPPROTO_TCP, TCP_CORK, &opt, sizeof (opt)) < 0) {
+        return FALSE;
+    }
+
+    return TRUE;
+#else
+    return FALSE;
+#endif /* TCP_CORK */
+}
+
 gchar *
 _lm_sock_get_local_host (LmOldSocketT sock)
 {
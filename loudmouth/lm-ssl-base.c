@@ -33,6 +33,7 @@ _lm_ssl_base_init (LmSSLBase      *base,
     base->func_data      = user_data;
     base->data_notify    = notify;
     base->fingerprint[0] = '\0';
+    base->use_session_tickets = TRUE;
     
     if (expected_fingerprint) {
         base->expected_fingerprint = g_memdup (expected_fingerprint, 16);
@@ -52,5 +53,74 @@ void
 _lm_ssl_base_free_fields (LmSSLBase *base)
 {
     g_free (base->expected_fingerprint);
+    g_free (base->server);
+    g_free (base->session_key);
+
+    if (base->context) {
+        lm_ssl_context_unref (base->context);
+    }
+}
+
+/* Sessions are cached per server name and port */
+void
+_lm_ssl_base_set_server (LmSSLBase *base, const gchar *server, guint port)
+{
+    g_free (base->server);
+    base->server = g_strdup (server);
+
+    g_free (base->session_key);
+    base->session_key = g_strdup_printf ("%s:%u", server, port);
+}
+
+void
+_lm_ssl_context_base_init (LmSSLContextBase *base)
+{
+    base->sessions = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify) g_bytes_unref);
+    g_mutex_init (&base->sessions_lock);
+    base->ref_count = 1;
+}
+
+void
+_lm_ssl_context_base_free_fields (LmSSLContextBase *base)
+{
+    g_hash_table_destroy (base->sessions);
+    g_mutex_clear (&base->sessions_lock);
+}
+
+/* Returns a reference to the session stored for @key, or NULL */
+GBytes *
+_lm_ssl_context_lookup_session (LmSSLContextBase *base, const gchar *key)
+{
+    GBytes *session;
+
+    g_mutex_lock (&base->sessions_lock);
+    session = g_hash_table_lookup (base->sessions, key);
+    if (session) {
+        g_bytes_ref (session);
+    }
+    g_mutex_unlock (&base->sessions_lock);
+
+    return session;
+}
+
+void
+_lm_ssl_context_store_session (LmSSLContextBase *base,
+                               const gchar      *key,
+                               GBytes           *session)
+{
+    g_mutex_lock (&base->sessions_lock);
+    g_hash_table_replace (base->sessions, g_strdup (key), 
+                          g_bytes_ref (session));
+    g_mutex_unlock (&base->sessions_lock);
+}
+
+void
+_lm_ssl_context_remove_session (LmSSLContextBase *base, const gchar *key)
+{
+    g_mutex_lock (&base->sessions_lock);
+    g_hash_table_remove (base->sessions, key);
+    g_mutex_unlock (&base->sessions_lock);
 }
 
@@ -24,6 +24,16 @@
 #include "lm-ssl.h"
 
 #define LM_SSL_BASE(x) ((LmSSLBase *) x)
+#define LM_SSL_CONTEXT_BASE(x) ((LmSSLContextBase *) x)
+
+typedef struct _LmSSLContextBase LmSSLContextBase;
+struct _LmSSLContextBase {
+    /* Serialized sessions to resume, "server:port" -> GBytes */
+    GHashTable     *sessions;
+    GMutex          sessions_lock;
+
+    gint            ref_count;
+};
 
 typedef struct _LmSSLBase LmSSLBase;
 struct _LmSSLBase {
@@ -34,6 +44,16 @@ struct _LmSSLBase {
     char            fingerprint[20];
     gboolean        use_starttls;
     gboolean        require_starttls;
+    gboolean        use_session_tickets;
+    gboolean        use_ktls;
+
+    /* Server to verify the certificate against and key of its session
+     * cache entry, see _lm_ssl_base_set_server() */
+    gchar          *server;
+    gchar          *session_key;
+
+    /* Set by lm_ssl_set_context(), %NULL for the default context */
+    LmSSLContext   *context;
 
     gint            ref_count;
 };
@@ -46,4 +66,18 @@ void _lm_ssl_base_init         (LmSSLBase      *base,
 
 void _lm_ssl_base_free_fields  (LmSSLBase      *base);
 
+void     _lm_ssl_base_set_server   (LmSSLBase      *base,
+                                    const gchar    *server,
+                                    guint           port);
+
+void     _lm_ssl_context_base_init        (LmSSLContextBase *base);
+void     _lm_ssl_context_base_free_fields (LmSSLContextBase *base);
+GBytes * _lm_ssl_context_lookup_session   (LmSSLContextBase *base,
+                                           const gchar      *key);
+void     _lm_ssl_context_store_session    (LmSSLContextBase *base,
+                                           const gchar      *key,
+                                           GBytes           *session);
+void     _lm_ssl_context_remove_session   (LmSSLContextBase *base,
+                                           const gchar      *key);
+
 #endif /* __LM_SSL_BASE_H__ */
@@ -20,6 +20,13 @@
 
 #include <config.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
 #include "lm-ssl.h"
 #include "lm-ssl-base.h"
 #include "lm-ssl-internals.h"
@@ -54,11 +61,19 @@ gboolean
 _lm_ssl_begin (LmSSL        *ssl,
                gint          fd,
                const gchar  *server,
+               guint         port,
                GError      **error)
 {
     return TRUE;
 }
 
+GIOStatus
+_lm_ssl_handshake (LmSSL *ssl, GError **error)
+{
+    /* NOOP */
+    return G_IO_STATUS_NORMAL;
+}
+
 GIOStatus
 _lm_ssl_read (LmSSL *ssl,
               gchar *buf,
@@ -77,6 +92,25 @@ _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
     /* NOOP */
     return TRUE;
 }
+
+GIOCondition
+_lm_ssl_get_send_condition (LmSSL *ssl)
+{
+    return G_IO_OUT;
+}
+
+gboolean
+_lm_ssl_get_pending (LmSSL *ssl)
+{
+    return FALSE;
+}
+
+gboolean
+_lm_ssl_get_ktls_send (LmSSL *ssl)
+{
+    return FALSE;
+}
+
 void 
 _lm_ssl_close (LmSSL *ssl)
 {
@@ -89,8 +123,37 @@ _lm_ssl_free (LmSSL *ssl)
     /* NOOP */
 }
 
+LmSSLContext *
+_lm_ssl_context_new (void)
+{
+    return NULL;
+}
+
+void
+_lm_ssl_context_free (LmSSLContext *context)
+{
+    /* NOOP */
+}
+
 #endif /* HAVE_SSL */
 
+/* Returns the context @ssl uses, the default one unless it was given one.
+ * The default is looked up each time rather than stored in @ssl so that 
+ * lm_ssl_get_context() keeps returning %NULL for it and a pool context 
+ * can still be set later. */
+LmSSLContext *
+_lm_ssl_get_context (LmSSL *ssl)
+{
+    LmSSLBase *base;
+
+    base = LM_SSL_BASE (ssl);
+    if (base->context) {
+        return base->context;
+    }
+
+    return lm_ssl_context_get_default ();
+}
+
 
 
 /**
@@ -164,7 +227,7 @@ lm_ssl_ref (LmSSL *ssl)
 {
     g_return_val_if_fail (ssl != NULL, NULL);
 
-    LM_SSL_BASE(ssl)->ref_count++;
+    g_atomic_int_inc (&LM_SSL_BASE(ssl)->ref_count);
 
     return ssl;
 }
@@ -201,6 +264,74 @@ lm_ssl_get_use_starttls (LmSSL *ssl)
     return base->use_starttls;
 }
 
+/**
+ * lm_ssl_set_use_session_tickets:
+ * @ssl: an #LmSSL
+ * @use_tickets: whether to resume sessions from tickets
+ *
+ * Set whether session tickets should be used. They are by default, which
+ * lets sessions be resumed from tickets and TLS 1.3 sessions be resumed 
+ * at all. Turn them off for servers that fail on empty session tickets, 
+ * like Google Talk did. Sessions can then still be resumed by id.
+ **/
+void
+lm_ssl_set_use_session_tickets (LmSSL *ssl, gboolean use_tickets)
+{
+    g_return_if_fail (ssl != NULL);
+
+    LM_SSL_BASE (ssl)->use_session_tickets = use_tickets;
+}
+
+/**
+ * lm_ssl_get_use_session_tickets:
+ * @ssl: an #LmSSL
+ *
+ * Return value: TRUE if @ssl is configured to use session tickets.
+ **/
+gboolean
+lm_ssl_get_use_session_tickets (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, FALSE);
+
+    return LM_SSL_BASE (ssl)->use_session_tickets;
+}
+
+/**
+ * lm_ssl_set_use_ktls:
+ * @ssl: an #LmSSL
+ * @use_ktls: whether to hand established sessions to the kernel
+ *
+ * Set whether the kernel should take over the encryption once the
+ * handshake is done (Linux kTLS, OpenSSL 3.0 or later). With TLS 1.2
+ * output is then written to the socket unencrypted, with the same
+ * writev() calls as plain connections. With TLS 1.3 it still goes
+ * through OpenSSL so that key updates are handled. It is off by default
+ * and silently not used where the kernel, the OpenSSL build or the
+ * negotiated cipher can't do it.
+ * Has to be set before the connection using @ssl is opened.
+ **/
+void
+lm_ssl_set_use_ktls (LmSSL *ssl, gboolean use_ktls)
+{
+    g_return_if_fail (ssl != NULL);
+
+    LM_SSL_BASE (ssl)->use_ktls = use_ktls;
+}
+
+/**
+ * lm_ssl_get_use_ktls:
+ * @ssl: an #LmSSL
+ *
+ * Return value: TRUE if @ssl is configured to use kernel TLS.
+ **/
+gboolean
+lm_ssl_get_use_ktls (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, FALSE);
+
+    return LM_SSL_BASE (ssl)->use_ktls;
+}
+
 /**
  * lm_ssl_get_require_starttls:
  *
@@ -215,6 +346,50 @@ lm_ssl_get_require_starttls (LmSSL *ssl)
     return base->require_starttls;
 }
 
+/**
+ * lm_ssl_set_context:
+ * @ssl: an #LmSSL
+ * @context: an #LmSSLContext, or %NULL for the default context
+ *
+ * Makes @ssl use the certificates and settings of @context. This has to 
+ * be done before the connection using @ssl is opened.
+ **/
+void
+lm_ssl_set_context (LmSSL *ssl, LmSSLContext *context)
+{
+    LmSSLBase *base;
+
+    g_return_if_fail (ssl != NULL);
+
+    base = LM_SSL_BASE (ssl);
+
+    if (context) {
+        lm_ssl_context_ref (context);
+    }
+
+    if (base->context) {
+        lm_ssl_context_unref (base->context);
+    }
+
+    base->context = context;
+}
+
+/**
+ * lm_ssl_get_context:
+ * @ssl: an #LmSSL
+ *
+ * Returns the context set with lm_ssl_set_context().
+ *
+ * Return value: the #LmSSLContext of @ssl, %NULL if it uses the default context.
+ **/
+LmSSLContext *
+lm_ssl_get_context (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, NULL);
+
+    return LM_SSL_BASE (ssl)->context;
+}
+
 /**
  * lm_ssl_unref
  * @ssl: an #LmSSL
@@ -231,9 +406,7 @@ lm_ssl_unref (LmSSL *ssl)
         
     base = LM_SSL_BASE (ssl);
 
-    base->ref_count --;
-        
-    if (base->ref_count == 0) {
+    if (g_atomic_int_dec_and_test (&base->ref_count)) {
         if (base->data_notify) {
             (* base->data_notify) (base->func_data);
         }
@@ -242,4 +415,258 @@ lm_ssl_unref (LmSSL *ssl)
     }
 }
 
+/**
+ * lm_ssl_context_new:
+ *
+ * Creates a new #LmSSLContext, loading the trusted CA certificates of the 
+ * system. Share it between any number of #LmSSL with lm_ssl_set_context().
+ *
+ * Return value: A new #LmSSLContext, %NULL if SSL is not supported.
+ **/
+LmSSLContext *
+lm_ssl_context_new (void)
+{
+    return _lm_ssl_context_new ();
+}
+
+/**
+ * lm_ssl_context_get_default:
+ *
+ * Returns the context used by every #LmSSL that wasn't given one with 
+ * lm_ssl_set_context(). It is created on first use and kept for the 
+ * lifetime of the process.
+ *
+ * Return value: the default #LmSSLContext, %NULL if SSL is not supported.
+ **/
+LmSSLContext *
+lm_ssl_context_get_default (void)
+{
+#ifdef HAVE_SSL
+    static LmSSLContext *default_context = NULL;
+
+    if (g_once_init_enter (&default_context)) {
+        g_once_init_leave (&default_context, _lm_ssl_context_new ());
+    }
+
+    return default_context;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * lm_ssl_context_ref:
+ * @context: an #LmSSLContext
+ *
+ * Adds a reference to @context.
+ *
+ * Return value: the context
+ **/
+LmSSLContext *
+lm_ssl_context_ref (LmSSLContext *context)
+{
+    g_return_val_if_fail (context != NULL, NULL);
+
+    g_atomic_int_inc (&LM_SSL_CONTEXT_BASE (context)->ref_count);
+
+    return context;
+}
+
+/**
+ * lm_ssl_context_unref:
+ * @context: an #LmSSLContext
+ *
+ * Removes a reference from @context. When no more references are present
+ * @context is freed.
+ **/
+void
+lm_ssl_context_unref (LmSSLContext *context)
+{
+    g_return_if_fail (context != NULL);
+
+    if (g_atomic_int_dec_and_test (&LM_SSL_CONTEXT_BASE (context)->ref_count)) {
+        _lm_ssl_context_free (context);
+    }
+}
+
+/**
+ * lm_ssl_context_load_sessions:
+ * @context: an #LmSSLContext
+ * @filename: file written by lm_ssl_context_save_sessions()
+ * @error: location to store error, or %NULL
+ *
+ * Adds the sessions saved in @filename to the session cache of @context, 
+ * so that connections made after a restart can resume them instead of 
+ * doing a full handshake. Sessions the server no longer accepts fall back 
+ * to a full handshake.
+ *
+ * Return value: #TRUE if @filename was read, otherwise #FALSE.
+ **/
+gboolean
+lm_ssl_context_load_sessions (LmSSLContext  *context,
+                              const gchar   *filename,
+                              GError       **error)
+{
+    gchar  *contents;
+    gchar **lines;
+    gint    i;
+
+    g_return_val_if_fail (context != NULL, FALSE);
+    g_return_val_if_fail (filename != NULL, FALSE);
+
+    if (!g_file_get_contents (filename, &contents, NULL, error)) {
+        return FALSE;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    g_free (contents);
+
+    /* Each line holds the key and the base64 encoded session */
+    for (i = 0; lines[i]; i++) {
+        GBytes *session;
+        gchar  *data;
+        gchar  *space;
+        gsize   len;
+
+        space = strchr (lines[i], ' ');
+        if (!space) {
+            continue;
+        }
+        *space = '\0';
+
+        data = (gchar *) g_base64_decode (space + 1, &len);
+        if (len == 0) {
+            g_free (data);
+            continue;
+        }
+
+        session = g_bytes_new_take (data, len);
+        _lm_ssl_context_store_session (LM_SSL_CONTEXT_BASE (context),
+                                       lines[i], session);
+        g_bytes_unref (session);
+    }
+
+    g_strfreev (lines);
+
+    return TRUE;
+}
+
+#if !GLIB_CHECK_VERSION(2, 66, 0)
+/* Writes @filename through a temporary file opened with mode 0600, so 
+ * that the sessions are never readable by others */
+static gboolean
+ssl_write_private_file (const gchar  *filename,
+                        const gchar  *data,
+                        gsize         len,
+                        GError      **error)
+{
+    gchar *tmp_name;
+    gint   fd;
+
+    tmp_name = g_strdup_printf ("%s.XXXXXX", filename);
+    fd = g_mkstemp_full (tmp_name, O_WRONLY, 0600);
+    if (fd < 0) {
+        goto error;
+    }
+
+    while (len > 0) {
+        gssize written;
+
+        written = write (fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto error;
+        }
+
+        data += written;
+        len  -= written;
+    }
 
+    if (close (fd) != 0) {
+        fd = -1;
+        goto error;
+    }
+    fd = -1;
+
+    if (g_rename (tmp_name, filename) != 0) {
+        goto error;
+    }
+
+    g_free (tmp_name);
+
+    return TRUE;
+
+error:
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Failed to write '%s': %s", filename, g_strerror (errno));
+
+    if (fd >= 0) {
+        close (fd);
+    }
+    g_unlink (tmp_name);
+    g_free (tmp_name);
+
+    return FALSE;
+}
+#endif
+
+/**
+ * lm_ssl_context_save_sessions:
+ * @context: an #LmSSLContext
+ * @filename: file to write
+ * @error: location to store error, or %NULL
+ *
+ * Writes the session cache of @context to @filename, to be read back with 
+ * lm_ssl_context_load_sessions(). The file holds the secrets to resume the 
+ * sessions and is created readable by the owner only.
+ *
+ * Return value: #TRUE if @filename was written, otherwise #FALSE.
+ **/
+gboolean
+lm_ssl_context_save_sessions (LmSSLContext  *context,
+                              const gchar   *filename,
+                              GError       **error)
+{
+    LmSSLContextBase *base;
+    GHashTableIter    iter;
+    gpointer          key, value;
+    GString          *contents;
+    gboolean          result;
+
+    g_return_val_if_fail (context != NULL, FALSE);
+    g_return_val_if_fail (filename != NULL, FALSE);
+
+    base = LM_SSL_CONTEXT_BASE (context);
+    contents = g_string_new (NULL);
+
+    g_mutex_lock (&base->sessions_lock);
+    g_hash_table_iter_init (&iter, base->sessions);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        gconstpointer  session;
+        gchar         *data;
+        gsize          len;
+
+        session = g_bytes_get_data (value, &len);
+        data = g_base64_encode (session, len);
+        g_string_append_printf (contents, "%s %s\n", (gchar *) key, data);
+        g_free (data);
+    }
+    g_mutex_unlock (&base->sessions_lock);
+
+#if GLIB_CHECK_VERSION(2, 66, 0)
+    result = g_file_set_contents_full (filename, 
+                                       contents->str, contents->len,
+                                       G_FILE_SET_CONTENTS_CONSISTENT, 0600,
+                                       error);
+#else
+    result = ssl_write_private_file (filename, 
+                                     contents->str, contents->len,
+                                     error);
+#endif
+
+    g_string_free (contents, TRUE);
+
+    return result;
+}
@@ -34,11 +34,16 @@
 
 #define CA_PEM_FILE "/etc/ssl/certs/ca-certificates.crt"
 
+struct _LmSSLContext {
+    LmSSLContextBase base;
+
+    gnutls_certificate_credentials gnutls_xcred;
+};
+
 struct _LmSSL {
     LmSSLBase base;
 
     gnutls_session                 gnutls_session;
-    gnutls_certificate_credentials gnutls_xcred;
     gboolean                       started;
 };
 
@@ -184,24 +189,119 @@ _lm_ssl_new (const gchar    *expected_fingerprint,
 void
 _lm_ssl_initialize (LmSSL *ssl) 
 {
+    _lm_ssl_get_context (ssl);
+}
+
+LmSSLContext *
+_lm_ssl_context_new (void)
+{
+    LmSSLContext *context;
+
+    context = g_new0 (LmSSLContext, 1);
+    _lm_ssl_context_base_init (LM_SSL_CONTEXT_BASE (context));
+
     gnutls_global_init ();
-    gnutls_certificate_allocate_credentials (&ssl->gnutls_xcred);
-    gnutls_certificate_set_x509_trust_file(ssl->gnutls_xcred,
+    gnutls_certificate_allocate_credentials (&context->gnutls_xcred);
+    gnutls_certificate_set_x509_trust_file(context->gnutls_xcred,
                                            CA_PEM_FILE,
                                            GNUTLS_X509_FMT_PEM);
+
+    return context;
+}
+
+void
+_lm_ssl_context_free (LmSSLContext *context)
+{
+    gnutls_certificate_free_credentials (context->gnutls_xcred);
+    gnutls_global_deinit ();
+    _lm_ssl_context_base_free_fields (LM_SSL_CONTEXT_BASE (context));
+    g_free (context);
+}
+
+static void
+ssl_resume_session (LmSSL *ssl)
+{
+    GBytes *bytes;
+    gsize   len;
+    gconstpointer data;
+
+    bytes = _lm_ssl_context_lookup_session (LM_SSL_CONTEXT_BASE (_lm_ssl_get_context (ssl)),
+                                            LM_SSL_BASE (ssl)->session_key);
+    if (!bytes) {
+        return;
+    }
+
+    data = g_bytes_get_data (bytes, &len);
+    gnutls_session_set_data (ssl->gnutls_session, data, len);
+
+    g_bytes_unref (bytes);
+}
+
+static void
+ssl_store_session (LmSSL *ssl)
+{
+    gnutls_datum_t  datum;
+    GBytes         *bytes;
+
+    if (gnutls_session_get_data2 (ssl->gnutls_session, &datum) < 0) {
+        return;
+    }
+
+    bytes = g_bytes_new (datum.data, datum.size);
+    gnutls_free (datum.data);
+
+    _lm_ssl_context_store_session (LM_SSL_CONTEXT_BASE (_lm_ssl_get_context (ssl)),
+                                   LM_SSL_BASE (ssl)->session_key,
+                                   bytes);
+    g_bytes_unref (bytes);
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+/* With TLS 1.3 the session data is only of use once the server has sent 
+ * a ticket, which happens after the handshake */
+static int
+ssl_new_session_ticket_cb (gnutls_session_t        session,
+                           unsigned int            htype,
+                           unsigned int            when,
+                           unsigned int            incoming,
+                           const gnutls_datum_t   *msg)
+{
+    if (gnutls_protocol_get_version (session) == GNUTLS_TLS1_3) {
+        ssl_store_session (gnutls_session_get_ptr (session));
+    }
+
+    return 0;
 }
+#endif
 
+/* Sets up @ssl on the connected @fd, the handshake is then run with
+ * _lm_ssl_handshake() */
 gboolean
-_lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
+_lm_ssl_begin (LmSSL       *ssl,
+               gint         fd,
+               const gchar *server,
+               guint        port,
+               GError     **error)
 {
-    int ret;
-    gboolean auth_ok = TRUE;
+    guint flags = GNUTLS_CLIENT;
     const int cert_type_priority[] =
         { GNUTLS_CRT_X509, GNUTLS_CRT_OPENPGP, 0 };
     const int compression_priority[] =
         { GNUTLS_COMP_DEFLATE, GNUTLS_COMP_NULL, 0 };
 
-    gnutls_init (&ssl->gnutls_session, GNUTLS_CLIENT);
+    _lm_ssl_base_set_server (LM_SSL_BASE (ssl), server, port);
+
+#if GNUTLS_VERSION_NUMBER >= 0x030506
+    /* For servers that fail on empty session tickets */
+    if (!LM_SSL_BASE (ssl)->use_session_tickets) {
+        flags |= GNUTLS_NO_TICKETS;
+    }
+#endif
+
+    gnutls_init (&ssl->gnutls_session, flags);
+    /* From here on _lm_ssl_close() has a session to deinit */
+    ssl->started = TRUE;
+
     gnutls_set_default_priority (ssl->gnutls_session);
     gnutls_certificate_type_set_priority (ssl->gnutls_session,
                                           cert_type_priority);
@@ -209,41 +309,75 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
                                      compression_priority);
     gnutls_credentials_set (ssl->gnutls_session,
                             GNUTLS_CRD_CERTIFICATE,
-                            ssl->gnutls_xcred);
+                            _lm_ssl_get_context (ssl)->gnutls_xcred);
 
     gnutls_transport_set_ptr (ssl->gnutls_session,
                               (gnutls_transport_ptr_t)(glong) fd);
 
-    ret = gnutls_handshake (ssl->gnutls_session);
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+    gnutls_session_set_ptr (ssl->gnutls_session, ssl);
+    gnutls_handshake_set_hook_function (ssl->gnutls_session,
+                                        GNUTLS_HANDSHAKE_NEW_SESSION_TICKET,
+                                        GNUTLS_HOOK_POST,
+                                        ssl_new_session_ticket_cb);
+#endif
 
-    if (ret >= 0) {
-        auth_ok = ssl_verify_certificate (ssl, server);
-    }
+    ssl_resume_session (ssl);
 
-    if (ret < 0 || !auth_ok) {
-        char *errmsg;
+    return TRUE;
+}
 
-        if (!auth_ok) {
-            errmsg = "authentication error";
-        } else {
-            errmsg = "handshake failed";
-        }
+/* Runs the handshake started by _lm_ssl_begin() as far as the socket
+ * allows. Returns G_IO_STATUS_AGAIN until it is done, the socket should
+ * then be polled for _lm_ssl_get_send_condition(). */
+GIOStatus
+_lm_ssl_handshake (LmSSL *ssl, GError **error)
+{
+    int ret;
 
+    ret = gnutls_handshake (ssl->gnutls_session);
+    if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+        return G_IO_STATUS_AGAIN;
+    }
+
+    if (ret < 0) {
+        g_set_error (error, 
+                     LM_ERROR, LM_ERROR_CONNECTION_OPEN,
+                     "*** GNUTLS handshake failed: %s",
+                     gnutls_strerror (ret));
+    }
+    else if (!ssl_verify_certificate (ssl, LM_SSL_BASE (ssl)->server)) {
         g_set_error (error, 
                      LM_ERROR, LM_ERROR_CONNECTION_OPEN,
-                     "*** GNUTLS %s: %s",
-                     errmsg, gnutls_strerror (ret));            
+                     "*** GNUTLS authentication error");
+        ret = -1;
+    }
 
-        return FALSE;
+    if (ret < 0) {
+        /* Don't offer a session that may be what failed */
+        _lm_ssl_context_remove_session (LM_SSL_CONTEXT_BASE (_lm_ssl_get_context (ssl)),
+                                        LM_SSL_BASE (ssl)->session_key);
+        return G_IO_STATUS_ERROR;
     }
 
     lm_verbose ("GNUTLS negotiated compression: %s",
                 gnutls_compression_get_name (gnutls_compression_get
                                              (ssl->gnutls_session)));
 
-    ssl->started = TRUE;
+    lm_verbose ("GNUTLS session %s",
+                gnutls_session_is_resumed (ssl->gnutls_session) ? 
+                "resumed" : "started");
 
-    return TRUE;
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+    /* See ssl_new_session_ticket_cb() */
+    if (gnutls_protocol_get_version (ssl->gnutls_session) != GNUTLS_TLS1_3) {
+        ssl_store_session (ssl);
+    }
+#else
+    ssl_store_session (ssl);
+#endif
+
+    return G_IO_STATUS_NORMAL;
 }
 
 GIOStatus
@@ -271,6 +405,8 @@ _lm_ssl_read (LmSSL *ssl, gchar *buf, gint len, gsize *bytes_read)
     return status;
 }
 
+/* Returns the number of bytes written, 0 if the write has to be retried
+ * once _lm_ssl_get_send_condition() is met and -1 on error */
 gint
 _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
 {
@@ -278,19 +414,46 @@ _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
 
     bytes_written = gnutls_record_send (ssl->gnutls_session, str, len);
 
-    while (bytes_written < 0) {
-        if (bytes_written != GNUTLS_E_INTERRUPTED &&
-            bytes_written != GNUTLS_E_AGAIN) {
-            return -1;
-        }
-    
-        bytes_written = gnutls_record_send (ssl->gnutls_session, 
-                                            str, len);
+    if (bytes_written == GNUTLS_E_INTERRUPTED ||
+        bytes_written == GNUTLS_E_AGAIN) {
+        return 0;
+    }
+
+    if (bytes_written < 0) {
+        return -1;
     }
 
     return bytes_written;
 }
 
+/* What the last write or handshake step that could not go on is
+ * waiting for */
+GIOCondition
+_lm_ssl_get_send_condition (LmSSL *ssl)
+{
+    /* 0 means gnutls was interrupted while reading */
+    if (gnutls_record_get_direction (ssl->gnutls_session) == 0) {
+        return G_IO_IN;
+    }
+
+    return G_IO_OUT;
+}
+
+/* Returns whether decrypted data is waiting that a poll on the socket
+ * would not report */
+gboolean
+_lm_ssl_get_pending (LmSSL *ssl)
+{
+    return gnutls_record_check_pending (ssl->gnutls_session) > 0;
+}
+
+gboolean
+_lm_ssl_get_ktls_send (LmSSL *ssl)
+{
+    /* Not implemented for GnuTLS */
+    return FALSE;
+}
+
 void 
 _lm_ssl_close (LmSSL *ssl)
 {
@@ -298,8 +461,7 @@ _lm_ssl_close (LmSSL *ssl)
         return;
 
     gnutls_deinit (ssl->gnutls_session);
-    gnutls_certificate_free_credentials (ssl->gnutls_xcred);
-    gnutls_global_deinit ();
+    ssl->started = FALSE;
 }
 
 void
@@ -35,6 +35,9 @@ void             _lm_ssl_initialize       (LmSSL            *ssl);
 gboolean         _lm_ssl_begin            (LmSSL            *ssl,
                                            gint              fd,
                                            const gchar      *server,
+                                           guint             port,
+                                           GError          **error);
+GIOStatus        _lm_ssl_handshake        (LmSSL            *ssl,
                                            GError          **error);
 GIOStatus        _lm_ssl_read             (LmSSL            *ssl,
                                            gchar            *buf,
@@ -43,6 +46,9 @@ GIOStatus        _lm_ssl_read             (LmSSL            *ssl,
 gint             _lm_ssl_send             (LmSSL            *ssl,
                                            const gchar      *str,
                                            gint              len);
+GIOCondition     _lm_ssl_get_send_condition (LmSSL          *ssl);
+gboolean         _lm_ssl_get_ktls_send    (LmSSL            *ssl);
+gboolean         _lm_ssl_get_pending      (LmSSL            *ssl);
 void             _lm_ssl_close            (LmSSL            *ssl);
 void             _lm_ssl_free             (LmSSL            *ssl);
 
@@ -55,6 +61,7 @@ void             _lm_ssl_initialize       (LmSSL            *ssl);
 gboolean         _lm_ssl_begin            (LmSSL            *ssl,
                                            gint              fd,
                                            const gchar      *server,
+                                           guint             port,
                                            GError          **error);
 GIOStatus        _lm_ssl_read             (LmSSL            *ssl,
                                            gchar            *buf,
@@ -66,4 +73,8 @@ gint             _lm_ssl_send             (LmSSL            *ssl,
 void             _lm_ssl_close            (LmSSL            *ssl);
 void             _lm_ssl_free             (LmSSL            *ssl);
 
+LmSSLContext *   _lm_ssl_context_new      (void);
+void             _lm_ssl_context_free     (LmSSLContext     *context);
+LmSSLContext *   _lm_ssl_get_context      (LmSSL            *ssl);
+
 #endif /* __LM_SSL_INTERNALS_H__ */
@@ -36,21 +36,45 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+/* Older versions need locking callbacks to be used from the workers of
+ * an LmConnectionPool */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#error "OpenSSL 1.1.0 or later is required"
+#endif
+
 #define LM_SSL_CN_MAX       63
 
+/* OpenSSL 3.0 can hand established sessions to the kernel */
+#if defined (SSL_OP_ENABLE_KTLS) && !defined (OPENSSL_NO_KTLS)
+#define LM_SSL_KTLS 1
+#endif
+
+struct _LmSSLContext {
+    LmSSLContextBase base;
+
+    SSL_CTX *ssl_ctx;
+};
+
 struct _LmSSL {
     LmSSLBase base;
 
-    SSL_METHOD *ssl_method;
+    /* Owned by the LmSSLContext of base */
     SSL_CTX *ssl_ctx;
     SSL *ssl;
     /*BIO *bio;*/
+
+    /* What the last blocked SSL_write() is waiting for */
+    GIOCondition send_condition;
+
+    /* The kernel encrypts what is written to the socket */
+    gboolean ktls_send;
 };
 
 int ssl_verify_cb (int preverify_ok, X509_STORE_CTX *x509_ctx);
 
 static gboolean ssl_verify_certificate (LmSSL *ssl, const gchar *server);
 static GIOStatus ssl_io_status_from_return (LmSSL *ssl, gint error);
+static int ssl_new_session_cb (SSL *ossl, SSL_SESSION *session);
 
 /*static char _ssl_error_code[11];*/
 
@@ -115,6 +139,60 @@ ssl_verify_cb (int preverify_ok, X509_STORE_CTX *x509_ctx)
     return 1;
 }
 
+/* Called for every session the server hands out, with TLS 1.3 that is
+ * after the handshake */
+static int
+ssl_new_session_cb (SSL *ossl, SSL_SESSION *session)
+{
+    LmSSL *ssl;
+    GBytes *bytes;
+    guchar *data, *p;
+    gint len;
+
+    ssl = SSL_get_app_data (ossl);
+
+    len = i2d_SSL_SESSION (session, NULL);
+    if (len <= 0) {
+        return 0;
+    }
+
+    data = p = g_malloc (len);
+    i2d_SSL_SESSION (session, &p);
+    bytes = g_bytes_new_take (data, len);
+
+    _lm_ssl_context_store_session (LM_SSL_CONTEXT_BASE (_lm_ssl_get_context (ssl)),
+                                   LM_SSL_BASE (ssl)->session_key,
+                                   bytes);
+    g_bytes_unref (bytes);
+
+    /* The session is kept serialized, not referenced */
+    return 0;
+}
+
+static void
+ssl_resume_session (LmSSL *ssl)
+{
+    GBytes *bytes;
+    SSL_SESSION *session;
+    const guchar *data;
+    gsize len;
+
+    bytes = _lm_ssl_context_lookup_session (LM_SSL_CONTEXT_BASE (_lm_ssl_get_context (ssl)),
+                                            LM_SSL_BASE (ssl)->session_key);
+    if (!bytes) {
+        return;
+    }
+
+    data = g_bytes_get_data (bytes, &len);
+    session = d2i_SSL_SESSION (NULL, &data, len);
+    if (session) {
+        SSL_set_session (ssl->ssl, session);
+        SSL_SESSION_free (session);
+    }
+
+    g_bytes_unref (bytes);
+}
+
 static gboolean
 ssl_verify_certificate (LmSSL *ssl, const gchar *server)
 {
@@ -285,35 +363,48 @@ _lm_ssl_new (const gchar    *expected_fingerprint,
 void
 _lm_ssl_initialize (LmSSL *ssl) 
 {
-    static gboolean initialized = FALSE;
+    ssl->ssl_ctx = _lm_ssl_get_context (ssl)->ssl_ctx;
+}
+
+LmSSLContext *
+_lm_ssl_context_new (void)
+{
+    static gsize initialized = 0;
+    LmSSLContext *context;
+    const SSL_METHOD *ssl_method;
     /*const char *cert_file = NULL;*/
 
-    if (!initialized) {
+    if (g_once_init_enter (&initialized)) {
         SSL_library_init();
         /* FIXME: Is this needed when we are not in debug? */
         SSL_load_error_strings();
-        initialized = TRUE;
+        g_once_init_leave (&initialized, 1);
     }
 
-    ssl->ssl_method = TLSv1_client_method();
-    if (ssl->ssl_method == NULL) {
-        g_warning ("TLSv1_client_method() == NULL");
+    context = g_new0 (LmSSLContext, 1);
+    _lm_ssl_context_base_init (LM_SSL_CONTEXT_BASE (context));
+
+    /* Negotiates the highest version both sides have, which is needed
+     * to resume TLS 1.3 sessions */
+    ssl_method = TLS_client_method();
+    if (ssl_method == NULL) {
+        g_warning ("TLS_client_method() == NULL");
         abort();
     }
-    ssl->ssl_ctx = SSL_CTX_new(ssl->ssl_method);
-    if (ssl->ssl_ctx == NULL) {
+    context->ssl_ctx = SSL_CTX_new(ssl_method);
+    if (context->ssl_ctx == NULL) {
         g_warning ("SSL_CTX_new() == NULL");
         abort();
     }
 
-    /* Set the NO_TICKET option on the context to allow for talk to Google Talk 
-     * which apparently seems to be having a problem handling empty session 
-     * tickets due to a bug in Java.
-     *
-     * See http://twistedmatrix.com/trac/ticket/3463 and
-     * Loudmouth [#28].
-     */
-    SSL_CTX_set_options (ssl->ssl_ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_options (context->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+    /* Sessions are cached by server name and port in the LmSSLContext,
+     * OpenSSL's own cache is keyed by session id only */
+    SSL_CTX_set_session_cache_mode (context->ssl_ctx,
+                                    SSL_SESS_CACHE_CLIENT |
+                                    SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb (context->ssl_ctx, ssl_new_session_cb);
 
     /*if (access("/etc/ssl/cert.pem", R_OK) == 0)
       cert_file = "/etc/ssl/cert.pem";
@@ -321,15 +412,30 @@ _lm_ssl_initialize (LmSSL *ssl)
       cert_file, "/etc/ssl/certs")) {
       g_warning("SSL_CTX_load_verify_locations() failed");
       }*/
-    SSL_CTX_set_default_verify_paths (ssl->ssl_ctx);
-    SSL_CTX_set_verify (ssl->ssl_ctx, SSL_VERIFY_PEER, ssl_verify_cb);
+    SSL_CTX_set_default_verify_paths (context->ssl_ctx);
+    SSL_CTX_set_verify (context->ssl_ctx, SSL_VERIFY_PEER, ssl_verify_cb);
+
+    return context;
 }
 
+void
+_lm_ssl_context_free (LmSSLContext *context)
+{
+    SSL_CTX_free (context->ssl_ctx);
+    _lm_ssl_context_base_free_fields (LM_SSL_CONTEXT_BASE (context));
+    g_free (context);
+}
+
+/* Sets up @ssl on the connected @fd, the handshake is then run with
+ * _lm_ssl_handshake() */
 gboolean
-_lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
+_lm_ssl_begin (LmSSL       *ssl,
+               gint         fd,
+               const gchar *server,
+               guint        port,
+               GError     **error)
 {
-    gint ssl_ret;
-    GIOStatus status;
+    _lm_ssl_base_set_server (LM_SSL_BASE (ssl), server, port);
 
     if (!ssl->ssl_ctx) {
         g_set_error (error,
@@ -346,6 +452,34 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
         return FALSE;
     }
 
+    /* Let SSL_write() return after each record and accept a retry from 
+     * a different buffer, the output queue gathers into a new one */
+    SSL_set_mode (ssl->ssl, 
+                  SSL_MODE_ENABLE_PARTIAL_WRITE | 
+                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    SSL_set_app_data (ssl->ssl, ssl);
+
+    if (!LM_SSL_BASE (ssl)->use_session_tickets) {
+        /* Allows to talk to Google Talk which apparently seems to be 
+         * having a problem handling empty session tickets due to a bug 
+         * in Java.
+         *
+         * See http://twistedmatrix.com/trac/ticket/3463 and
+         * Loudmouth [#28].
+         */
+        SSL_set_options (ssl->ssl, SSL_OP_NO_TICKET);
+    }
+
+#ifdef LM_SSL_KTLS
+    /* Only taken up if the kernel supports the negotiated cipher */
+    if (LM_SSL_BASE (ssl)->use_ktls) {
+        SSL_set_options (ssl->ssl, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+
+    ssl_resume_session (ssl);
+
     if (!SSL_set_fd (ssl->ssl, fd)) {
         g_warning ("SSL_set_fd() failed");
         g_set_error(error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
@@ -361,29 +495,72 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
       }
       SSL_set_bio(ssl->ssl, ssl->bio, ssl->bio);*/
 
-    do {
-        ssl_ret = SSL_connect(ssl->ssl);
-        if (ssl_ret <= 0) {
-            status = ssl_io_status_from_return(ssl, ssl_ret);
-            if (status != G_IO_STATUS_AGAIN) {
-                ssl_print_state(ssl, "SSL_connect",
-                                ssl_ret);
-                g_set_error(error, LM_ERROR,
-                            LM_ERROR_CONNECTION_OPEN,
-                            "SSL_connect()");
-                return FALSE;
-            }
+    ssl->send_condition = 0;
 
+    return TRUE;
+}
+
+/* Runs the handshake started by _lm_ssl_begin() as far as the socket
+ * allows. Returns G_IO_STATUS_AGAIN until it is done, the socket should
+ * then be polled for _lm_ssl_get_send_condition(). */
+GIOStatus
+_lm_ssl_handshake (LmSSL *ssl, GError **error)
+{
+    gint ssl_ret;
+
+    ssl_ret = SSL_connect (ssl->ssl);
+    if (ssl_ret <= 0) {
+        switch (SSL_get_error (ssl->ssl, ssl_ret)) {
+        case SSL_ERROR_WANT_READ:
+            ssl->send_condition = G_IO_IN;
+            return G_IO_STATUS_AGAIN;
+        case SSL_ERROR_WANT_WRITE:
+            ssl->send_condition = G_IO_OUT;
+            return G_IO_STATUS_AGAIN;
+        default:
+            break;
         }
-    } while (ssl_ret <= 0);
 
-    if (!ssl_verify_certificate (ssl, server)) {
+        ssl_print_state (ssl, "SSL_connect", ssl_ret);
+        /* Don't offer a session that may be what failed */
+        _lm_ssl_context_remove_session (LM_SSL_CONTEXT_BASE (_lm_ssl_get_context (ssl)),
+                                        LM_SSL_BASE (ssl)->session_key);
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
+                     "SSL_connect()");
+        return G_IO_STATUS_ERROR;
+    }
+
+    ssl->send_condition = 0;
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL,
+           "%s: Session %s\n", __FILE__,
+           SSL_session_reused (ssl->ssl) ? "resumed" : "started");
+
+    if (!ssl_verify_certificate (ssl, LM_SSL_BASE (ssl)->server)) {
         g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
                      "*** SSL certificate verification failed");
-        return FALSE;
+        return G_IO_STATUS_ERROR;
     }
-    
-    return TRUE; 
+
+#ifdef LM_SSL_KTLS
+    if (LM_SSL_BASE (ssl)->use_ktls) {
+        /* Writing around OpenSSL is only safe with TLS 1.2. With TLS 1.3
+         * a KeyUpdate from the peer has to be answered on the write side, 
+         * so output keeps going through SSL_write(), which still has the 
+         * kernel encrypt it. */
+        ssl->ktls_send = BIO_get_ktls_send (SSL_get_wbio (ssl->ssl)) &&
+            SSL_version (ssl->ssl) == TLS1_2_VERSION;
+
+        /* Received records are still read with SSL_read(), which leaves
+         * decrypting them to the kernel too */
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL,
+               "%s: Kernel TLS send %s, receive %s\n", __FILE__,
+               ssl->ktls_send ? "on" : "off",
+               BIO_get_ktls_recv (SSL_get_rbio (ssl->ssl)) ? "on" : "off");
+    }
+#endif
+
+    return G_IO_STATUS_NORMAL;
 }
 
 GIOStatus
@@ -402,22 +579,52 @@ _lm_ssl_read (LmSSL *ssl, gchar *buf, gint len, gsize *bytes_read)
     return status;
 }
 
+/* Returns the number of bytes written, 0 if the write has to be retried
+ * once _lm_ssl_get_send_condition() is met and -1 on error */
 gint
 _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
 {
-    GIOStatus status;
     gint ssl_ret;
 
-    do {
-        ssl_ret = SSL_write(ssl->ssl, str, len);
-        if (ssl_ret <= 0) {
-            status = ssl_io_status_from_return(ssl, ssl_ret);
-            if (status != G_IO_STATUS_AGAIN)
-                return -1;
-        }
-    } while (ssl_ret <= 0);
+    ssl_ret = SSL_write(ssl->ssl, str, len);
+    if (ssl_ret > 0) {
+        return ssl_ret;
+    }
 
-    return ssl_ret;
+    switch (SSL_get_error (ssl->ssl, ssl_ret)) {
+    case SSL_ERROR_WANT_READ:
+        ssl->send_condition = G_IO_IN;
+        return 0;
+    case SSL_ERROR_WANT_WRITE:
+        ssl->send_condition = G_IO_OUT;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* What the last SSL_write() or SSL_connect() that could not go on is
+ * waiting for */
+GIOCondition
+_lm_ssl_get_send_condition (LmSSL *ssl)
+{
+    return ssl->send_condition ? ssl->send_condition : G_IO_OUT;
+}
+
+/* Returns whether the kernel encrypts the output, which can then be 
+ * written to the socket directly */
+gboolean
+_lm_ssl_get_ktls_send (LmSSL *ssl)
+{
+    return ssl->ktls_send;
+}
+
+/* Returns whether decrypted data is waiting that a poll on the socket
+ * would not report */
+gboolean
+_lm_ssl_get_pending (LmSSL *ssl)
+{
+    return ssl->ssl != NULL && SSL_pending (ssl->ssl) > 0;
 }
 
 void 
@@ -428,14 +635,13 @@ _lm_ssl_close (LmSSL *ssl)
         SSL_free(ssl->ssl);
         ssl->ssl = NULL;
     }
+
+    ssl->ktls_send = FALSE;
 }
 
 void
 _lm_ssl_free (LmSSL *ssl)
 {
-    SSL_CTX_free(ssl->ssl_ctx);
-    ssl->ssl_ctx = NULL;
-
     _lm_ssl_base_free_fields (LM_SSL_BASE(ssl));
     g_free (ssl);
 }
@@ -34,6 +34,11 @@
  * lm_connection_set_ssl (connection, ssl);
  * ...
  * ]]></programlisting></informalexample>
+ * 
+ * The trusted CA certificates and the protocol settings are loaded into an 
+ * #LmSSLContext once and shared by every #LmSSL using it. Unless told 
+ * otherwise with lm_ssl_set_context() all #LmSSL share the context from 
+ * lm_ssl_context_get_default().
  */
 
 #ifndef __LM_SSL_H__
@@ -54,6 +59,14 @@ G_BEGIN_DECLS
  */
 typedef struct _LmSSL LmSSL;
 
+/**
+ * LmSSLContext:
+ * 
+ * The CA certificates and settings shared by a number of #LmSSL. This 
+ * should not be accessed directly.
+ */
+typedef struct _LmSSLContext LmSSLContext;
+
 /**
  * LmCertificateStatus:
  * @LM_CERT_INVALID: The certificate is invalid.
@@ -133,9 +146,32 @@ gboolean              lm_ssl_get_use_starttls (LmSSL *ssl);
 
 gboolean              lm_ssl_get_require_starttls (LmSSL *ssl);
 
+void                  lm_ssl_set_context     (LmSSL          *ssl,
+                                              LmSSLContext   *context);
+LmSSLContext *        lm_ssl_get_context     (LmSSL          *ssl);
+
+void                  lm_ssl_set_use_session_tickets (LmSSL    *ssl,
+                                                      gboolean  use_tickets);
+gboolean              lm_ssl_get_use_session_tickets (LmSSL    *ssl);
+
+void                  lm_ssl_set_use_ktls    (LmSSL          *ssl,
+                                              gboolean        use_ktls);
+gboolean              lm_ssl_get_use_ktls    (LmSSL          *ssl);
+
 LmSSL *               lm_ssl_ref             (LmSSL          *ssl);
 void                  lm_ssl_unref           (LmSSL          *ssl);
 
+LmSSLContext *        lm_ssl_context_new     (void);
+LmSSLContext *        lm_ssl_context_get_default (void);
+LmSSLContext *        lm_ssl_context_ref     (LmSSLContext   *context);
+void                  lm_ssl_context_unref   (LmSSLContext   *context);
+gboolean              lm_ssl_context_load_sessions (LmSSLContext  *context,
+                                                    const gchar   *filename,
+                                                    GError       **error);
+gboolean              lm_ssl_context_save_sessions (LmSSLContext  *context,
+                                                    const gchar   *filename,
+                                                    GError       **error);
+
 G_END_DECLS
 
 #endif /* __LM_SSL_H__ */
@@ -0,0 +1,499 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A hierarchical timer wheel. Timers are kept in WHEEL_LEVELS levels of
+ * WHEEL_SIZE slots each, level n covering WHEEL_SIZE^(n+1) ticks. Adding
+ * and cancelling a timer is O(1) and when the lowest level wraps around
+ * the next slot of the level above is cascaded down. The whole wheel is
+ * driven by a single GSource that only wakes up when a slot with timers
+ * is due or a cascade is needed.
+ */
+
+#include <config.h>
+
+#include "lm-timer-wheel.h"
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE  ((guint64) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+#define TICK_USEC    (LM_TIMER_WHEEL_TICK * 1000)
+
+struct _LmTimer {
+    LmTimer      *next;
+    LmTimer     **pprev;
+
+    guint64       expires;
+
+    LmTimerFunc   func;
+    gpointer      user_data;
+};
+
+struct _LmTimerWheel {
+    LmTimer      *slots[WHEEL_LEVELS][WHEEL_SIZE];
+
+    guint64       current_tick;
+    gint64        now;
+    guint         n_timers;
+
+    GMainContext *context;
+    GSource      *source;
+
+    gint          ref_count;
+};
+
+typedef struct {
+    GSource       source;
+    LmTimerWheel *wheel;
+} TimerWheelSource;
+
+static gboolean    timer_wheel_prepare_func    (GSource         *source,
+                                                gint            *timeout);
+static gboolean    timer_wheel_check_func      (GSource         *source);
+static gboolean    timer_wheel_dispatch_func   (GSource         *source,
+                                                GSourceFunc      callback,
+                                                gpointer         user_data);
+
+static GSourceFuncs source_funcs = {
+    timer_wheel_prepare_func,
+    timer_wheel_check_func,
+    timer_wheel_dispatch_func,
+    NULL
+};
+
+static void
+timer_wheel_free (LmTimerWheel *wheel)
+{
+    gint level, i;
+
+    lm_timer_wheel_detach (wheel);
+
+    for (level = 0; level < WHEEL_LEVELS; ++level) {
+        for (i = 0; i < WHEEL_SIZE; ++i) {
+            while (wheel->slots[level][i]) {
+                lm_timer_wheel_cancel (wheel, wheel->slots[level][i]);
+            }
+        }
+    }
+
+    g_slice_free (LmTimerWheel, wheel);
+}
+
+static guint64
+timer_wheel_time_to_tick (gint64 time)
+{
+    return time / TICK_USEC;
+}
+
+static gint64
+timer_wheel_get_now (LmTimerWheel *wheel)
+{
+    if (wheel->source) {
+        wheel->now = g_get_monotonic_time ();
+    }
+
+    return wheel->now;
+}
+
+static void
+timer_wheel_link (LmTimer **slot, LmTimer *timer)
+{
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void
+timer_wheel_unlink (LmTimer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+
+    timer->next  = NULL;
+    timer->pprev = NULL;
+}
+
+static void
+timer_wheel_insert (LmTimerWheel *wheel, LmTimer *timer)
+{
+    guint64 expires = timer->expires;
+    guint64 delta;
+    gint    level;
+
+    if (expires < wheel->current_tick) {
+        expires = wheel->current_tick;
+    }
+
+    delta = expires - wheel->current_tick;
+    if (delta >= WHEEL_RANGE) {
+        /* Too far in the future, park it in the last slot. It will be
+         * put back in the right place once it gets cascaded. */
+        expires = wheel->current_tick + WHEEL_RANGE - 1;
+        delta   = WHEEL_RANGE - 1;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; ++level) {
+        if (delta < ((guint64) 1 << (WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    timer_wheel_link (&wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK],
+                      timer);
+}
+
+static void
+timer_wheel_cascade (LmTimerWheel *wheel)
+{
+    gint level;
+
+    for (level = 1; level < WHEEL_LEVELS; ++level) {
+        guint    index;
+        LmTimer *list;
+
+        index = (wheel->current_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+        list = wheel->slots[level][index];
+        wheel->slots[level][index] = NULL;
+
+        while (list) {
+            LmTimer *timer = list;
+
+            list = timer->next;
+
+            timer->next  = NULL;
+            timer->pprev = NULL;
+            timer_wheel_insert (wheel, timer);
+        }
+
+        if (index != 0) {
+            break;
+        }
+    }
+}
+
+static gboolean
+timer_wheel_is_due (LmTimerWheel *wheel, gint64 now)
+{
+    if (wheel->n_timers == 0) {
+        return FALSE;
+    }
+
+    return timer_wheel_time_to_tick (now) > wheel->current_tick;
+}
+
+static gboolean
+timer_wheel_prepare_func (GSource *source, gint *timeout)
+{
+    LmTimerWheel *wheel;
+    gint64        now;
+
+    wheel = ((TimerWheelSource *) source)->wheel;
+    now = g_source_get_time (source);
+
+    if (timer_wheel_is_due (wheel, now)) {
+        return TRUE;
+    }
+
+    *timeout = lm_timer_wheel_get_timeout (wheel, now);
+
+    return FALSE;
+}
+
+static gboolean
+timer_wheel_check_func (GSource *source)
+{
+    LmTimerWheel *wheel;
+
+    wheel = ((TimerWheelSource *) source)->wheel;
+
+    return timer_wheel_is_due (wheel, g_source_get_time (source));
+}
+
+static gboolean
+timer_wheel_dispatch_func (GSource     *source,
+                           GSourceFunc  callback,
+                           gpointer     user_data)
+{
+    LmTimerWheel *wheel;
+
+    wheel = ((TimerWheelSource *) source)->wheel;
+
+    lm_timer_wheel_advance (wheel, g_source_get_time (source));
+
+    return TRUE;
+}
+
+LmTimerWheel *
+lm_timer_wheel_new (void)
+{
+    LmTimerWheel *wheel;
+
+    wheel = g_slice_new0 (LmTimerWheel);
+    wheel->ref_count = 1;
+
+    return wheel;
+}
+
+void
+lm_timer_wheel_attach (LmTimerWheel *wheel, GMainContext *context)
+{
+    GSource *source;
+
+    g_return_if_fail (wheel != NULL);
+
+    if (wheel->source) {
+        if (wheel->context == context) {
+            /* Already attached */
+            return;
+        }
+        lm_timer_wheel_detach (wheel);
+    }
+
+    if (context) {
+        wheel->context = g_main_context_ref (context);
+    }
+
+    source = g_source_new (&source_funcs, sizeof (TimerWheelSource));
+    ((TimerWheelSource *) source)->wheel = wheel;
+    wheel->source = source;
+
+    g_source_attach (source, wheel->context);
+
+    /* Catch up with the time that passed while detached */
+    lm_timer_wheel_advance (wheel, timer_wheel_get_now (wheel));
+}
+
+void
+lm_timer_wheel_detach (LmTimerWheel *wheel)
+{
+    g_return_if_fail (wheel != NULL);
+
+    if (wheel->source) {
+        g_source_destroy (wheel->source);
+        g_source_unref (wheel->source);
+    }
+
+    if (wheel->context) {
+        g_main_context_unref (wheel->context);
+    }
+
+    wheel->source  = NULL;
+    wheel->context = NULL;
+}
+
+/* Calls @func with @user_data once @timeout milliseconds have passed.
+ * The returned timer is owned by the wheel and is invalid once @func
+ * has been called or the timer has been cancelled. */
+LmTimer *
+lm_timer_wheel_add (LmTimerWheel *wheel,
+                    guint         timeout,
+                    LmTimerFunc   func,
+                    gpointer      user_data)
+{
+    LmTimer *timer;
+
+    g_return_val_if_fail (wheel != NULL, NULL);
+    g_return_val_if_fail (func != NULL, NULL);
+
+    timer = g_slice_new0 (LmTimer);
+    timer->func      = func;
+    timer->user_data = user_data;
+
+    lm_timer_wheel_readd (wheel, timer, timeout);
+
+    return timer;
+}
+
+void
+lm_timer_wheel_cancel (LmTimerWheel *wheel, LmTimer *timer)
+{
+    g_return_if_fail (wheel != NULL);
+    g_return_if_fail (timer != NULL);
+
+    if (timer->pprev) {
+        timer_wheel_unlink (timer);
+        wheel->n_timers--;
+    }
+
+    g_slice_free (LmTimer, timer);
+}
+
+/* Takes @timer out of @wheel without freeing it, so that it can be
+ * handed to lm_timer_wheel_readd() of another wheel. Returns the number
+ * of milliseconds that were left. */
+guint
+lm_timer_wheel_steal (LmTimerWheel *wheel, LmTimer *timer)
+{
+    guint64 now_tick;
+    guint64 base;
+
+    g_return_val_if_fail (wheel != NULL, 0);
+    g_return_val_if_fail (timer != NULL, 0);
+
+    if (timer->pprev) {
+        timer_wheel_unlink (timer);
+        wheel->n_timers--;
+    }
+
+    now_tick = timer_wheel_time_to_tick (timer_wheel_get_now (wheel));
+    base     = MAX (now_tick, wheel->current_tick);
+
+    if (timer->expires <= base) {
+        return 0;
+    }
+
+    return (timer->expires - base) * LM_TIMER_WHEEL_TICK;
+}
+
+/* Schedules @timer, new or stolen from a wheel, to run in @timeout
+ * milliseconds */
+void
+lm_timer_wheel_readd (LmTimerWheel *wheel, LmTimer *timer, guint timeout)
+{
+    guint64 now_tick;
+    guint64 ticks;
+
+    g_return_if_fail (wheel != NULL);
+    g_return_if_fail (timer != NULL && timer->pprev == NULL);
+
+    now_tick = timer_wheel_time_to_tick (timer_wheel_get_now (wheel));
+    if (wheel->n_timers == 0 && now_tick > wheel->current_tick) {
+        wheel->current_tick = now_tick;
+    }
+
+    ticks = MAX (1, (timeout + LM_TIMER_WHEEL_TICK - 1) / LM_TIMER_WHEEL_TICK);
+
+    timer->expires = MAX (now_tick, wheel->current_tick) + ticks;
+
+    timer_wheel_insert (wheel, timer);
+    wheel->n_timers++;
+}
+
+/* Moves the wheel forward to @now (monotonic time in microseconds),
+ * running all timers that expire on the way. */
+void
+lm_timer_wheel_advance (LmTimerWheel *wheel, gint64 now)
+{
+    guint64 target;
+
+    g_return_if_fail (wheel != NULL);
+
+    wheel->now = now;
+    target = timer_wheel_time_to_tick (now);
+
+    lm_timer_wheel_ref (wheel);
+
+    while (wheel->current_tick < target && wheel->n_timers > 0) {
+        guint index;
+
+        wheel->current_tick++;
+
+        index = wheel->current_tick & WHEEL_MASK;
+        if (index == 0) {
+            timer_wheel_cascade (wheel);
+        }
+
+        while (wheel->slots[0][index]) {
+            LmTimer *timer = wheel->slots[0][index];
+
+            timer_wheel_unlink (timer);
+            wheel->n_timers--;
+
+            timer->func (timer->user_data);
+            g_slice_free (LmTimer, timer);
+        }
+    }
+
+    if (wheel->current_tick < target) {
+        /* Nothing left to run, skip ahead */
+        wheel->current_tick = target;
+    }
+
+    lm_timer_wheel_unref (wheel);
+}
+
+/* Returns the number of milliseconds from @now until the wheel needs to
+ * be advanced again or -1 if there is nothing scheduled */
+gint
+lm_timer_wheel_get_timeout (LmTimerWheel *wheel, gint64 now)
+{
+    guint64 tick;
+    gint64  wakeup;
+
+    g_return_val_if_fail (wheel != NULL, -1);
+
+    if (wheel->n_timers == 0) {
+        return -1;
+    }
+
+    /* The next slot with timers in the lowest level, or the next
+     * cascade if it is empty for the rest of this round */
+    for (tick = wheel->current_tick + 1; ; ++tick) {
+        if ((tick & WHEEL_MASK) == 0 || wheel->slots[0][tick & WHEEL_MASK]) {
+            break;
+        }
+    }
+
+    wakeup = (gint64) tick * TICK_USEC;
+    if (wakeup <= now) {
+        return 0;
+    }
+
+    return (wakeup - now + 999) / 1000;
+}
+
+guint
+lm_timer_wheel_get_n_timers (LmTimerWheel *wheel)
+{
+    g_return_val_if_fail (wheel != NULL, 0);
+
+    return wheel->n_timers;
+}
+
+LmTimerWheel *
+lm_timer_wheel_ref (LmTimerWheel *wheel)
+{
+    g_return_val_if_fail (wheel != NULL, NULL);
+
+    g_atomic_int_inc (&wheel->ref_count);
+
+    return wheel;
+}
+
+void
+lm_timer_wheel_unref (LmTimerWheel *wheel)
+{
+    g_return_if_fail (wheel != NULL);
+
+    /* A wheel shared by a connection pool is released from any thread */
+    if (g_atomic_int_dec_and_test (&wheel->ref_count)) {
+        timer_wheel_free (wheel);
+    }
+}
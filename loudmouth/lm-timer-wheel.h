@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_TIMER_WHEEL_H__
+#define __LM_TIMER_WHEEL_H__
+
+#include <glib.h>
+
+/* Resolution of the wheel in milliseconds */
+#define LM_TIMER_WHEEL_TICK 10
+
+typedef struct _LmTimerWheel LmTimerWheel;
+typedef struct _LmTimer      LmTimer;
+
+typedef void (* LmTimerFunc) (gpointer user_data);
+
+LmTimerWheel * lm_timer_wheel_new            (void);
+void           lm_timer_wheel_attach         (LmTimerWheel *wheel,
+                                              GMainContext *context);
+void           lm_timer_wheel_detach         (LmTimerWheel *wheel);
+LmTimer *      lm_timer_wheel_add            (LmTimerWheel *wheel,
+                                              guint         timeout,
+                                              LmTimerFunc   func,
+                                              gpointer      user_data);
+void           lm_timer_wheel_cancel         (LmTimerWheel *wheel,
+                                              LmTimer      *timer);
+guint          lm_timer_wheel_steal          (LmTimerWheel *wheel,
+                                              LmTimer      *timer);
+void           lm_timer_wheel_readd          (LmTimerWheel *wheel,
+                                              LmTimer      *timer,
+                                              guint         timeout);
+void           lm_timer_wheel_advance        (LmTimerWheel *wheel,
+                                              gint64        now);
+gint           lm_timer_wheel_get_timeout    (LmTimerWheel *wheel,
+                                              gint64        now);
+guint          lm_timer_wheel_get_n_timers   (LmTimerWheel *wheel);
+LmTimerWheel * lm_timer_wheel_ref            (LmTimerWheel *wheel);
+void           lm_timer_wheel_unref          (LmTimerWheel *wheel);
+
+#endif /* __LM_TIMER_WHEEL_H__ */
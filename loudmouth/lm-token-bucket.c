@@ -0,0 +1,114 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "lm-token-bucket.h"
+
+/* A @rate of 0 leaves the bucket unlimited */
+void
+lm_token_bucket_init (LmTokenBucket *bucket,
+                      gdouble        rate,
+                      gdouble        burst,
+                      gint64         now)
+{
+    g_return_if_fail (bucket != NULL);
+    g_return_if_fail (rate >= 0);
+
+    bucket->rate    = rate;
+    bucket->burst   = MAX (burst, 1);
+    bucket->tokens  = bucket->burst;
+    bucket->updated = now;
+}
+
+gboolean
+lm_token_bucket_is_limited (LmTokenBucket *bucket)
+{
+    return bucket->rate > 0;
+}
+
+static void
+token_bucket_refill (LmTokenBucket *bucket, gint64 now)
+{
+    if (now <= bucket->updated) {
+        return;
+    }
+
+    bucket->tokens += bucket->rate * (now - bucket->updated) / G_USEC_PER_SEC;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+
+    bucket->updated = now;
+}
+
+gboolean
+lm_token_bucket_is_full (LmTokenBucket *bucket, gint64 now)
+{
+    if (!lm_token_bucket_is_limited (bucket)) {
+        return TRUE;
+    }
+
+    token_bucket_refill (bucket, now);
+
+    return bucket->tokens >= bucket->burst;
+}
+
+/* Returns how many microseconds from @now it takes until @amount tokens
+ * are available, 0 if they are already. More than @burst is never 
+ * available, so the wait is for a full bucket then. */
+gint64
+lm_token_bucket_get_delay (LmTokenBucket *bucket, 
+                           gdouble        amount,
+                           gint64         now)
+{
+    gdouble missing;
+
+    g_return_val_if_fail (bucket != NULL, 0);
+
+    if (!lm_token_bucket_is_limited (bucket)) {
+        return 0;
+    }
+
+    token_bucket_refill (bucket, now);
+
+    missing = MIN (amount, bucket->burst) - bucket->tokens;
+    if (missing <= 0) {
+        return 0;
+    }
+
+    /* Round up so that waiting the delay is always enough */
+    return (gint64) (missing * G_USEC_PER_SEC / bucket->rate) + 1;
+}
+
+/* Takes @amount tokens whether they are available or not */
+void
+lm_token_bucket_take (LmTokenBucket *bucket, gdouble amount, gint64 now)
+{
+    g_return_if_fail (bucket != NULL);
+
+    if (!lm_token_bucket_is_limited (bucket)) {
+        return;
+    }
+
+    token_bucket_refill (bucket, now);
+
+    bucket->tokens -= amount;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_TOKEN_BUCKET_H__
+#define __LM_TOKEN_BUCKET_H__
+
+#include <glib.h>
+
+/* A token bucket filling up at @rate tokens per second to at most @burst
+ * tokens. Taking more than there is leaves the bucket in debt, which has
+ * to be paid back before anything is available again. Times are in 
+ * microseconds as returned by g_get_monotonic_time(). */
+typedef struct {
+    gdouble rate;
+    gdouble burst;
+    gdouble tokens;
+    gint64  updated;
+} LmTokenBucket;
+
+void     lm_token_bucket_init       (LmTokenBucket *bucket,
+                                     gdouble        rate,
+                                     gdouble        burst,
+                                     gint64         now);
+gboolean lm_token_bucket_is_limited (LmTokenBucket *bucket);
+gboolean lm_token_bucket_is_full    (LmTokenBucket *bucket,
+                                     gint64         now);
+gint64   lm_token_bucket_get_delay  (LmTokenBucket *bucket,
+                                     gdouble        amount,
+                                     gint64         now);
+void     lm_token_bucket_take       (LmTokenBucket *bucket,
+                                     gdouble        amount,
+                                     gint64         now);
+
+#endif /* __LM_TOKEN_BUCKET_H__ */
@@ -75,17 +75,119 @@ _lm_utils_free_callback (LmCallback *cb)
     g_free (cb);
 }
 
+/* Ids are "lm", a random tag picked once per process, an underscore and
+ * a process wide counter. Replies to our own requests can then be 
+ * matched on the counter alone, see _lm_utils_parse_id(). */
+#define ID_PREFIX_LEN 11
+
+static const gchar *
+utils_get_id_prefix (void)
+{
+    static gsize initialized = 0;
+    static gchar prefix[ID_PREFIX_LEN + 1];
+
+    if (g_once_init_enter (&initialized)) {
+        g_snprintf (prefix, sizeof (prefix), "lm%08x_", g_random_int ());
+        g_once_init_leave (&initialized, 1);
+    }
+
+    return prefix;
+}
+
+#ifndef HAVE_ATOMIC_64
+G_LOCK_DEFINE_STATIC (id_counter);
+#endif
+
+static guint64
+utils_next_id (void)
+{
+    static guint64 counter = 0;
+
+#ifdef HAVE_ATOMIC_64
+    return __sync_add_and_fetch (&counter, 1);
+#else
+    guint64 value;
+
+    G_LOCK (id_counter);
+    value = ++counter;
+    G_UNLOCK (id_counter);
+
+    return value;
+#endif
+}
+
+/* Writes the id with counter @value into @buf, which must hold 
+ * LM_ID_BUF_SIZE bytes */
+void
+_lm_utils_print_id (guint64 value, gchar *buf)
+{
+    gchar digits[21];
+    gint  i = 0;
+
+    do {
+        digits[i++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    memcpy (buf, utils_get_id_prefix (), ID_PREFIX_LEN);
+    buf += ID_PREFIX_LEN;
+
+    while (i > 0) {
+        *buf++ = digits[--i];
+    }
+    *buf = '\0';
+}
+
+/* Writes a new unique id into @buf, which must hold LM_ID_BUF_SIZE bytes,
+ * and returns its counter value */
+guint64
+_lm_utils_format_id (gchar *buf)
+{
+    guint64 value;
+
+    value = utils_next_id ();
+    _lm_utils_print_id (value, buf);
+
+    return value;
+}
+
+/* Returns TRUE and the counter value in @value if @id was created by
+ * _lm_utils_format_id() in this process */
+gboolean
+_lm_utils_parse_id (const gchar *id, guint64 *value)
+{
+    const gchar *p;
+    guint64      n = 0;
+
+    if (!id || strncmp (id, utils_get_id_prefix (), ID_PREFIX_LEN) != 0) {
+        return FALSE;
+    }
+
+    p = id + ID_PREFIX_LEN;
+    if (*p == '\0' || *p == '0' || strlen (p) > 19) {
+        return FALSE;
+    }
+
+    for (; *p; ++p) {
+        if (*p < '0' || *p > '9') {
+            return FALSE;
+        }
+        n = n * 10 + (*p - '0');
+    }
+
+    *value = n;
+
+    return TRUE;
+}
+
 gchar *
 _lm_utils_generate_id (void)
 {
-    static guint  last_id = 0;
-    GTimeVal      tv;
-    glong         val;
-
-    g_get_current_time (&tv);
-    val = (tv.tv_sec & tv.tv_usec) + last_id++;
-        
-    return g_strdup_printf ("%ld%ld", val, tv.tv_usec);
+    gchar buf[LM_ID_BUF_SIZE];
+
+    _lm_utils_format_id (buf);
+
+    return g_strdup (buf);
 }
 
 gchar*
@@ -20,6 +20,7 @@
 
 #include <config.h>
 
+#include "lm-simple-io.h"
 #include "lm-xmpp-writer.h"
 
 static void    xmpp_writer_base_init (LmXmppWriterIface *iface);
@@ -58,26 +59,57 @@ xmpp_writer_base_init (LmXmppWriterIface *iface)
     }
 }
 
-void
-lm_xmpp_writer_send_message (LmXmppWriter *writer, LmMessage *message)
+/* Returns a writer that serializes straight into the output buffer of 
+ * @socket */
+LmXmppWriter *
+lm_xmpp_writer_new (LmOldSocket *socket)
+{
+    g_return_val_if_fail (socket != NULL, NULL);
+
+    return g_object_new (LM_TYPE_SIMPLE_IO, "socket", socket, NULL);
+}
+
+gboolean
+lm_xmpp_writer_send_message (LmXmppWriter      *writer, 
+                             LmMessage         *message,
+                             LmOutputPriority   priority,
+                             GError           **error)
 {
     if (!LM_XMPP_WRITER_GET_IFACE(writer)->send_message) {
         g_assert_not_reached ();
     }
 
-    LM_XMPP_WRITER_GET_IFACE(writer)->send_message (writer, message);
+    return LM_XMPP_WRITER_GET_IFACE(writer)->send_message (writer, message,
+                                                           priority, error);
 }
 
-void
-lm_xmpp_writer_send_text (LmXmppWriter *writer,
-                          const gchar  *buf,
-                          gsize         len)
+gboolean
+lm_xmpp_writer_send_text (LmXmppWriter      *writer,
+                          const gchar       *buf,
+                          gsize              len,
+                          LmOutputPriority   priority,
+                          GError           **error)
 {
     if (!LM_XMPP_WRITER_GET_IFACE(writer)->send_text) {
         g_assert_not_reached ();
     }
 
-    LM_XMPP_WRITER_GET_IFACE(writer)->send_text (writer, buf, len);
+    return LM_XMPP_WRITER_GET_IFACE(writer)->send_text (writer, buf, len,
+                                                        priority, error);
+}
+
+gboolean
+lm_xmpp_writer_send_bytes (LmXmppWriter  *writer,
+                           GBytes       **bytes,
+                           guint          n_bytes,
+                           GError       **error)
+{
+    if (!LM_XMPP_WRITER_GET_IFACE(writer)->send_bytes) {
+        g_assert_not_reached ();
+    }
+
+    return LM_XMPP_WRITER_GET_IFACE(writer)->send_bytes (writer, bytes, 
+                                                         n_bytes, error);
 }
 
 void
@@ -89,4 +121,3 @@ lm_xmpp_writer_flush (LmXmppWriter *writer)
 
     LM_XMPP_WRITER_GET_IFACE(writer)->flush (writer);
 }
-
@@ -25,6 +25,7 @@
 
 #include "lm-message.h"
 #include "lm-internals.h"
+#include "lm-old-socket.h"
 
 G_BEGIN_DECLS
 
@@ -40,25 +41,40 @@ struct _LmXmppWriterIface {
     GTypeInterface parent;
 
     /* <vtable> */
-    void (*send_message) (LmXmppWriter *writer,
-                          LmMessage    *message);
-    void (*send_text)    (LmXmppWriter *writer,
-                          const gchar  *buf,
-                          gsize         len);
+    gboolean (*send_message) (LmXmppWriter     *writer,
+                              LmMessage        *message,
+                              LmOutputPriority  priority,
+                              GError          **error);
+    gboolean (*send_text)    (LmXmppWriter     *writer,
+                              const gchar      *buf,
+                              gsize             len,
+                              LmOutputPriority  priority,
+                              GError          **error);
+    gboolean (*send_bytes)   (LmXmppWriter  *writer,
+                              GBytes       **bytes,
+                              guint          n_bytes,
+                              GError       **error);
 
-    /* Needed? */
-    void (*flush)        (LmXmppWriter   *writer);
+    void     (*flush)        (LmXmppWriter  *writer);
 };
 
 GType          lm_xmpp_writer_get_type      (void);
 
 LmXmppWriter * lm_xmpp_writer_new           (LmOldSocket       *socket);
 
-void           lm_xmpp_writer_send_message  (LmXmppWriter   *writer,
-                                             LmMessage      *message);
-void           lm_xmpp_writer_send_text     (LmXmppWriter   *writer,
-                                             const gchar    *buf,
-                                             gsize           len);
+gboolean       lm_xmpp_writer_send_message  (LmXmppWriter     *writer,
+                                             LmMessage        *message,
+                                             LmOutputPriority  priority,
+                                             GError          **error);
+gboolean       lm_xmpp_writer_send_text     (LmXmppWriter     *writer,
+                                             const gchar      *buf,
+                                             gsize             len,
+                                             LmOutputPriority  priority,
+                                             GError          **error);
+gboolean       lm_xmpp_writer_send_bytes    (LmXmppWriter   *writer,
+                                             GBytes        **bytes,
+                                             guint           n_bytes,
+                                             GError        **error);
 void           lm_xmpp_writer_flush         (LmXmppWriter   *writer);
 
 G_END_DECLS
@@ -24,6 +24,7 @@
 #define LM_INSIDE_LOUDMOUTH_H 1
 
 #include <loudmouth/lm-connection.h>
+#include <loudmouth/lm-connection-pool.h>
 #include <loudmouth/lm-error.h>
 #include <loudmouth/lm-message.h>
 #include <loudmouth/lm-message-handler.h>
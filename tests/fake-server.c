@@ -0,0 +1,372 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fake-server.h"
+
+/* Tests fail instead of hanging when what they wait for never comes */
+#define WAIT_TIMEOUT_MSECS 5000
+
+#define STREAM_HEADER                                                 \
+    "<?xml version='1.0' encoding='UTF-8'?>"                          \
+    "<stream:stream xmlns='jabber:client' "                           \
+    "xmlns:stream='http://etherx.jabber.org/streams' id='fake'>"
+
+struct _FakeServer {
+    GMainContext *context;
+
+    gint          listen_fd;
+    guint         port;
+    GSource      *listen_watch;
+
+    gint          client_fd;
+    GSource      *client_watch;
+    /* Whether client_watch reads, see fake_server_set_reading() */
+    gboolean      reading;
+
+    /* Everything the connection has sent */
+    GString      *received;
+
+    /* Answer each <iq/> with an empty result, up to reply_offset in
+     * received has been answered */
+    gboolean      auto_reply;
+    gsize         reply_offset;
+};
+
+static void
+server_write (FakeServer *server, const gchar *data, gsize len)
+{
+    while (len > 0) {
+        gssize written;
+
+        written = write (server->client_fd, data, len);
+        g_assert (written > 0);
+
+        data += written;
+        len  -= written;
+    }
+}
+
+static void
+server_auto_reply (FakeServer *server)
+{
+    const gchar *iq;
+
+    while ((iq = strstr (server->received->str + server->reply_offset,
+                         "<iq "))) {
+        const gchar *end;
+        const gchar *id;
+        gchar       *reply;
+
+        end = strchr (iq, '>');
+        if (!end) {
+            break;
+        }
+
+        server->reply_offset = end - server->received->str;
+
+        id = g_strstr_len (iq, end - iq, " id=\"");
+        if (!id) {
+            continue;
+        }
+
+        id += strlen (" id=\"");
+        reply = g_strdup_printf ("<iq type=\"result\" id=\"%.*s\"/>",
+                                 (gint) (strchr (id, '"') - id), id);
+        server_write (server, reply, strlen (reply));
+        g_free (reply);
+    }
+}
+
+static gboolean
+server_client_cb (GIOChannel   *channel,
+                  GIOCondition  condition,
+                  FakeServer   *server)
+{
+    gchar  buf[4096];
+    gssize len;
+
+    len = read (server->client_fd, buf, sizeof (buf));
+    if (len <= 0) {
+        server->client_watch = NULL;
+        close (server->client_fd);
+        server->client_fd = -1;
+
+        return FALSE;
+    }
+
+    g_string_append_len (server->received, buf, len);
+
+    if (server->auto_reply) {
+        server_auto_reply (server);
+    }
+
+    return TRUE;
+}
+
+static void
+server_add_client_watch (FakeServer *server)
+{
+    GIOChannel *client;
+
+    client = g_io_channel_unix_new (server->client_fd);
+    server->client_watch = g_io_create_watch (client, G_IO_IN | G_IO_HUP);
+    g_source_set_callback (server->client_watch,
+                           (GSourceFunc) server_client_cb, server, NULL);
+    g_source_attach (server->client_watch, server->context);
+    g_source_unref (server->client_watch);
+    g_io_channel_unref (client);
+}
+
+static gboolean
+server_accept_cb (GIOChannel   *channel,
+                  GIOCondition  condition,
+                  FakeServer   *server)
+{
+    g_assert (server->client_fd == -1);
+
+    server->client_fd = accept (server->listen_fd, NULL, NULL);
+    g_assert (server->client_fd >= 0);
+
+    server_write (server, STREAM_HEADER, strlen (STREAM_HEADER));
+
+    if (server->reading) {
+        server_add_client_watch (server);
+    }
+
+    return TRUE;
+}
+
+FakeServer *
+fake_server_new (GMainContext *context)
+{
+    FakeServer         *server;
+    GIOChannel         *channel;
+    struct sockaddr_in  addr;
+    socklen_t           addr_len = sizeof (addr);
+
+    server = g_new0 (FakeServer, 1);
+    server->context   = context;
+    server->client_fd = -1;
+    server->reading   = TRUE;
+    server->received  = g_string_new (NULL);
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    server->listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+    g_assert (server->listen_fd >= 0);
+    g_assert (bind (server->listen_fd, (struct sockaddr *) &addr,
+                    addr_len) == 0);
+    g_assert (listen (server->listen_fd, 1) == 0);
+    g_assert (getsockname (server->listen_fd, (struct sockaddr *) &addr,
+                           &addr_len) == 0);
+    server->port = ntohs (addr.sin_port);
+
+    channel = g_io_channel_unix_new (server->listen_fd);
+    server->listen_watch = g_io_create_watch (channel, G_IO_IN);
+    g_source_set_callback (server->listen_watch,
+                           (GSourceFunc) server_accept_cb, server, NULL);
+    g_source_attach (server->listen_watch, context);
+    g_io_channel_unref (channel);
+
+    return server;
+}
+
+void
+fake_server_free (FakeServer *server)
+{
+    fake_server_disconnect (server);
+
+    g_source_destroy (server->listen_watch);
+    g_source_unref (server->listen_watch);
+    close (server->listen_fd);
+
+    g_string_free (server->received, TRUE);
+    g_free (server);
+}
+
+static gboolean
+server_wakeup_cb (gboolean *timed_out)
+{
+    *timed_out = TRUE;
+
+    return FALSE;
+}
+
+/* Runs @context for @msecs */
+void
+fake_server_iterate (GMainContext *context, guint msecs)
+{
+    GSource  *source;
+    gboolean  timed_out = FALSE;
+
+    source = g_timeout_source_new (msecs);
+    g_source_set_callback (source, (GSourceFunc) server_wakeup_cb,
+                           &timed_out, NULL);
+    g_source_attach (source, context);
+
+    while (!timed_out) {
+        g_main_context_iteration (context, TRUE);
+    }
+
+    g_source_unref (source);
+}
+
+/* Opens @connection, which runs in the context of @server, to @server */
+void
+fake_server_open (FakeServer *server, LmConnection *connection)
+{
+    GSource  *source;
+    gboolean  timed_out = FALSE;
+
+    lm_connection_set_port (connection, server->port);
+
+    g_assert (lm_connection_open (connection, NULL, NULL, NULL, NULL));
+
+    source = g_timeout_source_new (WAIT_TIMEOUT_MSECS);
+    g_source_set_callback (source, (GSourceFunc) server_wakeup_cb,
+                           &timed_out, NULL);
+    g_source_attach (source, server->context);
+
+    while (lm_connection_get_state (connection) != LM_CONNECTION_STATE_OPEN) {
+        g_assert (!timed_out);
+        g_main_context_iteration (server->context, TRUE);
+    }
+
+    g_source_destroy (source);
+    g_source_unref (source);
+}
+
+/* Returns an open connection to @server, using its context */
+LmConnection *
+fake_server_connect (FakeServer *server)
+{
+    LmConnection *connection;
+
+    connection = lm_connection_new_with_context ("127.0.0.1",
+                                                 server->context);
+    fake_server_open (server, connection);
+
+    return connection;
+}
+
+void
+fake_server_set_auto_reply (FakeServer *server, gboolean auto_reply)
+{
+    server->auto_reply = auto_reply;
+}
+
+/* Stops or resumes reading what the connection sends, so that its output
+ * backs up once the kernel buffers are full */
+void
+fake_server_set_reading (FakeServer *server, gboolean reading)
+{
+    if (server->reading == reading) {
+        return;
+    }
+
+    server->reading = reading;
+
+    if (server->client_fd < 0) {
+        return;
+    }
+
+    if (reading) {
+        server_add_client_watch (server);
+    } else if (server->client_watch) {
+        g_source_destroy (server->client_watch);
+        server->client_watch = NULL;
+    }
+}
+
+/* Sends @data to the connection */
+void
+fake_server_send (FakeServer *server, const gchar *data)
+{
+    g_assert (server->client_fd >= 0);
+
+    server_write (server, data, strlen (data));
+}
+
+/* Runs the context until the connection has sent @data */
+void
+fake_server_wait_for (FakeServer *server, const gchar *data)
+{
+    GSource  *source;
+    gboolean  timed_out = FALSE;
+
+    source = g_timeout_source_new (WAIT_TIMEOUT_MSECS);
+    g_source_set_callback (source, (GSourceFunc) server_wakeup_cb,
+                           &timed_out, NULL);
+    g_source_attach (source, server->context);
+
+    while (!strstr (server->received->str, data)) {
+        g_assert (!timed_out);
+        g_main_context_iteration (server->context, TRUE);
+    }
+
+    g_source_destroy (source);
+    g_source_unref (source);
+}
+
+/* Returns everything the connection has sent */
+const gchar *
+fake_server_get_received (FakeServer *server)
+{
+    return server->received->str;
+}
+
+/* Returns how often the connection has sent @data */
+guint
+fake_server_count (FakeServer *server, const gchar *data)
+{
+    const gchar *p = server->received->str;
+    guint        n = 0;
+
+    while ((p = strstr (p, data))) {
+        p += strlen (data);
+        n++;
+    }
+
+    return n;
+}
+
+/* Drops the connection from the server side */
+void
+fake_server_disconnect (FakeServer *server)
+{
+    if (server->client_watch) {
+        g_source_destroy (server->client_watch);
+        server->client_watch = NULL;
+    }
+
+    if (server->client_fd >= 0) {
+        shutdown (server->client_fd, SHUT_RDWR);
+        close (server->client_fd);
+        server->client_fd = -1;
+    }
+}
@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __FAKE_SERVER_H__
+#define __FAKE_SERVER_H__
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+
+/* A server on the loopback interface that speaks just enough of the old
+ * Jabber stream for a connection to open. It runs from the main loop of
+ * the context it was created for. */
+typedef struct _FakeServer FakeServer;
+
+FakeServer *   fake_server_new            (GMainContext *context);
+void           fake_server_free           (FakeServer   *server);
+
+void           fake_server_open           (FakeServer   *server,
+                                           LmConnection *connection);
+LmConnection * fake_server_connect        (FakeServer   *server);
+
+void           fake_server_set_auto_reply (FakeServer   *server,
+                                           gboolean      auto_reply);
+void           fake_server_set_reading    (FakeServer   *server,
+                                           gboolean      reading);
+void           fake_server_send           (FakeServer   *server,
+                                           const gchar  *data);
+void           fake_server_wait_for       (FakeServer   *server,
+                                           const gchar  *data);
+guint          fake_server_count          (FakeServer   *server,
+                                           const gchar  *data);
+const gchar *  fake_server_get_received   (FakeServer   *server);
+void           fake_server_disconnect     (FakeServer   *server);
+
+void           fake_server_iterate        (GMainContext *context,
+                                           guint         msecs);
+
+#endif /* __FAKE_SERVER_H__ */
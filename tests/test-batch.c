@@ -0,0 +1,255 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "fake-server.h"
+
+#define N_MESSAGES 3
+
+typedef struct {
+    guint    n_calls;
+    guint    n_replies;
+    gchar   *ids[N_MESSAGES];
+} BatchResult;
+
+static void
+batch_cb (LmConnection  *connection,
+          LmMessage    **replies,
+          guint          n_replies,
+          BatchResult   *result)
+{
+    guint i;
+
+    result->n_calls++;
+    result->n_replies = n_replies;
+
+    for (i = 0; i < n_replies && i < N_MESSAGES; ++i) {
+        const gchar *id;
+
+        if (replies[i]) {
+            id = lm_message_node_get_attribute (replies[i]->node, "id");
+            result->ids[i] = g_strdup (id);
+        }
+    }
+}
+
+static void
+batch_result_clear (BatchResult *result)
+{
+    guint i;
+
+    for (i = 0; i < N_MESSAGES; ++i) {
+        g_free (result->ids[i]);
+    }
+}
+
+static void
+new_messages (LmMessage **messages, const gchar **ids)
+{
+    guint i;
+
+    for (i = 0; i < N_MESSAGES; ++i) {
+        messages[i] = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
+                                                    LM_MESSAGE_SUB_TYPE_GET);
+        if (ids[i]) {
+            lm_message_node_set_attribute (messages[i]->node, "id", ids[i]);
+        }
+    }
+}
+
+static void
+free_messages (LmMessage **messages)
+{
+    guint i;
+
+    for (i = 0; i < N_MESSAGES; ++i) {
+        lm_message_unref (messages[i]);
+    }
+}
+
+static void
+test_complete ()
+{
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+    LmMessage    *messages[N_MESSAGES];
+    const gchar  *ids[N_MESSAGES] = { "batch1", NULL, "batch3" };
+    BatchResult   result = { 0 };
+    GError       *error = NULL;
+    guint         i;
+
+    context    = g_main_context_new ();
+    server     = fake_server_new (context);
+    connection = fake_server_connect (server);
+
+    fake_server_set_auto_reply (server, TRUE);
+
+    new_messages (messages, ids);
+    g_assert (lm_connection_send_batch (connection, messages, N_MESSAGES,
+                                        5000, (LmBatchFunction) batch_cb,
+                                        &result, NULL, &error));
+    g_assert_no_error (error);
+
+    while (result.n_calls == 0) {
+        g_main_context_iteration (context, TRUE);
+    }
+
+    g_assert_cmpuint (result.n_calls, ==, 1);
+    g_assert_cmpuint (result.n_replies, ==, N_MESSAGES);
+
+    /* Replies come back in the order of the messages */
+    for (i = 0; i < N_MESSAGES; ++i) {
+        g_assert_cmpstr (result.ids[i], ==,
+                         lm_message_node_get_attribute (messages[i]->node, "id"));
+    }
+
+    batch_result_clear (&result);
+    free_messages (messages);
+
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+    fake_server_free (server);
+    g_main_context_unref (context);
+}
+
+static void
+test_duplicate_id ()
+{
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+    LmMessage    *messages[N_MESSAGES];
+    LmMessage    *others[N_MESSAGES];
+    const gchar  *ids[N_MESSAGES] = { "dup1", "dup2", "dup1" };
+    const gchar  *other_ids[N_MESSAGES] = { "other1", "other2", NULL };
+    const gchar  *pending_ids[N_MESSAGES] = { "other2", NULL, NULL };
+    BatchResult   result = { 0 };
+    GError       *error = NULL;
+
+    context    = g_main_context_new ();
+    server     = fake_server_new (context);
+    connection = fake_server_connect (server);
+
+    /* Within one batch */
+    new_messages (messages, ids);
+    g_assert (!lm_connection_send_batch (connection, messages, N_MESSAGES,
+                                         0, (LmBatchFunction) batch_cb,
+                                         &result, NULL, &error));
+    g_assert_error (error, LM_ERROR, LM_ERROR_DUPLICATE_ID);
+    g_clear_error (&error);
+    free_messages (messages);
+
+    /* Against a batch that is still waiting for its replies */
+    new_messages (others, other_ids);
+    g_assert (lm_connection_send_batch (connection, others, N_MESSAGES,
+                                        0, (LmBatchFunction) batch_cb,
+                                        &result, NULL, &error));
+    g_assert_no_error (error);
+
+    new_messages (messages, pending_ids);
+    g_assert (!lm_connection_send_batch (connection, messages, N_MESSAGES,
+                                         0, (LmBatchFunction) batch_cb,
+                                         &result, NULL, &error));
+    g_assert_error (error, LM_ERROR, LM_ERROR_DUPLICATE_ID);
+    g_clear_error (&error);
+
+    fake_server_wait_for (server, "other1");
+    fake_server_iterate (context, 50);
+
+    /* Nothing of the rejected batches was sent */
+    g_assert_cmpuint (fake_server_count (server, "dup1"), ==, 0);
+    g_assert_cmpuint (fake_server_count (server, "dup2"), ==, 0);
+    g_assert_cmpuint (fake_server_count (server, "other2"), ==, 1);
+    g_assert_cmpuint (result.n_calls, ==, 0);
+
+    free_messages (messages);
+    free_messages (others);
+
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+    fake_server_free (server);
+    g_main_context_unref (context);
+
+    batch_result_clear (&result);
+}
+
+static void
+test_teardown ()
+{
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+    LmMessage    *messages[N_MESSAGES];
+    const gchar  *ids[N_MESSAGES] = { NULL, NULL, NULL };
+    BatchResult   result = { 0 };
+    GError       *error = NULL;
+    guint         i;
+
+    context    = g_main_context_new ();
+    server     = fake_server_new (context);
+    connection = fake_server_connect (server);
+
+    new_messages (messages, ids);
+    g_assert (lm_connection_send_batch (connection, messages, N_MESSAGES,
+                                        0, (LmBatchFunction) batch_cb,
+                                        &result, NULL, &error));
+    g_assert_no_error (error);
+
+    /* Only the first message gets an answer */
+    fake_server_send (server, "<iq type='result' id='");
+    fake_server_send (server,
+                      lm_message_node_get_attribute (messages[0]->node, "id"));
+    fake_server_send (server, "'/>");
+    fake_server_iterate (context, 50);
+
+    g_assert_cmpuint (result.n_calls, ==, 0);
+
+    /* Closing the connection completes the batch with what arrived */
+    lm_connection_close (connection, NULL);
+
+    g_assert_cmpuint (result.n_calls, ==, 1);
+    g_assert_cmpuint (result.n_replies, ==, N_MESSAGES);
+    g_assert (result.ids[0] != NULL);
+    for (i = 1; i < N_MESSAGES; ++i) {
+        g_assert (result.ids[i] == NULL);
+    }
+
+    batch_result_clear (&result);
+    free_messages (messages);
+
+    lm_connection_unref (connection);
+    fake_server_free (server);
+    g_main_context_unref (context);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/batch/complete", test_complete);
+    g_test_add_func ("/batch/duplicate_id", test_duplicate_id);
+    g_test_add_func ("/batch/teardown", test_teardown);
+
+    return g_test_run ();
+}
@@ -0,0 +1,170 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "fake-server.h"
+
+static LmMessage *
+new_ping (const gchar *id)
+{
+    LmMessage *m;
+
+    m = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_GET);
+    lm_message_node_set_attribute (m->node, "id", id);
+
+    return m;
+}
+
+static void
+test_reply ()
+{
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+    LmMessage    *m;
+    LmMessage    *reply;
+    GError       *error = NULL;
+
+    context    = g_main_context_new ();
+    server     = fake_server_new (context);
+    connection = fake_server_connect (server);
+
+    fake_server_set_auto_reply (server, TRUE);
+
+    m = new_ping ("block1");
+    reply = lm_connection_send_with_reply_and_block_timeout (connection, m,
+                                                             5000, &error);
+    g_assert_no_error (error);
+    g_assert (reply != NULL);
+    g_assert_cmpstr (lm_message_node_get_attribute (reply->node, "id"),
+                     ==, "block1");
+    g_assert_cmpint (lm_message_get_sub_type (reply),
+                     ==, LM_MESSAGE_SUB_TYPE_RESULT);
+
+    lm_message_unref (reply);
+    lm_message_unref (m);
+
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+    fake_server_free (server);
+    g_main_context_unref (context);
+}
+
+static void
+test_timeout ()
+{
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+    LmMessage    *m;
+    LmMessage    *reply;
+    GError       *error = NULL;
+    GTimer       *timer;
+
+    context    = g_main_context_new ();
+    server     = fake_server_new (context);
+    connection = fake_server_connect (server);
+
+    timer = g_timer_new ();
+
+    m = new_ping ("block2");
+    reply = lm_connection_send_with_reply_and_block_timeout (connection, m,
+                                                             200, &error);
+    g_assert (reply == NULL);
+    g_assert_error (error, LM_ERROR, LM_ERROR_TIMED_OUT);
+    g_assert_cmpfloat (g_timer_elapsed (timer, NULL), >=, 0.2);
+    g_clear_error (&error);
+
+    /* The request went out, the server just never answered */
+    g_assert_cmpuint (fake_server_count (server, "block2"), ==, 1);
+
+    /* A late reply is dispatched like any other message */
+    fake_server_send (server, "<iq type='result' id='block2'/>");
+    fake_server_iterate (context, 50);
+
+    g_timer_destroy (timer);
+    lm_message_unref (m);
+
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+    fake_server_free (server);
+    g_main_context_unref (context);
+}
+
+static gboolean
+disconnect_cb (FakeServer *server)
+{
+    fake_server_disconnect (server);
+
+    return FALSE;
+}
+
+static void
+test_disconnect ()
+{
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+    LmMessage    *m;
+    LmMessage    *reply;
+    GError       *error = NULL;
+    GSource      *source;
+
+    context    = g_main_context_new ();
+    server     = fake_server_new (context);
+    connection = fake_server_connect (server);
+
+    /* Drop the connection while the caller is blocked */
+    source = g_timeout_source_new (100);
+    g_source_set_callback (source, (GSourceFunc) disconnect_cb, server, NULL);
+    g_source_attach (source, context);
+    g_source_unref (source);
+
+    m = new_ping ("block3");
+    reply = lm_connection_send_with_reply_and_block_timeout (connection, m,
+                                                             5000, &error);
+    g_assert (reply == NULL);
+    g_assert_error (error, LM_ERROR, LM_ERROR_CONNECTION_FAILED);
+    g_clear_error (&error);
+
+    g_assert_cmpint (lm_connection_get_state (connection),
+                     ==, LM_CONNECTION_STATE_CLOSED);
+
+    lm_message_unref (m);
+
+    lm_connection_unref (connection);
+    fake_server_free (server);
+    g_main_context_unref (context);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/blocking_reply/reply", test_reply);
+    g_test_add_func ("/blocking_reply/timeout", test_timeout);
+    g_test_add_func ("/blocking_reply/disconnect", test_disconnect);
+
+    return g_test_run ();
+}
@@ -0,0 +1,233 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "fake-server.h"
+
+#define N_CONNECTIONS 10
+
+static GMutex  lock;
+static GCond   cond;
+static gint    n_freed;
+
+static gboolean
+unref_cb (gpointer user_data)
+{
+    lm_connection_unref (user_data);
+
+    g_mutex_lock (&lock);
+    n_freed++;
+    g_cond_signal (&cond);
+    g_mutex_unlock (&lock);
+
+    return FALSE;
+}
+
+static gboolean
+thread_cb (gpointer user_data)
+{
+    GThread **thread = user_data;
+
+    g_mutex_lock (&lock);
+    *thread = g_thread_self ();
+    g_cond_signal (&cond);
+    g_mutex_unlock (&lock);
+
+    return FALSE;
+}
+
+/* Returns the thread running @connection */
+static GThread *
+get_thread (LmConnectionPool *pool, LmConnection *connection)
+{
+    GThread *thread = NULL;
+
+    lm_connection_pool_invoke (pool, connection, thread_cb, &thread, NULL);
+
+    g_mutex_lock (&lock);
+    while (!thread) {
+        g_cond_wait (&cond, &lock);
+    }
+    g_mutex_unlock (&lock);
+
+    return thread;
+}
+
+static void
+test_default_context ()
+{
+    LmConnectionPool      *pool;
+    LmConnection          *connection;
+    LmConnectionPoolStats  stats;
+
+    pool = lm_connection_pool_new (0);
+    g_assert (lm_connection_pool_get_n_workers (pool) == 0);
+
+    connection = lm_connection_pool_new_connection (pool, "localhost");
+    g_assert (lm_connection_get_state (connection) == LM_CONNECTION_STATE_CLOSED);
+
+    lm_connection_pool_get_stats (pool, &stats);
+    g_assert (stats.n_workers == 0);
+    g_assert (stats.n_connections == 1);
+    g_assert (stats.n_open == 0);
+
+    /* The connection keeps the pool alive */
+    lm_connection_pool_unref (pool);
+    lm_connection_unref (connection);
+}
+
+static void
+test_workers ()
+{
+    LmConnectionPool      *pool;
+    LmConnection          *connections[N_CONNECTIONS];
+    LmConnectionPoolStats  stats;
+    gint                   i;
+
+    pool = lm_connection_pool_new (3);
+    g_assert (lm_connection_pool_get_n_workers (pool) == 3);
+
+    for (i = 0; i < N_CONNECTIONS; i++) {
+        connections[i] = lm_connection_pool_new_connection (pool, "localhost");
+    }
+
+    lm_connection_pool_get_stats (pool, &stats);
+    g_assert (stats.n_workers == 3);
+    g_assert (stats.n_connections == N_CONNECTIONS);
+    g_assert (stats.n_opening == 0);
+    g_assert (stats.n_authenticated == 0);
+
+    n_freed = 0;
+    for (i = 0; i < N_CONNECTIONS; i++) {
+        lm_connection_pool_invoke (pool, connections[i], unref_cb,
+                                   connections[i], NULL);
+    }
+
+    g_mutex_lock (&lock);
+    while (n_freed < N_CONNECTIONS) {
+        g_cond_wait (&cond, &lock);
+    }
+    g_mutex_unlock (&lock);
+
+    lm_connection_pool_get_stats (pool, &stats);
+    g_assert (stats.n_connections == 0);
+
+    lm_connection_pool_unref (pool);
+}
+
+static void
+test_hash ()
+{
+    LmConnectionPool *pool;
+    LmConnection     *connections[3];
+    gint              i;
+
+    pool = lm_connection_pool_new (3);
+
+    connections[0] = lm_connection_pool_new_connection_with_hash (pool, "localhost", 7);
+    connections[1] = lm_connection_pool_new_connection_with_hash (pool, "localhost", 7);
+    connections[2] = lm_connection_pool_new_connection_with_hash (pool, "localhost", 8);
+
+    g_assert (get_thread (pool, connections[0]) == get_thread (pool, connections[1]));
+    g_assert (get_thread (pool, connections[0]) != get_thread (pool, connections[2]));
+
+    n_freed = 0;
+    for (i = 0; i < 3; i++) {
+        lm_connection_pool_invoke (pool, connections[i], unref_cb,
+                                   connections[i], NULL);
+    }
+
+    g_mutex_lock (&lock);
+    while (n_freed < 3) {
+        g_cond_wait (&cond, &lock);
+    }
+    g_mutex_unlock (&lock);
+
+    lm_connection_pool_unref (pool);
+}
+
+static void
+test_per_cpu ()
+{
+    LmConnectionPool *pool;
+
+    pool = lm_connection_pool_new_per_cpu ();
+    g_assert (lm_connection_pool_get_n_workers (pool) >= 1);
+
+    lm_connection_pool_unref (pool);
+}
+
+/* Connections of a pool share their DNS lookups */
+static void
+test_resolver_cache ()
+{
+    LmConnectionPool      *pool;
+    FakeServer            *server;
+    LmConnection          *connection;
+    LmConnectionPoolStats  stats;
+    gint                   i;
+
+    pool   = lm_connection_pool_new (0);
+    server = fake_server_new (NULL);
+
+    for (i = 0; i < 2; i++) {
+        connection = lm_connection_pool_new_connection (pool, "127.0.0.1");
+        fake_server_open (server, connection);
+
+        lm_connection_close (connection, NULL);
+        lm_connection_unref (connection);
+        fake_server_disconnect (server);
+    }
+
+    lm_connection_pool_get_stats (pool, &stats);
+    g_assert (stats.n_resolver_misses == 1);
+    g_assert (stats.n_resolver_hits == 1);
+
+    /* Turned off, every connection looks its server up */
+    lm_connection_pool_set_resolver_ttl (pool, 0);
+
+    connection = lm_connection_pool_new_connection (pool, "127.0.0.1");
+    fake_server_open (server, connection);
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+
+    lm_connection_pool_get_stats (pool, &stats);
+    g_assert (stats.n_resolver_misses == 1);
+    g_assert (stats.n_resolver_hits == 1);
+
+    fake_server_free (server);
+    lm_connection_pool_unref (pool);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/connection_pool/default_context", test_default_context);
+    g_test_add_func ("/connection_pool/workers", test_workers);
+    g_test_add_func ("/connection_pool/hash", test_hash);
+    g_test_add_func ("/connection_pool/per_cpu", test_per_cpu);
+    g_test_add_func ("/connection_pool/resolver_cache", test_resolver_cache);
+
+    return g_test_run ();
+}
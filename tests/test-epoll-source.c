@@ -0,0 +1,154 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "loudmouth/lm-epoll-source.h"
+
+typedef struct {
+    gint          fd;
+    guint         n_calls;
+    GIOCondition  condition;
+    gboolean      drain;
+    gboolean      free_watch;
+} Watched;
+
+static void
+watch_cb (LmEpollWatch *watch, GIOCondition condition, Watched *watched)
+{
+    gchar c;
+
+    watched->n_calls++;
+    watched->condition = condition;
+
+    if (watched->drain) {
+        while (read (watched->fd, &c, 1) == 1) {
+            ;
+        }
+    }
+
+    if (watched->free_watch) {
+        lm_epoll_watch_free (watch);
+    }
+}
+
+static void
+iterate (GMainContext *context)
+{
+    while (g_main_context_iteration (context, FALSE)) {
+        ;
+    }
+}
+
+static void
+test_edge_triggered ()
+{
+    GMainContext *context;
+    LmEpollWatch *watch;
+    Watched       watched = { 0 };
+    gint          fds[2];
+
+    context = g_main_context_new ();
+    g_assert (pipe (fds) == 0);
+    fcntl (fds[0], F_SETFL, O_NONBLOCK);
+
+    watched.fd = fds[0];
+    watch = lm_epoll_watch_new (context, fds[0], G_IO_IN,
+                                (LmEpollFunc) watch_cb, &watched);
+    g_assert (watch != NULL);
+
+    iterate (context);
+    g_assert (watched.n_calls == 0);
+
+    /* Reported once even though nothing was read */
+    g_assert (write (fds[1], "ab", 2) == 2);
+    iterate (context);
+    g_assert (watched.n_calls == 1);
+    g_assert (watched.condition & G_IO_IN);
+
+    iterate (context);
+    g_assert (watched.n_calls == 1);
+
+    /* Until it is put back */
+    lm_epoll_watch_set_ready (watch, G_IO_IN);
+    watched.drain = TRUE;
+    g_main_context_iteration (context, FALSE);
+    g_assert (watched.n_calls == 2);
+
+    /* New data is a new edge */
+    g_assert (write (fds[1], "c", 1) == 1);
+    iterate (context);
+    g_assert (watched.n_calls == 3);
+
+    lm_epoll_watch_free (watch);
+    close (fds[0]);
+    close (fds[1]);
+    g_main_context_unref (context);
+}
+
+static void
+test_free_while_ready ()
+{
+    GMainContext *context;
+    Watched       first = { 0 };
+    Watched       second = { 0 };
+    LmEpollWatch *watch;
+    gint          fds[2];
+
+    context = g_main_context_new ();
+    g_assert (pipe (fds) == 0);
+
+    first.fd = fds[0];
+    first.free_watch = TRUE;
+    watch = lm_epoll_watch_new (context, fds[0], G_IO_IN,
+                                (LmEpollFunc) watch_cb, &first);
+    g_assert (watch != NULL);
+
+    /* Freeing a queued watch takes it off the ready list */
+    second.fd = fds[1];
+    watch = lm_epoll_watch_new (context, fds[1], G_IO_OUT,
+                                (LmEpollFunc) watch_cb, &second);
+    lm_epoll_watch_set_ready (watch, G_IO_OUT);
+    lm_epoll_watch_free (watch);
+
+    /* The last watch going away in its callback removes the source */
+    g_assert (write (fds[1], "a", 1) == 1);
+    iterate (context);
+    g_assert (first.n_calls == 1);
+    g_assert (second.n_calls == 0);
+
+    close (fds[0]);
+    close (fds[1]);
+    g_main_context_unref (context);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/epoll_source/edge_triggered", test_edge_triggered);
+    g_test_add_func ("/epoll_source/free_while_ready", test_free_while_ready);
+
+    return g_test_run ();
+}
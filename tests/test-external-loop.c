@@ -0,0 +1,158 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "loudmouth/lm-external-loop.h"
+
+static gboolean
+count_cb (gpointer user_data)
+{
+    (*(guint *) user_data)++;
+
+    return FALSE;
+}
+
+static gboolean
+read_cb (GIOChannel *channel, GIOCondition condition, gpointer user_data)
+{
+    gchar c;
+
+    (*(guint *) user_data)++;
+    g_assert (read (g_io_channel_unix_get_fd (channel), &c, 1) == 1);
+
+    return TRUE;
+}
+
+static void
+attach (GMainContext *context, GSource *source, gpointer func, guint *n_calls)
+{
+    g_source_set_callback (source, (GSourceFunc) func, n_calls, NULL);
+    g_source_attach (source, context);
+    g_source_unref (source);
+}
+
+static void
+test_idle ()
+{
+    LmExternalLoop *loop;
+    GIOCondition    events;
+    guint           n_calls = 0;
+    gint            timeout;
+
+    loop = lm_external_loop_new ();
+
+    g_assert (lm_external_loop_prepare (loop, &events, &timeout) == -1);
+    g_assert (timeout == -1);
+
+    attach (lm_external_loop_get_context (loop), g_idle_source_new (),
+            count_cb, &n_calls);
+
+    lm_external_loop_prepare (loop, &events, &timeout);
+    g_assert (timeout == 0);
+
+    lm_external_loop_process (loop, 0);
+    g_assert (n_calls == 1);
+
+    lm_external_loop_prepare (loop, &events, &timeout);
+    g_assert (timeout == -1);
+
+    lm_external_loop_free (loop);
+}
+
+static void
+test_timeout ()
+{
+    LmExternalLoop *loop;
+    guint           n_calls = 0;
+    gint            timeout;
+
+    loop = lm_external_loop_new ();
+
+    attach (lm_external_loop_get_context (loop), g_timeout_source_new (20),
+            count_cb, &n_calls);
+
+    lm_external_loop_prepare (loop, NULL, &timeout);
+    g_assert (timeout > 0 && timeout <= 20);
+
+    /* Processing before the timeout does nothing */
+    lm_external_loop_process (loop, 0);
+    g_assert (n_calls == 0);
+
+    g_usleep (25 * G_TIME_SPAN_MILLISECOND);
+    lm_external_loop_prepare (loop, NULL, &timeout);
+    g_assert (timeout == 0);
+
+    lm_external_loop_process (loop, 0);
+    g_assert (n_calls == 1);
+
+    lm_external_loop_free (loop);
+}
+
+static void
+test_fd ()
+{
+    LmExternalLoop *loop;
+    GIOChannel     *channel;
+    GIOCondition    events;
+    guint           n_calls = 0;
+    gint            fds[2];
+    gint            timeout;
+
+    loop = lm_external_loop_new ();
+    g_assert (pipe (fds) == 0);
+
+    channel = g_io_channel_unix_new (fds[0]);
+    attach (lm_external_loop_get_context (loop),
+            g_io_create_watch (channel, G_IO_IN), read_cb, &n_calls);
+
+    g_assert (lm_external_loop_prepare (loop, &events, &timeout) == fds[0]);
+    g_assert (events & G_IO_IN);
+    g_assert (timeout == -1);
+
+    /* Only what the host reports is dispatched */
+    g_assert (write (fds[1], "a", 1) == 1);
+    lm_external_loop_process (loop, 0);
+    g_assert (n_calls == 0);
+
+    lm_external_loop_prepare (loop, &events, &timeout);
+    lm_external_loop_process (loop, G_IO_IN);
+    g_assert (n_calls == 1);
+
+    g_io_channel_unref (channel);
+    lm_external_loop_free (loop);
+    close (fds[0]);
+    close (fds[1]);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/external_loop/idle", test_idle);
+    g_test_add_func ("/external_loop/timeout", test_timeout);
+    g_test_add_func ("/external_loop/fd", test_fd);
+
+    return g_test_run ();
+}
@@ -0,0 +1,321 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "fake-server.h"
+
+#define BODY_SIZE      (16 * 1024)
+/* More than the kernel buffers of a loopback connection take */
+#define MAX_FILL_SENDS 4096
+
+typedef struct {
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+} Fixture;
+
+typedef struct {
+    guint    n_calls;
+    gboolean success;
+    gsize    pending;
+} CallResult;
+
+static void
+fixture_setup (Fixture *fixture)
+{
+    fixture->context    = g_main_context_new ();
+    fixture->server     = fake_server_new (fixture->context);
+    fixture->connection = fake_server_connect (fixture->server);
+}
+
+static void
+fixture_teardown (Fixture *fixture)
+{
+    lm_connection_close (fixture->connection, NULL);
+    lm_connection_unref (fixture->connection);
+    fake_server_free (fixture->server);
+    g_main_context_unref (fixture->context);
+}
+
+static LmMessage *
+new_message (const gchar *marker, gsize body_size)
+{
+    LmMessage *message;
+    gchar     *body;
+
+    message = lm_message_new ("peer@example.org", LM_MESSAGE_TYPE_MESSAGE);
+    lm_message_node_set_attribute (message->node, "id", marker);
+
+    body = g_strnfill (body_size, 'x');
+    lm_message_node_add_child (message->node, "body", body);
+    g_free (body);
+
+    return message;
+}
+
+/* Stops the server from reading and sends until output is pending */
+static void
+fixture_fill (Fixture *fixture)
+{
+    LmMessage *message;
+    guint      i;
+
+    fake_server_set_reading (fixture->server, FALSE);
+
+    message = new_message ("fill", BODY_SIZE);
+    for (i = 0; i < MAX_FILL_SENDS; ++i) {
+        g_assert (lm_connection_send (fixture->connection, message, NULL));
+
+        if (lm_connection_get_pending_output (fixture->connection) > 0) {
+            break;
+        }
+    }
+    lm_message_unref (message);
+
+    g_assert_cmpuint (lm_connection_get_pending_output (fixture->connection),
+                      >, 0);
+}
+
+static void
+writable_cb (LmConnection *connection, CallResult *result)
+{
+    result->n_calls++;
+    result->pending = lm_connection_get_pending_output (connection);
+}
+
+static void
+result_cb (LmConnection *connection, gboolean success, CallResult *result)
+{
+    result->n_calls++;
+    result->success = success;
+    result->pending = lm_connection_get_pending_output (connection);
+}
+
+static void
+test_output_full ()
+{
+    Fixture     fixture;
+    CallResult  writable = { 0 };
+    LmMessage  *message;
+    GError     *error = NULL;
+    gsize       low = 2 * BODY_SIZE;
+    gsize       high = 8 * BODY_SIZE;
+    guint       i;
+
+    fixture_setup (&fixture);
+
+    lm_connection_set_output_watermarks (fixture.connection, low, high);
+    lm_connection_set_fail_when_full (fixture.connection, TRUE);
+    lm_connection_set_writable_function (fixture.connection,
+                                         (LmWritableFunction) writable_cb,
+                                         &writable, NULL);
+
+    fixture_fill (&fixture);
+
+    /* Sends are refused once the high watermark is reached */
+    message = new_message ("full", BODY_SIZE);
+    for (i = 0; i < MAX_FILL_SENDS; ++i) {
+        if (!lm_connection_send (fixture.connection, message, &error)) {
+            break;
+        }
+    }
+    g_assert_error (error, LM_ERROR, LM_ERROR_OUTPUT_FULL);
+    g_clear_error (&error);
+    g_assert_cmpuint (lm_connection_get_pending_output (fixture.connection),
+                      >=, high);
+    g_assert_cmpuint (writable.n_calls, ==, 0);
+
+    /* The writable function is called once, at the low watermark */
+    fake_server_set_reading (fixture.server, TRUE);
+    while (writable.n_calls == 0) {
+        g_main_context_iteration (fixture.context, TRUE);
+    }
+    g_assert_cmpuint (writable.pending, <=, low);
+
+    fake_server_iterate (fixture.context, 100);
+    g_assert_cmpuint (writable.n_calls, ==, 1);
+    g_assert_cmpuint (lm_connection_get_pending_output (fixture.connection),
+                      ==, 0);
+
+    g_assert (lm_connection_send (fixture.connection, message, &error));
+    g_assert_no_error (error);
+    lm_message_unref (message);
+
+    fixture_teardown (&fixture);
+}
+
+static void
+test_completion ()
+{
+    Fixture     fixture;
+    CallResult  direct = { 0 };
+    CallResult  queued = { 0 };
+    LmMessage  *message;
+
+    fixture_setup (&fixture);
+
+    /* Written right away */
+    message = new_message ("direct", 16);
+    g_assert (lm_connection_send_full (fixture.connection, message,
+                                       (LmResultFunction) result_cb,
+                                       &direct, NULL, NULL));
+    lm_message_unref (message);
+    g_assert_cmpuint (direct.n_calls, ==, 1);
+    g_assert (direct.success);
+
+    fixture_fill (&fixture);
+
+    /* Only called once the message has reached the kernel */
+    message = new_message ("queued", BODY_SIZE);
+    g_assert (lm_connection_send_full (fixture.connection, message,
+                                       (LmResultFunction) result_cb,
+                                       &queued, NULL, NULL));
+    lm_message_unref (message);
+    g_assert_cmpuint (queued.n_calls, ==, 0);
+
+    fake_server_set_reading (fixture.server, TRUE);
+    while (queued.n_calls == 0) {
+        g_main_context_iteration (fixture.context, TRUE);
+    }
+    g_assert (queued.success);
+    g_assert_cmpuint (queued.pending, ==, 0);
+
+    fake_server_wait_for (fixture.server, "id=\"queued\"");
+
+    fixture_teardown (&fixture);
+}
+
+/* Sends still pending when the connection closes fail */
+static void
+test_completion_close ()
+{
+    Fixture     fixture;
+    CallResult  queued = { 0 };
+    LmMessage  *message;
+
+    fixture_setup (&fixture);
+    fixture_fill (&fixture);
+
+    message = new_message ("queued", BODY_SIZE);
+    g_assert (lm_connection_send_full (fixture.connection, message,
+                                       (LmResultFunction) result_cb,
+                                       &queued, NULL, NULL));
+    lm_message_unref (message);
+
+    lm_connection_close (fixture.connection, NULL);
+    g_assert_cmpuint (queued.n_calls, ==, 1);
+    g_assert (!queued.success);
+
+    fixture_teardown (&fixture);
+}
+
+/* Queued GBytes are referenced, not copied, so they must outlive the
+ * caller's reference */
+static void
+test_send_bytes ()
+{
+    Fixture      fixture;
+    GBytes      *shared;
+    GBytes      *parts[3];
+    const gchar *payload = "<message id='shared'><body>shared</body></message>";
+    GError      *error = NULL;
+
+    fixture_setup (&fixture);
+    fixture_fill (&fixture);
+
+    shared = g_bytes_new (payload, strlen (payload));
+
+    g_assert (lm_connection_send_bytes (fixture.connection, shared, &error));
+    g_assert_no_error (error);
+
+    parts[0] = g_bytes_new_static ("<message id='before'/>",
+                                   strlen ("<message id='before'/>"));
+    parts[1] = shared;
+    parts[2] = g_bytes_new_static ("<message id='after'/>",
+                                   strlen ("<message id='after'/>"));
+    g_assert (lm_connection_send_bytesv (fixture.connection, parts, 3,
+                                         &error));
+    g_assert_no_error (error);
+
+    g_bytes_unref (parts[0]);
+    g_bytes_unref (parts[2]);
+    g_bytes_unref (shared);
+
+    fake_server_set_reading (fixture.server, TRUE);
+    fake_server_wait_for (fixture.server,
+                          "<message id='shared'><body>shared</body></message>"
+                          "<message id='before'/>"
+                          "<message id='shared'><body>shared</body></message>"
+                          "<message id='after'/>");
+    g_assert_cmpuint (fake_server_count (fixture.server, payload), ==, 2);
+
+    fixture_teardown (&fixture);
+}
+
+/* Corked sends are held until the main loop comes around */
+static void
+test_cork_flush ()
+{
+    Fixture    fixture;
+    LmMessage *message;
+
+    fixture_setup (&fixture);
+
+    lm_connection_set_corked (fixture.connection, TRUE);
+
+    message = new_message ("first", 16);
+    g_assert (lm_connection_send (fixture.connection, message, NULL));
+    lm_message_unref (message);
+
+    message = new_message ("second", 16);
+    g_assert (lm_connection_send (fixture.connection, message, NULL));
+    lm_message_unref (message);
+
+    g_assert_cmpuint (lm_connection_get_pending_output (fixture.connection),
+                      >, 0);
+    g_assert_cmpuint (fake_server_count (fixture.server, "id=\"first\""),
+                      ==, 0);
+
+    fake_server_wait_for (fixture.server, "id=\"second\"");
+    g_assert_cmpuint (fake_server_count (fixture.server, "id=\"first\""),
+                      ==, 1);
+    g_assert_cmpuint (lm_connection_get_pending_output (fixture.connection),
+                      ==, 0);
+
+    fixture_teardown (&fixture);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/flow_control/output_full", test_output_full);
+    g_test_add_func ("/flow_control/completion", test_completion);
+    g_test_add_func ("/flow_control/completion_close", test_completion_close);
+    g_test_add_func ("/flow_control/send_bytes", test_send_bytes);
+    g_test_add_func ("/flow_control/cork_flush", test_cork_flush);
+
+    return g_test_run ();
+}
@@ -0,0 +1,125 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "loudmouth/lm-id-table.h"
+
+#define N_IDS 5000
+
+static void
+count_destroy (gpointer value)
+{
+    gint *count = value;
+
+    (*count)++;
+}
+
+static void
+test_insert_lookup ()
+{
+    LmIdTable *table;
+    guint64    id;
+
+    table = lm_id_table_new (NULL);
+
+    for (id = 1; id <= N_IDS; ++id) {
+        lm_id_table_insert (table, id, GUINT_TO_POINTER ((guint) id));
+    }
+    g_assert (lm_id_table_size (table) == N_IDS);
+
+    for (id = 1; id <= N_IDS; ++id) {
+        g_assert (GPOINTER_TO_UINT (lm_id_table_lookup (table, id)) == id);
+    }
+    g_assert (lm_id_table_lookup (table, N_IDS + 1) == NULL);
+    g_assert (lm_id_table_lookup (table, 0) == NULL);
+
+    lm_id_table_free (table);
+}
+
+static void
+test_remove ()
+{
+    LmIdTable *table;
+    guint64    id;
+
+    table = lm_id_table_new (NULL);
+
+    for (id = 1; id <= N_IDS; ++id) {
+        lm_id_table_insert (table, id * 7919, GUINT_TO_POINTER ((guint) id));
+    }
+
+    /* Remove every other id, the rest must still be found */
+    for (id = 1; id <= N_IDS; id += 2) {
+        g_assert (lm_id_table_remove (table, id * 7919));
+    }
+    g_assert (lm_id_table_size (table) == N_IDS / 2);
+
+    for (id = 1; id <= N_IDS; ++id) {
+        if (id % 2) {
+            g_assert (lm_id_table_lookup (table, id * 7919) == NULL);
+        } else {
+            g_assert (GPOINTER_TO_UINT (lm_id_table_steal (table, id * 7919)) == id);
+        }
+    }
+    g_assert (lm_id_table_size (table) == 0);
+    g_assert (!lm_id_table_remove (table, 7919));
+
+    lm_id_table_free (table);
+}
+
+static void
+test_destroy ()
+{
+    LmIdTable *table;
+    gint       count = 0;
+
+    table = lm_id_table_new (count_destroy);
+
+    lm_id_table_insert (table, 1, &count);
+    lm_id_table_insert (table, 2, &count);
+    lm_id_table_insert (table, 3, &count);
+
+    /* Replacing destroys the old value */
+    lm_id_table_insert (table, 1, &count);
+    g_assert (count == 1);
+
+    lm_id_table_remove (table, 2);
+    g_assert (count == 2);
+
+    lm_id_table_steal (table, 3);
+    g_assert (count == 2);
+
+    lm_id_table_free (table);
+    g_assert (count == 3);
+}
+
+int 
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/id_table/insert_lookup", test_insert_lookup);
+    g_test_add_func ("/id_table/remove", test_remove);
+    g_test_add_func ("/id_table/destroy", test_destroy);
+
+    return g_test_run ();
+}
@@ -0,0 +1,272 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "fake-server.h"
+
+typedef struct {
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+
+    /* Names of the handlers in the order they were called */
+    GString      *calls;
+    gboolean      done;
+} Fixture;
+
+typedef struct {
+    Fixture         *fixture;
+    const gchar     *name;
+    LmHandlerResult  result;
+} Handler;
+
+static LmHandlerResult
+handler_cb (LmMessageHandler *handler,
+            LmConnection     *connection,
+            LmMessage        *message,
+            Handler          *data)
+{
+    g_string_append_printf (data->fixture->calls, "%s ", data->name);
+
+    return data->result;
+}
+
+static LmHandlerResult
+done_cb (LmMessageHandler *handler,
+         LmConnection     *connection,
+         LmMessage        *message,
+         Fixture          *fixture)
+{
+    fixture->done = TRUE;
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+fixture_setup (Fixture *fixture)
+{
+    LmMessageHandler *handler;
+
+    fixture->context    = g_main_context_new ();
+    fixture->server     = fake_server_new (fixture->context);
+    fixture->connection = fake_server_connect (fixture->server);
+    fixture->calls      = g_string_new (NULL);
+
+    /* The stanza sent last by fixture_deliver() */
+    handler = lm_message_handler_new ((LmHandleMessageFunction) done_cb,
+                                      fixture, NULL);
+    lm_connection_register_message_handler (fixture->connection, handler,
+                                            LM_MESSAGE_TYPE_PRESENCE,
+                                            LM_HANDLER_PRIORITY_NORMAL);
+    lm_message_handler_unref (handler);
+}
+
+static void
+fixture_teardown (Fixture *fixture)
+{
+    lm_connection_close (fixture->connection, NULL);
+    lm_connection_unref (fixture->connection);
+    fake_server_free (fixture->server);
+    g_main_context_unref (fixture->context);
+    g_string_free (fixture->calls, TRUE);
+}
+
+static LmMessageHandler *
+fixture_add (Fixture         *fixture,
+             Handler         *data,
+             LmMessageType    type,
+             LmMessageSubType sub_type,
+             const gchar     *child_name,
+             const gchar     *xmlns,
+             LmHandlerPriority priority)
+{
+    LmMessageHandler *handler;
+
+    data->fixture = fixture;
+    handler = lm_message_handler_new ((LmHandleMessageFunction) handler_cb,
+                                      data, NULL);
+    lm_connection_register_message_handler_full (fixture->connection,
+                                                 handler, type, sub_type,
+                                                 child_name, xmlns,
+                                                 priority);
+    lm_message_handler_unref (handler);
+
+    return handler;
+}
+
+/* Sends @stanza from the server and waits until it has been dispatched */
+static void
+fixture_deliver (Fixture *fixture, const gchar *stanza)
+{
+    g_string_truncate (fixture->calls, 0);
+    fixture->done = FALSE;
+
+    fake_server_send (fixture->server, stanza);
+    fake_server_send (fixture->server, "<presence/>");
+
+    while (!fixture->done) {
+        g_main_context_iteration (fixture->context, TRUE);
+    }
+}
+
+#define VERSION_GET \
+    "<iq type='get' id='v1'><query xmlns='jabber:iq:version'/></iq>"
+#define VERSION_SET \
+    "<iq type='set' id='v2'><query xmlns='jabber:iq:version'/></iq>"
+#define PING_GET \
+    "<iq type='get' id='p1'><ping xmlns='urn:xmpp:ping'/></iq>"
+
+static void
+test_sub_type ()
+{
+    Fixture fixture;
+    Handler get = { NULL, "get", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+
+    fixture_setup (&fixture);
+    fixture_add (&fixture, &get, LM_MESSAGE_TYPE_IQ, LM_MESSAGE_SUB_TYPE_GET,
+                 NULL, NULL, LM_HANDLER_PRIORITY_NORMAL);
+
+    fixture_deliver (&fixture, VERSION_GET);
+    g_assert_cmpstr (fixture.calls->str, ==, "get ");
+
+    fixture_deliver (&fixture, VERSION_SET);
+    g_assert_cmpstr (fixture.calls->str, ==, "");
+
+    fixture_teardown (&fixture);
+}
+
+static void
+test_xmlns ()
+{
+    Fixture fixture;
+    Handler version = { NULL, "version", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+    Handler get_ping = { NULL, "get_ping", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+
+    fixture_setup (&fixture);
+    fixture_add (&fixture, &version, LM_MESSAGE_TYPE_IQ,
+                 LM_MESSAGE_SUB_TYPE_NOT_SET, NULL, "jabber:iq:version",
+                 LM_HANDLER_PRIORITY_NORMAL);
+    fixture_add (&fixture, &get_ping, LM_MESSAGE_TYPE_IQ,
+                 LM_MESSAGE_SUB_TYPE_GET, NULL, "urn:xmpp:ping",
+                 LM_HANDLER_PRIORITY_NORMAL);
+
+    fixture_deliver (&fixture, VERSION_GET);
+    g_assert_cmpstr (fixture.calls->str, ==, "version ");
+
+    fixture_deliver (&fixture, VERSION_SET);
+    g_assert_cmpstr (fixture.calls->str, ==, "version ");
+
+    fixture_deliver (&fixture, PING_GET);
+    g_assert_cmpstr (fixture.calls->str, ==, "get_ping ");
+
+    fixture_teardown (&fixture);
+}
+
+static void
+test_child_name ()
+{
+    Fixture fixture;
+    Handler query = { NULL, "query", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+
+    fixture_setup (&fixture);
+    fixture_add (&fixture, &query, LM_MESSAGE_TYPE_IQ,
+                 LM_MESSAGE_SUB_TYPE_NOT_SET, "query", NULL,
+                 LM_HANDLER_PRIORITY_NORMAL);
+
+    fixture_deliver (&fixture, VERSION_GET);
+    g_assert_cmpstr (fixture.calls->str, ==, "query ");
+
+    fixture_deliver (&fixture, PING_GET);
+    g_assert_cmpstr (fixture.calls->str, ==, "");
+
+    fixture_teardown (&fixture);
+}
+
+/* Filtered and plain handlers are called in one priority order */
+static void
+test_priority_order ()
+{
+    Fixture fixture;
+    Handler first = { NULL, "first", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+    Handler normal = { NULL, "normal", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+    Handler last = { NULL, "last", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+
+    fixture_setup (&fixture);
+    fixture_add (&fixture, &last, LM_MESSAGE_TYPE_IQ,
+                 LM_MESSAGE_SUB_TYPE_GET, NULL, "jabber:iq:version",
+                 LM_HANDLER_PRIORITY_LAST);
+    fixture_add (&fixture, &first, LM_MESSAGE_TYPE_IQ,
+                 LM_MESSAGE_SUB_TYPE_GET, NULL, NULL,
+                 LM_HANDLER_PRIORITY_FIRST);
+    fixture_add (&fixture, &normal, LM_MESSAGE_TYPE_IQ,
+                 LM_MESSAGE_SUB_TYPE_NOT_SET, NULL, NULL,
+                 LM_HANDLER_PRIORITY_NORMAL);
+
+    fixture_deliver (&fixture, VERSION_GET);
+    g_assert_cmpstr (fixture.calls->str, ==, "first normal last ");
+
+    /* A handler that takes the message stops the rest */
+    normal.result = LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    fixture_deliver (&fixture, VERSION_GET);
+    g_assert_cmpstr (fixture.calls->str, ==, "first normal ");
+
+    fixture_teardown (&fixture);
+}
+
+static void
+test_unregister ()
+{
+    Fixture           fixture;
+    Handler           version = { NULL, "version", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+    Handler           plain = { NULL, "plain", LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS };
+    LmMessageHandler *handler;
+
+    fixture_setup (&fixture);
+    handler = fixture_add (&fixture, &version, LM_MESSAGE_TYPE_IQ,
+                           LM_MESSAGE_SUB_TYPE_GET, NULL, "jabber:iq:version",
+                           LM_HANDLER_PRIORITY_NORMAL);
+    fixture_add (&fixture, &plain, LM_MESSAGE_TYPE_IQ,
+                 LM_MESSAGE_SUB_TYPE_NOT_SET, NULL, NULL,
+                 LM_HANDLER_PRIORITY_LAST);
+
+    lm_connection_unregister_message_handler (fixture.connection, handler,
+                                              LM_MESSAGE_TYPE_IQ);
+
+    fixture_deliver (&fixture, VERSION_GET);
+    g_assert_cmpstr (fixture.calls->str, ==, "plain ");
+
+    fixture_teardown (&fixture);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/message_handlers/sub_type", test_sub_type);
+    g_test_add_func ("/message_handlers/xmlns", test_xmlns);
+    g_test_add_func ("/message_handlers/child_name", test_child_name);
+    g_test_add_func ("/message_handlers/priority_order", test_priority_order);
+    g_test_add_func ("/message_handlers/unregister", test_unregister);
+
+    return g_test_run ();
+}
@@ -0,0 +1,147 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "fake-server.h"
+
+static LmHandlerResult
+count_cb (LmMessageHandler *handler,
+          LmConnection     *connection,
+          LmMessage        *message,
+          guint            *count)
+{
+    (*count)++;
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static gboolean
+timeout_cb (gboolean *timed_out)
+{
+    *timed_out = TRUE;
+
+    return FALSE;
+}
+
+static void
+test_live_move ()
+{
+    GMainContext     *server_context;
+    GMainContext     *context;
+    FakeServer       *server;
+    LmConnection     *connection;
+    LmMessageHandler *handler;
+    LmMessage        *m;
+    GSource          *source;
+    GError           *error = NULL;
+    guint             count = 0;
+    gboolean          timed_out = FALSE;
+
+    /* The connection starts out on the context of the server */
+    server_context = g_main_context_new ();
+    server         = fake_server_new (server_context);
+    connection     = fake_server_connect (server);
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) count_cb,
+                                      &count, NULL);
+    lm_connection_register_message_handler (connection, handler,
+                                            LM_MESSAGE_TYPE_MESSAGE,
+                                            LM_HANDLER_PRIORITY_NORMAL);
+    lm_message_handler_unref (handler);
+
+    context = g_main_context_new ();
+    g_assert (lm_connection_move_to_context (connection, context, &error));
+    g_assert_no_error (error);
+    g_assert_cmpint (lm_connection_get_state (connection),
+                     ==, LM_CONNECTION_STATE_OPEN);
+
+    /* Input is no longer read from the old context */
+    fake_server_send (server, "<message from='a@b' to='c@d'/>");
+    fake_server_iterate (server_context, 50);
+    g_assert_cmpuint (count, ==, 0);
+
+    source = g_timeout_source_new (5000);
+    g_source_set_callback (source, (GSourceFunc) timeout_cb,
+                           &timed_out, NULL);
+    g_source_attach (source, context);
+
+    while (count == 0) {
+        g_assert (!timed_out);
+        g_main_context_iteration (context, TRUE);
+    }
+
+    g_source_destroy (source);
+    g_source_unref (source);
+
+    /* Output still reaches the server */
+    m = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_GET);
+    lm_message_node_set_attribute (m->node, "id", "after-move");
+    g_assert (lm_connection_send (connection, m, &error));
+    g_assert_no_error (error);
+    lm_message_unref (m);
+
+    fake_server_wait_for (server, "after-move");
+
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+    fake_server_free (server);
+    g_main_context_unref (context);
+    g_main_context_unref (server_context);
+}
+
+static void
+test_pool_wrong_context ()
+{
+    LmConnectionPool *pool;
+    LmConnection     *connection;
+    GMainContext     *context;
+    GError           *error = NULL;
+
+    pool = lm_connection_pool_new (0);
+    connection = lm_connection_pool_new_connection (pool, "localhost");
+
+    context = g_main_context_new ();
+    g_assert (!lm_connection_move_to_context (connection, context, &error));
+    g_assert_error (error, LM_ERROR, LM_ERROR_WRONG_CONTEXT);
+    g_clear_error (&error);
+
+    /* Still on the default context of the pool */
+    g_assert (lm_connection_move_to_context (connection, NULL, &error));
+    g_assert_no_error (error);
+
+    g_main_context_unref (context);
+    lm_connection_pool_unref (pool);
+    lm_connection_unref (connection);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/move_context/live_move", test_live_move);
+    g_test_add_func ("/move_context/pool_wrong_context",
+                     test_pool_wrong_context);
+
+    return g_test_run ();
+}
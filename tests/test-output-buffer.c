@@ -0,0 +1,160 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <string.h>
+#include <glib.h>
+
+#include "loudmouth/lm-output-buffer.h"
+
+#define N_VECTORS 16
+
+/* Reads everything from @buffer through vectors, @step bytes at a time */
+static gchar *
+drain (LmOutputBuffer *buffer, gsize step)
+{
+    GString *str = g_string_new (NULL);
+
+    while (lm_output_buffer_get_size (buffer) > 0) {
+        LmOutputVector vectors[N_VECTORS];
+        gint           n, i;
+        gsize          len = 0;
+
+        n = lm_output_buffer_get_vectors (buffer, vectors, N_VECTORS);
+        g_assert (n > 0);
+
+        for (i = 0; i < n && len < step; ++i) {
+            gsize part = MIN (vectors[i].iov_len, step - len);
+
+            g_string_append_len (str, vectors[i].iov_base, part);
+            len += part;
+        }
+
+        lm_output_buffer_consume (buffer, len);
+    }
+
+    return g_string_free (str, FALSE);
+}
+
+static void
+test_append ()
+{
+    LmOutputBuffer *buffer;
+    GString        *expected;
+    gchar          *result;
+    guint           i;
+
+    buffer = lm_output_buffer_new ();
+    expected = g_string_new (NULL);
+
+    /* Spans several chunks */
+    for (i = 0; i < 2000; ++i) {
+        gchar *line = g_strdup_printf ("<message id='%u'/>", i);
+
+        lm_output_buffer_append (buffer, line, strlen (line));
+        g_string_append (expected, line);
+        g_free (line);
+    }
+    g_assert (lm_output_buffer_get_size (buffer) == expected->len);
+
+    result = drain (buffer, 1000);
+    g_assert (strcmp (result, expected->str) == 0);
+    g_assert (lm_output_buffer_get_size (buffer) == 0);
+
+    g_free (result);
+    g_string_free (expected, TRUE);
+    lm_output_buffer_free (buffer);
+}
+
+static void
+test_bytes ()
+{
+    LmOutputBuffer *buffer;
+    GBytes         *bytes;
+    gchar           data[10000];
+    gchar           gathered[8];
+    gchar          *result;
+
+    memset (data, 'x', sizeof (data));
+    bytes = g_bytes_new_static (data, sizeof (data));
+
+    buffer = lm_output_buffer_new ();
+    lm_output_buffer_append (buffer, "<a>", 3);
+    lm_output_buffer_append_bytes (buffer, bytes);
+    lm_output_buffer_append (buffer, "</a>", 4);
+    g_bytes_unref (bytes);
+
+    g_assert (lm_output_buffer_get_size (buffer) == sizeof (data) + 7);
+
+    lm_output_buffer_consume (buffer, 1);
+    g_assert (lm_output_buffer_gather (buffer, gathered, 4) == 4);
+    g_assert (memcmp (gathered, "a>xx", 4) == 0);
+
+    /* The caller's data is linked in, not copied */
+    lm_output_buffer_consume (buffer, 2);
+    {
+        LmOutputVector vectors[N_VECTORS];
+
+        g_assert (lm_output_buffer_get_vectors (buffer, vectors, N_VECTORS) == 2);
+        g_assert (vectors[0].iov_base == data);
+    }
+
+    result = drain (buffer, 333);
+    g_assert (strlen (result) == sizeof (data) + 4);
+    g_assert (strcmp (result + sizeof (data), "</a>") == 0);
+
+    g_free (result);
+    lm_output_buffer_free (buffer);
+}
+
+static void
+test_clear ()
+{
+    LmOutputBuffer *buffer;
+    GBytes         *bytes;
+
+    buffer = lm_output_buffer_new ();
+    bytes = g_bytes_new ("abc", 3);
+
+    lm_output_buffer_append (buffer, "0123456789", 10);
+    lm_output_buffer_append_bytes (buffer, bytes);
+    lm_output_buffer_consume (buffer, 5);
+    lm_output_buffer_clear (buffer);
+    g_assert (lm_output_buffer_get_size (buffer) == 0);
+
+    /* Still usable after being emptied */
+    lm_output_buffer_append (buffer, "abc", 3);
+    g_assert (lm_output_buffer_get_size (buffer) == 3);
+
+    g_bytes_unref (bytes);
+    lm_output_buffer_free (buffer);
+}
+
+int 
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/output_buffer/append", test_append);
+    g_test_add_func ("/output_buffer/bytes", test_bytes);
+    g_test_add_func ("/output_buffer/clear", test_clear);
+
+    return g_test_run ();
+}
@@ -0,0 +1,213 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "fake-server.h"
+
+#define BODY_SIZE      (16 * 1024)
+/* More than the kernel buffers of a loopback connection take */
+#define MAX_FILL_SENDS 4096
+#define N_BULK         4
+
+static LmMessage *
+new_bulk_message (const gchar *id)
+{
+    LmMessage *message;
+    gchar     *body;
+
+    message = lm_message_new ("peer@example.org", LM_MESSAGE_TYPE_MESSAGE);
+    lm_message_node_set_attribute (message->node, "id", id);
+
+    body = g_strnfill (BODY_SIZE, 'x');
+    lm_message_node_add_child (message->node, "body", body);
+    g_free (body);
+
+    return message;
+}
+
+static LmMessage *
+new_result (const gchar *id)
+{
+    LmMessage *message;
+
+    message = lm_message_new_with_sub_type ("example.org", LM_MESSAGE_TYPE_IQ,
+                                            LM_MESSAGE_SUB_TYPE_RESULT);
+    lm_message_node_set_attribute (message->node, "id", id);
+
+    return message;
+}
+
+/* Returns the offset of the stanza with @id in @received */
+static gsize
+find_stanza (const gchar *received, const gchar *id)
+{
+    const gchar *attribute;
+    gchar       *pattern;
+
+    pattern = g_strdup_printf ("id=\"%s\"", id);
+    attribute = strstr (received, pattern);
+    g_free (pattern);
+    g_assert (attribute != NULL);
+
+    while (attribute > received && *attribute != '<') {
+        attribute--;
+    }
+
+    return attribute - received;
+}
+
+/* Backs up bulk output behind a server that doesn't read, sends @result
+ * on top and returns everything the server got once it reads again */
+static gchar *
+send_behind_bulk (LmMessage *result)
+{
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+    LmMessage    *message;
+    gchar        *received;
+    gchar        *id;
+    guint         i;
+
+    context    = g_main_context_new ();
+    server     = fake_server_new (context);
+    connection = fake_server_connect (server);
+
+    fake_server_set_reading (server, FALSE);
+
+    message = new_bulk_message ("fill");
+    for (i = 0; i < MAX_FILL_SENDS; ++i) {
+        g_assert (lm_connection_send (connection, message, NULL));
+
+        if (lm_connection_get_pending_output (connection) > 0) {
+            break;
+        }
+    }
+    lm_message_unref (message);
+    g_assert_cmpuint (lm_connection_get_pending_output (connection), >, 0);
+
+    for (i = 0; i < N_BULK; ++i) {
+        id = g_strdup_printf ("bulk%u", i);
+        message = new_bulk_message (id);
+        g_assert (lm_connection_send (connection, message, NULL));
+        lm_message_unref (message);
+        g_free (id);
+    }
+
+    g_assert (lm_connection_send (connection, result, NULL));
+
+    fake_server_set_reading (server, TRUE);
+    fake_server_wait_for (server, "id=\"bulk3\"");
+    fake_server_wait_for (server, "id=\"pong\"");
+
+    received = g_strdup (fake_server_get_received (server));
+
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+    fake_server_free (server);
+    g_main_context_unref (context);
+
+    return received;
+}
+
+static void
+test_control_at_boundary ()
+{
+    LmMessage *result;
+    gchar     *received;
+    gsize      pong;
+
+    result = new_result ("pong");
+    received = send_behind_bulk (result);
+    lm_message_unref (result);
+
+    /* The reply goes out right after the bulk stanza that was being
+     * written, ahead of the bulk stanzas queued behind it */
+    pong = find_stanza (received, "pong");
+    g_assert_cmpuint (pong, <, find_stanza (received, "bulk0"));
+    g_assert (pong >= strlen ("</message>"));
+    g_assert (strncmp (received + pong - strlen ("</message>"),
+                       "</message>", strlen ("</message>")) == 0);
+
+    g_free (received);
+}
+
+/* A priority set on the message overrides the default for its type */
+static void
+test_message_priority ()
+{
+    LmMessage *result;
+    gchar     *received;
+
+    result = new_result ("pong");
+    lm_message_set_output_priority (result, LM_OUTPUT_PRIORITY_BULK);
+    received = send_behind_bulk (result);
+    lm_message_unref (result);
+
+    g_assert_cmpuint (find_stanza (received, "pong"), >,
+                      find_stanza (received, "bulk3"));
+
+    g_free (received);
+}
+
+static void
+test_defaults ()
+{
+    LmConnection *connection;
+
+    connection = lm_connection_new ("localhost");
+
+    g_assert_cmpint (lm_connection_get_output_priority (connection,
+                                                        LM_MESSAGE_TYPE_IQ,
+                                                        LM_MESSAGE_SUB_TYPE_RESULT),
+                     ==, LM_OUTPUT_PRIORITY_CONTROL);
+    g_assert_cmpint (lm_connection_get_output_priority (connection,
+                                                        LM_MESSAGE_TYPE_IQ,
+                                                        LM_MESSAGE_SUB_TYPE_ERROR),
+                     ==, LM_OUTPUT_PRIORITY_CONTROL);
+    g_assert_cmpint (lm_connection_get_output_priority (connection,
+                                                        LM_MESSAGE_TYPE_IQ,
+                                                        LM_MESSAGE_SUB_TYPE_GET),
+                     ==, LM_OUTPUT_PRIORITY_DEFAULT);
+    g_assert_cmpint (lm_connection_get_output_priority (connection,
+                                                        LM_MESSAGE_TYPE_MESSAGE,
+                                                        LM_MESSAGE_SUB_TYPE_NOT_SET),
+                     ==, LM_OUTPUT_PRIORITY_DEFAULT);
+
+    lm_connection_unref (connection);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/output_priority/defaults", test_defaults);
+    g_test_add_func ("/output_priority/control_at_boundary",
+                     test_control_at_boundary);
+    g_test_add_func ("/output_priority/message_priority",
+                     test_message_priority);
+
+    return g_test_run ();
+}
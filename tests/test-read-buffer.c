@@ -0,0 +1,172 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/loudmouth.h"
+#include "fake-server.h"
+
+/* Fits in the receive window of a new loopback connection, so the whole
+ * stanza is waiting by the time the connection reads */
+#define BODY_SIZE       (32 * 1024)
+#define IN_BUFFER_SIZE  1024
+/* Longer than the socket waits before dropping a grown buffer */
+#define IDLE_MSECS      1500
+
+typedef struct {
+    GMainContext *context;
+    FakeServer   *server;
+    LmConnection *connection;
+    guint         n_messages;
+} Fixture;
+
+static LmHandlerResult
+message_cb (LmMessageHandler *handler,
+            LmConnection     *connection,
+            LmMessage        *message,
+            Fixture          *fixture)
+{
+    fixture->n_messages++;
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+fixture_setup (Fixture *fixture)
+{
+    LmMessageHandler *handler;
+
+    fixture->context    = g_main_context_new ();
+    fixture->server     = fake_server_new (fixture->context);
+    fixture->connection = fake_server_connect (fixture->server);
+    fixture->n_messages = 0;
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) message_cb,
+                                      fixture, NULL);
+    lm_connection_register_message_handler (fixture->connection, handler,
+                                            LM_MESSAGE_TYPE_MESSAGE,
+                                            LM_HANDLER_PRIORITY_NORMAL);
+    lm_message_handler_unref (handler);
+}
+
+static void
+fixture_teardown (Fixture *fixture)
+{
+    lm_connection_close (fixture->connection, NULL);
+    lm_connection_unref (fixture->connection);
+    fake_server_free (fixture->server);
+    g_main_context_unref (fixture->context);
+}
+
+/* Sends a message with a body of @body_size bytes from the server */
+static void
+fixture_send (Fixture *fixture, gsize body_size)
+{
+    gchar *body;
+
+    body = g_strnfill (body_size, 'x');
+    fake_server_send (fixture->server, "<message><body>");
+    fake_server_send (fixture->server, body);
+    fake_server_send (fixture->server, "</body></message>");
+    g_free (body);
+}
+
+static void
+fixture_wait_for_messages (Fixture *fixture, guint n_messages)
+{
+    while (fixture->n_messages < n_messages) {
+        g_main_context_iteration (fixture->context, TRUE);
+    }
+}
+
+static gboolean
+count_cb (guint *n_calls)
+{
+    (*n_calls)++;
+
+    return TRUE;
+}
+
+static void
+test_grow_and_shrink ()
+{
+    Fixture fixture;
+
+    fixture_setup (&fixture);
+
+    g_assert_cmpuint (lm_connection_get_read_size (fixture.connection),
+                      ==, IN_BUFFER_SIZE);
+
+    fixture_send (&fixture, BODY_SIZE);
+    fixture_wait_for_messages (&fixture, 1);
+    g_assert_cmpuint (lm_connection_get_read_size (fixture.connection),
+                      >, IN_BUFFER_SIZE);
+
+    /* The grown buffer is dropped once the peer is quiet */
+    fake_server_iterate (fixture.context, IDLE_MSECS);
+    g_assert_cmpuint (lm_connection_get_read_size (fixture.connection),
+                      ==, IN_BUFFER_SIZE);
+
+    fixture_send (&fixture, 16);
+    fixture_wait_for_messages (&fixture, 2);
+
+    fixture_teardown (&fixture);
+}
+
+/* A small budget spreads a burst over several main loop iterations */
+static void
+test_read_budget ()
+{
+    Fixture  fixture;
+    GSource *source;
+    guint    n_iterations = 0;
+
+    fixture_setup (&fixture);
+
+    lm_connection_set_read_budget (fixture.connection, 1, 0);
+
+    source = g_idle_source_new ();
+    g_source_set_priority (source, G_PRIORITY_DEFAULT);
+    g_source_set_callback (source, (GSourceFunc) count_cb,
+                           &n_iterations, NULL);
+    g_source_attach (source, fixture.context);
+
+    fixture_send (&fixture, BODY_SIZE);
+    fixture_wait_for_messages (&fixture, 1);
+
+    /* One read per wakeup, while the buffer doubles from 1 kB */
+    g_assert_cmpuint (n_iterations, >=, 6);
+
+    g_source_destroy (source);
+    g_source_unref (source);
+
+    fixture_teardown (&fixture);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/read_buffer/grow_and_shrink", test_grow_and_shrink);
+    g_test_add_func ("/read_buffer/read_budget", test_read_budget);
+
+    return g_test_run ();
+}
@@ -0,0 +1,188 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <glib.h>
+
+#include "loudmouth/lm-resolver-cache.h"
+
+#define TTL 60
+#define NOW (1000 * G_USEC_PER_SEC)
+
+/* Two IPv4 addresses, the way getaddrinfo() would return them */
+static struct addrinfo *
+new_results (void)
+{
+    struct addrinfo    *results = NULL;
+    struct sockaddr_in *addr;
+    gint                i;
+
+    for (i = 2; i > 0; i--) {
+        struct addrinfo *ai;
+
+        addr = g_new0 (struct sockaddr_in, 1);
+        addr->sin_family      = AF_INET;
+        addr->sin_addr.s_addr = htonl (0x7f000000 + i);
+
+        ai = g_new0 (struct addrinfo, 1);
+        ai->ai_family   = AF_INET;
+        ai->ai_socktype = SOCK_STREAM;
+        ai->ai_addrlen  = sizeof (struct sockaddr_in);
+        ai->ai_addr     = (struct sockaddr *) addr;
+        ai->ai_next     = results;
+
+        results = ai;
+    }
+
+    return results;
+}
+
+static void
+test_host ()
+{
+    LmResolverCache    *cache;
+    struct addrinfo    *results;
+    struct addrinfo    *copy;
+    struct sockaddr_in *addr;
+    guint               n_hits;
+    guint               n_misses;
+
+    cache = lm_resolver_cache_new (TTL);
+    g_assert (lm_resolver_cache_lookup_host (cache, "example.org", NOW) == NULL);
+
+    results = new_results ();
+    lm_resolver_cache_add_host (cache, "example.org", results, NOW);
+
+    copy = lm_resolver_cache_lookup_host (cache, "example.org", NOW);
+    g_assert (copy != NULL && copy != results);
+    addr = (struct sockaddr_in *) copy->ai_addr;
+    g_assert_cmpuint (ntohl (addr->sin_addr.s_addr), ==, 0x7f000001);
+    g_assert (copy->ai_next != NULL);
+    addr = (struct sockaddr_in *) copy->ai_next->ai_addr;
+    g_assert_cmpuint (ntohl (addr->sin_addr.s_addr), ==, 0x7f000002);
+    g_assert (copy->ai_next->ai_next == NULL);
+    lm_resolver_cache_free_results (copy);
+
+    /* The cache keeps copies of its own */
+    lm_resolver_cache_free_results (results);
+    copy = lm_resolver_cache_lookup_host (cache, "example.org", NOW);
+    g_assert (copy != NULL);
+    lm_resolver_cache_free_results (copy);
+
+    g_assert (lm_resolver_cache_lookup_host (cache, "example.com", NOW) == NULL);
+
+    lm_resolver_cache_get_stats (cache, &n_hits, &n_misses);
+    g_assert_cmpuint (n_hits, ==, 2);
+    g_assert_cmpuint (n_misses, ==, 2);
+
+    lm_resolver_cache_unref (cache);
+}
+
+static void
+test_service ()
+{
+    LmResolverCache *cache;
+    gchar           *host = NULL;
+    guint            port = 0;
+
+    cache = lm_resolver_cache_new (TTL);
+
+    g_assert (!lm_resolver_cache_lookup_service (cache, "_xmpp-client._tcp.example.org",
+                                                 &host, &port, NOW));
+
+    lm_resolver_cache_add_service (cache, "_xmpp-client._tcp.example.org",
+                                   "xmpp.example.org", 5222, NOW);
+
+    g_assert (lm_resolver_cache_lookup_service (cache, "_xmpp-client._tcp.example.org",
+                                                &host, &port, NOW));
+    g_assert_cmpstr (host, ==, "xmpp.example.org");
+    g_assert_cmpuint (port, ==, 5222);
+    g_free (host);
+
+    /* Hosts and services don't mix */
+    g_assert (lm_resolver_cache_lookup_host (cache, "_xmpp-client._tcp.example.org",
+                                             NOW) == NULL);
+
+    lm_resolver_cache_unref (cache);
+}
+
+static void
+test_expire ()
+{
+    LmResolverCache *cache;
+    struct addrinfo *results;
+    struct addrinfo *copy;
+
+    cache = lm_resolver_cache_new (TTL);
+
+    results = new_results ();
+    lm_resolver_cache_add_host (cache, "example.org", results, NOW);
+    lm_resolver_cache_free_results (results);
+
+    copy = lm_resolver_cache_lookup_host (cache, "example.org",
+                                          NOW + (TTL - 1) * G_USEC_PER_SEC);
+    g_assert (copy != NULL);
+    lm_resolver_cache_free_results (copy);
+
+    g_assert (lm_resolver_cache_lookup_host (cache, "example.org",
+                                             NOW + TTL * G_USEC_PER_SEC) == NULL);
+    g_assert (lm_resolver_cache_lookup_host (cache, "example.org", NOW) == NULL);
+
+    lm_resolver_cache_unref (cache);
+}
+
+static void
+test_disabled ()
+{
+    LmResolverCache *cache;
+    struct addrinfo *results;
+
+    cache = lm_resolver_cache_new (TTL);
+
+    results = new_results ();
+    lm_resolver_cache_add_host (cache, "example.org", results, NOW);
+
+    /* A time to live of 0 empties the cache and keeps it empty */
+    lm_resolver_cache_set_ttl (cache, 0);
+    g_assert (lm_resolver_cache_lookup_host (cache, "example.org", NOW) == NULL);
+
+    lm_resolver_cache_add_host (cache, "example.org", results, NOW);
+    g_assert (lm_resolver_cache_lookup_host (cache, "example.org", NOW) == NULL);
+
+    lm_resolver_cache_free_results (results);
+    lm_resolver_cache_unref (cache);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/resolver_cache/host", test_host);
+    g_test_add_func ("/resolver_cache/service", test_service);
+    g_test_add_func ("/resolver_cache/expire", test_expire);
+    g_test_add_func ("/resolver_cache/disabled", test_disabled);
+
+    return g_test_run ();
+}
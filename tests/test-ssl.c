@@ -0,0 +1,203 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "loudmouth/loudmouth.h"
+
+static void
+test_context ()
+{
+    LmSSL        *ssl;
+    LmSSLContext *context;
+
+    ssl = lm_ssl_new (NULL, NULL, NULL, NULL);
+    g_assert (lm_ssl_get_context (ssl) == NULL);
+
+    context = lm_ssl_context_new ();
+    lm_ssl_set_context (ssl, context);
+    g_assert (lm_ssl_get_context (ssl) == context);
+
+    lm_ssl_set_context (ssl, NULL);
+    g_assert (lm_ssl_get_context (ssl) == NULL);
+
+    lm_ssl_context_unref (context);
+    lm_ssl_unref (ssl);
+}
+
+/* Tickets are used unless turned off for a server */
+static void
+test_use_session_tickets ()
+{
+    LmSSL *ssl;
+
+    ssl = lm_ssl_new (NULL, NULL, NULL, NULL);
+    g_assert (lm_ssl_get_use_session_tickets (ssl));
+
+    lm_ssl_set_use_session_tickets (ssl, FALSE);
+    g_assert (!lm_ssl_get_use_session_tickets (ssl));
+
+    lm_ssl_unref (ssl);
+}
+
+static void
+test_use_ktls ()
+{
+    LmSSL *ssl;
+
+    ssl = lm_ssl_new (NULL, NULL, NULL, NULL);
+    g_assert (!lm_ssl_get_use_ktls (ssl));
+
+    lm_ssl_set_use_ktls (ssl, TRUE);
+    g_assert (lm_ssl_get_use_ktls (ssl));
+
+    lm_ssl_set_use_ktls (ssl, FALSE);
+    g_assert (!lm_ssl_get_use_ktls (ssl));
+
+    lm_ssl_unref (ssl);
+}
+
+/* A pool context applies to every #LmSSL left on the default one */
+static void
+test_pool_context ()
+{
+    LmConnectionPool *pool;
+    LmConnection     *connection;
+    LmSSLContext     *context;
+    LmSSL            *ssl;
+
+    pool = lm_connection_pool_new (1);
+    context = lm_ssl_context_new ();
+    lm_connection_pool_set_ssl_context (pool, context);
+
+    ssl = lm_ssl_new (NULL, NULL, NULL, NULL);
+    connection = lm_connection_pool_new_connection (pool, "localhost");
+    lm_connection_set_ssl (connection, ssl);
+    g_assert (lm_ssl_get_context (ssl) == context);
+
+    lm_connection_unref (connection);
+    lm_ssl_unref (ssl);
+    lm_ssl_context_unref (context);
+    lm_connection_pool_unref (pool);
+}
+
+static gint
+compare_lines (gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Returns the lines of @filename in sorted order, the session cache 
+ * keeps no order */
+static gchar *
+read_sorted (const gchar *filename)
+{
+    gchar  *contents;
+    gchar **lines;
+    gchar  *sorted;
+
+    g_assert (g_file_get_contents (filename, &contents, NULL, NULL));
+
+    lines = g_strsplit (contents, "\n", -1);
+    qsort (lines, g_strv_length (lines), sizeof (gchar *), compare_lines);
+    sorted = g_strjoinv ("\n", lines);
+
+    g_strfreev (lines);
+    g_free (contents);
+
+    return sorted;
+}
+
+static void
+test_save_sessions ()
+{
+    LmSSLContext *context;
+    LmSSLContext *reloaded;
+    GError       *error = NULL;
+    GStatBuf      st;
+    gchar        *dir;
+    gchar        *saved, *resaved;
+    gchar        *expected, *result;
+
+    dir = g_dir_make_tmp ("test-ssl-XXXXXX", NULL);
+    g_assert (dir != NULL);
+
+    saved = g_build_filename (dir, "saved", NULL);
+    resaved = g_build_filename (dir, "resaved", NULL);
+
+    /* A missing file is an error */
+    context = lm_ssl_context_new ();
+    g_assert (!lm_ssl_context_load_sessions (context, saved, &error));
+    g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+    g_clear_error (&error);
+
+    g_assert (g_file_set_contents (saved,
+                                   "example.org:5223 c2Vzc2lvbi0x\n"
+                                   "example.net:5223 c2Vzc2lvbi0y\n",
+                                   -1, NULL));
+    g_assert (lm_ssl_context_load_sessions (context, saved, &error));
+    g_assert_no_error (error);
+
+    reloaded = lm_ssl_context_new ();
+    g_assert (lm_ssl_context_save_sessions (context, resaved, &error));
+    g_assert_no_error (error);
+    g_assert (lm_ssl_context_load_sessions (reloaded, resaved, &error));
+    g_assert_no_error (error);
+    g_assert (lm_ssl_context_save_sessions (reloaded, resaved, &error));
+    g_assert_no_error (error);
+
+    g_assert (g_stat (resaved, &st) == 0);
+    g_assert_cmpint (st.st_mode & 0777, ==, 0600);
+
+    expected = read_sorted (saved);
+    result = read_sorted (resaved);
+    g_assert_cmpstr (result, ==, expected);
+
+    g_free (expected);
+    g_free (result);
+    lm_ssl_context_unref (reloaded);
+    lm_ssl_context_unref (context);
+
+    g_unlink (saved);
+    g_unlink (resaved);
+    g_rmdir (dir);
+    g_free (saved);
+    g_free (resaved);
+    g_free (dir);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    if (lm_ssl_is_supported ()) {
+        g_test_add_func ("/ssl/context", test_context);
+        g_test_add_func ("/ssl/pool_context", test_pool_context);
+        g_test_add_func ("/ssl/use_session_tickets", test_use_session_tickets);
+        g_test_add_func ("/ssl/use_ktls", test_use_ktls);
+        g_test_add_func ("/ssl/save_sessions", test_save_sessions);
+    }
+
+    return g_test_run ();
+}
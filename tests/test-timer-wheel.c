@@ -0,0 +1,166 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "loudmouth/lm-timer-wheel.h"
+
+#define MSEC(ms) ((gint64) (ms) * 1000)
+
+static void
+count_cb (gpointer user_data)
+{
+    gint *count = user_data;
+
+    (*count)++;
+}
+
+static void
+test_expiry ()
+{
+    LmTimerWheel *wheel;
+    gint          short_count = 0;
+    gint          long_count = 0;
+    gint          far_count = 0;
+
+    wheel = lm_timer_wheel_new ();
+
+    lm_timer_wheel_add (wheel, 15, count_cb, &short_count);
+    lm_timer_wheel_add (wheel, 1000, count_cb, &long_count);
+    lm_timer_wheel_add (wheel, 3 * 60 * 60 * 1000, count_cb, &far_count);
+    g_assert (lm_timer_wheel_get_n_timers (wheel) == 3);
+
+    lm_timer_wheel_advance (wheel, MSEC (10));
+    g_assert (short_count == 0);
+
+    lm_timer_wheel_advance (wheel, MSEC (20));
+    g_assert (short_count == 1);
+    g_assert (long_count == 0);
+
+    lm_timer_wheel_advance (wheel, MSEC (990));
+    g_assert (long_count == 0);
+
+    lm_timer_wheel_advance (wheel, MSEC (1000));
+    g_assert (long_count == 1);
+    g_assert (lm_timer_wheel_get_n_timers (wheel) == 1);
+
+    lm_timer_wheel_advance (wheel, MSEC (3 * 60 * 60 * 1000 - 10));
+    g_assert (far_count == 0);
+
+    lm_timer_wheel_advance (wheel, MSEC (3 * 60 * 60 * 1000));
+    g_assert (far_count == 1);
+    g_assert (lm_timer_wheel_get_n_timers (wheel) == 0);
+
+    lm_timer_wheel_unref (wheel);
+}
+
+static void
+test_cancel ()
+{
+    LmTimerWheel *wheel;
+    LmTimer      *timer;
+    gint          count = 0;
+    gint          i;
+
+    wheel = lm_timer_wheel_new ();
+
+    timer = lm_timer_wheel_add (wheel, 500, count_cb, &count);
+    for (i = 0; i < 1000; ++i) {
+        lm_timer_wheel_add (wheel, 100 + i * 10, count_cb, &count);
+    }
+
+    lm_timer_wheel_cancel (wheel, timer);
+    g_assert (lm_timer_wheel_get_n_timers (wheel) == 1000);
+
+    lm_timer_wheel_advance (wheel, MSEC (100 + 999 * 10));
+    g_assert (count == 1000);
+    g_assert (lm_timer_wheel_get_n_timers (wheel) == 0);
+
+    lm_timer_wheel_unref (wheel);
+}
+
+static void
+test_timeout ()
+{
+    LmTimerWheel *wheel;
+    gint          count = 0;
+
+    wheel = lm_timer_wheel_new ();
+    g_assert (lm_timer_wheel_get_timeout (wheel, 0) == -1);
+
+    lm_timer_wheel_add (wheel, 50, count_cb, &count);
+    g_assert (lm_timer_wheel_get_timeout (wheel, 0) == 50);
+    g_assert (lm_timer_wheel_get_timeout (wheel, MSEC (60)) == 0);
+
+    lm_timer_wheel_advance (wheel, MSEC (60));
+    g_assert (count == 1);
+    g_assert (lm_timer_wheel_get_timeout (wheel, MSEC (60)) == -1);
+
+    lm_timer_wheel_unref (wheel);
+}
+
+static void
+test_steal ()
+{
+    LmTimerWheel *from;
+    LmTimerWheel *to;
+    LmTimer      *timer;
+    gint          count = 0;
+    guint         left;
+
+    from = lm_timer_wheel_new ();
+    to   = lm_timer_wheel_new ();
+
+    timer = lm_timer_wheel_add (from, 500, count_cb, &count);
+    lm_timer_wheel_advance (from, MSEC (200));
+
+    left = lm_timer_wheel_steal (from, timer);
+    g_assert (left == 300);
+    g_assert (lm_timer_wheel_get_n_timers (from) == 0);
+
+    /* The other wheel keeps time of its own */
+    lm_timer_wheel_advance (to, MSEC (1000));
+    lm_timer_wheel_readd (to, timer, left);
+    g_assert (lm_timer_wheel_get_n_timers (to) == 1);
+
+    lm_timer_wheel_advance (to, MSEC (1290));
+    g_assert (count == 0);
+
+    lm_timer_wheel_advance (to, MSEC (1300));
+    g_assert (count == 1);
+    g_assert (lm_timer_wheel_get_n_timers (to) == 0);
+
+    lm_timer_wheel_unref (from);
+    lm_timer_wheel_unref (to);
+}
+
+int 
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/timer_wheel/expiry", test_expiry);
+    g_test_add_func ("/timer_wheel/cancel", test_cancel);
+    g_test_add_func ("/timer_wheel/timeout", test_timeout);
+    g_test_add_func ("/timer_wheel/steal", test_steal);
+
+    return g_test_run ();
+}
@@ -0,0 +1,101 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/lm-token-bucket.h"
+
+#define SECOND G_USEC_PER_SEC
+
+static void
+test_unlimited ()
+{
+    LmTokenBucket bucket;
+
+    lm_token_bucket_init (&bucket, 0, 10, 0);
+
+    g_assert (!lm_token_bucket_is_limited (&bucket));
+
+    lm_token_bucket_take (&bucket, 1000, 0);
+    g_assert (lm_token_bucket_get_delay (&bucket, 1000, 0) == 0);
+    g_assert (lm_token_bucket_is_full (&bucket, 0));
+}
+
+static void
+test_burst ()
+{
+    LmTokenBucket bucket;
+    gint          i;
+
+    lm_token_bucket_init (&bucket, 2, 5, 0);
+
+    g_assert (lm_token_bucket_is_limited (&bucket));
+    g_assert (lm_token_bucket_is_full (&bucket, 0));
+
+    /* A full bucket lets a burst through right away */
+    for (i = 0; i < 5; i++) {
+        g_assert (lm_token_bucket_get_delay (&bucket, 1, 0) == 0);
+        lm_token_bucket_take (&bucket, 1, 0);
+    }
+
+    /* Then it takes 1 / rate for the next token */
+    g_assert (lm_token_bucket_get_delay (&bucket, 1, 0) > SECOND / 2 - 10);
+    g_assert (lm_token_bucket_get_delay (&bucket, 1, 0) <= SECOND / 2 + 1);
+    g_assert (lm_token_bucket_get_delay (&bucket, 1, SECOND / 2 + 1) == 0);
+    g_assert (!lm_token_bucket_is_full (&bucket, SECOND));
+
+    /* Refilling stops at the burst size */
+    g_assert (lm_token_bucket_is_full (&bucket, 100 * SECOND));
+    for (i = 0; i < 5; i++) {
+        lm_token_bucket_take (&bucket, 1, 100 * SECOND);
+    }
+    g_assert (lm_token_bucket_get_delay (&bucket, 1, 100 * SECOND) > 0);
+}
+
+static void
+test_debt ()
+{
+    LmTokenBucket bucket;
+    gint64        delay;
+
+    lm_token_bucket_init (&bucket, 1000, 1000, 0);
+
+    /* Taking more than available has to be paid back */
+    lm_token_bucket_take (&bucket, 3000, 0);
+
+    delay = lm_token_bucket_get_delay (&bucket, 0, 0);
+    g_assert (delay > 2 * SECOND - 10 && delay <= 2 * SECOND + 1);
+
+    /* Asking for more than the burst waits for a full bucket */
+    delay = lm_token_bucket_get_delay (&bucket, 5000, 2 * SECOND);
+    g_assert (delay > SECOND - 10 && delay <= SECOND + 1);
+}
+
+int 
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/token_bucket/unlimited", test_unlimited);
+    g_test_add_func ("/token_bucket/burst", test_burst);
+    g_test_add_func ("/token_bucket/debt", test_debt);
+
+    return g_test_run ();
+}